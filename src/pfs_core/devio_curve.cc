@@ -452,6 +452,12 @@ pfs_curvedev_submit_io(pfs_dev_t *dev, pfs_ioq_t *ioq, pfs_devio_t *io)
             pfs_curvedev_aio_callback(&iocb->ctx);
         }
         break;
+    case PFSDEV_REQ_FLUSH:
+        /* curve acknowledges a write after it is replicated */
+        iocb->ctx.cb = pfs_curvedev_aio_callback;
+        iocb->ctx.ret = 0;
+        pfs_curvedev_aio_callback(&iocb->ctx);
+        break;
     default:
         err = EINVAL;
         pfs_etrace("invalid io task! op: %d, bufp: %p, len: %zu, bda%lu\n",
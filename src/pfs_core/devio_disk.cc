@@ -409,6 +409,24 @@ pfs_diskdev_io_trim(pfs_diskdev_t *dkdev, pfs_devio_t *io)
 	return err;
 }
 
+/*
+ * O_DIRECT writes may still sit in the volatile cache of the disk,
+ * fdatasync() makes the kernel send a cache flush to it.
+ */
+static int
+pfs_diskdev_io_flush(pfs_diskdev_t *dkdev, pfs_devio_t *io)
+{
+	int err;
+
+	err = fdatasync(dkdev->dk_fd);
+	if (err < 0) {
+		err = -errno;
+		pfs_etrace("fdatasync(%s) failed, errno %d\n",
+		    dkdev->dk_base.d_devname, errno);
+	}
+	return err;
+}
+
 static void
 pfs_diskdev_try_flush(pfs_diskdev_t *dkdev, pfs_diskioq_t *dkioq, bool force)
 {
@@ -480,9 +498,12 @@ pfs_diskdev_submit_io(pfs_dev_t *dev, pfs_ioq_t *ioq, pfs_devio_t *io)
 	struct iocb *iocb;
 	int err;
 
-	/* XXX trim is not async */
-	if (io->io_op == PFSDEV_REQ_TRIM) {
-		io->io_error = pfs_diskdev_io_trim(dkdev, io);
+	/* XXX trim and flush are not async */
+	if (io->io_op == PFSDEV_REQ_TRIM || io->io_op == PFSDEV_REQ_FLUSH) {
+		if (io->io_op == PFSDEV_REQ_TRIM)
+			io->io_error = pfs_diskdev_io_trim(dkdev, io);
+		else
+			io->io_error = pfs_diskdev_io_flush(dkdev, io);
 		TAILQ_INSERT_TAIL(&dkioq->dkq_inflight_queue, io, io_next);
 		dkioq->dkq_inflight_count++;
 		return 0;
@@ -219,6 +219,18 @@ conn_handle_command(int clisock, msg_header_t *mh, admin_info_t *ai)
 		size = sizeof(struct cmd_namecachebinstat);
 		break;
 
+	case CMD_NOTIFY_REQ:
+		size = sizeof(struct cmd_notify);
+		break;
+
+	case CMD_HIST_REQ:
+		size = sizeof(struct cmd_hist);
+		break;
+
+	case CMD_METRICS_REQ:
+		size = sizeof(struct cmd_metrics);
+		break;
+
 	default:
 		pfs_etrace("unknonw cmd op %d\n", mh->mh_op);
 		return -1;
@@ -84,7 +84,16 @@ enum {
 	CMD_NAMECACHE_STAT_RPL = 20,
 
 	CMD_NAMECACHE_BINSTAT_REQ = 21,
-	CMD_NAMECACHE_BINSTAT_RPL = 22
+	CMD_NAMECACHE_BINSTAT_RPL = 22,
+
+	CMD_NOTIFY_REQ		= 23,
+	CMD_NOTIFY_RPL		= 24,
+
+	CMD_HIST_REQ		= 25,
+	CMD_HIST_RPL		= 26,
+
+	CMD_METRICS_REQ		= 27,
+	CMD_METRICS_RPL		= 28,
 };
 
 typedef struct msg_header {
@@ -156,6 +165,22 @@ struct cmd_namecachebinstat {
 	int			unused;
 } __attribute__((packed));
 
+struct cmd_notify {
+	char		nt_pbdname[PFS_MAX_PBDLEN];
+	uint64_t	nt_head_txid;
+} __attribute__((packed));
+
+struct cmd_hist {
+	char		hi_pbdname[PFS_MAX_PBDLEN];
+	char		hi_pattern[FILE_TYPE_PATTERN_MAXLEN];	/* name filter */
+	char		hi_pcts[FILE_TYPE_PATTERN_MAXLEN];	/* "50,99,99.9" */
+	int		hi_reset;
+} __attribute__((packed));
+
+struct cmd_metrics {
+	char		mt_pbdname[PFS_MAX_PBDLEN];
+} __attribute__((packed));
+
 typedef union msg_command {
 	struct cmd_read	mc_rd;
 	struct cmd_du	mc_du;
@@ -167,6 +192,9 @@ typedef union msg_command {
 	struct cmd_mountstat mc_mountstat;
 	struct cmd_namecachestat mc_namecachestat;
 	struct cmd_namecachebinstat mc_namecachebinstat;
+	struct cmd_notify mc_notify;
+	struct cmd_hist	mc_hist;
+	struct cmd_metrics mc_metrics;
 } msg_command_t;
 
 typedef struct admin_info 	admin_info_t;
@@ -354,16 +354,19 @@ out:
 static int
 _pfs_close(int fd)
 {
-	int err;
+	int err, err1;
 	pfs_mount_t *mnt = NULL;
 	pfs_file_t *file = NULL;
 
 	GET_MOUNT_FILE(fd, WRLOCK_FLAG, &mnt, &file);
 
+	/* deferred size change is committed before the file goes away */
+	err1 = pfs_file_xcommit(file);
 	err = pfs_file_close_locked(file);
 	if (err == 0) {
 		/* must set as null so that it will not be put again. */
 		file = NULL;
+		err = err1;
 	}
 
 	PUT_MOUNT_FILE(mnt, file);
@@ -819,7 +822,16 @@ _pfs_du(const char *pbdpath, int all, int depth, pfs_printer_t *printer)
 static int
 _pfs_fsync(int fd)
 {
-	return 0;
+	int err;
+	pfs_mount_t *mnt = NULL;
+	pfs_file_t *file = NULL;
+
+	GET_MOUNT_FILE(fd, RDLOCK_FLAG, &mnt, &file);
+
+	err = pfs_file_xfsync(file);
+
+	PUT_MOUNT_FILE(mnt, file);
+	return err;
 }
 
 static ssize_t
@@ -262,11 +262,15 @@ typedef struct pfs_chunkstream		pfs_chunkstream_t;
 #define	CHUNK_BACKUP		0x0001
 #define	CHUNK_RESTORE		0x0002
 #define	CHUNK_CRC		0x0010
+#define	CHUNK_INCR		0x0020
 
 /**
  * @description:	init meta， only need to be called once
  * @param cluster：	polarstore/disk/river, NULL means polarstore
  * @param flags:	CHUNK_BACKUP CHUNK_RESTORE CHUNK_BACKUP|CHUNK_CRC 
+ * 			CHUNK_BACKUP|CHUNK_INCR: only blocks changed since
+ * 			the last committed backup of this host, restore it
+ * 			over that backup
  * @return: 		return pfs_chunkstream_desc_t if success, 
  * 			otherwise return NULL
  */
@@ -298,6 +302,15 @@ int	pfs_chunkstream_fini(pfs_chunkstream_desc_t *desc);
  * @return:		return 0 if stream is finish
  */
 int	pfs_chunkstream_isfinish(pfs_chunkstream_t *stream);
+/**
+ * @description:	backup stream is stored by the caller, the next
+ * 			CHUNK_INCR backup of the chunk only streams blocks
+ * 			changed since it. Streams that are not committed
+ * 			are never taken as a base
+ * @return:		0 on success, negative errno if the stream is not
+ * 			finished or its digests fail to save
+ */
+int	pfs_chunkstream_commit(pfs_chunkstream_t *stream);
 
 /**
  * @description:	get pbd chunk num, used in backup mode
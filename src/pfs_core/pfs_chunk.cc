@@ -24,18 +24,39 @@
 #include <getopt.h>
 #include <string.h>
 
+#include "lib/fnv_hash.h"
+
 #include "pfs_chunk.h"
 #include "pfs_impl.h"
 #include "pfs_paxos.h"
 #include "pfs_meta.h"
 #include "pfs_mount.h"
+#include "pfs_option.h"
 #include "pfs_trace.h"
 #include "pfs_util.h"
 static const char	*meta_file_path = "/var/run/pfs";
 
+/*
+ * Max number of fragment IOs in flight when a stream reads or writes
+ * chunk data. IOs span block boundaries of the caller buffer, so a
+ * larger buffer keeps more of them busy.
+ */
+static int64_t		chunk_stream_iodepth = 64;
+PFS_OPTION_REG(chunk_stream_iodepth, pfs_check_ival_normal);
+
+/*
+ * MB of changed blocks an incremental read stream keeps from its
+ * prescan, so that they are streamed without being read again. Blocks
+ * beyond it are read twice.
+ */
+static int64_t		chunk_incr_cache_mb = 256;
+PFS_OPTION_REG(chunk_incr_cache_mb, pfs_check_ival_normal);
+
 #define	CHUNKFILE_MAGIC		0x43CB40FA34
 #define	CHUNKFILE_VERSION	0x01
 #define	METACACHE_MAGIC		0x0F1A341D
+#define	CHUNKDIGEST_MAGIC	0x44474B43
+#define	CHUNKMARK_MAGIC		0x4B524D43
 #define CHUNK_FRAG_SIZE		(4096)
 
 enum {
@@ -74,8 +95,15 @@ typedef struct pfs_chunkfile_header {
 	uint32_t	cf_metasz;
 	uint32_t	cf_crcsz;
 	uint64_t	cf_streamsz;
+
+	/* incremental info */
+	uint32_t	cf_flags;
+	uint64_t	cf_basectime;	/* cf_ctime of the base stream */
 }__attribute__((aligned(4096))) pfs_chunkfile_header_t;
 
+/* cf_flags */
+#define	CHUNKFILE_INCR		0x01	/* only blocks changed since base */
+
 typedef struct metacache_header {
 	uint32_t	mh_magic;
 	uint64_t	mh_run_version;	/* running pfs version */
@@ -93,6 +121,38 @@ typedef struct block_meta_head
 	int64_t		mh_datalen;
 } block_meta_head_t;
 
+/*
+ * Digest of data of a block, as it was streamed by the last backup of
+ * this host. Digests of a chunk are kept in a local digest file beside
+ * the metacache, and an incremental backup only streams blocks whose
+ * digest changed. PFS overwrites file data in place without any meta
+ * data change, so block digests rather than journal txids are what
+ * tell changed blocks.
+ */
+typedef struct block_digest {
+	uint32_t	bd_crc;
+	uint32_t	bd_len;
+	uint64_t	bd_fnv;		/* second hash against crc collision */
+} block_digest_t;
+
+typedef struct chunkdigest_header {
+	uint32_t	dh_magic;
+	uint32_t	dh_ckid;
+	uint64_t	dh_ctime;	/* cf_ctime of the stream */
+	uint32_t	dh_crc;		/* crc of the digests */
+} chunkdigest_header_t;
+
+/*
+ * Restore side counterpart of the digest file: the cf_ctime of the last
+ * stream applied to the chunk by this host. An incremental stream is
+ * only applied over the stream it was taken against.
+ */
+typedef struct chunkmark {
+	uint32_t	cm_magic;
+	uint32_t	cm_ckid;
+	uint64_t	cm_ctime;
+} chunkmark_t;
+
 typedef struct pfs_chunk_readstream {
 	pfs_chunkstream_t		cr_chunk_stream;
 	block_meta_head_t		*cr_meta_buf;
@@ -108,6 +168,9 @@ typedef struct pfs_chunk_readstream {
 	int64_t				cr_blkreadsz;
 	int64_t				cr_crcreadsz;
 	int64_t				cr_ncrcfrag;
+	block_digest_t			*cr_digest;
+	char				**cr_blkcache;	/* by prescan */
+	uint64_t			cr_basectime;	/* 0 if full */
 } pfs_chunk_readstream_t;
 
 typedef struct pfs_chunk_writestream {
@@ -143,6 +206,12 @@ chunk_enablecrc(const pfs_chunkstream_desc_t *desc)
 	return (desc->csd_flags & CHUNK_CRC) != 0;
 }
 
+static inline bool
+chunk_enableincr(const pfs_chunkstream_desc_t *desc)
+{
+	return (desc->csd_flags & CHUNK_INCR) != 0;
+}
+
 static int
 paxos_leader_read(int iodesc, char *buf, size_t buflen)
 {
@@ -593,6 +662,226 @@ fail:
 	return err;
 }
 
+static void
+chunkfile_path(const pfs_chunkstream_desc_t *desc, int ckid,
+    const char *suffix, bool tmp, char *path)
+{
+	snprintf(path, PFS_MAX_PATHLEN, "%s/pbd%s.ck%d.%s%s",
+	    meta_file_path, desc->csd_pbdname, ckid, suffix, tmp ? ".tmp" : "");
+	path[PFS_MAX_PATHLEN-1] = '\0';
+}
+
+/*
+ * Load digests saved by the last incremental backup of the chunk.
+ * -ENOENT means there is no usable one.
+ */
+static int
+chunkdigest_load(pfs_chunk_readstream_t *cr, block_digest_t *bdv)
+{
+	int err, fd;
+	ssize_t rlen;
+	chunkdigest_header_t dh;
+	char path[PFS_MAX_PATHLEN];
+	int ckid = cr->cr_chunk_stream.cs_ckid;
+	uint32_t bdsz = sizeof(block_digest_t) * PFS_NBT_PERCHUNK;
+
+	chunkfile_path(cr->cr_chunk_stream.cs_desc, ckid, "digest", false,
+	    path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pfs_itrace("open digest file %s failed, errno=%d\n", path,
+		    errno);
+		return -ENOENT;
+	}
+
+	err = 0;
+	rlen = pread(fd, &dh, sizeof(dh), 0);
+	if (rlen != sizeof(dh) || dh.dh_magic != CHUNKDIGEST_MAGIC ||
+	    dh.dh_ckid != (uint32_t)ckid)
+		ERR_GOTO(ENOENT, out);
+
+	rlen = pread(fd, bdv, bdsz, sizeof(dh));
+	if (rlen != bdsz || crc32c((uint32_t)~1, bdv, bdsz) != dh.dh_crc)
+		ERR_GOTO(ENOENT, out);
+
+	cr->cr_basectime = dh.dh_ctime;
+out:
+	if (err < 0)
+		pfs_etrace("digest file %s is invalid\n", path);
+	close(fd);
+	return err;
+}
+
+/*
+ * Digests become the base of the next incremental backup once the
+ * caller commits the stream it has read out and stored. They are
+ * written to a temp file and renamed, so a crash never leaves a torn
+ * base.
+ */
+static int
+chunkdigest_save(pfs_chunk_readstream_t *cr)
+{
+	int err, fd;
+	ssize_t wlen;
+	chunkdigest_header_t dh;
+	char path[PFS_MAX_PATHLEN], tmppath[PFS_MAX_PATHLEN];
+	const pfs_chunkstream_desc_t *desc = cr->cr_chunk_stream.cs_desc;
+	int ckid = cr->cr_chunk_stream.cs_ckid;
+	uint32_t bdsz = sizeof(block_digest_t) * PFS_NBT_PERCHUNK;
+
+	memset(&dh, 0, sizeof(dh));
+	dh.dh_magic = CHUNKDIGEST_MAGIC;
+	dh.dh_ckid = ckid;
+	dh.dh_ctime = cr->cr_cf.cf_ctime;
+	dh.dh_crc = crc32c((uint32_t)~1, cr->cr_digest, bdsz);
+
+	chunkfile_path(desc, ckid, "digest", true, tmppath);
+	fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		pfs_etrace("open digest file %s failed, errno=%d\n", tmppath,
+		    errno);
+		return -EIO;
+	}
+
+	err = 0;
+	wlen = pwrite(fd, &dh, sizeof(dh), 0);
+	if (wlen != sizeof(dh))
+		ERR_GOTO(EIO, out);
+	wlen = pwrite(fd, cr->cr_digest, bdsz, sizeof(dh));
+	if (wlen != bdsz)
+		ERR_GOTO(EIO, out);
+	if (fsync(fd) < 0)
+		ERR_GOTO(EIO, out);
+	close(fd);
+	fd = -1;
+
+	chunkfile_path(desc, ckid, "digest", false, path);
+	if (rename(tmppath, path) < 0)
+		ERR_GOTO(EIO, out);
+	return 0;
+
+out:
+	pfs_etrace("save digest file %s failed, errno=%d\n", tmppath, errno);
+	if (fd >= 0)
+		close(fd);
+	unlink(tmppath);
+	return err;
+}
+
+static int
+chunkmark_load(const pfs_chunkstream_desc_t *desc, int ckid, uint64_t *ctime)
+{
+	int fd;
+	ssize_t rlen;
+	chunkmark_t cm;
+	char path[PFS_MAX_PATHLEN];
+
+	chunkfile_path(desc, ckid, "restored", false, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -ENOENT;
+	rlen = pread(fd, &cm, sizeof(cm), 0);
+	close(fd);
+	if (rlen != sizeof(cm) || cm.cm_magic != CHUNKMARK_MAGIC ||
+	    cm.cm_ckid != (uint32_t)ckid) {
+		pfs_etrace("restore mark %s is invalid\n", path);
+		return -ENOENT;
+	}
+	*ctime = cm.cm_ctime;
+	return 0;
+}
+
+/*
+ * A chunk being restored matches no stream until the restore finishes,
+ * so the mark is dropped before any data is written and saved after.
+ */
+static void
+chunkmark_clear(const pfs_chunkstream_desc_t *desc, int ckid)
+{
+	char path[PFS_MAX_PATHLEN];
+
+	chunkfile_path(desc, ckid, "restored", false, path);
+	if (unlink(path) < 0 && errno != ENOENT)
+		pfs_etrace("unlink restore mark %s failed, errno=%d\n", path,
+		    errno);
+}
+
+static int
+chunkmark_save(const pfs_chunkstream_desc_t *desc, int ckid, uint64_t ctime)
+{
+	int err, fd;
+	chunkmark_t cm;
+	char path[PFS_MAX_PATHLEN], tmppath[PFS_MAX_PATHLEN];
+
+	if (mkdir(meta_file_path, 0777) < 0 && errno != EEXIST)
+		return -EIO;
+
+	memset(&cm, 0, sizeof(cm));
+	cm.cm_magic = CHUNKMARK_MAGIC;
+	cm.cm_ckid = ckid;
+	cm.cm_ctime = ctime;
+
+	chunkfile_path(desc, ckid, "restored", true, tmppath);
+	fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		pfs_etrace("open restore mark %s failed, errno=%d\n", tmppath,
+		    errno);
+		return -EIO;
+	}
+
+	err = 0;
+	if (pwrite(fd, &cm, sizeof(cm), 0) != sizeof(cm) || fsync(fd) < 0)
+		err = -EIO;
+	close(fd);
+	chunkfile_path(desc, ckid, "restored", false, path);
+	if (err == 0 && rename(tmppath, path) < 0)
+		err = -EIO;
+	if (err < 0) {
+		pfs_etrace("save restore mark %s failed, errno=%d\n", tmppath,
+		    errno);
+		unlink(tmppath);
+	}
+	return err;
+}
+
+/*
+ * Running digests of blocks streamed by the buffer, which starts at
+ * offset @blkoff of block @blkpos.
+ */
+static void
+chunkdigest_update(pfs_chunk_readstream_t *cr, int64_t blkpos, int64_t blkoff,
+    const char *buf, ssize_t len)
+{
+	ssize_t n;
+	block_digest_t *bd;
+	const block_meta_head_t *mh;
+
+	while (len > 0 && blkpos >= 0) {
+		mh = &cr->cr_meta_buf[blkpos];
+		if (mh->mh_datalen == 0) {
+			blkpos--;
+			blkoff = 0;
+			continue;
+		}
+
+		bd = &cr->cr_digest[blkpos];
+		if (blkoff == 0) {
+			bd->bd_crc = (uint32_t)~1;
+			bd->bd_len = mh->mh_datalen;
+			bd->bd_fnv = FNV1_64_INIT;
+		}
+		n = MIN(mh->mh_datalen - blkoff, len);
+		bd->bd_crc = crc32c(bd->bd_crc, buf, n);
+		bd->bd_fnv = fnv_64_buf(buf, n, bd->bd_fnv);
+		buf += n;
+		len -= n;
+		blkoff += n;
+		if (blkoff == mh->mh_datalen) {
+			blkpos--;
+			blkoff = 0;
+		}
+	}
+}
 
 static inline void
 chunkheader_dump(const pfs_chunkfile_header_t *cf)
@@ -600,10 +889,11 @@ chunkheader_dump(const pfs_chunkfile_header_t *cf)
 	pfs_itrace("Chunkfile header:\n"
 	    "magic:0x%lx\nver:0x%lx\nctime:%lu\npbd:%s\ncksz:%lu\nblksz:%u\n"
 	    "fragsz:%u\nsectsz:%u\nnck:%u\nckid:%u\nstreamsz:%lu\nenablecrc:%d\n"
-	    "crcsz:%u\nmetasz:%u\n", cf->cf_magic, cf->cf_version, cf->cf_ctime,
-	    cf->cf_pbdname, cf->cf_chunksz, cf->cf_blksz, cf->cf_fragsz,
-	    cf->cf_sectsz, cf->cf_nchunk, cf->cf_ckid, cf->cf_streamsz,
-	    cf->cf_enablecrc, cf->cf_crcsz, cf->cf_metasz);
+	    "crcsz:%u\nmetasz:%u\nflags:0x%x\nbasectime:%lu\n", cf->cf_magic,
+	    cf->cf_version, cf->cf_ctime, cf->cf_pbdname, cf->cf_chunksz,
+	    cf->cf_blksz, cf->cf_fragsz, cf->cf_sectsz, cf->cf_nchunk,
+	    cf->cf_ckid, cf->cf_streamsz, cf->cf_enablecrc, cf->cf_crcsz,
+	    cf->cf_metasz, cf->cf_flags, cf->cf_basectime);
 }
 
 static int
@@ -673,18 +963,36 @@ out:
 	return err;
 }
 
+static int	readstream_prescan(pfs_chunk_readstream_t *cr);
+
+static void
+readstream_free_cache(pfs_chunk_readstream_t *cr)
+{
+	uint32_t i;
+
+	if (cr->cr_blkcache == NULL)
+		return;
+	for (i = 0; i < PFS_NBT_PERCHUNK; i++) {
+		if (cr->cr_blkcache[i])
+			pfs_mem_free(cr->cr_blkcache[i], M_CHUNK_DIGEST);
+	}
+	pfs_mem_free(cr->cr_blkcache, M_CHUNK_DIGEST);
+	cr->cr_blkcache = NULL;
+}
+
 pfs_chunkstream_t *
 pfs_chunk_readstream_open(const pfs_chunkstream_desc_t *desc, int chunkid)
 {
 	int err;
 	pfs_chunk_readstream_t *cr;
 
-	cr = (pfs_chunk_readstream_t *)pfs_mem_malloc(sizeof(*cr),
-	    M_CHUNK_READSTREAM);
-	if (cr == NULL) {
+	/* the chunkfile header inside is declared page aligned */
+	if (pfs_mem_memalign((void **)&cr, alignof(pfs_chunk_readstream_t),
+	    sizeof(*cr), M_CHUNK_READSTREAM) != 0) {
 		pfs_etrace("mem alloc chunk stream failed!");
 		return NULL;
 	}
+	memset(cr, 0, sizeof(*cr));
 
 	cr->cr_metasz = roundup(sizeof(block_meta_head_t) * PFS_NBT_PERCHUNK,
 	    CHUNK_FRAG_SIZE);
@@ -704,6 +1012,16 @@ pfs_chunk_readstream_open(const pfs_chunkstream_desc_t *desc, int chunkid)
 	if (err != 0)
 		ERR_GOTO(EIO, fail);
 
+	if (chunk_enableincr(desc)) {
+		cr->cr_digest = (block_digest_t *)pfs_mem_malloc(
+		    sizeof(block_digest_t) * PFS_NBT_PERCHUNK, M_CHUNK_DIGEST);
+		if (cr->cr_digest == NULL)
+			ERR_GOTO(ENOMEM, fail);
+		err = readstream_prescan(cr);
+		if (err < 0)
+			ERR_GOTO(EIO, fail);
+	}
+
 	if (chunk_enablecrc(desc)) {
 		cr->cr_crcsz = roundup(sizeof(uint32_t) *
 		    (cr->cr_streamsz / CHUNK_FRAG_SIZE), CHUNK_FRAG_SIZE);
@@ -748,6 +1066,12 @@ fail:
 		cr->cr_crc_buf = NULL;
 	}
 
+	if (cr->cr_digest) {
+		pfs_mem_free(cr->cr_digest, M_CHUNK_DIGEST);
+		cr->cr_digest = NULL;
+	}
+	readstream_free_cache(cr);
+
 	pfs_mem_free(cr, M_CHUNK_READSTREAM);
 	cr = NULL;
 	return NULL;
@@ -758,12 +1082,13 @@ pfs_chunk_writestream_open(const pfs_chunkstream_desc_t *desc, int chunkid)
 {
 	pfs_chunk_writestream_t *cw;
 
-	cw = (pfs_chunk_writestream_t *)pfs_mem_malloc(sizeof(*cw),
-	    M_CHUNK_WRITESTREAM);
-	if (cw == NULL) {
+	/* the chunkfile header inside is declared page aligned */
+	if (pfs_mem_memalign((void **)&cw, alignof(pfs_chunk_writestream_t),
+	    sizeof(*cw), M_CHUNK_WRITESTREAM) != 0) {
 		pfs_etrace("mem alloc chunk stream failed!");
 		return NULL;
 	}
+	memset(cw, 0, sizeof(*cw));
 	cw->cw_chunk_stream.cs_desc = (pfs_chunkstream_desc_t *)desc;
 	cw->cw_writesz = 0;
 	cw->cw_chunk_stream.cs_ckid = chunkid;
@@ -787,7 +1112,8 @@ chunkheader_init(pfs_chunkfile_header_t *cf, const pfs_chunk_readstream_t *cr)
 	memset(cf, 0, sizeof(*cf));
 	cf->cf_magic = CHUNKFILE_MAGIC;
 	cf->cf_version = CHUNKFILE_VERSION;
-	cf->cf_ctime = time(NULL);
+	/* ctime names the stream, the one it is taken against must differ */
+	cf->cf_ctime = MAX((uint64_t)time(NULL), cr->cr_basectime + 1);
 	cf->cf_enablecrc = chunk_enablecrc(cr->cr_chunk_stream.cs_desc);
 	strncpy_safe(cf->cf_pbdname, cr->cr_chunk_stream.cs_desc->csd_pbdname,
 	    sizeof(cf->cf_pbdname));
@@ -799,14 +1125,40 @@ chunkheader_init(pfs_chunkfile_header_t *cf, const pfs_chunk_readstream_t *cr)
 	cf->cf_ckid = cr->cr_chunk_stream.cs_ckid;
 	cf->cf_metasz = cr->cr_metasz;
 	cf->cf_streamsz = cr->cr_streamsz;
+	cf->cf_flags = cr->cr_basectime ? CHUNKFILE_INCR : 0;
+	cf->cf_basectime = cr->cr_basectime;
 	cf->cf_crcsz = cr->cr_crcsz;
 
 	return sizeof(*cf);
 }
 
+/*
+ * Wait for all IOs of the stream when @ninflight reaches the iodepth,
+ * or when @force.
+ */
+static int
+block_wait_io(const pfs_chunkfile_header_t *cf, int iodesc, int *ninflight,
+    bool force)
+{
+	int err;
+
+	if (*ninflight == 0 || (!force && *ninflight < chunk_stream_iodepth))
+		return 0;
+
+	*ninflight = 0;
+	err = pfsdev_wait_io(iodesc);
+	if (err < 0)
+		pfs_etrace("IO of chunk %u failed, err=%d\n", cf->cf_ckid, err);
+	return err;
+}
+
+/*
+ * Submit reads of the block range without waiting for them, the caller
+ * waits by block_wait_io().
+ */
 static int
 block_read(void *buf, size_t blksz, const pfs_chunkfile_header_t *cf, int iodesc,
-    uint64_t bda)
+    uint64_t bda, int *ninflight)
 {
 	int err;
 	char *ptr;
@@ -819,6 +1171,10 @@ block_read(void *buf, size_t blksz, const pfs_chunkfile_header_t *cf, int iodesc
 	fragbda = bda;
 	ptr = (char *)buf;
 	for (rsum = 0; rsum < blksz; rsum += rlen) {
+		err = block_wait_io(cf, iodesc, ninflight, false);
+		if (err < 0)
+			return err;
+
 		left = blksz - rsum;
 		rlen = MIN(cf->cf_fragsz, left);
 		err = pfsdev_pread_flags(iodesc, ptr, rlen, fragbda, IO_NOWAIT);
@@ -827,21 +1183,16 @@ block_read(void *buf, size_t blksz, const pfs_chunkfile_header_t *cf, int iodesc
 			    cf->cf_ckid, fragbda, err);
 			return err;
 		}
+		(*ninflight)++;
 		fragbda += rlen;
 		ptr += rlen;
 	}
-
-	err = pfsdev_wait_io(iodesc);
-	if (err < 0) {
-		pfs_etrace("Read chunk %u failed, err=%d\n", cf->cf_ckid, err);
-		return err;
-	}
 	return 0;
 }
 
 static int
 block_write(const void *buf, size_t blksz, const pfs_chunkfile_header_t *cf,
-    int iodesc, int64_t bda)
+    int iodesc, int64_t bda, int *ninflight)
 {
 	int err;
 	char *ptr;
@@ -854,6 +1205,10 @@ block_write(const void *buf, size_t blksz, const pfs_chunkfile_header_t *cf,
 	ptr = (char *)buf;
 	fragbda = bda;
 	for (wsum = 0; wsum < blksz; wsum += wlen) {
+		err = block_wait_io(cf, iodesc, ninflight, false);
+		if (err < 0)
+			return err;
+
 		left = blksz - wsum;
 		wlen = MIN(cf->cf_fragsz, left);
 		err = pfsdev_pwrite_flags(iodesc, ptr, wlen, fragbda, IO_NOWAIT);
@@ -862,18 +1217,110 @@ block_write(const void *buf, size_t blksz, const pfs_chunkfile_header_t *cf,
 			    cf->cf_ckid, fragbda, err);
 			return err;
 		}
+		(*ninflight)++;
 		fragbda += wlen;
 		ptr += wlen;
 	}
+	return 0;
+}
 
-	err = pfsdev_wait_io(iodesc);
+/*
+ * Drop blocks whose data has the same digest as in the base, so that
+ * only changed blocks are streamed. They still have to be read here,
+ * as nothing else tells an in place overwrite. Changed blocks are kept
+ * up to chunk_incr_cache_mb, in stream order, and chunk_read_data()
+ * takes them from memory instead of reading them a second time.
+ */
+static int
+readstream_prescan(pfs_chunk_readstream_t *cr)
+{
+	int err, err1, ninflight;
+	int64_t i, nskip, ncache;
+	uint64_t bda;
+	char *buf = NULL;
+	block_digest_t *base = NULL, bd;
+	block_meta_head_t *mh;
+	const pfs_chunkfile_header_t *cf = &cr->cr_cf;
+	int ioch = cr->cr_chunk_stream.cs_desc->csd_ioch_desc;
+	int ckid = cr->cr_chunk_stream.cs_ckid;
+
+	base = (block_digest_t *)pfs_mem_malloc(sizeof(block_digest_t) *
+	    PFS_NBT_PERCHUNK, M_CHUNK_DIGEST);
+	if (base == NULL)
+		ERR_GOTO(ENOMEM, out);
+
+	err = chunkdigest_load(cr, base);
 	if (err < 0) {
-		pfs_etrace("Write chunk %u failed, err=%d\n", cf->cf_ckid, err);
-		return err;
+		pfs_itrace("chunk %d has no base digest, backup it fully\n",
+		    ckid);
+		err = 0;
+		goto out;
 	}
-	return 0;
-}
 
+	cr->cr_blkcache = (char **)pfs_mem_malloc(sizeof(char *) *
+	    PFS_NBT_PERCHUNK, M_CHUNK_DIGEST);
+	if (cr->cr_blkcache == NULL)
+		ERR_GOTO(ENOMEM, out);
+
+	/* block_read() takes ckid and fragsz from the header */
+	chunkheader_init(&cr->cr_cf, cr);
+
+	nskip = 0;
+	ncache = chunk_incr_cache_mb * (1 << 20) / PFS_BLOCK_SIZE;
+	for (i = PFS_NBT_PERCHUNK - 1; i >= 0; i--) {
+		mh = &cr->cr_meta_buf[i];
+		if (mh->mh_datalen == 0)
+			continue;
+
+		if (buf == NULL) {
+			err = pfs_mem_memalign((void **)&buf, CHUNK_FRAG_SIZE,
+			    PFS_BLOCK_SIZE, M_CHUNK_DIGEST);
+			if (err != 0) {
+				buf = NULL;
+				ERR_GOTO(err, out);
+			}
+		}
+
+		ninflight = 0;
+		bda = cf->cf_ckid * cf->cf_chunksz + i * cf->cf_blksz;
+		err = block_read(buf, mh->mh_datalen, cf, ioch, bda, &ninflight);
+		err1 = block_wait_io(cf, ioch, &ninflight, true);
+		ERR_UPDATE(err, err1);
+		if (err < 0)
+			goto out;
+
+		bd.bd_crc = crc32c((uint32_t)~1, buf, mh->mh_datalen);
+		bd.bd_len = mh->mh_datalen;
+		bd.bd_fnv = fnv_64_buf(buf, mh->mh_datalen, FNV1_64_INIT);
+		if (bd.bd_crc != base[i].bd_crc || bd.bd_len != base[i].bd_len ||
+		    bd.bd_fnv != base[i].bd_fnv) {
+			if (ncache > 0) {
+				cr->cr_blkcache[i] = buf;
+				buf = NULL;
+				ncache--;
+			}
+			continue;
+		}
+
+		cr->cr_digest[i] = bd;
+		cr->cr_streamsz -= mh->mh_datalen;
+		mh->mh_datalen = 0;
+		nskip++;
+	}
+
+	pfs_itrace("chunk %d incremental over base ctime %lu, %ld blocks"
+	    " unchanged\n", ckid, cr->cr_basectime, nskip);
+out:
+	if (err < 0) {
+		cr->cr_basectime = 0;
+		readstream_free_cache(cr);
+	}
+	if (buf)
+		pfs_mem_free(buf, M_CHUNK_DIGEST);
+	if (base)
+		pfs_mem_free(base, M_CHUNK_DIGEST);
+	return err;
+}
 
 int
 pfs_chunk_backup_init(pfs_chunkstream_desc_t *desc)
@@ -945,14 +1392,24 @@ chunk_read_block_next(pfs_chunk_readstream_t *cr)
 	cr->cr_blkreadsz = 0;
 }
 
+/*
+ * Fill the buffer with data of as many blocks as it can hold. Reads of
+ * all the blocks are in flight together, and they are all done before
+ * return. If any of them fails, the stream stays where it was, so the
+ * same data is read again by the next call.
+ */
 static int
 chunk_read_data(pfs_chunk_readstream_t *cr, char *buf, ssize_t *rlen,
     ssize_t left)
 {
-	int err;
+	int err, err1;
 	int ioch = cr->cr_chunk_stream.cs_desc->csd_ioch_desc;
+	int ninflight = 0;
 	uint64_t fragbda;
+	ssize_t len;
 	const pfs_chunkfile_header_t *cf = &cr->cr_cf;
+	int64_t blkpos = cr->cr_blkpos;
+	int64_t blkoff = cr->cr_blkreadsz;
 
 	if (cr->cr_blkpos < 0) {
 		if (chunk_enablecrc(cr->cr_chunk_stream.cs_desc))
@@ -960,40 +1417,70 @@ chunk_read_data(pfs_chunk_readstream_t *cr, char *buf, ssize_t *rlen,
 		return 0;
 	}
 
-	const block_meta_head_t *mh = &cr->cr_meta_buf[cr->cr_blkpos];
-	if (mh->mh_blko != cr->cr_blkpos) {
-		pfs_etrace("read metablk(%ld) not match blkpos(%ld)\n",
-		    mh->mh_blko, cr->cr_blkpos);
-		return -EINVAL;
-	}
+	err = 0;
+	*rlen = 0;
+	while (left > 0 && cr->cr_blkpos >= 0) {
+		const block_meta_head_t *mh = &cr->cr_meta_buf[cr->cr_blkpos];
+		if (mh->mh_blko != cr->cr_blkpos) {
+			pfs_etrace("read metablk(%ld) not match blkpos(%ld)\n",
+			    mh->mh_blko, cr->cr_blkpos);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	if (mh->mh_datalen == 0) {
-		chunk_read_block_next(cr);
-		return 0;
-	}
+		if (mh->mh_datalen == 0) {
+			chunk_read_block_next(cr);
+			continue;
+		}
 
-	*rlen = MIN(mh->mh_datalen - cr->cr_blkreadsz, left);
-	if(mh->mh_datalen % CHUNK_FRAG_SIZE != 0) {
-		pfs_etrace("invalid data len(%ld)\n", mh->mh_datalen);
-		return -EINVAL;
-	}
+		len = MIN(mh->mh_datalen - cr->cr_blkreadsz, left);
+		if(mh->mh_datalen % CHUNK_FRAG_SIZE != 0) {
+			pfs_etrace("invalid data len(%ld)\n", mh->mh_datalen);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	if(*rlen % CHUNK_FRAG_SIZE  != 0) {
-		pfs_etrace("invalid  rlen(%ld)\n", *rlen);
-		return -EINVAL;
-	}
+		if(len % CHUNK_FRAG_SIZE  != 0) {
+			pfs_etrace("invalid  rlen(%ld)\n", len);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	fragbda = cf->cf_ckid * cf->cf_chunksz + cr->cr_blkpos * cf->cf_blksz
-	    + cr->cr_blkreadsz;
-	err = block_read(buf, *rlen, cf, ioch, fragbda);
-	if (err < 0)
-		return err;
+		if (cr->cr_blkcache && cr->cr_blkcache[cr->cr_blkpos]) {
+			memcpy(buf + *rlen, cr->cr_blkcache[cr->cr_blkpos] +
+			    cr->cr_blkreadsz, len);
+		} else {
+			fragbda = cf->cf_ckid * cf->cf_chunksz +
+			    cr->cr_blkpos * cf->cf_blksz + cr->cr_blkreadsz;
+			err = block_read(buf + *rlen, len, cf, ioch, fragbda,
+			    &ninflight);
+			if (err < 0)
+				goto out;
+		}
 
-	cr->cr_blkreadsz += *rlen;
-	if (cr->cr_blkreadsz == mh->mh_datalen) {
-		chunk_read_block_next(cr);
+		*rlen += len;
+		left -= len;
+		cr->cr_blkreadsz += len;
+		if (cr->cr_blkreadsz == mh->mh_datalen) {
+			chunk_read_block_next(cr);
+		}
 	}
 
+out:
+	err1 = block_wait_io(cf, ioch, &ninflight, true);
+	ERR_UPDATE(err, err1);
+	if (err < 0) {
+		cr->cr_blkpos = blkpos;
+		cr->cr_blkreadsz = blkoff;
+		*rlen = 0;
+		return err;
+	}
+	if (cr->cr_digest)
+		chunkdigest_update(cr, blkpos, blkoff, buf, *rlen);
+	/* blocks streamed out are done with their cached copies */
+	for (; cr->cr_blkcache && blkpos > cr->cr_blkpos; blkpos--) {
+		if (cr->cr_blkcache[blkpos]) {
+			pfs_mem_free(cr->cr_blkcache[blkpos], M_CHUNK_DIGEST);
+			cr->cr_blkcache[blkpos] = NULL;
+		}
+	}
 	return 0;
 }
 
@@ -1091,9 +1578,10 @@ pfs_chunk_readstream(pfs_chunkstream_t *cs, char *buf, size_t len)
 			chunk_read_meta(cr, data_buf, &rlen, left);
 			break;
 		case CHUNK_READ_DATA:
+			/* what is already in buf goes out, the error next */
 			err = chunk_read_data(cr, data_buf, &rlen, left);
 			if (err < 0)
-				return err;
+				return rsum > 0 ? rsum : err;
 			break;
 		case CHUNK_READ_CRC:
 			chunk_read_crc(cr, data_buf, &rlen, left);
@@ -1150,8 +1638,9 @@ static int
 chunk_write_header(pfs_chunk_writestream_t *cw, const char *buf, ssize_t *wlen)
 {
 	int err = 0;
-	uint64_t streamsz;
-	uint32_t metasz;
+	uint64_t streamsz, mark;
+	uint32_t metasz, ckid;
+	const pfs_chunkstream_desc_t *desc = cw->cw_chunk_stream.cs_desc;
 
 	cw->cw_ck_header = *(pfs_chunkfile_header_t *)buf;
 
@@ -1183,6 +1672,20 @@ chunk_write_header(pfs_chunk_writestream_t *cw, const char *buf, ssize_t *wlen)
 			ERR_GOTO(err, out);
 	}
 
+	ckid = cw->cw_ck_header.cf_ckid;
+	if (cw->cw_ck_header.cf_flags & CHUNKFILE_INCR) {
+		mark = 0;
+		(void)chunkmark_load(desc, ckid, &mark);
+		if (mark != cw->cw_ck_header.cf_basectime) {
+			pfs_etrace("incremental chunk %u must be restored over"
+			    " the stream of ctime %lu, but the last one restored"
+			    " is of ctime %lu\n", ckid,
+			    cw->cw_ck_header.cf_basectime, mark);
+			ERR_GOTO(EINVAL, out);
+		}
+	}
+	chunkmark_clear(desc, ckid);
+
 	cw->cw_chunk_stream.cs_time_us =  gettimeofday_us();
 	cw->cw_meta_buf = (block_meta_head_t *)pfs_mem_malloc(metasz,
 	    M_CHUNK_METABUF);
@@ -1217,14 +1720,24 @@ chunk_write_block_next(pfs_chunk_writestream_t *cw)
 	cw->cw_blkwritesz = 0;
 }
 
+/*
+ * Counterpart of chunk_read_data(): write out data of as many blocks
+ * as the buffer holds, with the writes in flight together. If any of
+ * them fails, the stream stays where it was, and the same data is
+ * written again by the next call.
+ */
 static int
 chunk_write_data(pfs_chunk_writestream_t *cw, const char *buf, ssize_t *wlen,
     ssize_t left)
 {
-	int err;
+	int err, err1;
 	int ioch = cw->cw_chunk_stream.cs_desc->csd_ioch_desc;
+	int ninflight = 0;
 	uint64_t fragbda;
+	ssize_t len;
 	const pfs_chunkfile_header_t *cf = &cw->cw_ck_header;
+	int64_t blkpos = cw->cw_blkpos;
+	int64_t blkoff = cw->cw_blkwritesz;
 
 	if (cw->cw_blkpos < 0) {
 		if (cw->cw_ck_header.cf_enablecrc)
@@ -1232,41 +1745,56 @@ chunk_write_data(pfs_chunk_writestream_t *cw, const char *buf, ssize_t *wlen,
 		return 0;
 	}
 
-	block_meta_head_t *mh = &cw->cw_meta_buf[cw->cw_blkpos];
-	if (mh->mh_blko != cw->cw_blkpos) {
-		pfs_etrace("write metablk(%ld) not match blkpos(%ld)\n",
-		    mh->mh_blko, cw->cw_blkpos);
-		return -EINVAL;
-	}
+	err = 0;
+	*wlen = 0;
+	while (left > 0 && cw->cw_blkpos >= 0) {
+		block_meta_head_t *mh = &cw->cw_meta_buf[cw->cw_blkpos];
+		if (mh->mh_blko != cw->cw_blkpos) {
+			pfs_etrace("write metablk(%ld) not match blkpos(%ld)\n",
+			    mh->mh_blko, cw->cw_blkpos);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	if (mh->mh_datalen == 0) {
-		chunk_write_block_next(cw);
-		return 0;
-	}
+		if (mh->mh_datalen == 0) {
+			chunk_write_block_next(cw);
+			continue;
+		}
 
-	*wlen = MIN(mh->mh_datalen - cw->cw_blkwritesz, left);
-	if(mh->mh_datalen % CHUNK_FRAG_SIZE != 0) {
-		pfs_etrace("invalid data len(%ld)\n", mh->mh_datalen);
-		return -EINVAL;
-	}
+		len = MIN(mh->mh_datalen - cw->cw_blkwritesz, left);
+		if(mh->mh_datalen % CHUNK_FRAG_SIZE != 0) {
+			pfs_etrace("invalid data len(%ld)\n", mh->mh_datalen);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	if(*wlen % CHUNK_FRAG_SIZE  != 0) {
-		pfs_etrace("invalid  wlen(%ld)\n", *wlen);
-		return -EINVAL;
-	}
+		if(len % CHUNK_FRAG_SIZE  != 0) {
+			pfs_etrace("invalid  wlen(%ld)\n", len);
+			ERR_GOTO(EINVAL, out);
+		}
 
-	fragbda = cf->cf_ckid * cf->cf_chunksz + cw->cw_blkpos * cf->cf_blksz
-	    + cw->cw_blkwritesz;
-	err = block_write(buf, *wlen, cf, ioch, fragbda);
-	if (err < 0)
-		return err;
+		fragbda = cf->cf_ckid * cf->cf_chunksz +
+		    cw->cw_blkpos * cf->cf_blksz + cw->cw_blkwritesz;
+		err = block_write(buf + *wlen, len, cf, ioch, fragbda,
+		    &ninflight);
+		if (err < 0)
+			goto out;
 
-	cw->cw_blkwritesz += *wlen;
-	if (cw->cw_blkwritesz == mh->mh_datalen) {
-		chunk_write_block_next(cw);
+		*wlen += len;
+		left -= len;
+		cw->cw_blkwritesz += len;
+		if (cw->cw_blkwritesz == mh->mh_datalen) {
+			chunk_write_block_next(cw);
+		}
 	}
 
-	return 0;
+out:
+	err1 = block_wait_io(cf, ioch, &ninflight, true);
+	ERR_UPDATE(err, err1);
+	if (err < 0) {
+		cw->cw_blkpos = blkpos;
+		cw->cw_blkwritesz = blkoff;
+		*wlen = 0;
+	}
+	return err;
 }
 
 static void
@@ -1309,6 +1837,10 @@ chunk_write_finish(pfs_chunk_writestream_t *cw)
 			return err;
 	}
 
+	/* a mark that fails to save only rejects the next incremental */
+	(void)chunkmark_save(cw->cw_chunk_stream.cs_desc,
+	    cw->cw_ck_header.cf_ckid, cw->cw_ck_header.cf_ctime);
+
 	cw->cw_stage = CHUNK_WRITE_FINISH;
 
 	end = gettimeofday_us();
@@ -1354,9 +1886,10 @@ pfs_chunk_writestream(pfs_chunkstream_t *cs, const char *buf, size_t len)
 			chunk_write_meta(cw, data_buf, &wlen, left);
 			break;
 		case CHUNK_WRITE_DATA:
+			/* what is already written is taken, the error next */
 			err = chunk_write_data(cw, data_buf, &wlen, left);
 			if (err < 0)
-				return err;
+				return wsum > 0 ? wsum : err;
 			break;
 		case CHUNK_WRITE_CRC:
 			chunk_write_crc(cw, data_buf, &wlen, left);
@@ -1403,6 +1936,12 @@ pfs_chunk_readstream_close(pfs_chunkstream_t *cs)
 	pfs_mem_free(cr->cr_meta_buf, M_CHUNK_METABUF);
 	cr->cr_meta_buf = NULL;
 
+	if (cr->cr_digest) {
+		pfs_mem_free(cr->cr_digest, M_CHUNK_DIGEST);
+		cr->cr_digest = NULL;
+	}
+	readstream_free_cache(cr);
+
 	pfs_mem_free(cr, M_CHUNK_READSTREAM);
 	cr = NULL;
 }
@@ -1459,6 +1998,27 @@ pfs_chunk_readstream_isfinish(pfs_chunkstream_t *cs)
 	return 1;
 }
 
+/*
+ * The caller has stored the whole stream, its digests become the base
+ * of the next incremental backup.
+ */
+int
+pfs_chunk_readstream_commit(pfs_chunkstream_t *cs)
+{
+	pfs_chunk_readstream_t *cr = (pfs_chunk_readstream_t *)cs;
+
+	if (cr->cr_stage != CHUNK_READ_FINISH) {
+		pfs_etrace("commit unfinished stream, ckid=%d, readsz=%ld,"
+		    " streamsz=%ld\n", cs->cs_ckid, cr->cr_readsz,
+		    cr->cr_streamsz);
+		return -EINVAL;
+	}
+
+	if (cr->cr_digest == NULL)
+		return 0;
+	return chunkdigest_save(cr);
+}
+
 int
 pfs_chunk_writestream_isfinish(pfs_chunkstream_t *cs)
 {
@@ -1513,7 +2073,8 @@ pfs_chunkstream_init(const char *cluster, const char *pbdname, int flags)
 		err = pfs_chunk_backup_init(desc);
 	}
 	else if (pfs_chunk_isrestore(flags)) {
-		if (flags & CHUNK_CRC || flags & CHUNK_BACKUP) {
+		if (flags & CHUNK_CRC || flags & CHUNK_BACKUP ||
+		    flags & CHUNK_INCR) {
 			pfs_etrace("restore invalid flag(%d)\n", flags);
 			goto fail;
 		}
@@ -1636,6 +2197,23 @@ pfs_chunkstream_isfinish(pfs_chunkstream_t *stream)
 	return err;
 }
 
+int
+pfs_chunkstream_commit(pfs_chunkstream_t *stream)
+{
+	if (stream == NULL) {
+		pfs_etrace("commit stream is NULL");
+		return -EINVAL;
+	}
+
+	if (!pfs_chunk_isbackup(stream->cs_desc->csd_flags)) {
+		pfs_etrace("commit is only for backup, flags(%d), pbdname=%s\n",
+		    stream->cs_desc->csd_flags, stream->cs_desc->csd_pbdname);
+		return -EINVAL;
+	}
+
+	return pfs_chunk_readstream_commit(stream);
+}
+
 void
 pfs_chunkstream_get_nchunk(const pfs_chunkstream_desc_t *desc, int *nchunk)
 {
@@ -46,6 +46,7 @@ int64_t	pfs_chunkstream_write(pfs_chunkstream_t *stream, const char *buf,
 int	pfs_chunkstream_close(pfs_chunkstream_t *stream);
 int	pfs_chunkstream_fini(pfs_chunkstream_desc_t *desc); 
 int	pfs_chunkstream_eof(pfs_chunkstream_t *stream);
+int	pfs_chunkstream_commit(pfs_chunkstream_t *stream);
 void	pfs_chunkstream_get_nchunk(const pfs_chunkstream_desc_t *desc, 
 	    int *nchunk);
 }
@@ -65,6 +66,7 @@ void	pfs_chunk_readstream_close(pfs_chunkstream_t *cs);
 void	pfs_chunk_writesteam_close(pfs_chunkstream_t *cs);
 void	pfs_chunk_fini(pfs_chunkstream_desc_t *desc);
 int	pfs_chunk_readstream_isfinish(pfs_chunkstream_t *cs);
+int	pfs_chunk_readstream_commit(pfs_chunkstream_t *cs);
 int	pfs_chunk_writestream_isfinish(pfs_chunkstream_t *cs);
 
 
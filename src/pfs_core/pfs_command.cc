@@ -19,6 +19,8 @@
 #include "pfs_devio.h"
 #include "pfs_impl.h"
 #include "pfs_file.h"
+#include "pfs_hist.h"
+#include "pfs_metrics.h"
 #include "pfs_mount.h"
 #include "pfs_stat.h"
 #include "pfs_namecache.h"
@@ -177,6 +179,68 @@ pfs_command_mountstat(struct cmdinfo *ci, admin_buf_t *ab)
 	return err;
 }
 
+static int
+pfs_command_notify(struct cmdinfo *ci, admin_buf_t *ab)
+{
+	pfs_mount_t *mnt;
+	struct cmd_notify *cmdnt = &ci->ci_msgcmd.mc_notify;
+
+	mnt = pfs_get_mount(cmdnt->nt_pbdname);
+	if (mnt == NULL)
+		ERR_RETVAL(ENODEV);
+
+	pfs_mount_notify_head(mnt, cmdnt->nt_head_txid);
+
+	pfs_put_mount(mnt);
+	return 0;
+}
+
+static int
+pfs_command_hist(struct cmdinfo *ci, admin_buf_t *ab)
+{
+	int err, npct;
+	pfs_mount_t *mnt;
+	double pcts[PFS_HIST_MAXPCT];
+	struct cmd_hist *cmdhi = &ci->ci_msgcmd.mc_hist;
+
+	cmdhi->hi_pattern[sizeof(cmdhi->hi_pattern) - 1] = '\0';
+	cmdhi->hi_pcts[sizeof(cmdhi->hi_pcts) - 1] = '\0';
+	npct = pfs_hist_parse_pcts(cmdhi->hi_pcts, pcts, PFS_HIST_MAXPCT);
+	if (npct < 0)
+		return npct;
+
+	mnt = pfs_get_mount(cmdhi->hi_pbdname);
+	if (mnt == NULL)
+		ERR_RETVAL(ENODEV);
+
+	pfs_hist_print_header(ab, pcts, npct);
+	err = pfs_mntstat_hist_snap(ab, cmdhi->hi_pattern, pcts, npct,
+	    cmdhi->hi_reset != 0);
+	if (err == 0)
+		err = pfs_devstat_hist_snap(mnt->mnt_ioch_desc, ab,
+		    cmdhi->hi_pattern, pcts, npct, cmdhi->hi_reset != 0);
+
+	pfs_put_mount(mnt);
+	return err;
+}
+
+static int
+pfs_command_metrics(struct cmdinfo *ci, admin_buf_t *ab)
+{
+	int err;
+	pfs_mount_t *mnt;
+	struct cmd_metrics *cmdmt = &ci->ci_msgcmd.mc_metrics;
+
+	mnt = pfs_get_mount(cmdmt->mt_pbdname);
+	if (mnt == NULL)
+		ERR_RETVAL(ENODEV);
+
+	err = pfs_metrics_dump(pfs_adminbuf_printer(ab), mnt);
+
+	pfs_put_mount(mnt);
+	return err;
+}
+
 void *
 pfs_command_entry(void *arg)
 {
@@ -227,6 +291,18 @@ pfs_command_entry(void *arg)
 		err = pfs_namecache_dumpbin(ci, ab);
 		break;
 
+	case CMD_NOTIFY_REQ:
+		err = pfs_command_notify(ci, ab);
+		break;
+
+	case CMD_HIST_REQ:
+		err = pfs_command_hist(ci, ab);
+		break;
+
+	case CMD_METRICS_REQ:
+		err = pfs_command_metrics(ci, ab);
+		break;
+
 	default:
 		err = -EINVAL;
 		break;
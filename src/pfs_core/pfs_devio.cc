@@ -253,12 +253,22 @@ pfs_dev_create(const char *cluster, const char *devname, int flags)
 	/* epoch increment only when device open */
 	dev->d_epoch = __sync_add_and_fetch(&pfs_devs_epoch, 1);
 	pfs_devstat_init(&dev->d_ds);
+	mutex_init(&dev->d_flush_mtx);
+	cond_init(&dev->d_flush_cond, NULL);
+	dev->d_flushing = false;
+	dev->d_flush_started = 0;
+	dev->d_flush_done = 0;
+	dev->d_flush_errgen = 0;
+	dev->d_flush_err = 0;
 	return dev;
 }
 
 static void
 pfs_dev_destroy(pfs_dev_t *dev)
 {
+	PFS_ASSERT(dev->d_flushing == false);
+	cond_destroy(&dev->d_flush_cond);
+	mutex_destroy(&dev->d_flush_mtx);
 	pfs_devstat_uninit(&dev->d_ds);
 	pfs_dev_free_id(dev);
 	dev->d_id = -1;
@@ -280,6 +290,7 @@ pfs_io_start(pfs_devio_t *io)
 	case PFSDEV_REQ_RD:	stat = STAT_PFS_DEV_READ_BW; break;
 	case PFSDEV_REQ_WR: 	stat = STAT_PFS_DEV_WRITE_BW; break;
 	case PFSDEV_REQ_TRIM:	stat = -1; break;
+	case PFSDEV_REQ_FLUSH:	stat = -1; break;
 	default: PFS_ASSERT("io_start bad op" == NULL); break;
 	}
 	if (stat < 0)
@@ -298,15 +309,18 @@ pfs_io_end(pfs_devio_t *io)
 	case PFSDEV_REQ_RD:	stat = STAT_PFS_DEV_READ_DONE; break;
 	case PFSDEV_REQ_WR: 	stat = STAT_PFS_DEV_WRITE_DONE; break;
 	case PFSDEV_REQ_TRIM: 	stat = STAT_PFS_DEV_TRIM_DONE; break;
+	case PFSDEV_REQ_FLUSH:	stat = -1; break;
 	default: PFS_ASSERT("io_end bad op" == NULL); break;
 	}
-	PFS_STAT_LATENCY_VALUE((StatType)stat, &io->io_start_ts);
+	if (stat >= 0)
+		PFS_STAT_LATENCY_VALUE((StatType)stat, &io->io_start_ts);
 	(void)stat;	/* suppress compiler error when trace is disabled */
 
 	switch (io->io_op) {
 		case PFSDEV_REQ_RD:	stat = MNT_STAT_DEV_READ; break;
 		case PFSDEV_REQ_WR: 	stat = MNT_STAT_DEV_WRITE; break;
 		case PFSDEV_REQ_TRIM: 	stat = MNT_STAT_DEV_TRIM; break;
+		case PFSDEV_REQ_FLUSH:	stat = MNT_STAT_DEV_FLUSH; break;
 		default: PFS_ASSERT("io_end bad op" == NULL); break;
 	}
 
@@ -530,6 +544,79 @@ pfsdev_trim(int devi, uint64_t bda)
 	return pfsdev_do_io(dev, io);
 }
 
+/*
+ * pfsdev_flush_shared:
+ *
+ *	Run @flush on behalf of the caller and every other caller waiting
+ *	at the same time. A flush started before the call may miss writes
+ *	completed before it, so the caller waits for the next one, its
+ *	target generation. A failed flush leaves its generation behind,
+ *	and every caller whose target is not past it fails: a later flush
+ *	that succeeded before the caller woke up doesn't hide the error.
+ */
+int
+pfsdev_flush_shared(pfs_dev_t *dev, int (*flush)(pfs_dev_t *dev))
+{
+	uint64_t target, gen;
+	int err;
+
+	mutex_lock(&dev->d_flush_mtx);
+	target = dev->d_flush_started + 1;
+	while (dev->d_flush_done < target) {
+		if (dev->d_flushing) {
+			cond_wait(&dev->d_flush_cond, &dev->d_flush_mtx);
+			continue;
+		}
+
+		dev->d_flushing = true;
+		gen = ++dev->d_flush_started;
+		mutex_unlock(&dev->d_flush_mtx);
+
+		err = flush(dev);
+
+		mutex_lock(&dev->d_flush_mtx);
+		dev->d_flushing = false;
+		dev->d_flush_done = gen;
+		if (err < 0) {
+			dev->d_flush_errgen = gen;
+			dev->d_flush_err = err;
+		}
+		cond_broadcast(&dev->d_flush_cond);
+	}
+	err = (dev->d_flush_errgen >= target) ? dev->d_flush_err : 0;
+	mutex_unlock(&dev->d_flush_mtx);
+	return err;
+}
+
+static int
+pfsdev_flush_io(pfs_dev_t *dev)
+{
+	pfs_devio_t *io;
+
+	io = pfs_io_create(dev, PFSDEV_REQ_FLUSH, NULL, 0, 0, IO_WAIT);
+	PFS_VERIFY(io != NULL);
+	return pfsdev_do_io(dev, io);
+}
+
+/*
+ * pfsdev_flush:
+ *
+ *	Make writes completed before the call durable on the device, by
+ *	flushing its volatile cache if it has one. Concurrent callers share
+ *	a flush instead of issuing one each.
+ */
+int
+pfsdev_flush(int devi)
+{
+	pfs_dev_t *dev;
+
+	PFS_ASSERT(0 <= devi && devi < PFS_MAX_NCHD);
+	dev = pfs_devs[devi];
+	PFS_ASSERT(dev != NULL && dev_writable(dev));
+
+	return pfsdev_flush_shared(dev, pfsdev_flush_io);
+}
+
 int
 pfsdev_pread_flags(int devi, void *buf, size_t len, uint64_t bda, int flags)
 {
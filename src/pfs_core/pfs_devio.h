@@ -134,6 +134,15 @@ typedef struct pfs_dev {
 	char		d_devname[PFS_MAX_PBDLEN];	/* alias pbdname */
 
 	pfs_devstat_t	d_ds;		/* statistics */
+
+	/* cache flush shared by concurrent callers, see pfsdev_flush() */
+	pthread_mutex_t	d_flush_mtx;
+	pthread_cond_t	d_flush_cond;
+	bool		d_flushing;
+	uint64_t	d_flush_started;	/* # of flushes started */
+	uint64_t	d_flush_done;		/* # of flushes done */
+	uint64_t	d_flush_errgen;		/* last flush that failed */
+	int		d_flush_err;		/* and how */
 } pfs_dev_t;
 
 /* device operation API */
@@ -145,6 +154,8 @@ int	pfsdev_close(int devi);
 int	pfsdev_info(int devi, pbdinfo_t *pi);
 int	pfsdev_reload(int devi);
 int	pfsdev_trim(int devi, uint64_t bda);
+int	pfsdev_flush(int devi);
+int	pfsdev_flush_shared(pfs_dev_t *dev, int (*flush)(pfs_dev_t *dev));
 int	pfsdev_pread_flags(int devi, void *buf, size_t len, uint64_t bda,
 	    int flags);
 int	pfsdev_pwrite_flags(int devi, void *buf, size_t len, uint64_t bda,
@@ -17,10 +17,15 @@
 #include "pfs_admin.h"
 #include "pfs_devio.h"
 #include "pfs_devstat.h"
+#include "pfs_metrics.h"
 
 extern uint64_t			pfs_devs_epoch;
 extern pfs_dev_t		*pfs_devs[PFS_MAX_NCHD];
 
+static const char *devstat_opname[PFSDEV_REQ_MAX] = {
+	"nop", "info", "read", "write", "trim", "flush",
+};
+
 struct devstat_snap {
 	struct timeval	s_snaptime;
 	uint64_t	s_ndev;
@@ -30,36 +35,93 @@ struct devstat_snap {
 	char		s_devname[PFS_MAX_PBDLEN];
 	int		s_type;
 	int		s_flags;
-	char		s_iostat[offsetof(pfs_devstat_t, ds_iostat_end) -
-				 offsetof(pfs_devstat_t, ds_iostat_start)];
+	pfs_iostat_t	s_iostat;
 };
 
+static int		devstat_nextshard;
+static __thread int	devstat_shard = -1;
+
+static inline pfs_devstat_shard_t *
+devstat_myshard(pfs_devstat_t *ds)
+{
+	if (devstat_shard < 0)
+		devstat_shard = __atomic_fetch_add(&devstat_nextshard, 1,
+		    __ATOMIC_RELAXED) % PFS_DEVSTAT_NSHARD;
+	return &ds->ds_shard[devstat_shard];
+}
+
+static inline uint64_t
+devstat_tv2us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static inline void
+devstat_us2tv(uint64_t us, struct timeval *tv)
+{
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+static uint64_t
+devstat_inflight(const pfs_devstat_t *ds)
+{
+	int64_t n = 0;
+
+	for (int si = 0; si < PFS_DEVSTAT_NSHARD; si++)
+		n += __atomic_load_n(&ds->ds_shard[si].dss_inflight,
+		    __ATOMIC_ACQUIRE);
+	return n > 0 ? n : 0;
+}
+
+/*
+ * Move the stamp if a new tick began. The io ending was in flight since
+ * the stamp; an io starting only finds the device busy if others are.
+ */
+static void
+devstat_tick(pfs_devstat_t *ds, uint64_t now_us, bool end)
+{
+	uint64_t stamp = __atomic_load_n(&ds->ds_stamp_us, __ATOMIC_RELAXED);
+
+	if (now_us < stamp + PFS_DEVSTAT_TICK_US)
+		return;
+	if (!__atomic_compare_exchange_n(&ds->ds_stamp_us, &stamp, now_us,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	if (stamp != 0 && (end || devstat_inflight(ds) > 0))
+		__atomic_add_fetch(&ds->ds_busy_us, now_us - stamp,
+		    __ATOMIC_RELAXED);
+}
+
 void
 pfs_devstat_init(pfs_devstat_t *ds)
 {
 	memset(ds, 0, sizeof(*ds));
-	rwlock_init(&ds->ds_rwlock, NULL);
 }
 
 void
 pfs_devstat_uninit(pfs_devstat_t *ds)
 {
-	PFS_ASSERT(ds->ds_start_count == ds->ds_end_count);
-	rwlock_destroy(&ds->ds_rwlock);
+	pfs_iostat_t st;
+
+	pfs_devstat_collect(ds, &st, NULL);
+	PFS_ASSERT(st.is_start_count == st.is_end_count);
+	(void)st;
 }
 
 void
 pfs_devstat_io_start(pfs_devstat_t *ds, const pfs_devio_t *io)
 {
+	pfs_devstat_shard_t *dss;
+
 	PFS_ASSERT(ds == &io->io_dev->d_ds);
 	if (!(io->io_flags & IO_STAT))
 		return;
 
-	rwlock_wrlock(&ds->ds_rwlock);
-	if (ds->ds_start_count == ds->ds_end_count)
-		ds->ds_busy_from = io->io_start_ts;
-	ds->ds_start_count++;
-	rwlock_unlock(&ds->ds_rwlock);
+	devstat_tick(ds, devstat_tv2us(&io->io_start_ts), false);
+	dss = devstat_myshard(ds);
+	__atomic_add_fetch(&dss->dss_inflight, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&dss->dss_start_count, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -67,7 +129,9 @@ pfs_devstat_io_end(pfs_devstat_t *ds, const pfs_devio_t *io)
 {
 	int		op = io->io_op;
 	int		err;
-	struct timeval	now, delta;
+	struct timeval	now;
+	uint64_t	now_us, latency;
+	pfs_devstat_shard_t *dss;
 
 	PFS_ASSERT(ds == &io->io_dev->d_ds);
 	if (!(io->io_flags & IO_STAT))
@@ -76,33 +140,80 @@ pfs_devstat_io_end(pfs_devstat_t *ds, const pfs_devio_t *io)
 	/* setup end timestamp */
 	err = gettimeofday(&now, NULL);
 	PFS_VERIFY(err == 0);
+	now_us = devstat_tv2us(&now);
 
-	rwlock_wrlock(&ds->ds_rwlock);
 	/* if succeed, update statistics */
+	dss = devstat_myshard(ds);
 	if (io->io_error == 0) {
-		ds->ds_bytes[op] += io->io_len;
-		ds->ds_ops[op]++;
-		timersub(&now, &io->io_start_ts, &delta);
-		timeradd(&ds->ds_duration[op], &delta,
-		    &ds->ds_duration[op]);
+		latency = now_us - devstat_tv2us(&io->io_start_ts);
+		pfs_hist_record(&ds->ds_hist[op], latency);
+		__atomic_add_fetch(&dss->dss_bytes[op], io->io_len,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&dss->dss_ops[op], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&dss->dss_duration_us[op], latency,
+		    __ATOMIC_RELAXED);
 	}
 
-	/* accumulate total busy time */
-	timersub(&now, &ds->ds_busy_from, &delta);
-	timeradd(&ds->ds_busy_time, &delta, &ds->ds_busy_time);
-	ds->ds_busy_from = now;
+	devstat_tick(ds, now_us, true);
+	__atomic_sub_fetch(&dss->dss_inflight, 1, __ATOMIC_RELEASE);
 
-	ds->ds_end_count++;
 	// count - ops == failed_io_cnt
-	rwlock_unlock(&ds->ds_rwlock);
+	__atomic_add_fetch(&dss->dss_end_count, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sum up the shards. Ends are read before starts, so an io counted as
+ * ended is counted as started too. The busy time includes the current
+ * tick if ios are in flight.
+ */
+void
+pfs_devstat_collect(const pfs_devstat_t *ds, pfs_iostat_t *st,
+    uint64_t *inflight)
+{
+	const pfs_devstat_shard_t *dss;
+	uint64_t duration_us[PFSDEV_REQ_MAX], busy_us, nflight;
+	int si, op;
+
+	memset(st, 0, sizeof(*st));
+	memset(duration_us, 0, sizeof(duration_us));
+	for (si = 0; si < PFS_DEVSTAT_NSHARD; si++)
+		st->is_end_count += __atomic_load_n(
+		    &ds->ds_shard[si].dss_end_count, __ATOMIC_ACQUIRE);
+	for (si = 0; si < PFS_DEVSTAT_NSHARD; si++) {
+		dss = &ds->ds_shard[si];
+		st->is_start_count += __atomic_load_n(&dss->dss_start_count,
+		    __ATOMIC_RELAXED);
+		for (op = 0; op < PFSDEV_REQ_MAX; op++) {
+			st->is_bytes[op] += __atomic_load_n(&dss->dss_bytes[op],
+			    __ATOMIC_RELAXED);
+			st->is_ops[op] += __atomic_load_n(&dss->dss_ops[op],
+			    __ATOMIC_RELAXED);
+			duration_us[op] += __atomic_load_n(
+			    &dss->dss_duration_us[op], __ATOMIC_RELAXED);
+		}
+	}
+	for (op = 0; op < PFSDEV_REQ_MAX; op++)
+		devstat_us2tv(duration_us[op], &st->is_duration[op]);
+
+	busy_us = __atomic_load_n(&ds->ds_busy_us, __ATOMIC_RELAXED);
+	nflight = devstat_inflight(ds);
+	if (nflight > 0) {
+		uint64_t stamp = __atomic_load_n(&ds->ds_stamp_us,
+		    __ATOMIC_RELAXED);
+		uint64_t now_us = gettimeofday_us();
+		if (stamp != 0 && now_us > stamp)
+			busy_us += now_us - stamp;
+	}
+	devstat_us2tv(busy_us, &st->is_busy_time);
+	if (inflight != NULL)
+		*inflight = nflight;
 }
 
 #if 0
 static void
 print_devstat(devstat_snap *snap)
 {
-	pfs_devstat_t	stat;
-	memcpy(&stat.ds_start_count, snap->s_iostat, sizeof(snap->s_iostat));
+	pfs_iostat_t	stat = snap->s_iostat;
 
 	pfs_itrace("print_devstat:\n");
 	pfs_itrace("\tsnaptime: %ld.%ld\nndev: %lu\nglobal epoch: %lu\n",
@@ -113,17 +224,17 @@ print_devstat(devstat_snap *snap)
 	    snap->s_cluster, snap->s_devname, snap->s_type, snap->s_flags);
 
 	pfs_itrace("\tstart_count: %lu\n\tend_count: %lu\n",
-	    stat.ds_start_count, stat.ds_end_count);
+	    stat.is_start_count, stat.is_end_count);
 	pfs_itrace("\tbusy_time: %ld.%ld\n",
-	    stat.ds_busy_time.tv_sec, stat.ds_busy_time.tv_usec);
+	    stat.is_busy_time.tv_sec, stat.is_busy_time.tv_usec);
 	pfs_itrace("\tbytes: R %lu, W %lu, T %lu\n",
-	    stat.ds_bytes[PFSDEV_REQ_RD], stat.ds_bytes[PFSDEV_REQ_WR], stat.ds_bytes[PFSDEV_REQ_TRIM]);
+	    stat.is_bytes[PFSDEV_REQ_RD], stat.is_bytes[PFSDEV_REQ_WR], stat.is_bytes[PFSDEV_REQ_TRIM]);
 	pfs_itrace("\tops: R %lu, W %lu, T %lu\n",
-	    stat.ds_ops[PFSDEV_REQ_RD], stat.ds_ops[PFSDEV_REQ_WR], stat.ds_ops[PFSDEV_REQ_TRIM]);
+	    stat.is_ops[PFSDEV_REQ_RD], stat.is_ops[PFSDEV_REQ_WR], stat.is_ops[PFSDEV_REQ_TRIM]);
 	pfs_itrace("\tduration: R %ld.%ld, W %ld.%ld, T %ld.%ld\n",
-	    stat.ds_duration[PFSDEV_REQ_RD].tv_sec, stat.ds_duration[PFSDEV_REQ_RD].tv_usec,
-	    stat.ds_duration[PFSDEV_REQ_WR].tv_sec, stat.ds_duration[PFSDEV_REQ_WR].tv_usec,
-	    stat.ds_duration[PFSDEV_REQ_TRIM].tv_sec, stat.ds_duration[PFSDEV_REQ_TRIM].tv_usec);
+	    stat.is_duration[PFSDEV_REQ_RD].tv_sec, stat.is_duration[PFSDEV_REQ_RD].tv_usec,
+	    stat.is_duration[PFSDEV_REQ_WR].tv_sec, stat.is_duration[PFSDEV_REQ_WR].tv_usec,
+	    stat.is_duration[PFSDEV_REQ_TRIM].tv_sec, stat.is_duration[PFSDEV_REQ_TRIM].tv_usec);
 }
 #endif
 
@@ -157,11 +268,82 @@ pfs_devstat_snap(int devi, admin_buf_t *ab)
 	snap->s_type = dev->d_type;
 	snap->s_flags = dev->d_flags;
 
-	rwlock_rdlock(&ds->ds_rwlock);
-	memcpy(snap->s_iostat, (char *)&ds->ds_iostat_start,
-	    sizeof(snap->s_iostat));
-	rwlock_unlock(&ds->ds_rwlock);
+	pfs_devstat_collect(ds, &snap->s_iostat, NULL);
 
 	pfs_adminbuf_consume(ab, sizeof(*snap));
 	return 0;
 }
+
+int
+pfs_devstat_hist_snap(int devi, admin_buf_t *ab, const char *pattern,
+    const double *pcts, int npct, bool reset)
+{
+	pfs_dev_t		*dev = pfs_devs[devi];
+	pfs_devstat_t		*ds;
+	pfs_hist_snap_t		hn;
+	char			name[64];
+
+	PFS_ASSERT(0 <= devi && devi < PFS_MAX_NCHD && dev != NULL);
+	ds = &dev->d_ds;
+
+	for (int op = 0; op < PFSDEV_REQ_MAX; op++) {
+		snprintf(name, sizeof(name), "dev.%s", devstat_opname[op]);
+		if (pattern[0] != '\0' && strstr(name, pattern) == NULL)
+			continue;
+		pfs_hist_merge(&ds->ds_hist[op], &hn);
+		if (reset)
+			pfs_hist_reset(&ds->ds_hist[op]);
+		if (hn.hn_total != 0)
+			pfs_hist_print(ab, name, &hn, pcts, npct);
+	}
+	return 0;
+}
+
+void
+pfs_devstat_metrics(int devi, pfs_metrics_t *m)
+{
+	pfs_dev_t		*dev = pfs_devs[devi];
+	pfs_devstat_t		*ds;
+	pfs_iostat_t		st;
+	uint64_t		inflight;
+	pfs_hist_snap_t		hn;
+	int			op;
+
+	PFS_ASSERT(0 <= devi && devi < PFS_MAX_NCHD && dev != NULL);
+	ds = &dev->d_ds;
+
+	pfs_devstat_collect(ds, &st, &inflight);
+
+	pfs_metrics_family(m, "pfs_dev_ios_total", "counter",
+	    "Succeeded device ios.");
+	for (op = PFSDEV_REQ_RD; op < PFSDEV_REQ_MAX; op++)
+		pfs_metrics_u64(m, "pfs_dev_ios_total", "op",
+		    devstat_opname[op], st.is_ops[op]);
+	pfs_metrics_family(m, "pfs_dev_bytes_total", "counter",
+	    "Bytes of succeeded device ios.");
+	for (op = PFSDEV_REQ_RD; op < PFSDEV_REQ_MAX; op++)
+		pfs_metrics_u64(m, "pfs_dev_bytes_total", "op",
+		    devstat_opname[op], st.is_bytes[op]);
+	pfs_metrics_family(m, "pfs_dev_io_seconds_total", "counter",
+	    "Time spent in succeeded device ios.");
+	for (op = PFSDEV_REQ_RD; op < PFSDEV_REQ_MAX; op++)
+		pfs_metrics_double(m, "pfs_dev_io_seconds_total", "op",
+		    devstat_opname[op], st.is_duration[op].tv_sec +
+		    st.is_duration[op].tv_usec / 1000000.0);
+	pfs_metrics_family(m, "pfs_dev_busy_seconds_total", "counter",
+	    "Time the device had ios in flight.");
+	pfs_metrics_double(m, "pfs_dev_busy_seconds_total", NULL, NULL,
+	    st.is_busy_time.tv_sec + st.is_busy_time.tv_usec / 1000000.0);
+	pfs_metrics_family(m, "pfs_dev_inflight_ios", "gauge",
+	    "Device ios in flight.");
+	pfs_metrics_u64(m, "pfs_dev_inflight_ios", NULL, NULL, inflight);
+
+	pfs_metrics_family(m, "pfs_dev_latency_seconds", "summary",
+	    "Latency of succeeded device ios, quantiles since start or reset.");
+	for (op = PFSDEV_REQ_RD; op < PFSDEV_REQ_MAX; op++) {
+		pfs_hist_merge(&ds->ds_hist[op], &hn);
+		if (hn.hn_alltotal != 0)
+			pfs_metrics_summary(m, "pfs_dev_latency_seconds",
+			    "op", devstat_opname[op], &hn);
+	}
+}
@@ -17,6 +17,7 @@
 #define _PFS_DEVSTAT_H_
 
 #include "pfs_impl.h"
+#include "pfs_hist.h"
 #ifndef PFS_DISK_IO_ONLY
 #include "pfs_iochnl.h"
 #else
@@ -26,6 +27,7 @@ enum {
     PFSDEV_REQ_RD       = 2,
     PFSDEV_REQ_WR       = 3,
     PFSDEV_REQ_TRIM     = 4,
+    PFSDEV_REQ_FLUSH    = 5,
 
     PFSDEV_REQ_MAX,
 };
@@ -33,26 +35,60 @@ enum {
 
 typedef struct pfs_devio pfs_devio_t;
 typedef struct admin_buf admin_buf_t;
+typedef struct pfs_metrics pfs_metrics_t;
+
+/* device statistics as the devstat command sends them, see pfsadm */
+typedef struct pfs_iostat {
+	uint64_t	is_start_count;
+	uint64_t	is_end_count;
+	struct timeval	is_busy_time;
+	uint64_t	is_bytes[PFSDEV_REQ_MAX];
+	uint64_t	is_ops[PFSDEV_REQ_MAX];
+	struct timeval	is_duration[PFSDEV_REQ_MAX];
+} pfs_iostat_t;
+
+/*
+ * Io threads count into their own shard, so completions on different
+ * threads don't share a lock or a cache line; shards are summed when
+ * the statistics are read. An io may end on another thread than it
+ * started on, so a shard's inflight count alone may be negative.
+ *
+ * Busy time is kept in ticks, as iostat does: the first io starting or
+ * ending in a new tick moves the device-wide stamp and adds the time
+ * since the last stamp if ios were in flight. Other ios only read the
+ * stamp. Busy time is exact to a tick.
+ */
+#define	PFS_DEVSTAT_NSHARD	32
+#define	PFS_DEVSTAT_TICK_US	1000
+
+typedef struct pfs_devstat_shard {
+	int64_t		dss_inflight;
+	uint64_t	dss_start_count;
+	uint64_t	dss_end_count;
+	uint64_t	dss_bytes[PFSDEV_REQ_MAX];
+	uint64_t	dss_ops[PFSDEV_REQ_MAX];
+	uint64_t	dss_duration_us[PFSDEV_REQ_MAX];
+} __attribute__((aligned(64))) pfs_devstat_shard_t;
 
 /* device statistics */
 typedef struct pfs_devstat {
-	pthread_rwlock_t ds_rwlock;
-	/* statistics */
-#define	ds_iostat_start	ds_start_count
-	uint64_t	ds_start_count;
-	uint64_t	ds_end_count;
-	struct timeval	ds_busy_time;
-	uint64_t	ds_bytes[PFSDEV_REQ_MAX];
-	uint64_t	ds_ops[PFSDEV_REQ_MAX];
-	struct timeval	ds_duration[PFSDEV_REQ_MAX];
-#define	ds_iostat_end	ds_busy_from
-	struct timeval	ds_busy_from;
+	pfs_devstat_shard_t ds_shard[PFS_DEVSTAT_NSHARD];
+	/* busy time, updated at most once a tick */
+	uint64_t	ds_stamp_us __attribute__((aligned(64)));
+	uint64_t	ds_busy_us;
+	/* latency of succeeded ios */
+	pfs_hist_t	ds_hist[PFSDEV_REQ_MAX];
 } pfs_devstat_t;
 
 void pfs_devstat_init(pfs_devstat_t *ds);
 void pfs_devstat_uninit(pfs_devstat_t *ds);
 void pfs_devstat_io_start(pfs_devstat_t *ds, const pfs_devio_t *io);
 void pfs_devstat_io_end(pfs_devstat_t *ds, const pfs_devio_t *io);
+void pfs_devstat_collect(const pfs_devstat_t *ds, pfs_iostat_t *st,
+    uint64_t *inflight);
 int pfs_devstat_snap(int devi, admin_buf_t *ab);
+int pfs_devstat_hist_snap(int devi, admin_buf_t *ab, const char *pattern,
+    const double *pcts, int npct, bool reset);
+void pfs_devstat_metrics(int devi, pfs_metrics_t *m);
 
 #endif	/* _PFS_DEVSTAT_H_ */
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "pfs_dxindex.h"
+#include "pfs_impl.h"
+#include "pfs_memory.h"
+
+#define	DX_MINBITS	4
+#define	DX_NMOVE	32		/* old slots moved per add or delete */
+#define	DX_TOMB		((pfs_dxent_t *)1)	/* moved or deleted, in dx_old */
+
+static inline uint32_t
+dx_nslot(pfs_dxent_t **slot, int bits)
+{
+	return slot ? (1U << bits) : 0;
+}
+
+static inline uint32_t
+dx_home(uint32_t nmhash, int bits)
+{
+	/* FNV hashes are weak in the low bits, take the high ones */
+	return (nmhash * 0x9e3779b1U) >> (32 - bits);
+}
+
+static int64_t
+dx_probe(pfs_dxent_t **slot, int bits, uint32_t nmhash)
+{
+	uint32_t mask = dx_nslot(slot, bits) - 1;
+	uint32_t i;
+	pfs_dxent_t *e;
+
+	if (slot == NULL)
+		return -1;
+	for (i = dx_home(nmhash, bits); (e = slot[i]) != NULL;
+	    i = (i + 1) & mask) {
+		if (e != DX_TOMB && e->e_nmhash == nmhash)
+			return i;
+	}
+	return -1;
+}
+
+static void
+dx_insert(pfs_dxent_t **slot, int bits, pfs_dxent_t *ent)
+{
+	uint32_t mask = dx_nslot(slot, bits) - 1;
+	uint32_t i;
+
+	for (i = dx_home(ent->e_nmhash, bits); slot[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	slot[i] = ent;
+}
+
+/*
+ * Remove slot i of the current table, which has no tombstones: shift
+ * back the slots after it that may live closer to their home.
+ */
+static void
+dx_remove(pfs_dxent_t **slot, int bits, uint32_t i)
+{
+	uint32_t mask = dx_nslot(slot, bits) - 1;
+	uint32_t j, k;
+
+	for (j = (i + 1) & mask; slot[j] != NULL; j = (j + 1) & mask) {
+		k = dx_home(slot[j]->e_nmhash, bits);
+		/* slot[j] can fill i unless its home is in (i, j] */
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			slot[i] = slot[j];
+			i = j;
+		}
+	}
+	slot[i] = NULL;
+}
+
+static void
+dx_move(pfs_dxindex_t *dx)
+{
+	uint32_t nold = dx_nslot(dx->dx_old, dx->dx_oldbits);
+	pfs_dxent_t *e;
+	int n;
+
+	for (n = 0; n < DX_NMOVE && dx->dx_moved < nold; n++) {
+		e = dx->dx_old[dx->dx_moved];
+		if (e != NULL && e != DX_TOMB) {
+			dx_insert(dx->dx_slot, dx->dx_bits, e);
+			/* not NULL, probes of other hashes go on past it */
+			dx->dx_old[dx->dx_moved] = DX_TOMB;
+		}
+		dx->dx_moved++;
+	}
+
+	if (dx->dx_moved == nold) {
+		pfs_mem_free(dx->dx_old, M_DXINDEX);
+		dx->dx_old = NULL;
+		dx->dx_oldbits = 0;
+		dx->dx_moved = 0;
+	}
+}
+
+static void
+dx_grow(pfs_dxindex_t *dx)
+{
+	pfs_dxent_t **slot;
+	int bits;
+
+	/* the last grow is done long before the table is half full again */
+	while (dx->dx_old != NULL)
+		dx_move(dx);
+
+	bits = dx->dx_slot ? dx->dx_bits + 1 : DX_MINBITS;
+	slot = (pfs_dxent_t **)pfs_mem_malloc(sizeof(*slot) << bits,
+	    M_DXINDEX);
+	PFS_VERIFY(slot != NULL);
+
+	dx->dx_old = dx->dx_slot;
+	dx->dx_oldbits = dx->dx_bits;
+	dx->dx_moved = 0;
+	dx->dx_slot = slot;
+	dx->dx_bits = bits;
+	if (dx->dx_old == NULL)
+		dx->dx_oldbits = 0;
+}
+
+void
+pfs_dxindex_init(pfs_dxindex_t *dx)
+{
+	memset(dx, 0, sizeof(*dx));
+}
+
+/*
+ * Pass every subfile to fn, which frees it, and empty the index.
+ */
+void
+pfs_dxindex_clear(pfs_dxindex_t *dx, pfs_dxindex_fn_t *fn)
+{
+	pfs_dxent_t **tbl[2] = { dx->dx_slot, dx->dx_old };
+	uint32_t n[2] = { dx_nslot(dx->dx_slot, dx->dx_bits),
+	    dx_nslot(dx->dx_old, dx->dx_oldbits) };
+	pfs_dxent_t *e, *next;
+
+	for (int t = 0; t < 2; t++) {
+		for (uint32_t i = 0; i < n[t]; i++) {
+			if (tbl[t][i] == DX_TOMB)
+				continue;
+			for (e = tbl[t][i]; e != NULL; e = next) {
+				next = e->e_next;
+				fn(e);
+			}
+		}
+		pfs_mem_free(tbl[t], M_DXINDEX);
+	}
+	pfs_dxindex_init(dx);
+}
+
+pfs_dxent_t *
+pfs_dxindex_find(const pfs_dxindex_t *dx, uint32_t nmhash)
+{
+	int64_t i;
+
+	i = dx_probe(dx->dx_slot, dx->dx_bits, nmhash);
+	if (i >= 0)
+		return dx->dx_slot[i];
+	i = dx_probe(dx->dx_old, dx->dx_oldbits, nmhash);
+	if (i >= 0)
+		return dx->dx_old[i];
+	return NULL;
+}
+
+void
+pfs_dxindex_add(pfs_dxindex_t *dx, pfs_dxent_t *ent)
+{
+	pfs_dxent_t *first;
+
+	if (dx->dx_old != NULL)
+		dx_move(dx);
+
+	first = pfs_dxindex_find(dx, ent->e_nmhash);
+	if (first != NULL) {
+		// XXX for convenience, we do not append to tail
+		ent->e_next = first->e_next;
+		first->e_next = ent;
+		return;
+	}
+
+	if ((dx->dx_nused + 1) * 2 > dx_nslot(dx->dx_slot, dx->dx_bits))
+		dx_grow(dx);
+	ent->e_next = NULL;
+	dx_insert(dx->dx_slot, dx->dx_bits, ent);
+	dx->dx_nused++;
+}
+
+void
+pfs_dxindex_del(pfs_dxindex_t *dx, pfs_dxent_t *ent)
+{
+	pfs_dxent_t **slot, *prev;
+	int64_t i;
+	bool old = false;
+
+	if (dx->dx_old != NULL)
+		dx_move(dx);
+
+	i = dx_probe(dx->dx_slot, dx->dx_bits, ent->e_nmhash);
+	if (i < 0) {
+		i = dx_probe(dx->dx_old, dx->dx_oldbits, ent->e_nmhash);
+		old = true;
+	}
+	PFS_ASSERT(i >= 0);
+	slot = old ? dx->dx_old : dx->dx_slot;
+
+	if (slot[i] != ent) {
+		prev = slot[i];
+		while (prev->e_next != ent) {
+			prev = prev->e_next;
+			PFS_ASSERT(prev != NULL);
+		}
+		prev->e_next = ent->e_next;
+		return;
+	}
+	if (ent->e_next != NULL) {
+		slot[i] = ent->e_next;
+		return;
+	}
+
+	if (old)
+		slot[i] = DX_TOMB;
+	else
+		dx_remove(slot, dx->dx_bits, (uint32_t)i);
+	dx->dx_nused--;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PFS_DXINDEX_H_
+#define _PFS_DXINDEX_H_
+
+#include <stdint.h>
+
+typedef struct pfs_inode pfs_inode_t;
+
+typedef struct pfs_dxent {
+	uint32_t	e_nmhash;
+	int64_t		e_ino;
+	pfs_inode_t	*e_in;		/* maintain the existence of child inode */
+	struct pfs_dxent *e_next;	/* subfile with same hash */
+} pfs_dxent_t;
+
+/*
+ * Index of the subfiles of a directory by name hash.
+ *
+ * Open addressing with linear probing, one slot per hash; subfiles whose
+ * names hash the same are chained from it. The table doubles when half
+ * full. Instead of rehashing at once, which would stall a directory with
+ * 100k+ subfiles, the old table is kept and every add or delete moves a
+ * few of its slots over. Lookups check both tables until it is empty.
+ *
+ * Not thread safe, the directory inode lock protects it.
+ */
+typedef struct pfs_dxindex {
+	pfs_dxent_t	**dx_slot;
+	int		dx_bits;	/* dx_slot has 1 << dx_bits slots */
+	uint32_t	dx_nused;	/* hashes in both tables */
+	pfs_dxent_t	**dx_old;	/* table being moved into dx_slot */
+	int		dx_oldbits;
+	uint32_t	dx_moved;	/* slots of dx_old moved */
+} pfs_dxindex_t;
+
+typedef void pfs_dxindex_fn_t(pfs_dxent_t *ent);
+
+void	pfs_dxindex_init(pfs_dxindex_t *dx);
+void	pfs_dxindex_clear(pfs_dxindex_t *dx, pfs_dxindex_fn_t *fn);
+
+/* First subfile with the hash, the rest follow e_next */
+pfs_dxent_t *
+	pfs_dxindex_find(const pfs_dxindex_t *dx, uint32_t nmhash);
+void	pfs_dxindex_add(pfs_dxindex_t *dx, pfs_dxent_t *ent);
+void	pfs_dxindex_del(pfs_dxindex_t *dx, pfs_dxent_t *ent);
+
+#endif	/* _PFS_DXINDEX_H_ */
@@ -33,6 +33,7 @@
 #include "pfs_mount.h"
 #include "pfs_inode.h"
 #include "pfs_blkio.h"
+#include "pfs_devio.h"
 #include "pfs_version.h"
 #include "pfs_stat.h"
 
@@ -98,7 +99,7 @@
  *
  * The other problem is locking order. We abide with the locking order
  * below:
- *      ->  lock fdtbl, increment file refcnt, unlock fdtbl
+ *      ->  take a ref on the fd slot
  *      ->  lock file,
  *          enter tx
  *
@@ -116,7 +117,7 @@
  *          <-  unlock inode
  *
  *      <-  unlock file,
- *      -> lock fdtbl, decrement file refcnt, unlock fdtbl
+ *      -> drop the ref on the fd slot
  *
  * The special point is that we hold the meta data lock until tx is
  * done, either successfully or failed. For read type tx, the hold is
@@ -190,127 +191,155 @@ pfs_check_ival_shrink_size(void *data)
 static int64_t file_max_nfd = 204800;
 PFS_OPTION_REG(file_max_nfd, pfs_check_ival_max_nfd);
 
-static pfs_file_t	**fdtbl;
-static int		fdtbl_nopen;
-static int		fdtbl_free_last;
+/*
+ * An fd slot is open, with the readers and writers count of the file in
+ * the low bits, or free, with the next free fd in the low bits.
+ */
+#define	FD_OPEN			(1UL << 63)
+#define	FD_NIL			0xffffffffUL
+#define	FD_HEAD(tag, fd)	(((uint64_t)(tag) << 32) | (fd))
+
+typedef struct fd_slot {
+	uint64_t	fs_val;
+	pfs_file_t	*fs_file;
+} fd_slot_t;
+
+static fd_slot_t	*fdtbl;
+static int		fdtbl_nused;		/* fds ever handed out */
+static uint64_t		fdtbl_free_head;	/* tag and first free fd */
 static int		pfs_max_nfd;
-pthread_mutex_t		fdtbl_mtx;
+static pthread_once_t	fdtbl_once = PTHREAD_ONCE_INIT;
 
 int64_t file_shrink_size = (10L << 30);
 PFS_OPTION_REG(file_shrink_size, pfs_check_ival_shrink_size);
 
+/*
+ * Size changes of extending writes to redo log files can be left in
+ * memory and committed by one tx, until they sum up to
+ * file_defer_size_bytes or the oldest is file_defer_size_us old.
+ */
+static int64_t file_defer_size_enable = PFS_OPT_DISABLE;
+PFS_OPTION_REG(file_defer_size_enable, pfs_check_ival_switch);
+
+static int64_t file_defer_size_bytes = (1L << 20);
+PFS_OPTION_REG(file_defer_size_bytes, pfs_check_ival_normal);
+
+int64_t file_defer_size_us = 10000;
+PFS_OPTION_REG(file_defer_size_us, pfs_check_ival_normal);
+
 /**
- * We create a forward linked list to save the closed fd.
- *
- * We tag the fdtbl[fd] is free by encoding fdtbl[fd] % 2 == 1, due to valid
- * file pointers are aligned to sizeof(void*) so their lowest bit must be
- * zero. And the rest bit of fdtbl[fd] is used to save the previous closed fd.
- *
- * We use the linked list as a stack: we push closed fd at its
- * head (stored in varilable "fdtbl_free_last") and pop free fd at the head
- * as well.
+ * Open, close and lookup don't take a lock, databases open and close
+ * thousands of files a second from many threads.
  *
- * So now free fd positions set in fdtble now is divided into two parts: one
- * part is at [x, file_max_nfd) with zero value stored in fdtble where x is the
- * largest never allocated fd; the other is a linked list storing all the
- * closed fd using "2y+1" encoding with its head position at fdtbl_free_last.
+ * Closed fds are kept in a stack linked through the free slots, with
+ * its head in fdtbl_free_head. The head carries a tag bumped on every
+ * change, so a pop that read the next fd of a slot which was reused in
+ * the meantime fails its CAS instead of corrupting the stack. The slots
+ * are never freed, reading a stale one is harmless. When the stack is
+ * empty, fds are taken from [fdtbl_nused, pfs_max_nfd).
  *
- * A fdtbl elements values example after some open/close operations:
+ * A lookup takes a ref by CAS on the slot, only while it is open. Close
+ * turns the slot free only when at most the closer holds a ref, so the
+ * file can't be destroyed under a reader.
  *
- * |file*|file*|4*2+1|file_max_nfd*2+1|3*2+1|file*|0|0|0|.........|0|
- *              ^                                                  ^
- *              |                                                  |
- *       fdtbl_free_last                                     file_max_nfd
+ * An example after 6 fds are allocated and fd 3, 4, 2 are closed:
  *
- * We alloc 6 fds first. The values change order is:
- * 1. fdtbl[0] = file*
- * 2. fdtbl[1] = file*
- * 3. fdtbl[2] = file*
- * 4. fdtbl[3] = file*
- * 5. fdtbl[4] = file*
- * 6. fdtbl[5] = file*
- *
- * Now we close fd 3, 4, 2. The values change order is:
- * 1. fdtbl[3] = fdtbl_free_last * 2 + 1 = 2*file_max_nfd+1
- *    fdtbl_free_last = 3, --fdtbl_nopen
- * 2. fdtbl[4] = fdtbl_free_last * 2 + 1 = 7 fdtbl_free_last = 4, --fdtbl_nopen
- * 3. fdtbl[2] = fdtbl_free_last * 2 + 1 = 9 fdtbl_free_last = 2, --fdtbl_nopen
+ * |open|open|free:4|free:3|free:nil|open|0|0|.........|0|
+ *             ^                         ^               ^
+ *             |                         |               |
+ *      fdtbl_free_head             fdtbl_nused     pfs_max_nfd
  */
 
-static inline void
+static void
 fd_set_init()
 {
-	PFS_ASSERT((fdtbl_free_last == 0) && (pfs_max_nfd == 0));
+	PFS_ASSERT((fdtbl == NULL) && (pfs_max_nfd == 0));
 	/* max nfd must exactly control by config */
 	pfs_max_nfd = file_max_nfd;
-	fdtbl_free_last = pfs_max_nfd;
-	fdtbl = (pfs_file_t**)pfs_mem_malloc(pfs_max_nfd * sizeof(pfs_file_t*), M_FDTBL_PTR);
+	fdtbl = (fd_slot_t *)pfs_mem_malloc(pfs_max_nfd * sizeof(fd_slot_t),
+	    M_FDTBL_PTR);
 	PFS_VERIFY(fdtbl != NULL);
+	memset(fdtbl, 0, pfs_max_nfd * sizeof(fd_slot_t));
+	fdtbl_free_head = FD_HEAD(0, FD_NIL);
 }
 
 static inline int
-fd_get(pfs_file_t *file)
+fd_get()
 {
-	int fd = -1;
-	if (fdtbl == NULL)
-		fd_set_init();
-
-	if (fdtbl_free_last == pfs_max_nfd) {
-		if (fdtbl_nopen < pfs_max_nfd) {
-			/*
-			 * Pop from array
-			 */
-			fd = fdtbl_nopen;
-			++fdtbl_nopen;
-			fdtbl[fd] = file;
-		}
-	} else {
-		/*
-		 * Pop from the linked list with its head position at
-		 * fdtbl_free_last.
-		 *
-		 * After the last element is popped, then
-		 * fdtbl_free_last == pfs_max_nfd.
-		 */
-		fd = fdtbl_free_last;
-		fdtbl_free_last = (int)(((intptr_t)fdtbl[fdtbl_free_last]) / 2);
-		++fdtbl_nopen;
-		fdtbl[fd] = file;
+	uint64_t head, next;
+	int fd;
+
+	head = __atomic_load_n(&fdtbl_free_head, __ATOMIC_ACQUIRE);
+	while ((head & FD_NIL) != FD_NIL) {
+		fd = (int)(head & FD_NIL);
+		next = __atomic_load_n(&fdtbl[fd].fs_val, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&fdtbl_free_head, &head,
+		    FD_HEAD((head >> 32) + 1, next & FD_NIL), false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return fd;
 	}
+
+	fd = __atomic_load_n(&fdtbl_nused, __ATOMIC_RELAXED);
+	do {
+		if (fd >= pfs_max_nfd)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&fdtbl_nused, &fd, fd + 1,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 	return fd;
 }
 
 static inline void
 fd_put(int fd)
 {
-	PFS_ASSERT(fdtbl != NULL);
-	/*
-	 * Push into the linked list with its head position changed to
-	 * the input fd.
-	 */
-	fdtbl[fd] = (pfs_file_t*)(intptr_t)(fdtbl_free_last * 2 + 1);
-	fdtbl_free_last = fd;
-	--fdtbl_nopen;
+	uint64_t head;
+
+	head = __atomic_load_n(&fdtbl_free_head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&fdtbl[fd].fs_val, head & FD_NIL,
+		    __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&fdtbl_free_head, &head,
+	    FD_HEAD((head >> 32) + 1, fd), false, __ATOMIC_RELEASE,
+	    __ATOMIC_RELAXED));
 }
 
-static inline pfs_file_t*
-fd_to_file(int fd)
+/* Returns the file with a ref taken, or NULL if fd isn't open */
+static inline pfs_file_t *
+fd_ref(int fd)
 {
-	PFS_ASSERT(fdtbl != NULL);
-	if (((intptr_t)fdtbl[fd]) % 2 == 1)
+	fd_slot_t *fs;
+	uint64_t val;
+
+	if (fd < 0 || fd >= __atomic_load_n(&fdtbl_nused, __ATOMIC_ACQUIRE))
 		return NULL;
-	return fdtbl[fd];
+	fs = &fdtbl[fd];
+	val = __atomic_load_n(&fs->fs_val, __ATOMIC_RELAXED);
+	do {
+		if ((val & FD_OPEN) == 0)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&fs->fs_val, &val, val + 1,
+	    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return fs->fs_file;
+}
+
+static inline void
+fd_unref(int fd)
+{
+	__atomic_sub_fetch(&fdtbl[fd].fs_val, 1, __ATOMIC_RELEASE);
 }
 
 static int
 fd_alloc(pfs_file_t *file)
 {
-	int fd = -1;
-	mutex_lock(&fdtbl_mtx);
-	fd = fd_get(file);
-	//We guarantee fd and file is consistent after releasing fdtbl_mtx.
+	int fd;
+
+	pthread_once(&fdtbl_once, fd_set_init);
+	fd = fd_get();
+	if (fd < 0)
+		return fd;
+	//We guarantee fd and file is consistent before the fd is visible.
 	file->f_fd = fd;
-	mutex_unlock(&fdtbl_mtx);
+	fdtbl[fd].fs_file = file;
+	__atomic_store_n(&fdtbl[fd].fs_val, FD_OPEN, __ATOMIC_RELEASE);
 	return fd;
 }
 
@@ -330,42 +359,39 @@ static int
 fd_free(pfs_file_t *file, bool file_is_locked)
 {
 	int fd = file->f_fd;
-	bool need_free = false;
+	fd_slot_t *fs;
+	uint64_t val;
 
-	/*
-	 * File refcnt can only change when holding fdtbl lock.
-	 */
-	mutex_lock(&fdtbl_mtx);
 	PFS_ASSERT(fdtbl != NULL);
 	PFS_ASSERT(0 <= fd && fd < pfs_max_nfd);
-	PFS_ASSERT(fdtbl[fd] == file);
-	if (fdtbl[fd]->f_refcnt <= 1) {
-		fd_put(fd);
-		need_free = true;
-	}
-	mutex_unlock(&fdtbl_mtx);
+	fs = &fdtbl[fd];
+	PFS_ASSERT(fs->fs_file == file);
 
-	if (need_free) {
-		if (file_is_locked)
-			FILE_UNLOCK(file);
-		pfs_file_destroy(file);
-		return 0;
-	}
-	ERR_RETVAL(EAGAIN);
+	/*
+	 * Only the closer may hold a ref, once the slot is not open no
+	 * lookup can take a new one.
+	 */
+	val = __atomic_load_n(&fs->fs_val, __ATOMIC_RELAXED);
+	do {
+		PFS_ASSERT(val & FD_OPEN);
+		if ((val & ~FD_OPEN) > 1)
+			ERR_RETVAL(EAGAIN);
+	} while (!__atomic_compare_exchange_n(&fs->fs_val, &val, 0, false,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	fd_put(fd);
+
+	if (file_is_locked)
+		FILE_UNLOCK(file);
+	pfs_file_destroy(file);
+	return 0;
 }
 
 pfs_file_t *
 pfs_file_get(int fd, int lockflag)
 {
-	pfs_file_t *file = NULL;
-
-	mutex_lock(&fdtbl_mtx);
-	if (0 <= fd && fd < pfs_max_nfd)
-		file = fd_to_file(fd);
-	if (file)
-		file->f_refcnt++;
-	mutex_unlock(&fdtbl_mtx);
+	pfs_file_t *file;
 
+	file = fd_ref(fd);
 	if (file) {
 		pfs_mntstat_set_file_type(file->f_type);
 		if (lockflag == WRLOCK_FLAG)
@@ -383,10 +409,7 @@ pfs_file_put(pfs_file_t *file)
 		return;	/* the file may have been destroyed */
 
 	FILE_UNLOCK(file);
-
-	mutex_lock(&fdtbl_mtx);
-	file->f_refcnt--;
-	mutex_unlock(&fdtbl_mtx);
+	fd_unref(file->f_fd);
 }
 
 static ssize_t
@@ -484,7 +507,6 @@ pfs_file_open_impl(pfs_mount_t *mnt, pfs_ino_t ino, int flags,
 		ERR_RETVAL(ENOMEM);
 	memset(file, 0, sizeof(*file));
 	rwlock_init(&file->f_rwlock, NULL);
-	file->f_refcnt = 0;
 	file->f_offset = 0;
 	file->f_btime = btime;
 	file->f_flags = flags;
@@ -665,15 +687,23 @@ pfs_file_write(pfs_inode_t *in, const void *buf, size_t len, off_t *off,
 	off_t		offset, blkoff, dbhoff, woff;
 
 	if (locked) {
+		/* continue with the deferred size change, if any */
+		(void)pfs_inode_writemodify_adopt(in);
 		err = pfs_inode_sync_first(in, PFS_INODET_FILE, btime, false);
 		if (err)
 			return err;
+		/* or the one a reload has parked again */
+		(void)pfs_inode_writemodify_adopt(in);
 	}
 
+	/*
+	 * in_size doesn't include the size change not committed yet,
+	 * which belongs to current thread if there is.
+	 */
 	fsize = pfs_inode_size(in);
 	offset = *off;
 	if (offset == OFFSET_FILE_SIZE)
-		offset = (off_t)fsize;
+		offset = (off_t)(fsize + in->in_write_modify.wm_sizeinc);
 	err = 0;
 	for (wsum = 0; wsum < (ssize_t)len; wsum += wlen, offset += wlen) {
 		left = len - wsum;
@@ -724,7 +754,7 @@ pfs_file_write(pfs_inode_t *in, const void *buf, size_t len, off_t *off,
 			 * Record the delta into writemodify to exclude others
 			 * before releasing lock.
 			 */
-			if (offset + wlen > fsize) {
+			if (offset + wlen > fsize + in->in_write_modify.wm_sizeinc) {
 				pfs_inode_writemodify_increment_size(in,
 				    offset + wlen - fsize);
 			}
@@ -964,6 +994,138 @@ pfs_file_map(pfs_inode_t *in, fmap_entry_t *fmapv, int count, uint64_t btime)
 	return 0;
 }
 
+/*
+ * Whether the writemodify of current thread can be left uncommitted.
+ */
+static bool
+pfs_file_defer_size(pfs_file_t *file, pfs_inode_t *in)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+
+	if (file_defer_size_enable != PFS_OPT_ENABLE ||
+	    file->f_type != FILE_REDO_LOG)
+		return false;
+	if (wm->wm_sizeinc >= file_defer_size_bytes)
+		return false;
+	if (wm->wm_parkts != 0 &&
+	    gettimeofday_us() - wm->wm_parkts >= (uint64_t)file_defer_size_us)
+		return false;
+	return pfs_inode_writemodify_park(in);
+}
+
+/*
+ * Commit the deferred size change of the file, so that it is seen by
+ * others and survives crash. If the commit fails, the change is parked
+ * again and retried later. The error is returned either way, as is a
+ * change lost before, so that fsync and close of the writer see it.
+ */
+static int
+pfs_file_flush_size(pfs_inode_t *in)
+{
+	pfs_mount_t *mnt = in->in_mnt;
+	pfs_writemodify_t save;
+	int64_t size;
+	bool adopted;
+	int err, lasterr;
+
+	/* racy peek, the parked state is checked again with inode lock */
+	if (!in->in_write_modify.wm_parked && in->in_wmerr == 0)
+		return 0;
+
+	lasterr = 0;
+	adopted = false;
+	tls_write_begin(mnt);
+	pfs_inode_lock(in);
+	lasterr = in->in_wmerr;
+	in->in_wmerr = 0;
+	err = 0;
+	adopted = pfs_inode_writemodify_adopt(in);
+	if (adopted) {
+		pfs_inode_writemodify_copy(in, &save, &size);
+		err = pfs_inode_writemodify_commit(in);
+	}
+	pfs_inode_unlock(in);
+	tls_write_end(err);
+
+	if (adopted) {
+		pfs_inode_lock(in);
+		if (err < 0)
+			(void)pfs_inode_writemodify_repark(in, &save, size);
+		else
+			pfs_mem_free(save.wm_dblkv, M_DBLKV);
+		pfs_inode_unlock(in);
+	}
+	if (err < 0)
+		pfs_etrace("inode %ld flush deferred size failed, err %d\n",
+		    (long)in->in_ino, err);
+	ERR_UPDATE(err, lasterr);
+	return err;
+}
+
+/*
+ * Commit deferred size changes which are due, or all of them if @all.
+ * Inodes are collected in batches, until none is due or, as a failed
+ * change is parked again, a batch makes no progress.
+ */
+void
+pfs_file_flush_deferred(pfs_mount_t *mnt, bool all)
+{
+	pfs_ino_t inov[64];
+	pfs_inode_t *in;
+	int i, n, nfail;
+
+	do {
+		n = pfs_inode_writemodify_expired(mnt,
+		    all ? 0 : file_defer_size_us, inov,
+		    sizeof(inov) / sizeof(inov[0]));
+		nfail = 0;
+		for (i = 0; i < n; i++) {
+			in = pfs_get_inode(mnt, inov[i]);
+			if (in == NULL) {
+				nfail++;
+				continue;
+			}
+			/* racy, a writer holding it commits or parks it */
+			if (!in->in_write_modify.wm_parked ||
+			    pfs_file_flush_size(in) < 0)
+				nfail++;
+			pfs_put_inode(mnt, in);
+		}
+	} while (n > 0 && nfail < n);
+
+	if (all && nfail > 0)
+		pfs_etrace("%d deferred size changes are not committed\n",
+		    nfail);
+}
+
+int
+pfs_file_xcommit(pfs_file_t *file)
+{
+	return pfs_file_flush_size(file->f_inode);
+}
+
+/*
+ * Data is written to the device before pwrite returns and meta data is
+ * in the journal once its tx is done, except deferred size changes. So
+ * fsync commits them and then flushes the device cache, which is shared
+ * with other concurrent fsync.
+ */
+int
+pfs_file_xfsync(pfs_file_t *file)
+{
+	pfs_mount_t *mnt = file->f_inode->in_mnt;
+	int err;
+
+	if (!pfs_writable(mnt))
+		return 0;
+
+	err = pfs_file_flush_size(file->f_inode);
+	if (err < 0)
+		return err;
+
+	return pfsdev_flush(mnt->mnt_ioch_desc);
+}
+
 int
 pfs_file_xftruncate(pfs_file_t *file, off_t len)
 {
@@ -974,6 +1136,11 @@ pfs_file_xftruncate(pfs_file_t *file, off_t len)
 
 	PFS_ASSERT(len >= 0);
 	MNT_STAT_BEGIN();
+	err = pfs_file_flush_size(in);
+	if (err < 0) {
+		MNT_STAT_END(MNT_STAT_FILE_TRUNCATE);
+		return err;
+	}
 	/*
 	 * pfs_file_truncate() may not truncate file size to len
 	 * if truncated size is too large, so we should check whether
@@ -1006,6 +1173,11 @@ pfs_file_xpread(pfs_file_t *file, void *buf, size_t len, off_t off)
 		off2 = off;
 	PFS_ASSERT(off2 >= 0);
 
+	err = pfs_file_flush_size(in);
+	if (err < 0) {
+		MNT_STAT_END(MNT_STAT_FILE_READ);
+		return err;
+	}
 	rlen = -1;
 	tls_read_begin(mnt);
 	pfs_inode_lock(in);
@@ -1053,6 +1225,10 @@ pfs_file_xpwrite(pfs_file_t *file, const void *buf, size_t len, off_t off)
 	pfs_inode_lock(in);
 	wlen = pfs_file_write(in, buf, len, &off2, true, file->f_btime);
 	err = wlen < 0 ? wlen : 0;
+	if (err == 0 && pfs_file_defer_size(file, in)) {
+		pfs_inode_unlock(in);
+		goto out;
+	}
 	pfs_inode_unlock(in);
 	// tls_read_end(mnt);
 
@@ -1074,6 +1250,7 @@ pfs_file_xpwrite(pfs_file_t *file, const void *buf, size_t len, off_t off)
 	pfs_inode_unlock(in);
 	tls_write_end(err);
 
+out:
 	if (err)
 	       wlen = err;
 	else if (off == OFFSET_FILE_POS)
@@ -1090,6 +1267,9 @@ pfs_file_xsetxattr(pfs_file_t *file, const char *name, const void *value,
 	pfs_mount_t *mnt = in->in_mnt;
 	int err;
 
+	err = pfs_file_flush_size(in);
+	if (err < 0)
+		return err;
 	tls_write_begin(mnt);
 	pfs_inode_lock(in);
 	err = pfs_file_setxattr(in, name, value, size, file->f_btime);
@@ -1105,6 +1285,11 @@ pfs_file_xstat(pfs_file_t *file, struct stat *st)
 	pfs_mount_t *mnt = in->in_mnt;
 	int err;
 	MNT_STAT_BEGIN();
+	err = pfs_file_flush_size(in);
+	if (err < 0) {
+		MNT_STAT_END(MNT_STAT_FILE_FSTAT);
+		return err;
+	}
 	tls_read_begin(mnt);
 	pfs_inode_lock(in);
 	err = pfs_file_stat(in, st, file->f_btime);
@@ -1140,6 +1325,11 @@ pfs_file_xfallocate(pfs_file_t *file, off_t offset, size_t len, int mode)
 	}
 	PFS_ASSERT(off2 >= 0 || off2 == OFFSET_FILE_SIZE);
 
+	err = pfs_file_flush_size(in);
+	if (err < 0) {
+		MNT_STAT_END(MNT_STAT_FILE_FALLOCATE);
+		return err;
+	}
 	tls_write_begin(mnt);
 	pfs_inode_lock(in);
 	newfsize = pfs_file_allocate(in, off2, len, mode, file->f_btime);
@@ -1158,6 +1348,13 @@ pfs_file_xlseek(pfs_file_t *file, off_t offset, int whence)
 	off_t curoff;
 	bool need_sync = pfs_mount_needsync(mnt) && (whence == SEEK_END);
 	MNT_STAT_BEGIN();
+	if (whence == SEEK_END) {
+		err = pfs_file_flush_size(file->f_inode);
+		if (err < 0) {
+			MNT_STAT_END(MNT_STAT_FILE_LSEEK);
+			return err;
+		}
+	}
 	curoff = -1;
 	tls_read_begin_flags(mnt, need_sync);
 	curoff = pfs_file_lseek(file, offset, whence);
@@ -1249,12 +1446,6 @@ pfs_file_xmap(pfs_file_t *file, fmap_entry_t *fmapv, int count)
 	return err;
 }
 
-static void __attribute__((constructor))
-init_pfs_fdtbl()
-{
-	mutex_init(&fdtbl_mtx);
-}
-
 static int
 dump_file(admin_buf_t *ab, pfs_file_t *file)
 {
@@ -1284,15 +1475,15 @@ pfs_fdtbl_dump(admin_buf_t *ab)
 	int i, n;
 	pfs_file_t *file;
 
-	mutex_lock(&fdtbl_mtx);
-	for (i = 0, n = 0; i < pfs_max_nfd && n < fdtbl_nopen; i++) {
-		file = fd_to_file(i);
+	/* the ref keeps a file from being closed while it is dumped */
+	n = __atomic_load_n(&fdtbl_nused, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		file = fd_ref(i);
 		if (file == NULL)
 			continue;
-		n++;
 		(void)dump_file(ab, file);
+		fd_unref(i);
 	}
-	mutex_unlock(&fdtbl_mtx);
 
 	return 0;
 }
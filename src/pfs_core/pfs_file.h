@@ -32,6 +32,7 @@ typedef struct nameinfo	nameinfo_t;
 #define	OFFSET_FILE_SIZE	(-2)	/* offset is file size */
 
 extern int64_t file_shrink_size;
+extern int64_t file_defer_size_us;
 
 /*
  * I: file lock f_rwlock
@@ -45,8 +46,6 @@ typedef struct pfs_file {
 					   atomic add\sub */
 	uint64_t	f_btime;
 	pfs_inode_t	*f_inode;
-	int32_t		f_refcnt;	/* readers and writers count, only
-					   changed when holding fdtbl lock */
 	int		f_type;
 } pfs_file_t;
 
@@ -83,6 +82,9 @@ ssize_t pfs_file_pread(pfs_file_t *file, void *buf, size_t len, off_t offset);
 ssize_t pfs_file_pwrite(pfs_file_t *file, const void *buf, size_t len, off_t offset);
 int	pfs_file_release(pfs_mount_t *mnt, pfs_ino_t ino, uint64_t btime);
 int	pfs_file_xsetxattr(pfs_file_t *file, const char *name, const void *value, size_t size);
+int	pfs_file_xcommit(pfs_file_t *file);
+int	pfs_file_xfsync(pfs_file_t *file);
+void	pfs_file_flush_deferred(pfs_mount_t *mnt, bool all);
 
 typedef	struct admin_buf	admin_buf_t;
 int 	pfs_fdtbl_dump(admin_buf_t *ab);
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfs_admin.h"
+#include "pfs_hist.h"
+#include "pfs_impl.h"
+
+static const double hist_default_pcts[] = { 50, 90, 99, 99.9 };
+#define	HIST_NDEFAULT_PCT \
+	(int)(sizeof(hist_default_pcts) / sizeof(hist_default_pcts[0]))
+
+static int		hist_nextshard;
+static __thread int	hist_shard = -1;
+
+int
+pfs_hist_index(uint64_t val)
+{
+	int msb;
+
+	if (val < PFS_HIST_NSUB)
+		return (int)val;
+	msb = 63 - __builtin_clzll(val);
+	if (msb >= PFS_HIST_MAXBITS)
+		return PFS_HIST_NBUCKET - 1;
+	return (msb - PFS_HIST_SUBBITS + 1) * PFS_HIST_NSUB +
+	    (int)((val >> (msb - PFS_HIST_SUBBITS)) & (PFS_HIST_NSUB - 1));
+}
+
+uint64_t
+pfs_hist_lowest(int idx)
+{
+	int shift;
+
+	if (idx < PFS_HIST_NSUB)
+		return idx;
+	shift = idx / PFS_HIST_NSUB - 1;
+	return (uint64_t)(PFS_HIST_NSUB + idx % PFS_HIST_NSUB) << shift;
+}
+
+uint64_t
+pfs_hist_highest(int idx)
+{
+	int shift;
+
+	if (idx < PFS_HIST_NSUB)
+		return idx;
+	if (idx == PFS_HIST_NBUCKET - 1)
+		return UINT64_MAX;
+	shift = idx / PFS_HIST_NSUB - 1;
+	return pfs_hist_lowest(idx) + ((uint64_t)1 << shift) - 1;
+}
+
+void
+pfs_hist_record(pfs_hist_t *h, uint64_t val)
+{
+	pfs_hist_shard_t *hs;
+	uint64_t max;
+
+	if (hist_shard < 0)
+		hist_shard = __atomic_fetch_add(&hist_nextshard, 1,
+		    __ATOMIC_RELAXED) % PFS_HIST_NSHARD;
+	hs = &h->h_shard[hist_shard];
+
+	__atomic_fetch_add(&hs->hs_count[pfs_hist_index(val)], 1,
+	    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hs->hs_sum, val, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&hs->hs_max, __ATOMIC_RELAXED);
+	while (val > max &&
+	    !__atomic_compare_exchange_n(&hs->hs_max, &max, val, true,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Not atomic against recorders; a value recorded meanwhile may survive
+ * the reset in one field but not in another. The bases are stored after
+ * the counts they were taken from are read, and merge loads them before
+ * the counts, so a merge never sees a base above a count.
+ */
+void
+pfs_hist_reset(pfs_hist_t *h)
+{
+	pfs_hist_shard_t *hs;
+	uint64_t cnt, sum;
+
+	sum = 0;
+	for (int i = 0; i < PFS_HIST_NBUCKET; i++) {
+		cnt = 0;
+		for (int si = 0; si < PFS_HIST_NSHARD; si++)
+			cnt += __atomic_load_n(&h->h_shard[si].hs_count[i],
+			    __ATOMIC_RELAXED);
+		__atomic_store_n(&h->h_base_count[i], cnt, __ATOMIC_RELEASE);
+	}
+	for (int si = 0; si < PFS_HIST_NSHARD; si++) {
+		hs = &h->h_shard[si];
+		sum += __atomic_load_n(&hs->hs_sum, __ATOMIC_RELAXED);
+		__atomic_store_n(&hs->hs_max, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&h->h_base_sum, sum, __ATOMIC_RELEASE);
+}
+
+void
+pfs_hist_merge(const pfs_hist_t *h, pfs_hist_snap_t *hn)
+{
+	const pfs_hist_shard_t *hs;
+	uint64_t base[PFS_HIST_NBUCKET], basesum;
+	uint64_t cnt, max;
+
+	memset(hn, 0, sizeof(*hn));
+	for (int i = 0; i < PFS_HIST_NBUCKET; i++)
+		base[i] = __atomic_load_n(&h->h_base_count[i],
+		    __ATOMIC_ACQUIRE);
+	basesum = __atomic_load_n(&h->h_base_sum, __ATOMIC_ACQUIRE);
+	for (int si = 0; si < PFS_HIST_NSHARD; si++) {
+		hs = &h->h_shard[si];
+		for (int i = 0; i < PFS_HIST_NBUCKET; i++) {
+			cnt = __atomic_load_n(&hs->hs_count[i],
+			    __ATOMIC_RELAXED);
+			hn->hn_count[i] += cnt;
+			hn->hn_alltotal += cnt;
+		}
+		hn->hn_allsum += __atomic_load_n(&hs->hs_sum, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&hs->hs_max, __ATOMIC_RELAXED);
+		if (max > hn->hn_max)
+			hn->hn_max = max;
+	}
+	for (int i = 0; i < PFS_HIST_NBUCKET; i++) {
+		hn->hn_count[i] -= base[i];
+		hn->hn_total += hn->hn_count[i];
+	}
+	hn->hn_sum = hn->hn_allsum - basesum;
+}
+
+/*
+ * The highest value of the bucket holding the pct-th percentile, so the
+ * result is never below the real one by more than a bucket width.
+ */
+uint64_t
+pfs_hist_percentile(const pfs_hist_snap_t *hn, double pct)
+{
+	uint64_t rank, seen, val;
+
+	if (hn->hn_total == 0)
+		return 0;
+	rank = (uint64_t)ceil(pct / 100.0 * hn->hn_total);
+	if (rank < 1)
+		rank = 1;
+	if (rank > hn->hn_total)
+		rank = hn->hn_total;
+
+	seen = 0;
+	for (int i = 0; i < PFS_HIST_NBUCKET; i++) {
+		seen += hn->hn_count[i];
+		if (seen >= rank) {
+			val = pfs_hist_highest(i);
+			return val < hn->hn_max ? val : hn->hn_max;
+		}
+	}
+	return hn->hn_max;
+}
+
+/*
+ * Parse a list like "50,99,99.9" into pcts. An empty list means the
+ * default percentiles.
+ */
+int
+pfs_hist_parse_pcts(const char *str, double *pcts, int maxpct)
+{
+	const char *p = str;
+	char *end;
+	int n = 0;
+
+	if (str == NULL || str[0] == '\0') {
+		for (n = 0; n < HIST_NDEFAULT_PCT && n < maxpct; n++)
+			pcts[n] = hist_default_pcts[n];
+		return n;
+	}
+
+	while (*p != '\0') {
+		if (n >= maxpct)
+			ERR_RETVAL(E2BIG);
+		pcts[n] = strtod(p, &end);
+		if (end == p || pcts[n] <= 0 || pcts[n] > 100)
+			ERR_RETVAL(EINVAL);
+		n++;
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p != '\0')
+			ERR_RETVAL(EINVAL);
+	}
+	return n;
+}
+
+void
+pfs_hist_print_header(admin_buf_t *ab, const double *pcts, int npct)
+{
+	char pname[16];
+
+	pfs_adminbuf_printf(ab, "%-24s %-10s %-10s ", "Name", "Count",
+	    "Avg(us)");
+	for (int i = 0; i < npct; i++) {
+		snprintf(pname, sizeof(pname), "p%g", pcts[i]);
+		pfs_adminbuf_printf(ab, "%-10s ", pname);
+	}
+	pfs_adminbuf_printf(ab, "%-10s\n", "Max(us)");
+}
+
+void
+pfs_hist_print(admin_buf_t *ab, const char *name, const pfs_hist_snap_t *hn,
+    const double *pcts, int npct)
+{
+	pfs_adminbuf_printf(ab, "%-24s %-10lu %-10.2f ", name, hn->hn_total,
+	    hn->hn_total ? hn->hn_sum / double(hn->hn_total) : 0.0);
+	for (int i = 0; i < npct; i++)
+		pfs_adminbuf_printf(ab, "%-10lu ",
+		    pfs_hist_percentile(hn, pcts[i]));
+	pfs_adminbuf_printf(ab, "%-10lu\n", hn->hn_max);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PFS_HIST_H_
+#define _PFS_HIST_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram.
+ *
+ * Values below PFS_HIST_NSUB have a bucket each. Above that, every power
+ * of two is split into PFS_HIST_NSUB buckets of equal width, so a bucket
+ * is never wider than 1/PFS_HIST_NSUB of its lowest value. Values from
+ * 2^PFS_HIST_MAXBITS on all fall into the last bucket.
+ *
+ * Recording threads are spread over shards so they don't bounce each
+ * other's cache lines; shards are merged when the histogram is read.
+ *
+ * Reset doesn't clear the shard counts, it takes them as the new base.
+ * So counts since start stay monotonic for exporters while the admin
+ * commands show counts since the last reset.
+ */
+#define	PFS_HIST_SUBBITS	4
+#define	PFS_HIST_NSUB		(1 << PFS_HIST_SUBBITS)
+#define	PFS_HIST_MAXBITS	32
+#define	PFS_HIST_NBUCKET	\
+	((PFS_HIST_MAXBITS - PFS_HIST_SUBBITS + 1) * PFS_HIST_NSUB)
+#define	PFS_HIST_NSHARD		8
+
+#define	PFS_HIST_MAXPCT		8
+
+typedef struct pfs_hist_shard {
+	uint64_t	hs_count[PFS_HIST_NBUCKET];
+	uint64_t	hs_sum;
+	uint64_t	hs_max;
+} __attribute__((aligned(64))) pfs_hist_shard_t;
+
+typedef struct pfs_hist {
+	pfs_hist_shard_t h_shard[PFS_HIST_NSHARD];
+	uint64_t	h_base_count[PFS_HIST_NBUCKET];	/* at last reset */
+	uint64_t	h_base_sum;
+} pfs_hist_t;
+
+/* merged view of all shards, since the last reset unless said */
+typedef struct pfs_hist_snap {
+	uint64_t	hn_count[PFS_HIST_NBUCKET];
+	uint64_t	hn_total;
+	uint64_t	hn_sum;
+	uint64_t	hn_max;
+	uint64_t	hn_alltotal;	/* since start */
+	uint64_t	hn_allsum;	/* since start */
+} pfs_hist_snap_t;
+
+typedef struct admin_buf admin_buf_t;
+
+int		pfs_hist_index(uint64_t val);
+uint64_t	pfs_hist_lowest(int idx);
+uint64_t	pfs_hist_highest(int idx);
+
+void		pfs_hist_record(pfs_hist_t *h, uint64_t val);
+void		pfs_hist_reset(pfs_hist_t *h);
+void		pfs_hist_merge(const pfs_hist_t *h, pfs_hist_snap_t *hn);
+uint64_t	pfs_hist_percentile(const pfs_hist_snap_t *hn, double pct);
+
+int		pfs_hist_parse_pcts(const char *str, double *pcts, int maxpct);
+void		pfs_hist_print_header(admin_buf_t *ab, const double *pcts,
+		    int npct);
+void		pfs_hist_print(admin_buf_t *ab, const char *name,
+		    const pfs_hist_snap_t *hn, const double *pcts, int npct);
+
+#endif	/* _PFS_HIST_H_ */
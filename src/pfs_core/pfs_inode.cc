@@ -555,17 +555,29 @@ pfs_inode_writemodify_init(pfs_writemodify_t *wm)
 	PFS_ASSERT(wm->wm_dblkn == 0);
 	PFS_ASSERT(wm->wm_sizeinc == 0);
 	PFS_ASSERT(wm->wm_thread == 0);
+	PFS_ASSERT(wm->wm_parked == false);
+	PFS_ASSERT(wm->wm_parkts == 0);
 }
 
 static void
-pfs_inode_writemodify_fini(pfs_writemodify_t *wm)
+pfs_inode_writemodify_fini(pfs_inode_t *in)
 {
+	pfs_mount_t *mnt = in->in_mnt;
+	pfs_writemodify_t *wm = &in->in_write_modify;
+
+	if (wm->wm_parkts) {
+		mutex_lock(&mnt->mnt_poll_mtx);
+		TAILQ_REMOVE(&mnt->mnt_wmlist, in, in_wmnext);
+		mutex_unlock(&mnt->mnt_poll_mtx);
+	}
 	pfs_mem_free(wm->wm_dblkv, M_DBLKV);
 	wm->wm_dblkv = NULL;
 	wm->wm_dblki = 0;
 	wm->wm_dblkn = 0;
 	wm->wm_sizeinc = 0;
 	wm->wm_thread = 0;
+	wm->wm_parked = false;
+	wm->wm_parkts = 0;
 }
 
 static inline bool
@@ -574,6 +586,154 @@ pfs_inode_writemodify_inprogress(const pfs_writemodify_t *wm)
 	return (wm->wm_dblkv || wm->wm_sizeinc);
 }
 
+/*
+ * Whether current thread has to take the writemodify into account. A
+ * parked one is not, outside a tx: readers go on with the committed
+ * in_size rather than wait for the poll thread to commit it.
+ */
+static inline bool
+pfs_inode_writemodify_pending(const pfs_inode_t *in)
+{
+	const pfs_writemodify_t *wm = &in->in_write_modify;
+
+	if (!pfs_inode_writemodify_inprogress(wm))
+		return false;
+	return !wm->wm_parked || pfs_tls_get_tx() != NULL;
+}
+
+static void
+pfs_inode_writemodify_add_dblk(pfs_writemodify_t *wm, pfs_blkid_t blkid,
+    const pfs_dblk_t *dblk)
+{
+	if (wm->wm_dblkv == NULL || wm->wm_dblki >= wm->wm_dblkn) {
+		wm->wm_dblkn += 8;
+		void *tmp = pfs_mem_realloc(wm->wm_dblkv,
+		    wm->wm_dblkn * sizeof(pfs_wmdblk_t), M_DBLKV);
+		PFS_VERIFY(tmp != NULL);
+		wm->wm_dblkv = (pfs_wmdblk_t *)tmp;
+	}
+
+	PFS_ASSERT(0 <= wm->wm_dblki && wm->wm_dblki < wm->wm_dblkn);
+	wm->wm_dblkv[wm->wm_dblki].wd_blkid = blkid;
+	wm->wm_dblkv[wm->wm_dblki].wd_dblk = *dblk;
+	wm->wm_dblki++;
+}
+
+/*
+ * Link the inode into the parked list of the mount, which is kept in
+ * the order of wm_parkts.
+ */
+static void
+pfs_inode_wmlist_insert(pfs_inode_t *in)
+{
+	pfs_mount_t *mnt = in->in_mnt;
+	pfs_inode_t *next;
+
+	mutex_lock(&mnt->mnt_poll_mtx);
+	TAILQ_FOREACH(next, &mnt->mnt_wmlist, in_wmnext) {
+		if (next->in_write_modify.wm_parkts > in->in_write_modify.wm_parkts)
+			break;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, in, in_wmnext);
+	else
+		TAILQ_INSERT_TAIL(&mnt->mnt_wmlist, in, in_wmnext);
+	/* the poll thread commits it when it becomes too old */
+	cond_signal(&mnt->mnt_poll_cond);
+	mutex_unlock(&mnt->mnt_poll_mtx);
+}
+
+/*
+ * pfs_inode_writemodify_detach:
+ *
+ *	Move the writemodify out of the inode into @save, along with the
+ *	file size it extends to, so that it can be merged back after the
+ *	inode is reloaded.
+ */
+static void
+pfs_inode_writemodify_detach(pfs_inode_t *in, pfs_writemodify_t *save,
+    int64_t *sizep)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+
+	*save = *wm;
+	*sizep = in->in_size + wm->wm_sizeinc;
+	/* fini must not free what has been moved */
+	wm->wm_dblkv = NULL;
+	pfs_inode_writemodify_fini(in);
+}
+
+/*
+ * pfs_inode_writemodify_merge:
+ *
+ *	Put the change in @save, which extends the file to @size, before
+ *	the current writemodify of the inode. Hole changes that the block
+ *	map already covers are skipped. The owner of the current
+ *	writemodify keeps it; if there is none, @save tells the owner.
+ *	@save is freed. Return -EIO and drop @save if a block has been
+ *	remapped in between, as the change can't be applied any more.
+ */
+static int
+pfs_inode_writemodify_merge(pfs_inode_t *in, pfs_writemodify_t *save,
+    int64_t size)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+	pfs_writemodify_t merged;
+	pfs_wmdblk_t *wd;
+	pfs_dblk_t *dblk;
+	bool inprogress;
+	int i, err = 0;
+
+	for (i = 0; i < save->wm_dblki; i++) {
+		wd = &save->wm_dblkv[i];
+		dblk = pfs_inode_get_blk(in, wd->wd_blkid);
+		if (dblk == NULL || dblk->db_blkno != wd->wd_dblk.db_blkno) {
+			err = -EIO;
+			goto out;
+		}
+	}
+
+	memset(&merged, 0, sizeof(merged));
+	for (i = 0; i < save->wm_dblki; i++) {
+		wd = &save->wm_dblkv[i];
+		dblk = pfs_inode_get_blk(in, wd->wd_blkid);
+		if (pfs_dblk_holeoff(dblk) >= wd->wd_dblk.db_holeoff)
+			continue;
+		pfs_dblk_change(dblk, wd->wd_dblk.db_holeoff,
+		    wd->wd_dblk.db_holelen);
+		pfs_inode_writemodify_add_dblk(&merged, wd->wd_blkid, dblk);
+	}
+	for (i = 0; i < wm->wm_dblki; i++) {
+		wd = &wm->wm_dblkv[i];
+		pfs_inode_writemodify_add_dblk(&merged, wd->wd_blkid,
+		    &wd->wd_dblk);
+	}
+
+	inprogress = pfs_inode_writemodify_inprogress(wm);
+	pfs_mem_free(wm->wm_dblkv, M_DBLKV);
+	wm->wm_dblkv = merged.wm_dblkv;
+	wm->wm_dblki = merged.wm_dblki;
+	wm->wm_dblkn = merged.wm_dblkn;
+	size = MAX(size, in->in_size + wm->wm_sizeinc);
+	if (size > in->in_size)
+		wm->wm_sizeinc = size - in->in_size;
+	if (inprogress || !pfs_inode_writemodify_inprogress(wm))
+		goto out;
+
+	wm->wm_thread = save->wm_thread;
+	wm->wm_parked = save->wm_parked;
+	if (wm->wm_parkts == 0 && (save->wm_parked || save->wm_parkts)) {
+		wm->wm_parkts = save->wm_parkts ? save->wm_parkts :
+		    gettimeofday_us();
+		pfs_inode_wmlist_insert(in);
+	}
+
+out:
+	pfs_mem_free(save->wm_dblkv, M_DBLKV);
+	save->wm_dblkv = NULL;
+	return err;
+}
+
 void
 pfs_inode_writemodify_shrink_dblk_hole(pfs_inode_t *in, pfs_blkid_t blkid,
     off_t newbhoff, int32_t newbhlen)
@@ -590,16 +750,7 @@ pfs_inode_writemodify_shrink_dblk_hole(pfs_inode_t *in, pfs_blkid_t blkid,
 	dblk = pfs_inode_get_blk(in, blkid);
 	pfs_dblk_change(dblk, newbhoff, newbhlen);
 
-	if (wm->wm_dblkv == NULL || wm->wm_dblki >= wm->wm_dblkn) {
-		wm->wm_dblkn += 8;
-		void *tmp = pfs_mem_realloc(wm->wm_dblkv,
-		    wm->wm_dblkn * sizeof(pfs_dblk_t), M_DBLKV);
-		PFS_VERIFY(tmp != NULL);
-		wm->wm_dblkv = (pfs_dblk_t *)tmp;
-	}
-
-	PFS_ASSERT(0 <= wm->wm_dblki && wm->wm_dblki < wm->wm_dblkn);
-	wm->wm_dblkv[wm->wm_dblki++] = *dblk;
+	pfs_inode_writemodify_add_dblk(wm, blkid, dblk);
 	wm->wm_thread = tid;
 }
 
@@ -664,7 +815,7 @@ pfs_inode_writemodify_commit(pfs_inode_t *in)
 		}
 
 		for (int i = 0; i < wm->wm_dblki; i++) {
-			dblk = &wm->wm_dblkv[i];
+			dblk = &wm->wm_dblkv[i].wd_dblk;
 			pfs_inode_modify_dblk_hole(in, dblk);
 		}
 	} else {
@@ -692,11 +843,145 @@ fini:
 	 * failed, because there may be no callback to notify them if
 	 * pfs_inode_change() failed.
 	 */
-	pfs_inode_writemodify_fini(wm);
+	pfs_inode_writemodify_fini(in);
 	cond_broadcast(&in->in_cond);
 	return err;
 }
 
+/*
+ * pfs_inode_writemodify_park:
+ *
+ *	Leave the writemodify of current thread uncommitted, so that size
+ *	and hole changes of following writes are committed together. The
+ *	inode is still barred from other threads except writers, which
+ *	adopt the parked writemodify. Return false if there is nothing to
+ *	park.
+ *
+ *	Until committed, the change lives only in memory: it is lost if
+ *	the process crashes or the inode gets stale, even though the data
+ *	has been written.
+ */
+bool
+pfs_inode_writemodify_park(pfs_inode_t *in)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+
+	if (!pfs_inode_writemodify_inprogress(wm))
+		return false;
+	PFS_ASSERT(wm->wm_thread == pthread_self());
+
+	wm->wm_parked = true;
+	wm->wm_thread = 0;
+	if (wm->wm_parkts == 0) {
+		wm->wm_parkts = gettimeofday_us();
+		pfs_inode_wmlist_insert(in);
+	}
+	return true;
+}
+
+/*
+ * pfs_inode_writemodify_adopt:
+ *
+ *	Take over a parked writemodify as the modifying thread.
+ */
+bool
+pfs_inode_writemodify_adopt(pfs_inode_t *in)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+
+	if (!wm->wm_parked)
+		return false;
+	PFS_ASSERT(wm->wm_thread == 0);
+	wm->wm_parked = false;
+	wm->wm_thread = pthread_self();
+	return true;
+}
+
+/*
+ * pfs_inode_writemodify_expired:
+ *
+ *	Collect at most @ninov inodes whose writemodify has been parked
+ *	for @age_us or longer.
+ */
+int
+pfs_inode_writemodify_expired(pfs_mount_t *mnt, uint64_t age_us,
+    pfs_ino_t *inov, int ninov)
+{
+	pfs_inode_t *in;
+	uint64_t now = gettimeofday_us();
+	int n = 0;
+
+	mutex_lock(&mnt->mnt_poll_mtx);
+	TAILQ_FOREACH(in, &mnt->mnt_wmlist, in_wmnext) {
+		if (n >= ninov || now - in->in_write_modify.wm_parkts < age_us)
+			break;
+		inov[n++] = in->in_ino;
+	}
+	mutex_unlock(&mnt->mnt_poll_mtx);
+	return n;
+}
+
+/*
+ * pfs_inode_writemodify_copy:
+ *
+ *	Copy the writemodify of current thread into @save before it is
+ *	committed, with the file size it extends to, so that it can be
+ *	parked again by writemodify_repark if the tx fails.
+ */
+void
+pfs_inode_writemodify_copy(pfs_inode_t *in, pfs_writemodify_t *save,
+    int64_t *sizep)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+	int i;
+
+	PFS_ASSERT(wm->wm_thread == pthread_self());
+	memset(save, 0, sizeof(*save));
+	for (i = 0; i < wm->wm_dblki; i++)
+		pfs_inode_writemodify_add_dblk(save, wm->wm_dblkv[i].wd_blkid,
+		    &wm->wm_dblkv[i].wd_dblk);
+	save->wm_sizeinc = wm->wm_sizeinc;
+	*sizep = in->in_size + wm->wm_sizeinc;
+}
+
+/*
+ * pfs_inode_writemodify_repark:
+ *
+ *	Park again the change in @save whose commit failed, so that it is
+ *	retried after file_defer_size_us instead of being lost. The failed
+ *	tx has made the inode stale; its reload merges the change back
+ *	into the block map. If another writer has come in meanwhile, the
+ *	change goes before its writemodify. Return -EIO if the change
+ *	can't be kept; the next flush of the file reports it as well.
+ */
+int
+pfs_inode_writemodify_repark(pfs_inode_t *in, pfs_writemodify_t *save,
+    int64_t size)
+{
+	pfs_writemodify_t *wm = &in->in_write_modify;
+	int err;
+
+	save->wm_thread = 0;
+	save->wm_parked = true;
+	save->wm_parkts = gettimeofday_us();
+	if (!pfs_inode_writemodify_inprogress(wm)) {
+		PFS_ASSERT(wm->wm_parkts == 0);
+		*wm = *save;
+		in->in_size = in->in_size2 = size - save->wm_sizeinc;
+		pfs_inode_mark_stale(in);
+		pfs_inode_wmlist_insert(in);
+		return 0;
+	}
+
+	err = pfs_inode_writemodify_merge(in, save, size);
+	if (err < 0) {
+		pfs_etrace("inode %ld drop deferred change to size %ld, "
+		    "block remapped\n", (long)in->in_ino, (long)size);
+		in->in_wmerr = err;
+	}
+	return err;
+}
+
 /*
  * pfs_inode_map:
  *
@@ -724,39 +1009,17 @@ pfs_inode_map(pfs_inode_t *in, pfs_blkid_t blkid, pfs_blkno_t *dblkno,
 	}
 }
 
-typedef struct pfs_dxent {
-	pfs_avl_node_t	e_avlnode;
-
-	uint32_t	e_nmhash;
-	pfs_ino_t	e_ino;
-	pfs_inode_t	*e_in;		/* maintain the existence of child inode */
-	struct pfs_dxent *e_next;	/* subfile with same hash */
-} pfs_dxent_t;
-
 static inline uint32_t
 dx_calc_hash(const char *name)
 {
 	return fnv_32_buf(name, strlen(name), FNV1_32_INIT);
 }
 
-static int
-pfs_inode_dx_compare(const void *keya, const void *keyb)
-{
-	pfs_dxent_t *e1 = (pfs_dxent_t *)keya;
-	pfs_dxent_t *e2 = (pfs_dxent_t *)keyb;
-
-	if (e1->e_nmhash > e2->e_nmhash)
-		return 1;
-	if (e1->e_nmhash < e2->e_nmhash)
-		return -1;
-	return 0;
-}
-
 static void
-pfs_inode_dx_add(pfs_mount_t *mnt, pfs_avl_tree_t *dxroot, uint32_t nmhash,
+pfs_inode_dx_add(pfs_mount_t *mnt, pfs_dxindex_t *dx, uint32_t nmhash,
     pfs_ino_t ino, bool isdir)
 {
-	pfs_dxent_t *ent, *first;
+	pfs_dxent_t *ent;
 
 	/* alloc dx entry and reference mem-inode */
 	ent = (pfs_dxent_t *)pfs_mem_malloc(sizeof(*ent), M_DXENT);
@@ -765,92 +1028,51 @@ pfs_inode_dx_add(pfs_mount_t *mnt, pfs_avl_tree_t *dxroot, uint32_t nmhash,
 	ent->e_ino = ino;
 	ent->e_in = isdir ? pfs_inode_get(mnt, ino) : NULL;
 	ent->e_next = NULL;
-
-	first = (pfs_dxent_t *)pfs_avl_find(dxroot, ent, NULL);
-	if (first == NULL) {
-		pfs_avl_add(dxroot, ent);
-	} else {
-		// XXX for convenience, we do not append to tail
-		ent->e_next = first->e_next;
-		first->e_next = ent;
-	}
+	pfs_dxindex_add(dx, ent);
 }
 
 static void
-pfs_inode_dx_del(pfs_avl_tree_t *dxroot, uint32_t nmhash, pfs_ino_t ino, bool isdir)
+pfs_inode_dx_free(pfs_dxent_t *ent)
 {
-	pfs_dxent_t fent, *ent, *first, *prev;
-
-	fent.e_nmhash = nmhash;
-	first = (pfs_dxent_t *)pfs_avl_find(dxroot, &fent, NULL);
-	for (prev = NULL, ent = first; ent != NULL; ent = ent->e_next) {
-		if (ent->e_ino == ino)
-			break;
-		prev = ent;
-	}
-	PFS_ASSERT(ent != NULL);
-
-	if (ent == first) {
-		pfs_avl_remove(dxroot, ent);
-		/* tree updated here and do not use pfs_avl_insert */
-		if (ent->e_next != NULL)
-			pfs_avl_add(dxroot, ent->e_next);
-	} else {
-		PFS_ASSERT(prev != NULL && prev->e_next == ent);
-		prev->e_next = ent->e_next;
-	}
-
 	/* dereference mem-inode and free dx entry */
-	if (isdir)
+	if (ent->e_in != NULL)
 		pfs_inode_put(ent->e_in);
 	pfs_mem_free(ent, M_DXENT);
 }
 
 static void
-pfs_inode_dx_del_self(pfs_avl_tree_t *dxroot, uint32_t nmhash, pfs_ino_t ino, bool isdir)
+pfs_inode_dx_free_self(pfs_dxent_t *ent)
 {
-	pfs_dxent_t fent, *ent, *first, *prev;
+	/* XXX only difference, do not follow inode ptr reference */
+	pfs_mem_free(ent, M_DXENT);
+}
 
-	fent.e_nmhash = nmhash;
-	first = (pfs_dxent_t *)pfs_avl_find(dxroot, &fent, NULL);
-	for (prev = NULL, ent = first; ent != NULL; ent = ent->e_next) {
+static void
+pfs_inode_dx_del(pfs_dxindex_t *dx, uint32_t nmhash, pfs_ino_t ino)
+{
+	pfs_dxent_t *ent;
+
+	for (ent = pfs_dxindex_find(dx, nmhash); ent != NULL; ent = ent->e_next) {
 		if (ent->e_ino == ino)
 			break;
-		prev = ent;
 	}
 	PFS_ASSERT(ent != NULL);
 
-	if (ent == first) {
-		pfs_avl_remove(dxroot, ent);
-		/* tree updated here and do not use pfs_avl_insert */
-		if (ent->e_next != NULL)
-			pfs_avl_add(dxroot, ent->e_next);
-	} else {
-		PFS_ASSERT(prev != NULL && prev->e_next == ent);
-		prev->e_next = ent->e_next;
-	}
-
-	/* dereference mem-inode and free dx entry */
-	/* XXX only difference, do not follow inode ptr reference
-	if (isdir)
-		pfs_inode_put(ent->e_in);
-		*/
-	pfs_mem_free(ent, M_DXENT);
+	pfs_dxindex_del(dx, ent);
+	pfs_inode_dx_free(ent);
 }
 
-
 static int
-pfs_inode_dx_find(pfs_mount_t *mnt, pfs_avl_tree_t *dxroot, const char *name,
+pfs_inode_dx_find(pfs_mount_t *mnt, pfs_dxindex_t *dx, const char *name,
     pfs_ino_t *tgtinop, uint64_t *denop, int *typep, uint64_t *btimep)
 {
-	pfs_dxent_t fent, *ent, *first;
+	pfs_dxent_t *ent;
 	pfs_direntry_phy_t *de;
 	pfs_inode_phy_t *phyin;
 	char nm[PFS_MAX_NAMELEN];
 
-	fent.e_nmhash = dx_calc_hash(name);
-	first = (pfs_dxent_t *)pfs_avl_find(dxroot, &fent, NULL);
-	for (ent = first; ent != NULL; ent = ent->e_next) {
+	ent = pfs_dxindex_find(dx, dx_calc_hash(name));
+	for (; ent != NULL; ent = ent->e_next) {
 		phyin = pfs_meta_get_inode(mnt, ent->e_ino, NULL);
 		de = pfs_meta_get_direntry(mnt, phyin->in_deno, NULL);
 		pfs_direntry_getname(mnt, de, nm, sizeof(nm));
@@ -910,15 +1132,74 @@ pfs_inode_dxredo_inprogress(const pfs_dxredo_t *dxr)
 	return (dxr->r_cnt > 0);
 }
 
+static void
+pfs_inode_build_dindex(pfs_inode_t *in)
+{
+	pfs_mount_t *mnt = in->in_mnt;
+	pfs_inode_phy_t *dphyin, *phyin;
+	pfs_direntry_phy_t *de;
+	uint64_t deno;
+	char name[PFS_MAX_NAMELEN];
+	uint32_t nmhash;
+
+	dphyin = pfs_meta_get_inode(mnt, in->in_ino, NULL);
+
+	for (deno = MONO_FIRST(dphyin); MONO_VALID(deno); deno = MONO_NEXT(de)) {
+		de = pfs_meta_get_direntry(mnt, deno, NULL);
+		pfs_direntry_getname(mnt, de, name, sizeof(name));
+		nmhash = dx_calc_hash(name);
+		phyin = pfs_meta_get_inode(mnt, de->de_ino, NULL);
+		pfs_inode_dx_add(mnt, &in->in_dx_index, nmhash, de->de_ino,
+		    phyin->in_type == PFS_INODET_DIR);
+	}
+}
+
+/*
+ * The subfile index is built on the first lookup rather than on load,
+ * stat and readdir of a large directory don't pay for it. Lookups hold
+ * the inode and meta lock.
+ */
+static void
+pfs_inode_dx_build(pfs_inode_t *in)
+{
+	if (in->in_dx_built)
+		return;
+	pfs_inode_build_dindex(in);
+	in->in_dx_built = true;
+	in->in_dx_dirty = pfs_inode_dxredo_inprogress(&in->in_dx_redo);
+}
+
+static void
+pfs_inode_destroy_dindex(pfs_inode_t *in)
+{
+	pfs_dxindex_clear(&in->in_dx_index, pfs_inode_dx_free);
+	in->in_dx_built = false;
+}
+
+static void
+pfs_inode_destroy_dindex_self(pfs_inode_t *in)
+{
+	pfs_dxindex_clear(&in->in_dx_index,
+	    pfs_inode_dx_free_self);	// XXX only difference
+	in->in_dx_built = false;
+}
+
 static void
 pfs_inode_dxredo_apply(pfs_inode_t *dirin)
 {
 	pfs_dxredo_t *dxr = &dirin->in_dx_redo;
 	struct dxredo_rec *rec;
 	ssize_t szdelta;
+	bool index;
 
 	PFS_ASSERT(dxr->r_thread == pthread_self());
 
+	/*
+	 * An index not built yet is built from meta later, one built
+	 * during the tx already has the changes.
+	 */
+	index = dirin->in_dx_built && !dirin->in_dx_dirty;
+
 	szdelta = 0;
 	for (int i = 0; i < dxr->r_cnt; i++) {
 
@@ -929,14 +1210,17 @@ pfs_inode_dxredo_apply(pfs_inode_t *dirin)
 		rec = &dxr->r_rec[i];
 		switch (rec->rr_op) {
 		case DXOP_ADD:
-			pfs_inode_dx_add(dirin->in_mnt, &dirin->in_dx_root,
-			    rec->rr_nmhash, rec->rr_ino, rec->rr_isdir);
+			if (index)
+				pfs_inode_dx_add(dirin->in_mnt,
+				    &dirin->in_dx_index, rec->rr_nmhash,
+				    rec->rr_ino, rec->rr_isdir);
 			szdelta += sizeof(pfs_metaobj_phy_t);
 			break;
 
 		case DXOP_DEL:
-			pfs_inode_dx_del(&dirin->in_dx_root,
-			    rec->rr_nmhash, rec->rr_ino, rec->rr_isdir);
+			if (index)
+				pfs_inode_dx_del(&dirin->in_dx_index,
+				    rec->rr_nmhash, rec->rr_ino);
 			szdelta -= sizeof(pfs_metaobj_phy_t);
 			break;
 
@@ -962,6 +1246,9 @@ pfs_inode_dir_update_done(pfs_mount_t *mnt, pfs_ino_t ino, int err)
 
 	if (err == 0)
 		pfs_inode_dxredo_apply(in);
+	else if (in->in_dx_dirty)
+		pfs_inode_destroy_dindex(in);	/* has changes undone */
+	in->in_dx_dirty = false;
 	pfs_inode_dxredo_fini(&in->in_dx_redo);
 
 	in->in_cbdone = true;
@@ -1022,7 +1309,8 @@ pfs_inode_dir_find(pfs_inode_t *dirin, const char *name, pfs_ino_t *tgtinop,
 	if (err < 0)
 		return err;
 
-	err = pfs_inode_dx_find(mnt, &dirin->in_dx_root, name, tgtinop,
+	pfs_inode_dx_build(dirin);
+	err = pfs_inode_dx_find(mnt, &dirin->in_dx_index, name, tgtinop,
 	    &deno, typep, btimep);
 	if (err < 0)
 		return err;
@@ -1102,30 +1390,6 @@ pfs_inode_destroy_findex(pfs_inode_t *in)
 	pfs_inode_destroy_blk_table(in);
 }
 
-static void
-pfs_inode_destroy_dindex(pfs_inode_t *in)
-{
-	pfs_dxent_t *ent;
-	while (!pfs_avl_is_empty(&in->in_dx_root)) {
-		ent = (pfs_dxent_t *)pfs_avl_first(&in->in_dx_root);
-		pfs_inode_dx_del(&in->in_dx_root, ent->e_nmhash, ent->e_ino,
-		    ent->e_in != NULL);
-	}
-	pfs_avl_destroy(&in->in_dx_root);
-}
-
-static void
-pfs_inode_destroy_dindex_self(pfs_inode_t *in)
-{
-	pfs_dxent_t *ent;
-	while (!pfs_avl_is_empty(&in->in_dx_root)) {
-		ent = (pfs_dxent_t *)pfs_avl_first(&in->in_dx_root);
-		pfs_inode_dx_del_self(&in->in_dx_root, ent->e_nmhash, ent->e_ino,
-		    ent->e_in != NULL);	// XXX only difference
-	}
-	pfs_avl_destroy(&in->in_dx_root);
-}
-
 static inline void
 pfs_inode_destroy_index(pfs_inode_t *in)
 {
@@ -1183,28 +1447,6 @@ pfs_inode_build_findex(pfs_inode_t *in)
 	(void)blkcnt;
 }
 
-static void
-pfs_inode_build_dindex(pfs_inode_t *in)
-{
-	pfs_mount_t *mnt = in->in_mnt;
-	pfs_inode_phy_t *dphyin, *phyin;
-	pfs_direntry_phy_t *de;
-	uint64_t deno;
-	char name[PFS_MAX_NAMELEN];
-	uint32_t nmhash;
-
-	dphyin = pfs_meta_get_inode(mnt, in->in_ino, NULL);
-
-	for (deno = MONO_FIRST(dphyin); MONO_VALID(deno); deno = MONO_NEXT(de)) {
-		de = pfs_meta_get_direntry(mnt, deno, NULL);
-		pfs_direntry_getname(mnt, de, name, sizeof(name));
-		nmhash = dx_calc_hash(name);
-		phyin = pfs_meta_get_inode(mnt, de->de_ino, NULL);
-		pfs_inode_dx_add(mnt, &in->in_dx_root, nmhash, de->de_ino,
-		    phyin->in_type == PFS_INODET_DIR);
-	}
-}
-
 static inline void
 pfs_inode_build_index(pfs_inode_t *in)
 {
@@ -1214,7 +1456,7 @@ pfs_inode_build_index(pfs_inode_t *in)
 		break;
 
 	case PFS_INODET_DIR:
-		pfs_inode_build_dindex(in);
+		/* see pfs_inode_dx_build() */
 		break;
 
 	default:
@@ -1280,7 +1522,9 @@ out:
 static int
 pfs_inode_reload(pfs_inode_t *in, bool force_unlck_meta)
 {
-	int err;
+	pfs_writemodify_t save;
+	int64_t size;
+	int err, err1;
 	MNT_STAT_BEGIN();
 	/*
 	 * The # of data blocks has changed. Have to rebuild
@@ -1288,10 +1532,25 @@ pfs_inode_reload(pfs_inode_t *in, bool force_unlck_meta)
 	 */
 	PFS_ASSERT(in->in_stale == true);
 	PFS_ASSERT(in->in_refcnt != 0);
+	/*
+	 * A deferred size change lives only in memory, so it is kept
+	 * aside and merged into the reloaded block map.
+	 */
+	pfs_inode_writemodify_detach(in, &save, &size);
 	pfs_inode_destroy_index(in);
-	pfs_inode_writemodify_fini(&in->in_write_modify);
 	pfs_inode_dxredo_fini(&in->in_dx_redo);
 	err = pfs_inode_load(in, in->in_ino, force_unlck_meta);
+	if (pfs_inode_writemodify_inprogress(&save)) {
+		err1 = (err == 0) ? pfs_inode_writemodify_merge(in, &save, size) :
+		    -EIO;
+		if (err1 < 0) {
+			pfs_etrace("inode %ld reloaded, drop deferred change to "
+			    "size %ld, err %d\n", (long)in->in_ino, (long)size,
+			    err ? err : err1);
+			pfs_mem_free(save.wm_dblkv, M_DBLKV);
+			in->in_wmerr = -EIO;
+		}
+	}
 	MNT_STAT_END(MNT_STAT_SYNC_INODE_RELOAD);
 	return err;
 }
@@ -1303,7 +1562,7 @@ pfs_inode_destroy(pfs_inode_t *in)
 	mutex_destroy(&in->in_mtx);
 	cond_destroy(&in->in_cond);
 	pfs_inode_destroy_index(in);
-	pfs_inode_writemodify_fini(&in->in_write_modify);
+	pfs_inode_writemodify_fini(in);
 	pfs_inode_dxredo_fini(&in->in_dx_redo);
 
 	pfs_mem_free(in, M_INODE);
@@ -1316,12 +1575,37 @@ pfs_inode_destroy_self(pfs_inode_t *in)
 	mutex_destroy(&in->in_mtx);
 	cond_destroy(&in->in_cond);
 	pfs_inode_destroy_index_self(in);	// XXX only difference
-	pfs_inode_writemodify_fini(&in->in_write_modify);
+	pfs_inode_writemodify_fini(in);
 	pfs_inode_dxredo_fini(&in->in_dx_redo);
 
 	pfs_mem_free(in, M_INODE);
 }
 
+/*
+ * Estimate the memory an inode holds: itself, its block tables and
+ * their block vectors, and the entries and slots of its subfile index.
+ */
+size_t
+pfs_inode_memsize(pfs_inode_t *in)
+{
+	const pfs_dxindex_t *dx = &in->in_dx_index;
+	size_t sz;
+	int64_t i;
+
+	sz = sizeof(*in);
+	sz += in->in_blk_table_nhard * sizeof(pfs_inode_blk_table_t);
+	for (i = 0; i < in->in_blk_table_nsoft; i++) {
+		if (pfs_get_dblk_vect(&in->in_blk_tables[i]) != NULL)
+			sz += BLK_TABLE_BLK_CNT * sizeof(pfs_dblk_t);
+	}
+	sz += dx->dx_nused * sizeof(pfs_dxent_t);
+	if (dx->dx_slot != NULL)
+		sz += sizeof(pfs_dxent_t *) << dx->dx_bits;
+	if (dx->dx_old != NULL)
+		sz += sizeof(pfs_dxent_t *) << dx->dx_oldbits;
+	return sz;
+}
+
 static pfs_inode_t *
 pfs_inode_create(pfs_mount_t *mnt, pfs_ino_t ino)
 {
@@ -1336,6 +1620,7 @@ pfs_inode_create(pfs_mount_t *mnt, pfs_ino_t ino)
 		in->in_btime = 0;
 		in->in_mnt = mnt;
 		in->in_refcnt = 0;
+		in->in_lrumem = 0;
 		in->in_nblk_ip = 0;
 		in->in_nblk_modify = 0;
 		in->in_cbdone = true;
@@ -1348,8 +1633,10 @@ pfs_inode_create(pfs_mount_t *mnt, pfs_ino_t ino)
 		in->in_rpl_ver = 0;
 		in->in_stale = true;
 		pfs_inode_writemodify_init(&in->in_write_modify);
-		pfs_avl_create(&in->in_dx_root, pfs_inode_dx_compare,
-		    offsetof(pfs_dxent_t, e_avlnode));
+		in->in_wmerr = 0;
+		pfs_dxindex_init(&in->in_dx_index);
+		in->in_dx_built = false;
+		in->in_dx_dirty = false;
 		pfs_inode_dxredo_init(&in->in_dx_redo);
 		pfs_inode_init_blktable(in);
 	}
@@ -1775,7 +2062,7 @@ pfs_inode_sync_impl(pfs_inode_t *in, int type, bool first_sync, uint64_t btime,
 	pfs_inode_rpl_lock(in);
 	while (in->in_nblk_ip != 0 || in->in_nblk_modify ||
 	    in->in_size != in->in_size2 || !in->in_cbdone ||
-	    (pfs_inode_writemodify_inprogress(&in->in_write_modify) &&
+	    (pfs_inode_writemodify_pending(in) &&
 	    in->in_write_modify.wm_thread != pthread_self()) ||
 	    (pfs_inode_dxredo_inprogress(&in->in_dx_redo) &&
 	    in->in_dx_redo.r_thread != pthread_self())) {
@@ -1791,7 +2078,7 @@ pfs_inode_sync_impl(pfs_inode_t *in, int type, bool first_sync, uint64_t btime,
 			return err;
 		reloaded = true;
 	}
-	if (pfs_inode_writemodify_inprogress(&in->in_write_modify) &&
+	if (pfs_inode_writemodify_pending(in) &&
 	    in->in_sync_ver < in->in_rpl_ver)
 		return -EAGAIN;
 
@@ -23,6 +23,7 @@
 #include <limits.h>
 
 #include "pfs_avl.h"
+#include "pfs_dxindex.h"
 #include "pfs_impl.h"
 #include "pfs_meta.h"
 
@@ -66,12 +67,19 @@ typedef struct pfs_dblk {
 	int32_t		db_holelen;
 } pfs_dblk_t;
 
+typedef struct pfs_wmdblk {
+	pfs_blkid_t	wd_blkid;
+	pfs_dblk_t	wd_dblk;
+} pfs_wmdblk_t;
+
 typedef struct pfs_writemodify {
-	pfs_dblk_t	*wm_dblkv;	/* modified dblk vector */
+	pfs_wmdblk_t	*wm_dblkv;	/* modified dblk vector */
 	int		wm_dblki;
 	int		wm_dblkn;
 	int64_t		wm_sizeinc;	/* size increment */
 	pthread_t	wm_thread;	/* modifying thread */
+	bool		wm_parked;	/* left uncommitted, no owner */
+	uint64_t	wm_parkts;	/* first parked time in us, or 0 */
 } pfs_writemodify_t;
 
 enum {
@@ -119,14 +127,22 @@ typedef struct pfs_inode {
 //	bool		in_doom;	/* unlink barrier, whether is being unlinked */
 //					/* protected by mount inode list lock */
 	int32_t		in_refcnt;	/* XXX: opened file count */
-					/* protected by mount inode list lock */
+					/* protected by inode shard lock */
+	size_t		in_lrumem;	/* memory counted in the shard LRU,
+					   protected by inode shard lock */
 	bool		in_stale;
 	bool		in_cbdone;
 	int64_t		in_nblk_ip;	/* (I) number of block in progress */
 	int64_t		in_nblk_modify;	/* (I) # blocks being modified */
 	pfs_writemodify_t in_write_modify;
-
-	pfs_avl_tree_t	in_dx_root;	/* (I) index of subfiles */
+	TAILQ_ENTRY(pfs_inode) in_wmnext;	/* (P) link of parked writemodify,
+						   P is mount poll mutex */
+	int		in_wmerr;	/* (I) deferred change lost, reported
+					   by the next flush */
+
+	pfs_dxindex_t	in_dx_index;	/* (I) index of subfiles */
+	bool		in_dx_built;	/* (I) built on the first lookup */
+	bool		in_dx_dirty;	/* (I) built with dxredo in flight */
 	pfs_dxredo_t	in_dx_redo;	/* (I) record all subfile change, like wm */
 
 	int64_t		in_sync_ver;	/* record the rpl version when sync*/
@@ -191,6 +207,7 @@ int 	pfs_inode_sync_first(pfs_inode_t *in, int type, uint64_t btime,
 	    bool force_unlck_meta);
 void 	pfs_inode_destroy(pfs_inode_t *in);
 void 	pfs_inode_destroy_self(pfs_inode_t *in);
+size_t	pfs_inode_memsize(pfs_inode_t *in);
 void	pfs_inode_lock(pfs_inode_t *in);
 void	pfs_inode_unlock(pfs_inode_t *in);
 void 	pfs_inode_expand_dblk_hole(pfs_inode_t *in, pfs_blkid_t blkid,
@@ -201,6 +218,14 @@ void 	pfs_inode_writemodify_shrink_dblk_hole(pfs_inode_t *in,
 	    pfs_blkid_t blkid, off_t newbhoff, int32_t newbhlen);
 void 	pfs_inode_writemodify_increment_size(pfs_inode_t *in, int64_t szdelta);
 int 	pfs_inode_writemodify_commit(pfs_inode_t *in);
+bool	pfs_inode_writemodify_park(pfs_inode_t *in);
+bool	pfs_inode_writemodify_adopt(pfs_inode_t *in);
+int	pfs_inode_writemodify_expired(pfs_mount_t *mnt, uint64_t age_us,
+	    pfs_ino_t *inov, int ninov);
+void	pfs_inode_writemodify_copy(pfs_inode_t *in, pfs_writemodify_t *save,
+	    int64_t *sizep);
+int	pfs_inode_writemodify_repark(pfs_inode_t *in, pfs_writemodify_t *save,
+	    int64_t size);
 bool	pfs_inode_skip_sync(pfs_inode_t *in);
 int	pfs_inode_phy_check(pfs_inode_t *in);
 
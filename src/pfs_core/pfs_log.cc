@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "pfs_def.h"
 #include "pfs_devio.h"
 #include "pfs_dir.h"
 #include "pfs_file.h"
@@ -645,6 +646,89 @@ pfs_log_check(const pfs_logentry_phy_t *lebuf, uint32_t nle)
 	}
 }
 
+STATIC_ASSERT(sizeof(pfs_logpack_phy_t) == sizeof(pfs_logentry_phy_t) &&
+    offsetof(pfs_logpack_phy_t, lp_lsn) == offsetof(pfs_logentry_phy_t, le_lsn) &&
+    offsetof(pfs_logpack_phy_t, lp_txid) == offsetof(pfs_logentry_phy_t, le_txid) &&
+    offsetof(pfs_logpack_phy_t, lp_magic) == offsetof(pfs_logentry_phy_t, le_obj_idx) &&
+    offsetof(pfs_logpack_phy_t, lp_checksum) == offsetof(pfs_logentry_phy_t, le_checksum) &&
+    offsetof(pfs_logpack_phy_t, lp_more) == offsetof(pfs_logentry_phy_t, le_more) &&
+    offsetof(pfs_logpack_phy_t, lp_tail) + LOGPACK_TAILSIZE == sizeof(pfs_logpack_phy_t));
+
+/*
+ * pfs_logpack_next:
+ *
+ *	Return the record at *posp of a pack slot and advance *posp,
+ *	which starts from 0. NULL is returned after the last record.
+ */
+const pfs_logrec_phy_t *
+pfs_logpack_next(const pfs_logpack_phy_t *lp, int *posp)
+{
+	const pfs_logrec_phy_t *lr;
+	int pos = *posp;
+
+	if (pos < lp->lp_headlen)
+		lr = (const pfs_logrec_phy_t *)&lp->lp_head[pos];
+	else if (pos - lp->lp_headlen < lp->lp_taillen)
+		lr = (const pfs_logrec_phy_t *)&lp->lp_tail[pos - lp->lp_headlen];
+	else
+		return NULL;
+	PFS_ASSERT(lr->lr_len >= sizeof(*lr));
+	*posp = pos + lr->lr_len;
+	return lr;
+}
+
+void
+pfs_logpack_init(pfs_logpack_phy_t *lp, pfs_lsn_t lsn, int64_t txid)
+{
+	memset(lp, 0, sizeof(*lp));
+	lp->lp_lsn = lsn;
+	lp->lp_txid = txid;
+	lp->lp_magic = LOGPACK_MAGIC;
+}
+
+/* Append a record, false if the slot has no room left for it */
+bool
+pfs_logpack_add(pfs_logpack_phy_t *lp, const char *rec, int reclen)
+{
+	if (lp->lp_taillen == 0 &&
+	    lp->lp_headlen + reclen <= (int)sizeof(lp->lp_head)) {
+		memcpy(&lp->lp_head[lp->lp_headlen], rec, reclen);
+		lp->lp_headlen += reclen;
+	} else if (lp->lp_taillen + reclen <= (int)sizeof(lp->lp_tail)) {
+		memcpy(&lp->lp_tail[lp->lp_taillen], rec, reclen);
+		lp->lp_taillen += reclen;
+	} else
+		return false;
+	lp->lp_nrec++;
+	return true;
+}
+
+void
+pfs_logpack_seal(pfs_logpack_phy_t *lp, bool more)
+{
+	PFS_ASSERT(lp->lp_nrec > 0);
+	lp->lp_more = more;
+	lp->lp_checksum = crc32c_compute(lp, sizeof(*lp),
+	    offsetof(struct pfs_logpack_phy, lp_checksum));
+}
+
+static void
+pfs_logpack_dump(const pfs_logpack_phy_t *lp, int level)
+{
+	const pfs_logrec_phy_t *lr;
+	int pos = 0;
+
+	DUMP_FIELD("%u",	level, lp, lp_nrec);
+	while ((lr = pfs_logpack_next(lp, &pos)) != NULL) {
+		DUMP_FIELD("%lu",	level+1, lr, lr_sector_bda);
+		DUMP_FIELD("%u",	level+1, lr, lr_obj_idx);
+		DUMP_FIELD("%u",	level+1, lr, lr_obj_type);
+		DUMP_FIELD("%lu",	level+1, lr, lr_obj_number);
+		DUMP_FIELD("%u",	level+1, lr, lr_basecrc);
+		DUMP_FIELD("%u",	level+1, lr, lr_nrange);
+	}
+}
+
 void
 pfs_log_dump(pfs_logentry_phy_t *lebuf, uint32_t nle, int level)
 {
@@ -653,6 +737,14 @@ pfs_log_dump(pfs_logentry_phy_t *lebuf, uint32_t nle, int level)
 	for (le = lebuf; le - lebuf < nle; le++) {
 		DUMP_FIELD("%ld",	level, le, le_txid);
 		DUMP_FIELD("%ld",	level, le, le_lsn);
+		if (pfs_logentry_ispack(le)) {
+			DUMP_FIELD("%u",	level, le, le_checksum);
+			if (pfs_log_check_one(le) == false)
+				DUMP_VALUE("%s", level, (le_checksum_isvalid), "false");
+			DUMP_FIELD("%d",	level, le, le_more);
+			pfs_logpack_dump((const pfs_logpack_phy_t *)le, level);
+			continue;
+		}
 		DUMP_FIELD("%lu",	level, le, le_sector_bda);
 		DUMP_FIELD("%u",	level, le, le_obj_idx);
 		DUMP_FIELD("%u",	level, le, le_checksum);
@@ -785,10 +877,15 @@ pfs_log_scan(pfs_log_t *log, char *buf, ssize_t buflen, off_t start_offset,
 			TAILQ_INSERT_TAIL(txhead, tx, t_next);
 		}
 		pfs_dbgtrace("log scan le %llu\n", le->le_lsn);
-		top = NULL;
-		err = pfs_tx_recreate_op(tx, le, top);
+		if (pfs_logentry_ispack(le)) {
+			err = pfs_tx_recreate_pack(tx, (pfs_logpack_phy_t *)le);
+		} else {
+			top = NULL;
+			err = pfs_tx_recreate_op(tx, le, top);
+		}
 		if (err < 0)
 			return err;
+		tx->t_nle++;
 		nentry++;
 
 		if ((pfs_txid_t)le->le_txid == stop_txid && !le->le_more) {
@@ -1424,7 +1521,11 @@ pfs_log_handle_write(pfs_log_t *log, struct req_qhead *work_req)
 		return LOG_IO_CONT;
 	}
 
-	/* LOG_TRIM_POINT */
+	/*
+	 * LOG_TRIM_POINT
+	 * Packed delta entries never take more slots than ops, so t_nops
+	 * is an upper bound of the space to be used.
+	 */
 	tx = req->r_itx;
 	txspace = tx->t_nops * sizeof(pfs_logentry_phy_t);
 	PFS_ASSERT(tx->t_nops > 0 && txspace <= lr->log_size);
@@ -1447,6 +1548,7 @@ pfs_log_handle_write(pfs_log_t *log, struct req_qhead *work_req)
 	 * trimrecord_queue. Otherwise io thread needs to send back write
 	 * tx and log thread cuts sectbufs into trimrecord queue.
 	 */
+	txspace = tx->t_nle * sizeof(pfs_logentry_phy_t);
 	err = pfs_log_add_trimentry(log, tx->t_id, txspace, &tx->t_ops);
 	/* TRIM_SWAP_CHECKPOINT */
 	(void)pfs_log_tryswap_trimgroup(log, false, LOG_WRITE);
@@ -1829,8 +1931,9 @@ pfs_log_start(pfs_log_t *log)
 	mutex_init(&log->log_trimreq.r_mtx);
 	cond_init(&log->log_trimreq.r_cond, NULL);
 
-	buf = (char *)pfs_mem_malloc(PFS_FRAG_SIZE, M_FRAG);
-	if (buf == NULL)
+	/* log entries are built in place, keep them as aligned as declared */
+	if (pfs_mem_memalign((void **)&buf, sizeof(pfs_logentry_phy_t),
+	    PFS_FRAG_SIZE, M_FRAG) != 0)
 		ERR_RETVAL(ENOMEM);
 	log->log_workbuf = buf;
 	log->log_workbufsz = PFS_FRAG_SIZE;
@@ -1994,7 +2097,7 @@ pfs_log_replaytx_put(pfs_log_t *log, struct tx_qhead *otxq, bool trim)
 	while ((tx = TAILQ_FIRST(otxq)) != NULL) {
 		TAILQ_REMOVE(otxq, tx, t_next);
 		if (trim) {
-			txspace = tx->t_nops * sizeof(pfs_logentry_phy_t);
+			txspace = tx->t_nle * sizeof(pfs_logentry_phy_t);
 			err = pfs_log_add_trimentry(log, tx->t_id, txspace,
 			    &tx->t_ops);
 			PFS_ASSERT(err == 0);
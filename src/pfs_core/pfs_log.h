@@ -129,6 +129,59 @@ typedef struct pfs_logentry_phy {
 	int		le_more;
 } __attribute__((aligned(256))) pfs_logentry_phy_t;
 
+/*
+ * With PFS_FEATURE_LOGDELTA, small object updates of a tx are packed as
+ * byte-range deltas into shared slots. A pack slot has the size of a log
+ * entry and keeps lsn, txid, checksum and more at the same offsets, so the
+ * journal is still read, checked, scanned and trimmed slot by slot. It is
+ * told apart by LOGPACK_MAGIC in the place of le_obj_idx.
+ *
+ * Records are never split: they fill lp_head first, then lp_tail.
+ */
+#define	LOGPACK_MAGIC		0x4b50474cU	/* "LGPK" */
+#define	LOGPACK_TAILSIZE	92
+
+typedef struct pfs_logpack_phy {
+	char		lp_head[sizeof(pfs_metaobj_phy_t)];
+	int64_t		lp_lsn;
+	uint16_t	lp_headlen;	/* bytes of records in lp_head */
+	uint16_t	lp_taillen;	/* bytes of records in lp_tail */
+	uint32_t	lp_nrec;
+	int64_t		lp_txid;
+	uint32_t	lp_magic;
+	uint32_t	lp_checksum;
+	int		lp_more;
+	char		lp_tail[LOGPACK_TAILSIZE];
+} __attribute__((aligned(256))) pfs_logpack_phy_t;
+
+/*
+ * A delta record, followed by lr_nrange of {offset, length, bytes}.
+ * It only applies to the image whose mo_checksum is lr_basecrc.
+ */
+typedef struct pfs_logrec_phy {
+	uint64_t	lr_sector_bda;
+	uint64_t	lr_obj_number;
+	uint32_t	lr_basecrc;
+	uint8_t		lr_obj_idx;
+	uint8_t		lr_obj_type;
+	uint8_t		lr_len;		/* whole record in bytes */
+	uint8_t		lr_nrange;
+} __attribute__((packed)) pfs_logrec_phy_t;
+
+#define	LOGREC_RANGEHDR		2
+#define	LOGREC_MAXSIZE		LOGPACK_TAILSIZE
+
+static inline bool
+pfs_logentry_ispack(const pfs_logentry_phy_t *le)
+{
+	return le->le_obj_idx == LOGPACK_MAGIC;
+}
+
+void	pfs_logpack_init(pfs_logpack_phy_t *lp, pfs_lsn_t lsn, int64_t txid);
+bool	pfs_logpack_add(pfs_logpack_phy_t *lp, const char *rec, int reclen);
+void	pfs_logpack_seal(pfs_logpack_phy_t *lp, bool more);
+const pfs_logrec_phy_t *
+	pfs_logpack_next(const pfs_logpack_phy_t *lp, int *posp);
 void	pfs_log_dump(pfs_logentry_phy_t *lebuf, uint32_t nle, int level);
 
 int 	pfs_log_start(pfs_log_t *log);
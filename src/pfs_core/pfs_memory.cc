@@ -20,17 +20,22 @@
 
 #include "pfs_impl.h"
 #include "pfs_admin.h"
+#include "pfs_metrics.h"
 
+/*
+ * Counters are updated atomically on every allocation and free, without
+ * a lock; readers may see the alloc and free sides a few updates apart.
+ * A type per cache line, so hot types don't share one.
+ */
 typedef struct pfs_memtype {
 	const char 	*mt_name;
-	pthread_mutex_t	mt_mtx;
 	ssize_t		mt_bytes_alloc;
 	ssize_t 	mt_bytes_free;
 	int64_t		mt_count_alloc;
 	int64_t		mt_count_free;
-} pfs_memtype_t;
+} __attribute__((aligned(64))) pfs_memtype_t;
 
-#define	MEMTYPE_ENTRY(tag)	[tag] = { #tag, PTHREAD_MUTEX_INITIALIZER, }
+#define	MEMTYPE_ENTRY(tag)	[tag] = { #tag, }
 static pfs_memtype_t	pfs_mem_type[M_NTYPE] = {
 	MEMTYPE_ENTRY(M_NONE),
 	MEMTYPE_ENTRY(M_SECTOR),
@@ -77,6 +82,7 @@ static pfs_memtype_t	pfs_mem_type[M_NTYPE] = {
 	MEMTYPE_ENTRY(M_CHUNK_METABUF),
 	MEMTYPE_ENTRY(M_CHUNK_CRCBUF),
 	MEMTYPE_ENTRY(M_CHUNK_BLOCKUSED),
+	MEMTYPE_ENTRY(M_CHUNK_DIGEST),
 	MEMTYPE_ENTRY(M_NAMECACHE),
 	MEMTYPE_ENTRY(M_OIDV_HOLEOFF),
 	MEMTYPE_ENTRY(M_DXENT),
@@ -88,6 +94,7 @@ static pfs_memtype_t	pfs_mem_type[M_NTYPE] = {
 	MEMTYPE_ENTRY(M_INODE_BLK_TABLE),
 	MEMTYPE_ENTRY(M_CURVE_IOQ),
 	MEMTYPE_ENTRY(M_CURVE_DEV),
+	MEMTYPE_ENTRY(M_DXINDEX),
 };
 
 static inline const char *
@@ -104,10 +111,9 @@ memtype_inc(int type, int count, size_t size)
 	PFS_ASSERT(0 < type && type < M_NTYPE);
 
 	mt = &pfs_mem_type[type];
-	mutex_lock(&mt->mt_mtx);
-	mt->mt_bytes_alloc += (ssize_t)size;
-	mt->mt_count_alloc += count;
-	mutex_unlock(&mt->mt_mtx);
+	__atomic_add_fetch(&mt->mt_bytes_alloc, (ssize_t)size,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mt->mt_count_alloc, count, __ATOMIC_RELAXED);
 }
 
 static void
@@ -118,10 +124,9 @@ memtype_dec(int type, size_t size)
 	PFS_ASSERT(0 < type && type < M_NTYPE);
 
 	mt = &pfs_mem_type[type];
-	mutex_lock(&mt->mt_mtx);
-	mt->mt_bytes_free += (ssize_t)size;
-	mt->mt_count_free += 1;
-	mutex_unlock(&mt->mt_mtx);
+	__atomic_add_fetch(&mt->mt_bytes_free, (ssize_t)size,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mt->mt_count_free, 1, __ATOMIC_RELAXED);
 }
 
 void *
@@ -219,3 +224,30 @@ pfs_mem_stat(admin_buf_t *ab)
 
 	return 0;
 }
+
+void
+pfs_mem_metrics(pfs_metrics_t *m)
+{
+	int t;
+
+	pfs_metrics_family(m, "pfs_mem_allocs_total", "counter",
+	    "Allocations by memory type.");
+	for (t = 1; t < M_NTYPE; t++)
+		pfs_metrics_u64(m, "pfs_mem_allocs_total", "type",
+		    pfs_mem_type[t].mt_name, pfs_mem_type[t].mt_count_alloc);
+	pfs_metrics_family(m, "pfs_mem_frees_total", "counter",
+	    "Frees by memory type.");
+	for (t = 1; t < M_NTYPE; t++)
+		pfs_metrics_u64(m, "pfs_mem_frees_total", "type",
+		    pfs_mem_type[t].mt_name, pfs_mem_type[t].mt_count_free);
+	pfs_metrics_family(m, "pfs_mem_alloc_bytes_total", "counter",
+	    "Bytes allocated by memory type.");
+	for (t = 1; t < M_NTYPE; t++)
+		pfs_metrics_u64(m, "pfs_mem_alloc_bytes_total", "type",
+		    pfs_mem_type[t].mt_name, pfs_mem_type[t].mt_bytes_alloc);
+	pfs_metrics_family(m, "pfs_mem_free_bytes_total", "counter",
+	    "Bytes freed by memory type.");
+	for (t = 1; t < M_NTYPE; t++)
+		pfs_metrics_u64(m, "pfs_mem_free_bytes_total", "type",
+		    pfs_mem_type[t].mt_name, pfs_mem_type[t].mt_bytes_free);
+}
@@ -62,6 +62,7 @@ enum {
 	M_CHUNK_METABUF,
 	M_CHUNK_CRCBUF,
 	M_CHUNK_BLOCKUSED,
+	M_CHUNK_DIGEST,
 	M_NAMECACHE,
 	M_OIDV_HOLEOFF,
 	M_DXENT,
@@ -73,16 +74,19 @@ enum {
 	M_INODE_BLK_TABLE,
 	M_CURVE_IOQ,
 	M_CURVE_DEV,
+	M_DXINDEX,
 
 	M_NTYPE
 };
 
 typedef struct admin_buf admin_buf_t;
+typedef struct pfs_metrics pfs_metrics_t;
 
 void * 	pfs_mem_malloc(size_t size, int type);
 void 	pfs_mem_free(void *ptr, int type);
 void * 	pfs_mem_realloc(void *ptr, size_t newsize, int type);
 int 	pfs_mem_memalign(void **pp, size_t alignment, size_t size, int type);
 int	pfs_mem_stat(admin_buf_t *dbuf);
+void	pfs_mem_metrics(pfs_metrics_t *m);
 
 #endif	/* _PFS_MEMORY_H_ */
@@ -18,10 +18,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <search.h>
 #include <stddef.h>
+#include <unistd.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include "pfs_meta.h"
 #include "pfs_devio.h"
@@ -41,6 +44,9 @@
 static int64_t loadthread_count = MIN_NTHRD;
 PFS_OPTION_REG(loadthread_count, pfs_check_ival_normal);
 
+static int64_t meta_ckpt_enable = PFS_OPT_DISABLE;
+PFS_OPTION_REG(meta_ckpt_enable, pfs_check_ival_switch);
+
 #define CHECK_META 0
 
 typedef struct metatype {
@@ -748,21 +754,19 @@ pfs_metaset_visit(pfs_anode_t *an, uint64_t oid, void *data)
 
 
 /*
- * metset_load:
- *
- * 	Load the disk content of a metaset into memory as a seperate copy.
- * 	The in-memory copy will act as an allocation node.
+ * Set up the in-memory copy of a metaset described by the chunk
+ * header. Its sectors are in one consecutive buffer which is returned
+ * and recorded by ms->ms_objbuf[0].
  */
-static int
-pfs_meta_load_set(pfs_mount_t *mnt, pfs_chunk_t *ck, int mtype)
+static char *
+pfs_meta_init_set(pfs_chunk_t *ck, int mtype)
 {
-	int i, err = 0, err1 = 0;
+	int i;
 	pfs_chunk_phy_t *phyck = ck->ck_phyck;
 	uint64_t sectsize = phyck->ck_sectsize;
 	pfs_metaset_t *ms = &ck->ck_metaset[mtype];
 	pfs_metaset_phy_t *physet = &phyck->ck_physet[mtype];
-	uint64_t bda;
-	ssize_t buflen, rsum, rlen;
+	ssize_t buflen;
 	char *bufptr;
 
 	ms->ms_type = mtype;
@@ -774,7 +778,7 @@ pfs_meta_load_set(pfs_mount_t *mnt, pfs_chunk_t *ck, int mtype)
 	ms->ms_objbuf = (pfs_metaobj_phy_t **)pfs_mem_malloc(
 	    ms->ms_nsect * sizeof(*ms->ms_objbuf), M_OBJBUFV);
 	if (ms->ms_objbuf == NULL)
-		ERR_RETVAL(ENOMEM);
+		return NULL;
 	memset(ms->ms_objbuf, 0, ms->ms_nsect * sizeof(*ms->ms_objbuf));
 
 	/*
@@ -789,6 +793,28 @@ pfs_meta_load_set(pfs_mount_t *mnt, pfs_chunk_t *ck, int mtype)
 	for (i = 0; i < (int)ms->ms_nsect; i++) {
 		ms->ms_objbuf[i] = (pfs_metaobj_phy_t *)(bufptr + i * sectsize);
 	}
+	return bufptr;
+}
+
+/*
+ * metset_load:
+ *
+ * 	Load the disk content of a metaset into memory as a seperate copy.
+ * 	The in-memory copy will act as an allocation node.
+ */
+static int
+pfs_meta_load_set(pfs_mount_t *mnt, pfs_chunk_t *ck, int mtype)
+{
+	int err = 0, err1 = 0;
+	pfs_metaset_t *ms = &ck->ck_metaset[mtype];
+	uint64_t bda;
+	ssize_t buflen, rsum, rlen;
+	char *bufptr;
+
+	bufptr = pfs_meta_init_set(ck, mtype);
+	if (bufptr == NULL)
+		ERR_RETVAL(ENOMEM);
+	buflen = ms->ms_nsect * ck->ck_sectsize;
 
 	/*
 	 * issue nowait I/Os which are 4KB aligned to load
@@ -1112,6 +1138,275 @@ pfs_meta_load_chunks_parallel(pfs_mount_t *mnt, uint32_t oldnck,
 	return err;
 }
 
+/*
+ * Metadata checkpoint.
+ *
+ * At umount, superblocks of all chunks in memory are saved into a local
+ * image, stamped with the txid they are up to. The next mount loads the
+ * image instead of reading superblocks chunk by chunk, as long as that
+ * txid is still in the log, i.e. in [tail, head]. Log replay then brings
+ * the image up to date, just as it does for superblocks that are newer
+ * than the log tail.
+ *
+ * The image is a header followed by, for each chunk, its header sector,
+ * its metaset sectors and a crc of them. Only a read-write mount saves
+ * it: read-only mounts of the PBD on the same host would race on the
+ * image, and any of them may load it.
+ */
+#define	METACKPT_DIR	"/var/run/pfs"
+#define	METACKPT_MAGIC	0x54504b4341544d50ULL
+
+typedef struct metackpt_header {
+	uint64_t	mh_magic;
+	uint64_t	mh_txid;
+	uint64_t	mh_btime;	/* root inode btime, changes by mkfs */
+	uint32_t	mh_nchunk;
+	uint32_t	mh_crc;
+} metackpt_header_t;
+
+static void
+metackpt_path(pfs_mount_t *mnt, bool tmp, char *path)
+{
+	snprintf(path, PFS_MAX_PATHLEN, "%s/pbd%s.ckpt%s", METACKPT_DIR,
+	    mnt->mnt_pbdname, tmp ? ".tmp" : "");
+	path[PFS_MAX_PATHLEN-1] = '\0';
+}
+
+static int
+metackpt_io(int fd, void *buf, size_t len, bool wr)
+{
+	ssize_t n;
+	char *p = (char *)buf;
+
+	while (len > 0) {
+		n = wr ? write(fd, p, len) : read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -EIO;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint32_t
+metackpt_header_crc(const metackpt_header_t *mh)
+{
+	return crc32c((uint32_t)~1, mh, offsetof(metackpt_header_t, mh_crc));
+}
+
+static bool
+metackpt_usable(pfs_mount_t *mnt)
+{
+	return meta_ckpt_enable == PFS_OPT_ENABLE && pfs_loggable(mnt) &&
+	    !pfs_istool(mnt);
+}
+
+int
+pfs_meta_ckpt_save(pfs_mount_t *mnt)
+{
+	int i, err, fd;
+	int32_t ckid;
+	uint32_t crc;
+	ssize_t len;
+	pfs_chunk_t *ck;
+	pfs_metaset_t *ms;
+	metackpt_header_t mh;
+	char path[PFS_MAX_PATHLEN], tmppath[PFS_MAX_PATHLEN];
+
+	if (!metackpt_usable(mnt) || !pfs_writable(mnt) ||
+	    mnt->mnt_nchunk <= 0)
+		return 0;
+
+	if (mkdir(METACKPT_DIR, 0777) < 0 && errno != EEXIST) {
+		pfs_etrace("mkdir %s failed, errno=%d\n", METACKPT_DIR, errno);
+		return -EIO;
+	}
+	metackpt_path(mnt, true, tmppath);
+	fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		pfs_etrace("open checkpoint %s failed, errno=%d\n", tmppath,
+		    errno);
+		return -EIO;
+	}
+
+	MOUNT_META_RDLOCK(mnt);
+	memset(&mh, 0, sizeof(mh));
+	mh.mh_magic = METACKPT_MAGIC;
+	mh.mh_txid = mnt->mnt_log.log_leader.head_txid;
+	mh.mh_btime = MO2IN(&mnt->mnt_chunkv[0]->
+	    ck_metaset[MT_INODE].ms_objbuf[0][0])->in_btime;
+	mh.mh_nchunk = mnt->mnt_nchunk;
+	mh.mh_crc = metackpt_header_crc(&mh);
+	err = metackpt_io(fd, &mh, sizeof(mh), true);
+	for (ckid = 0; err == 0 && ckid < mnt->mnt_nchunk; ckid++) {
+		ck = mnt->mnt_chunkv[ckid];
+		crc = crc32c((uint32_t)~1, ck->ck_phyck, PBD_SECTOR_SIZE);
+		err = metackpt_io(fd, ck->ck_phyck, PBD_SECTOR_SIZE, true);
+		for (i = 0; err == 0 && i < MT_NTYPE; i++) {
+			if (i == MT_NONE)
+				continue;
+			ms = &ck->ck_metaset[i];
+			len = ms->ms_nsect * ck->ck_sectsize;
+			crc = crc32c(crc, ms->ms_objbuf[0], len);
+			err = metackpt_io(fd, ms->ms_objbuf[0], len, true);
+		}
+		if (err == 0)
+			err = metackpt_io(fd, &crc, sizeof(crc), true);
+	}
+	MOUNT_META_UNLOCK(mnt);
+
+	if (err == 0 && fsync(fd) < 0)
+		err = -EIO;
+	close(fd);
+	metackpt_path(mnt, false, path);
+	if (err == 0 && rename(tmppath, path) < 0)
+		err = -EIO;
+	if (err < 0) {
+		pfs_etrace("save checkpoint %s failed, errno=%d\n", tmppath,
+		    errno);
+		unlink(tmppath);
+		return err;
+	}
+	pfs_itrace("saved metadata checkpoint %s at txid %llu\n", path,
+	    (unsigned long long)mh.mh_txid);
+	return 0;
+}
+
+/*
+ * Check the checkpoint against the PBD: it must be taken from the same
+ * filesystem and of the same size, and its txid must still be in the
+ * log, otherwise txs between them are lost.
+ */
+static int
+pfs_meta_ckpt_check(pfs_mount_t *mnt, const metackpt_header_t *mh,
+    const pfs_chunk_phy_t *phyck0)
+{
+	int err;
+	char buf[PBD_SECTOR_SIZE];
+	pfs_metaobj_phy_t *rootmo = (pfs_metaobj_phy_t *)buf;
+	pfs_leader_record_t *lr = &mnt->mnt_log.log_leader;
+
+	if (mh->mh_magic != METACKPT_MAGIC ||
+	    mh->mh_crc != metackpt_header_crc(mh))
+		ERR_RETVAL(ENOENT);
+
+	if (mh->mh_nchunk != phyck0->ck_nchunk ||
+	    mh->mh_txid < lr->tail_txid || mh->mh_txid > lr->head_txid) {
+		pfs_itrace("checkpoint of %u chunks at txid %llu is stale,"
+		    " PBD has %u chunks, log needs txid in [%llu, %llu]\n",
+		    mh->mh_nchunk, (unsigned long long)mh->mh_txid,
+		    phyck0->ck_nchunk,
+		    (unsigned long long)lr->tail_txid,
+		    (unsigned long long)lr->head_txid);
+		ERR_RETVAL(ENOENT);
+	}
+
+	err = pfsdev_pread(mnt->mnt_ioch_desc, buf, PBD_SECTOR_SIZE,
+	    phyck0->ck_physet[MT_INODE].ms_sectbda);
+	if (err < 0)
+		return err;
+	if (MO2IN(rootmo)->in_btime != mh->mh_btime) {
+		pfs_itrace("checkpoint is of another filesystem, btime %llu"
+		    " vs %llu\n", (unsigned long long)mh->mh_btime,
+		    (unsigned long long)MO2IN(rootmo)->in_btime);
+		ERR_RETVAL(ENOENT);
+	}
+	return 0;
+}
+
+static int
+pfs_meta_ckpt_load(pfs_mount_t *mnt, const pfs_chunk_phy_t *phyck0)
+{
+	int i, err, fd;
+	uint32_t ckid, crc, ckcrc;
+	ssize_t len;
+	char *bufptr;
+	pfs_chunk_t *ck;
+	pfs_chunk_phy_t *phyck;
+	pfs_metaset_t *ms;
+	metackpt_header_t mh;
+	char path[PFS_MAX_PATHLEN];
+
+	metackpt_path(mnt, false, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		ERR_RETVAL(ENOENT);
+
+	err = metackpt_io(fd, &mh, sizeof(mh), false);
+	if (err < 0)
+		ERR_GOTO(ENOENT, out);
+	err = pfs_meta_ckpt_check(mnt, &mh, phyck0);
+	if (err < 0)
+		goto out;
+
+	for (ckid = 0; ckid < mh.mh_nchunk; ckid++) {
+		phyck = (pfs_chunk_phy_t *)pfs_mem_malloc(PBD_SECTOR_SIZE,
+		    M_SECTOR);
+		if (phyck == NULL)
+			ERR_GOTO(ENOMEM, out);
+		ck = (pfs_chunk_t *)pfs_mem_malloc(sizeof(*ck), M_CHUNK);
+		if (ck == NULL) {
+			pfs_mem_free(phyck, M_SECTOR);
+			ERR_GOTO(ENOMEM, out);
+		}
+		ck->ck_mnt = mnt;
+		ck->ck_phyck = phyck;
+		mnt->mnt_chunkv[ckid] = ck;
+
+		err = metackpt_io(fd, phyck, PBD_SECTOR_SIZE, false);
+		if (err < 0 || phyck->ck_number != ckid ||
+		    (ckid == 0 && memcmp(phyck, phyck0, sizeof(*phyck)) != 0))
+			ERR_GOTO(ENOENT, out);
+		ck->ck_number = phyck->ck_number;
+		ck->ck_sectsize = phyck->ck_sectsize;
+
+		crc = crc32c((uint32_t)~1, phyck, PBD_SECTOR_SIZE);
+		for (i = 0; i < MT_NTYPE; i++) {
+			if (i == MT_NONE)
+				continue;
+			ms = &ck->ck_metaset[i];
+			ms->ms_chunk = ck;
+			bufptr = pfs_meta_init_set(ck, i);
+			if (bufptr == NULL)
+				ERR_GOTO(ENOMEM, out);
+			len = ms->ms_nsect * ck->ck_sectsize;
+			err = metackpt_io(fd, bufptr, len, false);
+			if (err < 0)
+				ERR_GOTO(ENOENT, out);
+			crc = crc32c(crc, bufptr, len);
+		}
+		err = metackpt_io(fd, &ckcrc, sizeof(ckcrc), false);
+		if (err < 0 || ckcrc != crc) {
+			pfs_etrace("checkpoint chunk %u is corrupted\n", ckid);
+			ERR_GOTO(ENOENT, out);
+		}
+
+		for (i = 0; i < MT_NTYPE; i++) {
+			if (i == MT_NONE)
+				continue;
+			ms = &ck->ck_metaset[i];
+			pfs_metaset_check_crc(ms);
+			pfs_metaset_init_anode(ms, ck->ck_number);
+		}
+	}
+	pfs_itrace("loaded %u chunks from checkpoint %s at txid %llu\n",
+	    mh.mh_nchunk, path, (unsigned long long)mh.mh_txid);
+
+out:
+	close(fd);
+	if (err < 0) {
+		for (ckid = 0; ckid < (uint32_t)mnt->mnt_nchunk; ckid++) {
+			if (mnt->mnt_chunkv[ckid] == NULL)
+				continue;
+			pfs_meta_finish_chunk(mnt->mnt_chunkv[ckid]);
+			mnt->mnt_chunkv[ckid] = NULL;
+		}
+	}
+	return err;
+}
+
 int
 pfs_meta_load_all_chunks(pfs_mount_t *mnt)
 {
@@ -1160,7 +1455,11 @@ pfs_meta_load_all_chunks(pfs_mount_t *mnt)
 	for (i = oldnchunk; i < nchunk; i++) {
 		mnt->mnt_chunkv[i] = NULL;
 	}
-	err = pfs_meta_load_chunks_parallel(mnt, oldnchunk, nchunk);
+	err = -ENOENT;
+	if (oldnchunk == 0 && metackpt_usable(mnt))
+		err = pfs_meta_ckpt_load(mnt, phyck);
+	if (err < 0)
+		err = pfs_meta_load_chunks_parallel(mnt, oldnchunk, nchunk);
 	mnt->mnt_disksize = nchunk * PBD_CHUNK_SIZE;
 	return err;
 }
@@ -1625,6 +1924,21 @@ pfs_metaobj_cp(const pfs_metaobj_phy_t *src, pfs_metaobj_phy_t *dest)
 	static void (*pfs_meta_func_array[MT_NTYPE])(const pfs_metaobj_phy_t *,
 	    pfs_metaobj_phy_t *) = {
 	    NULL, pfs_metaobj_cp_blktag, pfs_metaobj_cp_dentry, pfs_metaobj_cp_inode};
+	static const size_t pfs_meta_size_array[MT_NTYPE] = {
+	    0, sizeof(pfs_blktag_phy_t), sizeof(pfs_direntry_phy_t),
+	    sizeof(pfs_inode_phy_t)};
+	size_t size;
+
 	PFS_ASSERT(src->mo_type > 0 && src->mo_type < MT_NTYPE);
 	pfs_meta_func_array[src->mo_type](src, dest);
+
+	/*
+	 * Unused bytes after the typed data are copied as well, so that the
+	 * cached object is the very image in journal. Delta log entries are
+	 * made against it.
+	 */
+	size = pfs_meta_size_array[src->mo_type];
+	if (size < sizeof(src->mo_data))
+		memcpy(&dest->mo_data[size], &src->mo_data[size],
+		    sizeof(src->mo_data) - size);
 }
@@ -144,6 +144,7 @@ typedef	void	pfs_meta_visitfn_t(void *, pfs_metaobj_phy_t *);
 
 int 	pfs_meta_load_all_chunks(pfs_mount_t *mnt);
 void	pfs_meta_finish_chunk(pfs_chunk_t *ck);
+int	pfs_meta_ckpt_save(pfs_mount_t *mnt);
 void	pfs_meta_check_chunk(const pfs_chunk_phy_t *phyck);
 
 pfs_metaobj_phy_t *
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pfs_devstat.h"
+#include "pfs_hist.h"
+#include "pfs_impl.h"
+#include "pfs_memory.h"
+#include "pfs_metrics.h"
+#include "pfs_mount.h"
+#include "pfs_namecache.h"
+#include "pfs_stat.h"
+
+#define	METRICS_LABELSZ		512
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define	METRICS_NQUANTILE \
+	(int)(sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]))
+
+static pfs_metrics_provider_t	*metrics_provider;
+
+/* Label values escape backslash, double quote and newline */
+static void
+metrics_escape(char *dst, size_t dstlen, const char *src)
+{
+	size_t n = 0;
+
+	for (; *src != '\0' && n + 2 < dstlen; src++) {
+		if (*src == '\\' || *src == '"') {
+			dst[n++] = '\\';
+			dst[n++] = *src;
+		} else if (*src == '\n') {
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+		} else {
+			dst[n++] = *src;
+		}
+	}
+	dst[n] = '\0';
+}
+
+static void
+metrics_labels(pfs_metrics_t *m, const char *lname, const char *lvalue,
+    const char *quantile, char *buf, size_t len)
+{
+	char val[128];
+	size_t n;
+
+	n = snprintf(buf, len, "%s", m->m_labels);
+	if (lname != NULL && n < len) {
+		metrics_escape(val, sizeof(val), lvalue);
+		n += snprintf(buf + n, len - n, "%s%s=\"%s\"",
+		    n ? "," : "", lname, val);
+	}
+	if (quantile != NULL && n < len)
+		snprintf(buf + n, len - n, "%squantile=\"%s\"",
+		    n ? "," : "", quantile);
+}
+
+static void
+metrics_sample(pfs_metrics_t *m, const char *name, const char *suffix,
+    const char *labels, const char *val)
+{
+	int rv;
+
+	if (m->m_err < 0)
+		return;
+	if (labels[0] != '\0')
+		rv = pfs_printf(m->m_pr, "%s%s{%s} %s\n", name, suffix, labels,
+		    val);
+	else
+		rv = pfs_printf(m->m_pr, "%s%s %s\n", name, suffix, val);
+	if (rv < 0)
+		m->m_err = rv;
+}
+
+void
+pfs_metrics_family(pfs_metrics_t *m, const char *name, const char *type,
+    const char *help)
+{
+	int rv;
+
+	if (m->m_err < 0)
+		return;
+	rv = pfs_printf(m->m_pr, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+	    name, type);
+	if (rv < 0)
+		m->m_err = rv;
+}
+
+void
+pfs_metrics_u64(pfs_metrics_t *m, const char *name, const char *lname,
+    const char *lvalue, uint64_t val)
+{
+	char labels[METRICS_LABELSZ];
+	char vbuf[32];
+
+	metrics_labels(m, lname, lvalue, NULL, labels, sizeof(labels));
+	snprintf(vbuf, sizeof(vbuf), "%lu", val);
+	metrics_sample(m, name, "", labels, vbuf);
+}
+
+void
+pfs_metrics_double(pfs_metrics_t *m, const char *name, const char *lname,
+    const char *lvalue, double val)
+{
+	char labels[METRICS_LABELSZ];
+	char vbuf[64];
+
+	metrics_labels(m, lname, lvalue, NULL, labels, sizeof(labels));
+	snprintf(vbuf, sizeof(vbuf), "%.6f", val);
+	metrics_sample(m, name, "", labels, vbuf);
+}
+
+/* The histogram is of microseconds, the samples are in seconds */
+void
+pfs_metrics_summary(pfs_metrics_t *m, const char *name, const char *lname,
+    const char *lvalue, const pfs_hist_snap_t *hn)
+{
+	char labels[METRICS_LABELSZ];
+	char qbuf[16], vbuf[32];
+
+	for (int i = 0; i < METRICS_NQUANTILE; i++) {
+		snprintf(qbuf, sizeof(qbuf), "%g", metrics_quantiles[i]);
+		metrics_labels(m, lname, lvalue, qbuf, labels, sizeof(labels));
+		snprintf(vbuf, sizeof(vbuf), "%.6f",
+		    pfs_hist_percentile(hn, metrics_quantiles[i] * 100) /
+		    1000000.0);
+		metrics_sample(m, name, "", labels, vbuf);
+	}
+
+	metrics_labels(m, lname, lvalue, NULL, labels, sizeof(labels));
+	snprintf(vbuf, sizeof(vbuf), "%.6f", hn->hn_allsum / 1000000.0);
+	metrics_sample(m, name, "_sum", labels, vbuf);
+	snprintf(vbuf, sizeof(vbuf), "%lu", hn->hn_alltotal);
+	metrics_sample(m, name, "_count", labels, vbuf);
+}
+
+/* Read without the log lock, a gauge may be one tx behind */
+static void
+metrics_journal(pfs_metrics_t *m, pfs_mount_t *mnt)
+{
+	const pfs_leader_record_t *lr = &mnt->mnt_log.log_leader;
+	uint64_t head, tail;
+
+	head = __atomic_load_n(&lr->head_txid, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&lr->tail_txid, __ATOMIC_RELAXED);
+
+	pfs_metrics_family(m, "pfs_journal_head_txid", "gauge",
+	    "Last txid written to the journal.");
+	pfs_metrics_u64(m, "pfs_journal_head_txid", NULL, NULL, head);
+	pfs_metrics_family(m, "pfs_journal_tail_txid", "gauge",
+	    "Last txid applied to metadata on disk.");
+	pfs_metrics_u64(m, "pfs_journal_tail_txid", NULL, NULL, tail);
+	pfs_metrics_family(m, "pfs_journal_pending_txs", "gauge",
+	    "Txs in the journal not yet trimmed.");
+	pfs_metrics_u64(m, "pfs_journal_pending_txs", NULL, NULL,
+	    head >= tail ? head - tail : 0);
+	pfs_metrics_family(m, "pfs_journal_size_bytes", "gauge",
+	    "Size of the journal file.");
+	pfs_metrics_u64(m, "pfs_journal_size_bytes", NULL, NULL, lr->log_size);
+}
+
+static void
+metrics_namecache(pfs_metrics_t *m)
+{
+	struct namecache_stat ns;
+
+	pfs_namecache_stat(&ns);
+
+	pfs_metrics_family(m, "pfs_namecache_entries", "gauge",
+	    "Names in the name cache.");
+	pfs_metrics_u64(m, "pfs_namecache_entries", NULL, NULL, ns.numcache);
+	pfs_metrics_family(m, "pfs_namecache_lookups_total", "counter",
+	    "Name cache lookups.");
+	pfs_metrics_u64(m, "pfs_namecache_lookups_total", NULL, NULL,
+	    ns.numchecks);
+	pfs_metrics_family(m, "pfs_namecache_hits_total", "counter",
+	    "Name cache lookups that hit.");
+	pfs_metrics_u64(m, "pfs_namecache_hits_total", NULL, NULL, ns.numhits);
+	pfs_metrics_family(m, "pfs_namecache_misses_total", "counter",
+	    "Name cache lookups that missed.");
+	pfs_metrics_u64(m, "pfs_namecache_misses_total", NULL, NULL,
+	    ns.nummiss);
+	pfs_metrics_family(m, "pfs_namecache_evictions_total", "counter",
+	    "Names evicted from the name cache.");
+	pfs_metrics_u64(m, "pfs_namecache_evictions_total", NULL, NULL,
+	    ns.numevicts);
+	pfs_metrics_family(m, "pfs_namecache_rejects_total", "counter",
+	    "Names not cached.");
+	pfs_metrics_u64(m, "pfs_namecache_rejects_total", NULL, NULL,
+	    ns.numrejects);
+}
+
+void
+pfs_metrics_set_provider(pfs_metrics_provider_t *fn)
+{
+	metrics_provider = fn;
+}
+
+/*
+ * Without a mount, only the process wide counters are dumped and the
+ * samples carry no pbd and mount labels. Returns the error of the
+ * printer, e.g. -ENOBUFS if the admin buffer can't be flushed.
+ */
+int
+pfs_metrics_dump(pfs_printer_t *pr, pfs_mount_t *mnt)
+{
+	pfs_metrics_t m;
+	char pbd[PFS_MAX_PBDLEN * 2];
+
+	m.m_pr = pr;
+	m.m_err = 0;
+	m.m_labels[0] = '\0';
+	if (mnt != NULL) {
+		metrics_escape(pbd, sizeof(pbd), mnt->mnt_pbdname);
+		snprintf(m.m_labels, sizeof(m.m_labels),
+		    "pbd=\"%s\",mount=\"%u\"", pbd, mnt->mnt_host_id);
+	}
+
+	pfs_mntstat_metrics(&m);
+	if (mnt != NULL) {
+		metrics_journal(&m, mnt);
+		pfs_devstat_metrics(mnt->mnt_ioch_desc, &m);
+	}
+	metrics_namecache(&m);
+	pfs_mem_metrics(&m);
+	if (metrics_provider != NULL)
+		metrics_provider(&m);
+	return m.m_err;
+}
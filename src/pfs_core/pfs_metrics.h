@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PFS_METRICS_H_
+#define _PFS_METRICS_H_
+
+#include <stdint.h>
+
+#include "pfs_util.h"
+
+/*
+ * Counters in the Prometheus text exposition format, for node agents to
+ * scrape from the admin socket.
+ *
+ * Metric and label names are an interface: add new ones, never rename.
+ * Every sample carries the pbd and mount (host id) labels of the mount
+ * the command was sent to; op, type and the like are added per sample.
+ * Times are in seconds. Summaries are built from latency histograms:
+ * _count and _sum are since start, quantiles since the last reset by
+ * 'pfsadm latency -r'.
+ */
+typedef struct pfs_mount pfs_mount_t;
+typedef struct pfs_hist_snap pfs_hist_snap_t;
+
+typedef struct pfs_metrics {
+	pfs_printer_t	*m_pr;
+	int		m_err;		/* first printer error, stops output */
+	char		m_labels[256];	/* pbd and mount, escaped */
+} pfs_metrics_t;
+
+typedef void pfs_metrics_provider_t(pfs_metrics_t *m);
+
+void	pfs_metrics_family(pfs_metrics_t *m, const char *name,
+	    const char *type, const char *help);
+void	pfs_metrics_u64(pfs_metrics_t *m, const char *name,
+	    const char *lname, const char *lvalue, uint64_t val);
+void	pfs_metrics_double(pfs_metrics_t *m, const char *name,
+	    const char *lname, const char *lvalue, double val);
+void	pfs_metrics_summary(pfs_metrics_t *m, const char *name,
+	    const char *lname, const char *lvalue, const pfs_hist_snap_t *hn);
+
+/* pfsd adds its own counters through this */
+void	pfs_metrics_set_provider(pfs_metrics_provider_t *fn);
+int	pfs_metrics_dump(pfs_printer_t *pr, pfs_mount_t *mnt);
+
+#endif	/* _PFS_METRICS_H_ */
@@ -180,8 +180,8 @@ mountentry_hasname(const mountentry_t *me, const void *data)
 	return mnt && pfs_mount_hasname(mnt, (const char *)data);
 }
 
-#define	INODE_LIST_LOCK(mnt)	mutex_lock(&(mnt)->mnt_inodetree_mtx)
-#define	INODE_LIST_UNLOCK(mnt)	mutex_unlock(&(mnt)->mnt_inodetree_mtx)
+#define	INODE_SHARD_LOCK(sh)	mutex_lock(&(sh)->is_mtx)
+#define	INODE_SHARD_UNLOCK(sh)	mutex_unlock(&(sh)->is_mtx)
 
 static void 	pfs_wait_inited(pfs_mount_t *mnt);
 static void 	pfs_notify_inited(pfs_mount_t *mnt);
@@ -209,6 +209,26 @@ PFS_OPTION_REG(discard_ninp, pfs_check_ival_normal);
 static int64_t poll_interval = 1;
 PFS_OPTION_REG(poll_interval, pfs_check_ival_normal);
 
+/*
+ * Low latency journal notification for RO mounts. When enabled, the
+ * poll thread is woken up at once when a notifier reports a new head
+ * txid, see pfs_mount_notify_head(). Once the head moved, the journal
+ * is probed again at an interval growing from poll_notify_min_us to
+ * poll_notify_max_us to catch the rest of the burst; while it stays
+ * idle, only the poll_interval probe reads the leader record. Read txs
+ * on RO then no longer poll the journal by themselves, as long as the
+ * notifier reports at least once per poll_interval, repeating the head
+ * if need be. Without one, they poll as with notification disabled.
+ */
+static int64_t poll_notify_enable = PFS_OPT_DISABLE;
+PFS_OPTION_REG(poll_notify_enable, pfs_check_ival_switch);
+
+static int64_t poll_notify_min_us = 200;
+PFS_OPTION_REG(poll_notify_min_us, pfs_check_ival_normal);
+
+static int64_t poll_notify_max_us = 20000;
+PFS_OPTION_REG(poll_notify_max_us, pfs_check_ival_normal);
+
 static int64_t orphan_interval = 1;
 PFS_OPTION_REG(orphan_interval, pfs_check_ival_normal);
 
@@ -227,9 +247,22 @@ PFS_OPTION_REG(orphan_select_max_num, pfs_check_ival_orphan_select);
 static int64_t readtx_skip_sync = PFS_OPT_ENABLE;
 PFS_OPTION_REG(readtx_skip_sync, pfs_check_ival_switch);
 
+/*
+ * Unused inodes are kept cached up to inodetree_lru_size per mount. With
+ * inodetree_lru_mem_enable, they are also swapped out once the unused
+ * inodes of a mount and their block and direntry indexes take more than
+ * inodetree_lru_mem_mb. Inodes in use don't count, they can't be swapped
+ * out anyway.
+ */
 static int64_t inodetree_lru_size = 65536;
 PFS_OPTION_REG(inodetree_lru_size, pfs_check_ival_normal);
 
+static int64_t inodetree_lru_mem_enable = PFS_OPT_DISABLE;
+PFS_OPTION_REG(inodetree_lru_mem_enable, pfs_check_ival_switch);
+
+static int64_t inodetree_lru_mem_mb = 1024;
+PFS_OPTION_REG(inodetree_lru_mem_mb, pfs_check_ival_normal);
+
 static int
 pfs_load_log(pfs_mount_t *mnt)
 {
@@ -250,6 +283,30 @@ pfs_load_log(pfs_mount_t *mnt)
 	return 0;
 }
 
+static inline bool
+pfs_mount_notifiable(pfs_mount_t *mnt)
+{
+	return poll_notify_enable == PFS_OPT_ENABLE && !pfs_writable(mnt);
+}
+
+/* A notifier has reported lately, read txs may leave the poll to it */
+static inline bool
+pfs_mount_notified(pfs_mount_t *mnt)
+{
+	uint64_t ts = __atomic_load_n(&mnt->mnt_notify_ts, __ATOMIC_RELAXED);
+
+	if (!pfs_mount_notifiable(mnt) || ts == 0)
+		return false;
+	return gettimeofday_us() - ts <= (uint64_t)poll_interval * 1000000;
+}
+
+static inline uint64_t
+pfs_mount_head_txid(pfs_mount_t *mnt)
+{
+	return __atomic_load_n(&mnt->mnt_log.log_leader.head_txid,
+	    __ATOMIC_ACQUIRE);
+}
+
 bool
 pfs_mount_needsync(pfs_mount_t *mnt)
 {
@@ -257,9 +314,11 @@ pfs_mount_needsync(pfs_mount_t *mnt)
 
 	/*
 	 * Issuing a poll request when read tx begins in two cases:
-	 * 1. on RO.
+	 * 1. on RO, unless a notifier tells the poll thread of new entries.
 	 * 2. on RW but configured not to skip.
 	 */
+	if (pfs_mount_notified(mnt))
+		return false;
 	return !pfs_writable(mnt) || !skip;
 }
 
@@ -293,31 +352,114 @@ pfs_mount_signal_sync(pfs_mount_t *mnt)
 	mutex_unlock(&mnt->mnt_poll_mtx);
 }
 
+/*
+ * pfs_mount_notify_head:
+ *
+ *	Called by a journal notifier when the writer has committed up to
+ *	@head_txid. The poll thread is kicked only if the head has moved
+ *	beyond what is replayed locally, so a notifier may repeat itself,
+ *	and has to at least once per poll_interval to stay in charge.
+ */
+void
+pfs_mount_notify_head(pfs_mount_t *mnt, uint64_t head_txid)
+{
+	__atomic_store_n(&mnt->mnt_notify_ts, gettimeofday_us(),
+	    __ATOMIC_RELAXED);
+	if ((int64_t)(head_txid - pfs_mount_head_txid(mnt)) <= 0)
+		return;
+	pfs_mount_signal_sync(mnt);
+}
+
+static void
+pfs_poll_deadline(struct timespec *ts, int64_t intvl_us)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += intvl_us / 1000000;
+	ts->tv_nsec += (intvl_us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int
+pfs_poll_wait(pfs_mount_t *mnt, const struct timespec *ts, bool rearm,
+    bool *flushp)
+{
+	pfs_inode_t *in;
+	struct timespec fts;
+	const struct timespec *dl;
+	uint64_t due;
+	int err = 0;
+
+	*flushp = false;
+	mutex_lock(&mnt->mnt_poll_mtx);
+	if (rearm)
+		mnt->mnt_poll_sync = false;
+	while (err == 0 && !mnt->mnt_poll_stop && !mnt->mnt_poll_sync) {
+		/*
+		 * Wake up earlier if the oldest deferred size change
+		 * is due before the poll.
+		 */
+		dl = ts;
+		in = TAILQ_FIRST(&mnt->mnt_wmlist);
+		if (in != NULL) {
+			due = in->in_write_modify.wm_parkts + file_defer_size_us;
+			fts.tv_sec = due / 1000000;
+			fts.tv_nsec = (due % 1000000) * 1000;
+			if (fts.tv_sec < ts->tv_sec || (fts.tv_sec == ts->tv_sec &&
+			    fts.tv_nsec < ts->tv_nsec))
+				dl = &fts;
+		}
+		err = pthread_cond_timedwait(&mnt->mnt_poll_cond,
+		    &mnt->mnt_poll_mtx, dl);
+		if (err == ETIMEDOUT && dl == &fts) {
+			*flushp = true;
+			err = 0;
+			break;
+		}
+	}
+	mutex_unlock(&mnt->mnt_poll_mtx);
+	return err;
+}
+
 static void *
 pfs_poll_thread_entry(void *arg)
 {
 	pfs_mount_t *mnt = (pfs_mount_t *)arg;
 	struct timespec ts;
+	int64_t intvl_us;
+	uint64_t head_txid;
+	bool notify, flush;
 	int err;
 
-	pfs_itrace("poll thread starts, period = %ds\n", poll_interval);
+	pfs_itrace("poll thread starts, period = %ds, notify %s\n",
+	    poll_interval, pfs_mount_notifiable(mnt) ? "on" : "off");
 
 	pfs_wait_inited(mnt);
 	if (pfs_init_failed(mnt))
 		return NULL;
+	intvl_us = 0;
+	flush = false;
         for (;;) {
-                clock_gettime(CLOCK_REALTIME, &ts);
-                ts.tv_sec += poll_interval;
-                err = 0;
-                mutex_lock(&mnt->mnt_poll_mtx);
-                mnt->mnt_poll_sync = false;
-                while (err == 0 && !mnt->mnt_poll_stop && !mnt->mnt_poll_sync)
-                        err = pthread_cond_timedwait(&mnt->mnt_poll_cond,
-                            &mnt->mnt_poll_mtx, &ts);
-                mutex_unlock(&mnt->mnt_poll_mtx);
-
-                if (mnt->mnt_poll_stop)
+		/* keep the poll deadline across deferred size flushes */
+		if (!flush) {
+			notify = pfs_mount_notifiable(mnt);
+			pfs_poll_deadline(&ts, (notify && intvl_us > 0) ?
+			    intvl_us : poll_interval * 1000000);
+		}
+		err = pfs_poll_wait(mnt, &ts, !flush, &flush);
+
+                if (mnt->mnt_poll_stop) {
+			/* don't leave size changes behind */
+			pfs_file_flush_deferred(mnt, true);
                         break;
+		}
+
+		if (flush) {
+			pfs_file_flush_deferred(mnt, false);
+			continue;
+		}
 
                 if (err && err != ETIMEDOUT) {
                         pfs_etrace("poll thread wait error %d, %s\n", err,
@@ -325,9 +467,22 @@ pfs_poll_thread_entry(void *arg)
                         continue;
                 }
 
+		head_txid = pfs_mount_head_txid(mnt);
 		err = pfs_mount_sync(mnt);
 		if (err != 0)
 			pfs_etrace("poll thread poll error %d\n", err);
+
+		/*
+		 * Poll again soon after the head moved, and back off while
+		 * the journal stays idle. Past poll_notify_max_us, stop the
+		 * fast probes: the leader is then read once per poll_interval
+		 * or when the notifier reports a new head.
+		 */
+		if (pfs_mount_head_txid(mnt) != head_txid)
+			intvl_us = poll_notify_min_us;
+		else if (intvl_us > 0)
+			intvl_us = (intvl_us * 2 <= poll_notify_max_us) ?
+			    intvl_us * 2 : 0;
         }
 	pfs_itrace("poll thread stops\n");
 
@@ -447,9 +602,15 @@ pfs_create_mount(const char *cluster, const char *pbdname, int host_id,
 	mnt->mnt_nchunk = 0;
 	mnt->mnt_chunkv = NULL;
 	mnt->mnt_admin = NULL;
-	pfs_avl_create(&mnt->mnt_inodetree, pfs_inode_compare,
-	    offsetof(pfs_inode_t, in_node));
-	TAILQ_INIT(&mnt->mnt_inodelist);
+	for (i = 0; i < PFS_INODE_NSHARD; i++) {
+		pfs_inode_shard_t *sh = &mnt->mnt_inodeshard[i];
+
+		mutex_init(&sh->is_mtx);
+		pfs_avl_create(&sh->is_tree, pfs_inode_compare,
+		    offsetof(pfs_inode_t, in_node));
+		TAILQ_INIT(&sh->is_lru);
+		sh->is_lrumem = 0;
+	}
 	mnt->mnt_host_id = host_id;
 	mnt->mnt_host_generation = 0;
 	mnt->mnt_num_hosts = 0;
@@ -457,7 +618,9 @@ pfs_create_mount(const char *cluster, const char *pbdname, int host_id,
 	mnt->mnt_log.log_mount = mnt;
 	mnt->mnt_poll_stop = false;
 	mnt->mnt_poll_sync = false;
+	mnt->mnt_notify_ts = 0;
 	mnt->mnt_poll_tid = 0;
+	TAILQ_INIT(&mnt->mnt_wmlist);
 	mnt->mnt_run_version = (uint64_t)-1;
 	mnt->mnt_disk_version = 0;
 
@@ -472,7 +635,6 @@ pfs_create_mount(const char *cluster, const char *pbdname, int host_id,
 	mnt->mnt_stat_tid = 0;
 	mnt->mnt_stat_stop = false;
 	rwlock_init(&mnt->mnt_meta_rwlock, NULL);
-	mutex_init(&mnt->mnt_inodetree_mtx);
 	mutex_init(&mnt->mnt_inited_mtx);
 	cond_init(&mnt->mnt_inited_cond, NULL);
 	mutex_init(&mnt->mnt_poll_mtx);
@@ -539,29 +701,14 @@ out:
 	return err;
 }
 
-/*
- * pfs_destroy_mount:
- *
- *	Start destroying all refered objects and finally destroy the mount
- *	itself. The implementation should be safe even if some refered objects
- *	have not been initialized.
- */
 static void
-pfs_destroy_mount(pfs_mount_t *mnt)
+pfs_inode_shard_destroy(pfs_inode_shard_t *sh)
 {
-	int i;
-
-	/*
-	 * All opened files must be closed.
-	 * Otherwisw, we shall destroy all nodes by pfs_avl_destroy_nodes()
-	 */
-	//PFS_ASSERT(pfs_avl_is_empty(&mnt->mnt_inodetree));
-
-	pfs_inode_t *in = (pfs_inode_t *)pfs_avl_first(&mnt->mnt_inodetree);
+	pfs_inode_t *in = (pfs_inode_t *)pfs_avl_first(&sh->is_tree);
 	while (in != NULL) {
 		pfs_inode_t *tmp = in;
-		in = (pfs_inode_t *)pfs_avl_next(&mnt->mnt_inodetree, in);
-		pfs_avl_remove(&mnt->mnt_inodetree, tmp);
+		in = (pfs_inode_t *)pfs_avl_next(&sh->is_tree, in);
+		pfs_avl_remove(&sh->is_tree, tmp);
 		// FIXME
 		// Dir-index maintain the reference across inodes in the form
 		// of pfs_dxent_t->e_in (see 77ddaef8 for details).
@@ -575,7 +722,28 @@ pfs_destroy_mount(pfs_mount_t *mnt)
 		// of inode.
 		pfs_inode_destroy_self(tmp);
 	}
-	pfs_avl_destroy(&mnt->mnt_inodetree);
+	pfs_avl_destroy(&sh->is_tree);
+	mutex_destroy(&sh->is_mtx);
+}
+
+/*
+ * pfs_destroy_mount:
+ *
+ *	Start destroying all refered objects and finally destroy the mount
+ *	itself. The implementation should be safe even if some refered objects
+ *	have not been initialized.
+ */
+static void
+pfs_destroy_mount(pfs_mount_t *mnt)
+{
+	int i;
+
+	/*
+	 * All opened files must be closed.
+	 * Otherwisw, we shall destroy all nodes by pfs_avl_destroy_nodes()
+	 */
+	for (i = 0; i < PFS_INODE_NSHARD; i++)
+		pfs_inode_shard_destroy(&mnt->mnt_inodeshard[i]);
 
 	/* destroy the anode */
 	pfs_anode_destroy(&mnt->mnt_anode[MT_BLKTAG]);
@@ -598,7 +766,6 @@ pfs_destroy_mount(pfs_mount_t *mnt)
 
 	// destory pfs read/write lock
 	rwlock_destroy(&mnt->mnt_meta_rwlock);
-	mutex_destroy(&mnt->mnt_inodetree_mtx);
 	mutex_destroy(&mnt->mnt_inited_mtx);
 	cond_destroy(&mnt->mnt_inited_cond);
 	mutex_destroy(&mnt->mnt_poll_mtx);
@@ -887,8 +1054,11 @@ pfs_umount(const char *pbdname)
 	pfs_poll_stop(mnt);
 
 	pfs_memdir_unload(mnt);
-	if (mnt->mnt_log.log_file)
+	if (mnt->mnt_log.log_file) {
 		pfs_log_stop(&mnt->mnt_log);
+		/* all txs up to head have been replayed, save the image */
+		pfs_meta_ckpt_save(mnt);
+	}
 
 	pfs_namecache_clear_mount(mnt);
 	pfs_leader_unload(mnt);
@@ -944,25 +1114,48 @@ pfs_put_mount(pfs_mount_t *mnt)
 	mountentry_unlock(me);
 }
 
+static inline pfs_inode_shard_t *
+pfs_inode_shard(pfs_mount_t *mnt, pfs_ino_t ino)
+{
+	/* Fibonacci hashing, consecutive inos land on different shards */
+	uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+
+	return &mnt->mnt_inodeshard[h >> 60];
+}
+
+static bool
+pfs_inode_shard_full(pfs_inode_shard_t *sh)
+{
+	if ((int64_t)pfs_avl_numnodes(&sh->is_tree) * PFS_INODE_NSHARD >
+	    inodetree_lru_size)
+		return true;
+	return inodetree_lru_mem_enable == PFS_OPT_ENABLE &&
+	    (int64_t)sh->is_lrumem * PFS_INODE_NSHARD >
+	    (inodetree_lru_mem_mb << 20);
+}
+
 pfs_inode_t *
 pfs_get_inode(pfs_mount_t *mnt, pfs_ino_t ino)
 {
+	pfs_inode_shard_t *sh = pfs_inode_shard(mnt, ino);
 	pfs_inode_t fin, *in;
 	MNT_STAT_BEGIN();
 	fin.in_ino = ino;
-	INODE_LIST_LOCK(mnt);
-	in = (pfs_inode_t *)pfs_avl_find(&mnt->mnt_inodetree, &fin, NULL);
+	INODE_SHARD_LOCK(sh);
+	in = (pfs_inode_t *)pfs_avl_find(&sh->is_tree, &fin, NULL);
 	if (in != NULL) {
 		++in->in_refcnt;
 		if (in->in_refcnt == 1) {
+			sh->is_lrumem -= in->in_lrumem;
+			in->in_lrumem = 0;
 			//Move "in" to tail so that do not disturb "head" swap
 			//out.
-			TAILQ_REMOVE(&mnt->mnt_inodelist, in, in_next);
-			TAILQ_INSERT_TAIL(&mnt->mnt_inodelist, in, in_next);
+			TAILQ_REMOVE(&sh->is_lru, in, in_next);
+			TAILQ_INSERT_TAIL(&sh->is_lru, in, in_next);
 		}
 	}
 
-	INODE_LIST_UNLOCK(mnt);
+	INODE_SHARD_UNLOCK(sh);
 	MNT_STAT_END(MNT_STAT_CONTAINER_INODE_GET);
 	return in;
 }
@@ -970,52 +1163,63 @@ pfs_get_inode(pfs_mount_t *mnt, pfs_ino_t ino)
 void
 pfs_put_inode(pfs_mount_t *mnt, pfs_inode_t *in)
 {
-	bool need_free = false;
+	pfs_inode_shard_t *sh;
+	pfs_inode_t *next;
+	TAILQ_HEAD(, pfs_inode) victims = TAILQ_HEAD_INITIALIZER(victims);
 	PFS_ASSERT(in != NULL);
 	MNT_STAT_BEGIN();
-	INODE_LIST_LOCK(mnt);
+	sh = pfs_inode_shard(mnt, in->in_ino);
+	INODE_SHARD_LOCK(sh);
 	--in->in_refcnt;
-	if ((int)pfs_avl_numnodes(&mnt->mnt_inodetree) <=
-	    inodetree_lru_size) {
-		if (in->in_refcnt == 0) {
-			//make in easier to be swap out.
-			TAILQ_REMOVE(&mnt->mnt_inodelist, in, in_next);
-			TAILQ_INSERT_HEAD(&mnt->mnt_inodelist, in, in_next);
-		}
-	} else {
-		if (in->in_refcnt != 0) {
-			//choose a candidate to be swap out.
-			in = TAILQ_FIRST(&mnt->mnt_inodelist);
-			if (in->in_refcnt != 0)
-				in = NULL;
-		}
-
-		if (in != NULL) {
-			pfs_avl_remove(&mnt->mnt_inodetree, in);
-			TAILQ_REMOVE(&mnt->mnt_inodelist, in, in_next);
-			need_free = true;
-		}
+	if (in->in_refcnt == 0) {
+		in->in_lrumem = pfs_inode_memsize(in);
+		sh->is_lrumem += in->in_lrumem;
+		//make in easier to be swap out.
+		TAILQ_REMOVE(&sh->is_lru, in, in_next);
+		TAILQ_INSERT_HEAD(&sh->is_lru, in, in_next);
 	}
-	INODE_LIST_UNLOCK(mnt);
-	if (need_free)
+
+	/*
+	 * swap out from the head until under the targets or it is in use.
+	 * An inode whose size change is parked is skipped, the change would
+	 * be lost with it; the poll thread commits it later.
+	 */
+	next = TAILQ_FIRST(&sh->is_lru);
+	while (pfs_inode_shard_full(sh)) {
+		in = next;
+		if (in == NULL || in->in_refcnt != 0)
+			break;
+		next = TAILQ_NEXT(in, in_next);
+		if (in->in_write_modify.wm_parkts != 0)
+			continue;
+		pfs_avl_remove(&sh->is_tree, in);
+		TAILQ_REMOVE(&sh->is_lru, in, in_next);
+		sh->is_lrumem -= in->in_lrumem;
+		TAILQ_INSERT_TAIL(&victims, in, in_next);
+	}
+	INODE_SHARD_UNLOCK(sh);
+	while ((in = TAILQ_FIRST(&victims)) != NULL) {
+		TAILQ_REMOVE(&victims, in, in_next);
 		pfs_inode_destroy(in);
+	}
 	MNT_STAT_END(MNT_STAT_CONTAINER_INODE_PUT);
 }
 
 pfs_inode_t *
 pfs_add_inode(pfs_mount_t *mnt, pfs_inode_t *in)
 {
+	pfs_inode_shard_t *sh = pfs_inode_shard(mnt, in->in_ino);
 	pfs_inode_t *in2;
 
-	INODE_LIST_LOCK(mnt);
-	in2 = (pfs_inode_t *)pfs_avl_find(&mnt->mnt_inodetree, in, NULL);
+	INODE_SHARD_LOCK(sh);
+	in2 = (pfs_inode_t *)pfs_avl_find(&sh->is_tree, in, NULL);
 	if (in2 == NULL) {
-		pfs_avl_add(&mnt->mnt_inodetree, in);
+		pfs_avl_add(&sh->is_tree, in);
 		//make in hard to be swap out.
-		TAILQ_INSERT_TAIL(&mnt->mnt_inodelist, in, in_next);
+		TAILQ_INSERT_TAIL(&sh->is_lru, in, in_next);
 		in2 = in;
 	}
-	INODE_LIST_UNLOCK(mnt);
+	INODE_SHARD_UNLOCK(sh);
 
 	return in2;
 }
@@ -60,16 +60,29 @@ typedef struct nameinfo 	nameinfo_t;
 typedef struct admin_info	admin_info_t;
 
 /*
- * (I) 	inode mutex lock
+ * Cached inodes are spread over shards by ino hash, each with its own
+ * lock and LRU, so gets and puts of different files don't serialize.
+ *
+ * (S)	shard mutex lock
+ */
+#define	PFS_INODE_NSHARD	16
+
+typedef struct pfs_inode_shard {
+	pthread_mutex_t	is_mtx;
+	TAILQ_HEAD(, pfs_inode) is_lru;	/* (S) head is swapped out first */
+	pfs_avl_tree_t	is_tree;	/* (S) */
+	size_t		is_lrumem;	/* (S) memory of unused inodes */
+} __attribute__((aligned(64))) pfs_inode_shard_t;
+
+/*
+ * (I) 	inode shard mutex lock
  * (M)	meta data rw lock
  */
 typedef struct pfs_mount {
 	int		mnt_id;
 	int64_t		mnt_epoch;
 
-	pthread_mutex_t	mnt_inodetree_mtx;
-	TAILQ_HEAD(, pfs_inode) mnt_inodelist;	/* destack helper for swap out*/
-	pfs_avl_tree_t	mnt_inodetree;		/* (I) */
+	pfs_inode_shard_t mnt_inodeshard[PFS_INODE_NSHARD];	/* (I) */
 
 	int		mnt_flags;		/* flags set by user, whether
 						   enable modules. */
@@ -116,6 +129,8 @@ typedef struct pfs_mount {
 	pthread_t	mnt_poll_tid;
 	int		mnt_poll_stop;
 	int		mnt_poll_sync;
+	uint64_t	mnt_notify_ts;		/* last head notified in us, or 0 */
+	TAILQ_HEAD(, pfs_inode) mnt_wmlist;	/* inodes with parked writemodify */
 
 	pthread_mutex_t	mnt_discard_mtx;
 	pthread_cond_t	mnt_discard_cond;
@@ -170,6 +185,7 @@ int		pfs_mount_block_isused(pfs_mount_t *mnt, uint64_t btno);
 bool		pfs_mount_needsync(pfs_mount_t *mnt);
 int 		pfs_mount_sync(pfs_mount_t *mnt);
 void		pfs_mount_signal_sync(pfs_mount_t *mnt);
+void		pfs_mount_notify_head(pfs_mount_t *mnt, uint64_t head_txid);
 int 		pfs_mount_flush(pfs_mount_t *mnt);
 
 int		pfs_bd_compare(const void *keya, const void *keyb);
@@ -16,6 +16,8 @@
 #include <sys/time.h>
 
 #include "pfs_stat.h"
+#include "pfs_hist.h"
+#include "pfs_metrics.h"
 #include "pfs_mount.h"
 #include "pfs_impl.h"
 #include "pfs_admin.h"
@@ -45,6 +47,10 @@ static uint32_t mount_file_type_stat_iosize
 
 static uint32_t mount_threads_stat[MNT_STAT_SIZE][MNT_STAT_TH_TYPE_COUNT];
 
+/* latency distribution since start or the last reset, not per second */
+static pfs_hist_t mount_hist[MNT_STAT_TYPE_COUNT];
+static pfs_hist_t mount_api_hist[MNT_STAT_FILE_SPEC_TYPE_COUNT];
+
 static int mountstat_nthreads = 0;
 
 typedef struct {
@@ -92,6 +98,7 @@ static const char* mountstat_name[MNT_STAT_TYPE_COUNT] = {
     "dev_read",
     "dev_write",
     "dev_trim",
+    "dev_flush",
     "meta_rdlock",
     "meta_wrlock",
 };
@@ -335,6 +342,7 @@ pfs_mntstat_store(struct timeval* stat_begin, struct timeval* stat_end,
 	    stat_end->tv_usec - stat_begin->tv_usec;
 	if (!file_type_spec) {
 		pfs_stat_add(stat_end->tv_sec, stat_type, stat_latency);
+		pfs_hist_record(&mount_hist[stat_type], stat_latency);
 		if (stat_type == MNT_STAT_DEV_READ) {
 			stat_type = MNT_STAT_BACK_READ;
 			file_type_spec = true;
@@ -347,6 +355,8 @@ pfs_mntstat_store(struct timeval* stat_begin, struct timeval* stat_end,
 		}
 	}
 	if (file_type_spec) {
+		PFS_VERIFY(stat_type < MNT_STAT_FILE_SPEC_TYPE_COUNT);
+		pfs_hist_record(&mount_api_hist[stat_type], stat_latency);
 		file_type = pfs_tls_get_stat_file_type();
 		if (FILE_PFS_INITED == file_type)
 			return;
@@ -476,6 +486,61 @@ pfs_mntstat_snap(admin_buf_t *ab, int64_t begin_time, int64_t time_range,
 	return err;
 }
 
+int
+pfs_mntstat_hist_snap(admin_buf_t *ab, const char *pattern,
+    const double *pcts, int npct, bool reset)
+{
+	pfs_hist_snap_t hn;
+	char name[64];
+	int i;
+
+	for (i = 0; i < MNT_STAT_TYPE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "mount.%s", mountstat_name[i]);
+		if (pattern[0] != '\0' && strstr(name, pattern) == NULL)
+			continue;
+		pfs_hist_merge(&mount_hist[i], &hn);
+		if (reset)
+			pfs_hist_reset(&mount_hist[i]);
+		if (hn.hn_total != 0)
+			pfs_hist_print(ab, name, &hn, pcts, npct);
+	}
+	for (i = 0; i < MNT_STAT_FILE_SPEC_TYPE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "api.%s", mountstat_api_name[i]);
+		if (pattern[0] != '\0' && strstr(name, pattern) == NULL)
+			continue;
+		pfs_hist_merge(&mount_api_hist[i], &hn);
+		if (reset)
+			pfs_hist_reset(&mount_api_hist[i]);
+		if (hn.hn_total != 0)
+			pfs_hist_print(ab, name, &hn, pcts, npct);
+	}
+	return 0;
+}
+
+void
+pfs_mntstat_metrics(pfs_metrics_t *m)
+{
+	pfs_hist_snap_t hn;
+	int i;
+
+	pfs_metrics_family(m, "pfs_op_latency_seconds", "summary",
+	    "Latency of internal operations, quantiles since start or reset.");
+	for (i = 0; i < MNT_STAT_TYPE_COUNT; ++i) {
+		pfs_hist_merge(&mount_hist[i], &hn);
+		if (hn.hn_alltotal != 0)
+			pfs_metrics_summary(m, "pfs_op_latency_seconds",
+			    "op", mountstat_name[i], &hn);
+	}
+	pfs_metrics_family(m, "pfs_api_latency_seconds", "summary",
+	    "Latency of file api calls, quantiles since start or reset.");
+	for (i = 0; i < MNT_STAT_FILE_SPEC_TYPE_COUNT; ++i) {
+		pfs_hist_merge(&mount_api_hist[i], &hn);
+		if (hn.hn_alltotal != 0)
+			pfs_metrics_summary(m, "pfs_api_latency_seconds",
+			    "op", mountstat_api_name[i], &hn);
+	}
+}
+
 int
 pfs_mntstat_sample(char* sample_pattern, int sample_pattern_len)
 {
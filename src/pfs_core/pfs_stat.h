@@ -55,6 +55,7 @@ enum {
 	MNT_STAT_DEV_READ,
 	MNT_STAT_DEV_WRITE,
 	MNT_STAT_DEV_TRIM,
+	MNT_STAT_DEV_FLUSH,
 
 	MNT_STAT_META_RDLOCK,
 	MNT_STAT_META_WRLOCK,
@@ -99,6 +100,7 @@ enum {
 
 struct timeval;
 typedef struct admin_buf admin_buf_t;
+typedef struct pfs_metrics pfs_metrics_t;
 
 void pfs_mntstat_init();
 void pfs_mntstat_prepare(struct timeval* stat_begin, int api_type);
@@ -114,6 +116,9 @@ void pfs_mntstat_nthreads_change(int delta);
 int pfs_mntstat_snap(admin_buf_t *ab, int64_t begin_time,
     int64_t time_range, char* file_type_pattern, int file_type_pattern_len);
 int pfs_mntstat_sample(char* sample_pattern, int sample_pattern_len);
+int pfs_mntstat_hist_snap(admin_buf_t *ab, const char *pattern,
+    const double *pcts, int npct, bool reset);
+void pfs_mntstat_metrics(pfs_metrics_t *m);
 
 #define MNT_STAT_CLEAR() pfs_mntstat_clear()
 
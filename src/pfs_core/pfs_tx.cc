@@ -32,9 +32,19 @@
 #include "pfs_log.h"
 #include "pfs_trace.h"
 #include "pfs_stat.h"
+#include "pfs_option.h"
+#include "pfs_version.h"
 
 #define	TX_DEBUG_VERBOSE 0
 
+/*
+ * Max number of replay txs applied while holding the meta wrlock.
+ * Every tx boundary is a consistent meta state, so the lock is
+ * dropped between batches to let readers in during a long replay.
+ */
+static int64_t replay_batch_ntx = 32;
+PFS_OPTION_REG(replay_batch_ntx, pfs_check_ival_normal);
+
 /*
  * Tx is to protect the integrity of meta data. A read tx acquires the
  * rdlock of meta data before reading, and simply releases it after
@@ -67,6 +77,7 @@
 #define	TOP_FLG_RECREATE	0x00000001	/* the txop is recreated from log */
 #define	TOP_FLG_INITED		0x00000002	/* undo flag: top old is set */
 #define	TOP_FLG_DONE		0x00000004	/* undo flag: top new is set */
+#define	TOP_FLG_DELTA		0x00000008	/* top_remote is partially set */
 
 static pfs_txop_t *pfs_tx_index_op(pfs_tx_t *tx, pfs_metaobj_phy_t *mo);
 static pfs_metaobj_phy_t *pfs_tx_find_mo(pfs_tx_t *tx, pfs_metaobj_phy_t *mo);
@@ -221,6 +232,59 @@ pfs_txop_recreate(pfs_tx_t *tx, pfs_logentry_phy_t *le, const char *func,
 	return top;
 }
 
+/*
+ * pfs_txop_recreate_rec:
+ *
+ *	Recreate a transaction op from a delta record @lr of a pack slot.
+ *	Only the bytes marked in top_dmask are valid in top_remote until
+ *	the op is redone on its base object.
+ */
+static pfs_txop_t *
+pfs_txop_recreate_rec(pfs_tx_t *tx, const pfs_logrec_phy_t *lr,
+    const char *func, const char *name, int line)
+{
+	pfs_txop_t *top;
+	const uint8_t *p;
+	int i, off, len;
+
+	top = (pfs_txop_t *)pfs_mem_malloc(sizeof(*top), M_TXOP);
+	if (top) {
+		memset(top, 0, sizeof(*top));
+		top->top_tx = tx;
+		top->top_flags |= TOP_FLG_RECREATE | TOP_FLG_DELTA;
+
+		top->top_func = func;
+		top->top_name = name;
+		top->top_line = line;
+		top->top_cb = NULL;
+
+		top->top_buf = NULL;
+		top->top_idx = lr->lr_obj_idx;
+		top->top_bda = lr->lr_sector_bda;
+		top->top_basecrc = lr->lr_basecrc;
+		top->top_remote.mo_number = lr->lr_obj_number;
+		top->top_remote.mo_type = lr->lr_obj_type;
+		PFS_ASSERT(top->top_remote.mo_type != MT_NONE);
+
+		p = (const uint8_t *)(lr + 1);
+		for (i = 0; i < lr->lr_nrange; i++) {
+			off = p[0];
+			len = p[1];
+			PFS_ASSERT(off + len <= (int)sizeof(pfs_metaobj_phy_t));
+			memcpy((char *)&top->top_remote + off,
+			    p + LOGREC_RANGEHDR, len);
+			for (; len > 0; off++, len--)
+				top->top_dmask[off / 64] |= 1ULL << (off % 64);
+			p += LOGREC_RANGEHDR + p[1];
+		}
+		PFS_ASSERT(p == (const uint8_t *)lr + lr->lr_len);
+
+		top->top_dup_head = NULL;
+		top->top_shadow = NULL;
+	}
+	return top;
+}
+
 static void
 pfs_txop_update(pfs_txop_t *top, pfs_txop_callback_t *cb)
 {
@@ -270,6 +334,62 @@ pfs_txop_log(pfs_txop_t *top, pfs_lsn_t lsn, pfs_logentry_phy_t *le)
 #endif
 }
 
+/*
+ * pfs_txop_logrec:
+ *
+ *	Encode the change of @top against the object in meta cache, which
+ *	is still the image before the tx, as a delta record into @rec.
+ *	Return the record length, or -1 if a full log entry should be used.
+ */
+int
+pfs_txop_logrec(pfs_txop_t *top, char *rec, int reclen)
+{
+	const pfs_metaobj_phy_t *base = top->top_buf + top->top_idx;
+	const uint8_t *old = (const uint8_t *)base;
+	const uint8_t *cur = (const uint8_t *)&top->top_local;
+	pfs_logrec_phy_t *lr = (pfs_logrec_phy_t *)rec;
+	int i, j, gap, len;
+	const int n = sizeof(pfs_metaobj_phy_t);
+
+	PFS_ASSERT(top->top_flags & TOP_FLG_DONE);
+
+	/* base without checksum can't be identified by replayers */
+	if (base->mo_checksum == 0 || top->top_idx > UINT8_MAX)
+		return -1;
+
+	memset(lr, 0, sizeof(*lr));
+	lr->lr_sector_bda = top->top_bda;
+	lr->lr_obj_number = top->top_local.mo_number;
+	lr->lr_basecrc = base->mo_checksum;
+	lr->lr_obj_idx = top->top_idx;
+	lr->lr_obj_type = top->top_local.mo_type;
+	len = sizeof(*lr);
+	for (i = 0; i < n; i = j) {
+		if (old[i] == cur[i]) {
+			j = i + 1;
+			continue;
+		}
+
+		/*
+		 * Unchanged gaps shorter than a range header are cheaper
+		 * to carry than to split the range on.
+		 */
+		for (j = i + 1, gap = 0; j < n && gap < LOGREC_RANGEHDR; j++)
+			gap = (old[j] == cur[j]) ? gap + 1 : 0;
+		j -= gap;
+
+		if (len + LOGREC_RANGEHDR + (j - i) > reclen)
+			return -1;
+		rec[len] = i;
+		rec[len + 1] = j - i;
+		memcpy(&rec[len + LOGREC_RANGEHDR], &cur[i], j - i);
+		len += LOGREC_RANGEHDR + (j - i);
+		lr->lr_nrange++;
+	}
+	lr->lr_len = len;
+	return len;
+}
+
 /*
  * pfs_txop_rollback
  *
@@ -326,6 +446,23 @@ pfs_txop_destroy(pfs_txop_t *top)
 	} while (top);
 }
 
+/*
+ * Fill the bytes not carried by a delta record from its base object.
+ */
+static void
+pfs_txop_patch(pfs_txop_t *top, const pfs_metaobj_phy_t *mo)
+{
+	uint8_t *dst = (uint8_t *)&top->top_remote;
+	const uint8_t *src = (const uint8_t *)mo;
+	size_t i;
+
+	for (i = 0; i < sizeof(*mo); i++) {
+		if ((top->top_dmask[i / 64] & (1ULL << (i % 64))) == 0)
+			dst[i] = src[i];
+	}
+	top->top_flags &= ~TOP_FLG_DELTA;
+}
+
 int
 pfs_txop_redo(pfs_txop_t *top, pfs_metaobj_phy_t *mo, void *buf)
 {
@@ -339,6 +476,24 @@ pfs_txop_redo(pfs_txop_t *top, pfs_metaobj_phy_t *mo, void *buf)
 	PFS_ASSERT(top->top_buf == NULL);
 	top->top_buf = (pfs_metaobj_phy_t *)buf;
 
+	if (top->top_flags & TOP_FLG_DELTA) {
+		if (mo->mo_checksum != top->top_basecrc) {
+			/*
+			 * The object isn't the image the delta was made
+			 * against. That happens when a trim wrote the
+			 * sector but crashed before moving the journal
+			 * tail: the object on disk is already newer, and
+			 * the records after it will apply again.
+			 */
+			pfs_itrace("skip delta of mo %lu, crc %u vs base %u\n",
+			    mo->mo_number, mo->mo_checksum, top->top_basecrc);
+			top->top_remote = *mo;
+			return 0;
+		}
+		pfs_txop_patch(top, mo);
+		pfs_metaobj_check_crc(&top->top_remote);
+	}
+
 	nfree_delta = mo->mo_used - top->top_remote.mo_used;
 	*mo = top->top_remote;
 	return nfree_delta;
@@ -420,14 +575,48 @@ pfs_txop_do_callback(pfs_txop_t *top, pfs_metaobj_phy_t *mo, int err)
 	}
 }
 
+static int
+pfs_tx_log_flush(pfs_log_t *log, char *buf, int buflen, uint64_t *lenp,
+    uint64_t *offsetp)
+{
+	int rv;
+
+	/*
+	 * Ensure there is buffer space to write at least one log entry.
+	 * Otherwise, flush the bufer to free space.
+	 */
+	if (*lenp < (uint64_t)buflen)
+		return 0;
+	PFS_ASSERT(*lenp == (uint64_t)buflen);
+	rv = pfs_log_write(log, buf, *lenp, *offsetp);
+	if (rv < 0)
+		return rv;
+	memset(buf, 0, buflen);
+	*lenp = 0;
+	*offsetp += rv;
+	return 0;
+}
+
+/*
+ * pfs_tx_log:
+ *
+ *	Write the log entries of @tx. If PFS_FEATURE_LOGDELTA is on, ops
+ *	with a small change are packed as delta records, the others are
+ *	logged as full entries. A pack slot is sealed before a full entry
+ *	so that ops keep their order in the journal.
+ */
 int
 pfs_tx_log(pfs_tx_t *tx, uint64_t head_txid, uint64_t head_lsn,
     uint64_t head_offset, char *buf, int buflen)
 {
 	pfs_mount_t *mnt = tx->t_mnt;
 	pfs_log_t *log = &mnt->mnt_log;
+	pfs_logpack_phy_t *lp;
 	pfs_txop_t *top;
 	uint64_t len, offset;
+	char rec[LOGREC_MAXSIZE];
+	bool packable;
+	int reclen;
 	int rv;
 	int nle;
 
@@ -438,27 +627,43 @@ pfs_tx_log(pfs_tx_t *tx, uint64_t head_txid, uint64_t head_lsn,
 	offset = head_offset;
 	memset(buf, 0, buflen);
 	tx->t_id = head_txid + 1;
+	packable = pfs_version_has_features(mnt, PFS_FEATURE_LOGDELTA);
+	lp = NULL;
 
 	TAILQ_FOREACH(top, &tx->t_ops, top_next) {
-		nle++;
-		pfs_txop_log(top, head_lsn + nle, (pfs_logentry_phy_t *)(buf + len));
-
-		/*
-		 * Ensure there is buffer space to write at least one log entry.
-		 * Otherwise, flush the bufer to free space.
-		 */
-		len += sizeof(pfs_logentry_phy_t);
-		if (len >= (uint64_t)buflen) {
-			PFS_ASSERT(len == (uint64_t)buflen);
-			rv = pfs_log_write(log, buf, len, offset);
+		reclen = packable ? pfs_txop_logrec(top, rec, sizeof(rec)) : -1;
+		if (lp && (reclen < 0 || !pfs_logpack_add(lp, rec, reclen))) {
+			pfs_logpack_seal(lp, true);
+			lp = NULL;
+			len += sizeof(pfs_logentry_phy_t);
+			rv = pfs_tx_log_flush(log, buf, buflen, &len, &offset);
 			if (rv < 0)
 				return rv;
-			memset(buf, 0, buflen);
-			len = 0;
-			offset += rv;
 		}
+
+		if (reclen >= 0) {
+			if (lp == NULL) {
+				nle++;
+				lp = (pfs_logpack_phy_t *)(buf + len);
+				pfs_logpack_init(lp, head_lsn + nle, tx->t_id);
+				PFS_VERIFY(pfs_logpack_add(lp, rec, reclen));
+			}
+			continue;
+		}
+
+		nle++;
+		pfs_txop_log(top, head_lsn + nle, (pfs_logentry_phy_t *)(buf + len));
+		len += sizeof(pfs_logentry_phy_t);
+		rv = pfs_tx_log_flush(log, buf, buflen, &len, &offset);
+		if (rv < 0)
+			return rv;
+	}
+	if (lp) {
+		pfs_logpack_seal(lp, false);
+		len += sizeof(pfs_logentry_phy_t);
 	}
-	PFS_ASSERT(nle == tx->t_nops);
+	PFS_ASSERT(nle <= tx->t_nops);
+	tx->t_nle = nle;
 	if (len != 0) {
 		rv = pfs_log_write(log, buf, len, offset);
 		if (rv < 0)
@@ -585,6 +790,27 @@ _pfs_tx_recreate_op(pfs_tx_t *tx, pfs_logentry_phy_t *le, pfs_txop_t **topp,
 	return 0;
 }
 
+int
+_pfs_tx_recreate_pack(pfs_tx_t *tx, const pfs_logpack_phy_t *lp,
+    const char *func, const char *name, int line)
+{
+	const pfs_logrec_phy_t *lr;
+	pfs_txop_t *top;
+	uint32_t nrec = 0;
+	int pos = 0;
+
+	while ((lr = pfs_logpack_next(lp, &pos)) != NULL) {
+		top = pfs_txop_recreate_rec(tx, lr, func, name, line);
+		if (top == NULL)
+			ERR_RETVAL(ENOMEM);
+		TAILQ_INSERT_TAIL(&tx->t_ops, top, top_next);
+		tx->t_nops++;
+		nrec++;
+	}
+	PFS_ASSERT(nrec == lp->lp_nrec);
+	return 0;
+}
+
 void
 _pfs_tx_done_op(pfs_tx_t *tx, pfs_txop_t *top, pfs_txop_callback_t *cb)
 {
@@ -656,7 +882,7 @@ pfs_txlist_replay(pfs_mount_t *mnt, struct tx_qhead *replaytxq)
 	int err;
 	pfs_tx_t *otx, *rtx;
 	int64_t starttid, stoptid;
-	int ntxs;
+	int ntxs, nbatch;
 	MNT_STAT_BEGIN();
 	PFS_ASSERT(TAILQ_EMPTY(replaytxq) == false);
 
@@ -677,14 +903,28 @@ pfs_txlist_replay(pfs_mount_t *mnt, struct tx_qhead *replaytxq)
 	}
 
 	starttid = stoptid = -1;
-	ntxs = 0;
+	ntxs = nbatch = 0;
 	TAILQ_FOREACH(rtx, replaytxq, t_next) {
 		PFS_ASSERT(rtx->t_type == TXT_REPLAY);
 		if (starttid < 0)
 			starttid = rtx->t_id;
 		stoptid = rtx->t_id;
 		ntxs++;
+
+		/*
+		 * A write tx holds the lock for its own modification, so
+		 * only the lock taken here can be released. The log thread
+		 * won't hand out new replay txs before LOG_REPLAYDONE, so
+		 * the order of txs is kept even if the lock is dropped.
+		 */
+		if (!otx && nbatch >= replay_batch_ntx) {
+			pfs_meta_unlock(mnt);
+			pfs_tls_set_tx(rtx);
+			pfs_meta_lock(mnt);
+			nbatch = 0;
+		}
 		pfs_tx_replay(rtx);
+		nbatch++;
 	}
 	PFS_ASSERT(stoptid - starttid + 1 == ntxs);
 
@@ -722,7 +962,7 @@ pfs_tx_submit(pfs_tx_t *tx, int err)
 	TAILQ_INIT(&rplhead);
 	rv = pfs_log_request(&mnt->mnt_log, LOG_WRITE, tx, &rplhead);
 	MNT_STAT_END_BANDWIDTH(MNT_STAT_TX_WRITE,
-	    tx->t_nops * sizeof(pfs_logentry_phy_t));
+	    tx->t_nle * sizeof(pfs_logentry_phy_t));
 	if (rv < 0) {
 		pfs_tx_rollback(tx);
 
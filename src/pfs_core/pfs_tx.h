@@ -25,6 +25,7 @@
 
 typedef struct pfs_mount pfs_mount_t;
 typedef struct pfs_logentry_phy pfs_logentry_phy_t;
+typedef struct pfs_logpack_phy pfs_logpack_phy_t;
 typedef struct pfs_inode pfs_inode_t;
 
 enum {
@@ -75,6 +76,7 @@ typedef struct pfs_tx {
 						   if ETIMEDOUT */
 
 	int			t_nops;
+	int			t_nle;		/* journal slots taken */
 	struct txop_qhead 	t_ops;
 	tnode_t			*t_opsroot;
 
@@ -117,6 +119,9 @@ typedef struct pfs_txop {
 	pfs_txop_t		*top_shadow;	/* txops on same mo are shadowed */
 	int			top_dup_cnt;	/* number of shadow txops that nested */
 	int			top_dup_idx;	/* index in nested stack */
+
+	uint32_t		top_basecrc;	/* delta: checksum of base mo */
+	uint64_t		top_dmask[2];	/* delta: bytes set in top_remote */
 } pfs_txop_t;
 
 typedef struct pfs_txcb {
@@ -131,6 +136,8 @@ void		_pfs_tx_done_op(pfs_tx_t *tx, pfs_txop_t *top, pfs_txop_callback_t *cb);
 int		_pfs_tx_recreate_op(pfs_tx_t *tx, pfs_logentry_phy_t *le,
 		    pfs_txop_t **topp, const char *func, const char *name,
 		    int line);
+int		_pfs_tx_recreate_pack(pfs_tx_t *tx, const pfs_logpack_phy_t *lp,
+		    const char *func, const char *name, int line);
 int		pfs_tx_commit(pfs_tx_t *tx);
 void		pfs_txlist_replay(pfs_mount_t *mnt, struct tx_qhead *txq);
 int		pfs_tx_log(pfs_tx_t *tx, uint64_t head_txid, uint64_t head_lsn,
@@ -154,6 +161,7 @@ pfs_metaobj_phy_t*
 pfs_metaobj_phy_t*
 		pfs_tx_get_mo(pfs_tx_t *tx, pfs_metaobj_phy_t *obj);
 
+int		pfs_txop_logrec(pfs_txop_t *top, char *rec, int reclen);
 int		pfs_txop_redo(pfs_txop_t *top, pfs_metaobj_phy_t *mo, void *buf);
 int		pfs_txop_undo(pfs_txop_t *top, pfs_metaobj_phy_t *mo);
 int		pfs_txop_load(pfs_txop_t *top, pfs_mount_t *mnt);
@@ -170,6 +178,9 @@ pfs_tx_empty(pfs_tx_t *tx)
 #define	pfs_tx_recreate_op(tx, le, top) 		\
 	_pfs_tx_recreate_op(tx, le, &top, __func__, #top, __LINE__)
 
+#define	pfs_tx_recreate_pack(tx, lp) 			\
+	_pfs_tx_recreate_pack(tx, lp, __func__, #lp, __LINE__)
+
 #define	pfs_tx_done_op_callback(tx, top, callback)	\
 	_pfs_tx_done_op(tx, top, callback)
 
@@ -16,6 +16,7 @@
 #ifndef	_PFS_UTIL_H_
 #define	_PFS_UTIL_H_
 
+#include <stdarg.h>
 #include <sys/types.h>
 #include <stdint.h>
 
@@ -23,12 +23,20 @@
 
 static uint64_t	pfs_current_version	= 2;
 
-/* table of features supported by all versions */
+/*
+ * table of features supported by all versions
+ *
+ * Versions above pfs_current_version are defined but not run yet: a RW
+ * mount upgrades the disk to the running version, after which RO nodes
+ * still on an older binary can't mount or parse the journal.
+ */
 static uint64_t pfs_feature_table[PFS_MAX_VERSION] = {
 	[0] = PFS_FEATURE_NONE,
 	[1] = PFS_FEATURE_BLKHOLE,
 	[2] = PFS_FEATURE_BLKHOLE | PFS_FEATURE_EXTNAME,
 	[3] = PFS_FEATURE_BLKHOLE | PFS_FEATURE_EXTNAME | PFS_FEATURE_PVTID,
+	[4] = PFS_FEATURE_BLKHOLE | PFS_FEATURE_EXTNAME | PFS_FEATURE_PVTID |
+	      PFS_FEATURE_LOGDELTA,
 };
 
 int
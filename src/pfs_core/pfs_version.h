@@ -21,6 +21,7 @@ enum {
 	PFS_FEATURE_BLKHOLE	= (1ULL << 0),
 	PFS_FEATURE_EXTNAME	= (1ULL << 1),
 	PFS_FEATURE_PVTID	= (1ULL << 2),
+	PFS_FEATURE_LOGDELTA	= (1ULL << 3),
 };
 
 typedef struct pfs_chunk_phy	pfs_chunk_phy_t;
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <assert.h>
 #include <sys/file.h>
+#include <sys/syscall.h>
 
 #include "pfsd_common.h"
 #include "pfsd_proto.h"
@@ -159,3 +160,37 @@ const char mon_name[][4] = {
     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
 };
 
+
+int
+pfsd_numa_nodes()
+{
+	/* like "0" or "0-1", nodes are numbered from 0 */
+	char buf[64] = "";
+	int nnode = 1;
+	FILE *fp = fopen("/sys/devices/system/node/online", "r");
+	if (fp == NULL)
+		return 1;
+	if (fgets(buf, sizeof(buf), fp) != NULL) {
+		char *last = strrchr(buf, '-');
+		if (last == NULL)
+			last = strrchr(buf, ',');
+		nnode = atoi(last ? last + 1 : buf) + 1;
+	}
+	fclose(fp);
+	return nnode > 0 ? nnode : 1;
+}
+
+int
+pfsd_numa_node()
+{
+	/* threads rarely migrate, refresh the node once in a while */
+	static __thread unsigned node = (unsigned)-1;
+	static __thread unsigned ncall;
+	unsigned cpu;
+
+	if (node == (unsigned)-1 || (++ncall & 1023) == 0) {
+		if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+			node = (unsigned)-1;
+	}
+	return (int)node;
+}
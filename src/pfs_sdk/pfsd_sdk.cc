@@ -60,6 +60,7 @@ static int s_remount_timeout_ms = 2000 * 1000;
 	s_mnt_flags = 0;\
 	s_mount_epoch = 0;\
 	s_mnt_hostid = -1;\
+	attrcache_reset();\
 } while (0)
 
 /* Don't check it for multi process.
@@ -81,6 +82,147 @@ static int s_remount_timeout_ms = 2000 * 1000;
 	} \
 } while(0)
 
+/*
+ * Attribute cache, keyed by inode number.
+ *
+ * An entry is valid while its lease lasts and pfsd has not changed any
+ * metadata since the entry was fetched, as told by the generation pfsd
+ * bumps in shm. Changes from other hosts don't bump it, so only RW mounts
+ * use the cache, where every change goes through the local pfsd.
+ */
+#define ATTRCACHE_NSLOT	1024
+
+typedef struct attrcache_slot {
+	pthread_mutex_t	a_mtx;
+	int64_t		a_ino;
+	uint64_t	a_gen;
+	int64_t		a_expire_us;
+	struct stat	a_st;
+} attrcache_slot_t;
+
+static pthread_once_t s_attrcache_once = PTHREAD_ONCE_INIT;
+static attrcache_slot_t s_attrcache[ATTRCACHE_NSLOT];
+static int s_attr_lease_us = 100 * 1000;
+static volatile uint64_t *s_meta_gen = NULL;
+
+static void
+attrcache_init()
+{
+	for (int i = 0; i < ATTRCACHE_NSLOT; ++i) {
+		pthread_mutex_init(&s_attrcache[i].a_mtx, NULL);
+		s_attrcache[i].a_ino = -1;
+	}
+}
+
+static int64_t
+attrcache_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static attrcache_slot_t *
+attrcache_slot(int64_t ino)
+{
+	pthread_once(&s_attrcache_once, attrcache_init);
+	return &s_attrcache[(uint64_t)ino % ATTRCACHE_NSLOT];
+}
+
+/*
+ * Whether a result fetched now may be cached. The generation is taken
+ * before the request is sent, so a change racing with it stales the entry.
+ */
+static bool
+attrcache_begin(uint64_t *gen)
+{
+	volatile uint64_t *genp = s_meta_gen;
+
+	if (s_attr_lease_us <= 0 || genp == NULL || !pfsd_writable(s_mnt_flags))
+		return false;
+	*gen = __atomic_load_n(genp, __ATOMIC_ACQUIRE);
+	return true;
+}
+
+static bool
+attrcache_get(int64_t ino, struct stat *st)
+{
+	attrcache_slot_t *a;
+	uint64_t gen;
+	bool hit = false;
+
+	if (!attrcache_begin(&gen))
+		return false;
+
+	a = attrcache_slot(ino);
+	pthread_mutex_lock(&a->a_mtx);
+	if (a->a_ino == ino && a->a_gen == gen &&
+	    attrcache_now_us() < a->a_expire_us) {
+		memcpy(st, &a->a_st, sizeof(*st));
+		hit = true;
+	}
+	pthread_mutex_unlock(&a->a_mtx);
+	return hit;
+}
+
+static void
+attrcache_put(uint64_t gen, const struct stat *st)
+{
+	attrcache_slot_t *a = attrcache_slot(st->st_ino);
+
+	pthread_mutex_lock(&a->a_mtx);
+	a->a_ino = st->st_ino;
+	a->a_gen = gen;
+	a->a_expire_us = attrcache_now_us() + s_attr_lease_us;
+	memcpy(&a->a_st, st, sizeof(*st));
+	pthread_mutex_unlock(&a->a_mtx);
+}
+
+/*
+ * Learn where pfsd publishes the generation from a channel in use. A pfsd
+ * which doesn't advertise PFSD_SHM_F_METAGEN never bumps it, the cache
+ * stays off then.
+ */
+static void
+attrcache_attach(pfsd_iochannel_t *ch)
+{
+	pfsd_shm_t *shm;
+
+	if (s_meta_gen != NULL)
+		return;
+	shm = pfsd_channel_shm(ch);
+	if (shm->sh_flags & PFSD_SHM_F_METAGEN)
+		s_meta_gen = &shm->sh_meta_gen;
+}
+
+/*
+ * Drop the entry of an inode this process is changing. pfsd bumps the
+ * generation too, this keeps the cache right on its own.
+ */
+static void
+attrcache_invalidate(int64_t ino)
+{
+	attrcache_slot_t *a = attrcache_slot(ino);
+
+	pthread_mutex_lock(&a->a_mtx);
+	if (a->a_ino == ino)
+		a->a_ino = -1;
+	pthread_mutex_unlock(&a->a_mtx);
+}
+
+/* shm is going away, and a new mount starts its generation over */
+static void
+attrcache_reset()
+{
+	s_meta_gen = NULL;
+	for (int i = 0; i < ATTRCACHE_NSLOT; ++i) {
+		attrcache_slot_t *a = attrcache_slot(i);
+		pthread_mutex_lock(&a->a_mtx);
+		a->a_ino = -1;
+		pthread_mutex_unlock(&a->a_mtx);
+	}
+}
+
 static ssize_t pfsd_file_pread(pfsd_file_t *file, void *buf, size_t len,
 	off_t off);
 static ssize_t pfsd_file_pwrite(pfsd_file_t *file, const void *buf, size_t len,
@@ -118,6 +260,15 @@ pfsd_set_connect_timeout(int timeout_ms)
 	s_timeout_ms = timeout_ms;
 }
 
+void
+pfsd_set_attr_lease(int lease_us)
+{
+	if (lease_us < 0)
+		return;
+
+	s_attr_lease_us = lease_us;
+}
+
 static void
 pfsd_mount_atfork_child_init()
 {
@@ -860,6 +1011,7 @@ retry:
 
 	memcpy(wbuf, buf, len);
 
+	attrcache_invalidate(file->f_inode);
 	pfsd_chnl_send_recv(s_connid, req, len, rsp, 0, wbuf, pfsd_tolong(ch),
 	    0);
 
@@ -926,6 +1078,7 @@ retry:
 	req->fa_req.f_mode = mode;
 	req->common_pl_req = file->f_common_pl;
 
+	attrcache_invalidate(file->f_inode);
 	pfsd_chnl_send_recv(s_connid, req, 0,
 	    rsp, 0, NULL, pfsd_tolong(ch), 0);
 	CHECK_STALE(rsp);
@@ -1032,6 +1185,7 @@ retry:
 	req->ft_req.f_len = len;
 	req->common_pl_req = file->f_common_pl;
 
+	attrcache_invalidate(file->f_inode);
 	pfsd_chnl_send_recv(s_connid, req, 0, rsp, 0, NULL, pfsd_tolong(ch), 0);
 	CHECK_STALE(rsp);
 
@@ -1116,6 +1270,8 @@ pfsd_stat(const char *pbdpath, struct stat *st)
 	unsigned char *buf = NULL;
 	int rv = -1;
 	pfsd_response_t *rsp = NULL;
+	uint64_t gen = 0;
+	bool cacheable = attrcache_begin(&gen);
 
 retry:
 	if (pfsd_chnl_buffer_alloc(s_connid, PFS_MAX_PATHLEN, (void**)&req, 0,
@@ -1140,7 +1296,10 @@ retry:
 			PFSD_CLIENT_ELOG("stat %s: %s", pbdpath, strerror(errno));
 	} else {
 		memcpy(st, &rsp->s_rsp.s_st, sizeof(*st));
+		if (cacheable)
+			attrcache_put(gen, st);
 	}
+	attrcache_attach(ch);
 
 	pfsd_chnl_buffer_free(s_connid, req, rsp, buf, pfsd_tolong(ch));
 	return rv;
@@ -1157,10 +1316,17 @@ pfsd_fstat(int fd, struct stat *st)
 	pfsd_file_t *file = NULL;
 	PFSD_SDK_GET_FILE(fd);
 
+	if (attrcache_get(file->f_inode, st)) {
+		pfsd_put_file(file);
+		return 0;
+	}
+
 	pfsd_iochannel_t *ch = NULL;
 	pfsd_request_t *req = NULL;
 	int rv = -1;
 	pfsd_response_t *rsp = NULL;
+	uint64_t gen = 0;
+	bool cacheable = attrcache_begin(&gen);
 
 retry:
 	if (pfsd_chnl_buffer_alloc(s_connid, 0, (void**)&req, 0,
@@ -1184,7 +1350,10 @@ retry:
 		PFSD_CLIENT_ELOG("fstat %ld error: %s", file->f_inode, strerror(errno));
 	} else {
 		memcpy(st, &rsp->f_rsp.f_st, sizeof(*st));
+		if (cacheable)
+			attrcache_put(gen, st);
 	}
+	attrcache_attach(ch);
 
 	pfsd_put_file(file);
 	pfsd_chnl_buffer_free(s_connid, req, rsp, NULL, pfsd_tolong(ch));
@@ -1263,6 +1432,8 @@ pfsd_file_lseek(pfsd_file_t *file, off_t offset, int whence)
 	pfsd_request_t *req = NULL;
 	pfsd_response_t *rsp = NULL;
 
+	struct stat st;
+
 	off_t rv = -1;
 	rv = local_file_lseek(file, offset, whence);
 	if (rv >= 0)
@@ -1270,6 +1441,21 @@ pfsd_file_lseek(pfsd_file_t *file, off_t offset, int whence)
 	if (rv == off_t(-1) && errno != 0)
 		goto finish;
 
+	/* size of a recent fstat is still good for SEEK_END */
+	if (attrcache_get(file->f_inode, &st)) {
+		rv = st.st_size + offset;
+		if (offset > 0 && rv < st.st_size) {
+			errno = EOVERFLOW;
+			rv = off_t(-1);
+		} else if (rv < 0) {
+			errno = EINVAL;
+			rv = off_t(-1);
+		} else {
+			file->f_offset = rv;
+		}
+		goto finish;
+	}
+
 retry:
 	/* ask pfsd to seek end */
 	if (pfsd_chnl_buffer_alloc(s_connid, 0, (void**)&req, 0,
@@ -1610,8 +1796,53 @@ pfsd_readdir(DIR *dir)
 	return sysent;
 }
 
-int
-pfsd_readdir_r(DIR *dir, struct dirent *entry, struct dirent **result)
+/* Take the next entry from the dirent buffer, false if it is drained */
+static bool
+pfsd_dir_take(DIR *dir, struct dirent *entry, struct stat *st)
+{
+	if (dir->d_data_offset >= dir->d_data_size) {
+		dir->d_data_offset = 0;
+		dir->d_data_size = 0;
+		return false;
+	}
+
+	if (!dir->d_data_plus) {
+		memcpy(entry, &dir->d_data[dir->d_data_offset], sizeof(*entry));
+		dir->d_data_offset += sizeof(struct dirent);
+		assert (dir->d_data_offset <= dir->d_data_size);
+		return true;
+	}
+
+	const pfsd_direntplus_t *dp =
+	    (const pfsd_direntplus_t *)&dir->d_data[dir->d_data_offset];
+	memset(entry, 0, offsetof(struct dirent, d_name));
+	entry->d_ino = dp->dp_ino;
+	entry->d_reclen = sizeof(*entry);
+	entry->d_type = dp->dp_type;
+	memcpy(entry->d_name, dp->dp_name, dp->dp_namelen + 1);
+
+	if (st) {
+		memset(st, 0, sizeof(*st));
+		st->st_ino = dp->dp_ino;
+		st->st_size = dp->dp_size;
+		st->st_mtime = dp->dp_mtime;
+		st->st_mode = dp->dp_mode;
+	}
+
+	dir->d_data_offset += dp->dp_reclen;
+	assert (dir->d_data_offset <= dir->d_data_size);
+	return true;
+}
+
+/*
+ * Entries are fetched by readdirplus if pfsd serves it, whose compact
+ * records let one round trip bring back several times more entries
+ * than struct dirent does, along with their attributes. An older pfsd
+ * gets READDIR, readdirplus then fails with ENOTSUP.
+ */
+static int
+pfsd_dir_read(DIR *dir, struct dirent *entry, struct stat *st,
+    struct dirent **result)
 {
 	if (!PFSD_DIR_ISVALID(dir)) {
 		errno = EINVAL;
@@ -1624,18 +1855,15 @@ pfsd_readdir_r(DIR *dir, struct dirent *entry, struct dirent **result)
 		return -1;
 	}
 
+	if (st && !dir->d_data_plus && dir->d_data_offset < dir->d_data_size) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
 	/* Try read from dirent buffer */
-	if (dir->d_data_offset < dir->d_data_size) {
+	if (pfsd_dir_take(dir, entry, st)) {
 		*result = entry;
-		memcpy(entry, &dir->d_data[dir->d_data_offset], sizeof(*entry));
-
-		dir->d_data_offset += sizeof(struct dirent);
-		assert (dir->d_data_offset <= dir->d_data_size);
-
 		return 0;
-	} else {
-		dir->d_data_offset = 0;
-		dir->d_data_size = 0;
 	}
 
 	if (dir->d_next_ino == 0) {
@@ -1649,6 +1877,7 @@ pfsd_readdir_r(DIR *dir, struct dirent *entry, struct dirent **result)
 	pfsd_request_t *req = NULL;
 	pfsd_response_t *rsp = NULL;
 	unsigned char *dbuf = NULL;
+	bool plus;
 
 retry:
 	if (pfsd_chnl_buffer_alloc(s_connid, 0, (void**)&req,
@@ -1657,8 +1886,14 @@ retry:
 		errno = ENOMEM;
 		return -1;
 	}
+	plus = (pfsd_channel_shm(ch)->sh_flags & PFSD_SHM_F_DIRPLUS) != 0;
+	if (st && !plus) {
+		pfsd_chnl_buffer_free(s_connid, req, rsp, dbuf, pfsd_tolong(ch));
+		errno = ENOTSUP;
+		return -1;
+	}
 	/* fill request */
-	req->type = PFSD_REQUEST_READDIR;
+	req->type = plus ? PFSD_REQUEST_READDIRPLUS : PFSD_REQUEST_READDIR;
 	req->rd_req.r_dino = dir->d_ino;
 	req->rd_req.r_ino = dir->d_next_ino;
 	req->rd_req.r_offset = dir->d_next_offset;
@@ -1679,10 +1914,10 @@ retry:
 		*result = entry;
 
 		dir->d_data_size = rsp->rd_rsp.r_data_size;
+		dir->d_data_plus = plus;
 		memcpy(dir->d_data, dbuf, dir->d_data_size);
 
-		memcpy(entry, &dir->d_data[0], sizeof(*entry));
-		dir->d_data_offset = sizeof(*entry);
+		pfsd_dir_take(dir, entry, st);
 		dir->d_next_ino = rsp->rd_rsp.r_ino;
 		dir->d_next_offset = rsp->rd_rsp.r_offset;
 	}
@@ -1691,6 +1926,46 @@ retry:
 	return err;
 }
 
+int
+pfsd_readdir_r(DIR *dir, struct dirent *entry, struct dirent **result)
+{
+	return pfsd_dir_read(dir, entry, NULL, result);
+}
+
+int
+pfsd_readdirplus_r(DIR *dir, struct dirent *entry, struct stat *st,
+    struct dirent **result)
+{
+	if (st == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return pfsd_dir_read(dir, entry, st, result);
+}
+
+struct dirent *
+pfsd_readdirplus(DIR *dir, struct stat *st)
+{
+	if (!PFSD_DIR_ISVALID(dir)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	DIR *raw_dir = PFSD_DIR_RAW(dir);
+	if (!raw_dir) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct dirent *sysent = NULL;
+	int err = pfsd_readdirplus_r(dir, &raw_dir->d_sysde, st, &sysent);
+	if (err != 0) {
+		sysent = NULL;
+	}
+
+	return sysent;
+}
+
 int
 pfsd_closedir(DIR *dir)
 {
@@ -1776,7 +2051,44 @@ retry:
 int
 pfsd_fsync(int fd)
 {
-	return 0;
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pfsd_file_t *file = NULL;
+	PFSD_SDK_GET_FILE(fd);
+
+	pfsd_iochannel_t *ch = NULL;
+	pfsd_request_t *req = NULL;
+	int rv = -1;
+	pfsd_response_t *rsp = NULL;
+
+retry:
+	if (pfsd_chnl_buffer_alloc(s_connid, 0, (void**)&req, 0,
+	    (void**)&rsp, NULL, (long*)(&ch)) != 0) {
+		pfsd_put_file(file);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* fill request */
+	req->type = PFSD_REQUEST_FSYNC;
+	req->fs_req.f_ino = file->f_inode;
+	req->common_pl_req = file->f_common_pl;
+
+	pfsd_chnl_send_recv(s_connid, req, 0, rsp, 0, NULL, pfsd_tolong(ch), 0);
+	CHECK_STALE(rsp);
+
+	rv = rsp->fs_rsp.f_res;
+	if (rv != 0) {
+		errno = rsp->error;
+		PFSD_CLIENT_ELOG("fsync %ld error: %s", file->f_inode, strerror(errno));
+	}
+
+	pfsd_put_file(file);
+	pfsd_chnl_buffer_free(s_connid, req, rsp, NULL, pfsd_tolong(ch));
+	return rv;
 }
 
 ssize_t
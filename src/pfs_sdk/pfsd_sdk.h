@@ -19,6 +19,7 @@
 #include <dirent.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 /* copy from pfs_impl.h, just for lib user */
 #define	PFS_OBJDATA_SIZE	(128 - 40)
@@ -65,6 +66,8 @@ void pfsd_set_mode(int multi_thread_or_process);
 void pfsd_set_svr_addr(const char *svraddr, size_t len);
 /* set connect timeout */
 void pfsd_set_connect_timeout(int timeout_ms);
+/* set lease of cached file attributes in us, 0 disables the cache */
+void pfsd_set_attr_lease(int lease_us);
 
 /* DEPRECATED !!! DO NOT USE THIS FUNCTION, USE pfsd_mount INSTEAD. */
 int pfsd_sdk_init(int mode, const char *svraddr, int timeout_ms,
@@ -122,6 +125,13 @@ int pfsd_mkdir(const char *pbdpath, mode_t mode);
 DIR *pfsd_opendir(const char *pbdpath);
 struct dirent *pfsd_readdir(DIR *dir);
 int pfsd_readdir_r(DIR *dir, struct dirent *entry, struct dirent **result);
+/*
+ * readdir with st_ino, st_size, st_mtime and st_mode of the entry in @st,
+ * fails with ENOTSUP if pfsd is too old to serve it
+ */
+struct dirent *pfsd_readdirplus(DIR *dir, struct stat *st);
+int pfsd_readdirplus_r(DIR *dir, struct dirent *entry, struct stat *st,
+    struct dirent **result);
 int pfsd_closedir(DIR *dir);
 int pfsd_rmdir(const char *pbdpath);
 int pfsd_chdir(const char *path);
@@ -130,8 +140,9 @@ char *pfsd_getcwd(char *buf, size_t size);
 
 int pfsd_access(const char *pbdpath, int amode);
 
-/* mock */
 int pfsd_fsync(int fd);
+
+/* mock */
 ssize_t pfsd_readlink(const char *pbdpath, char *buf, size_t bufsize);
 int pfsd_chmod(const char *pbdpath, mode_t mode);
 int pfsd_fchmod(int fd, mode_t mode);
@@ -34,39 +34,59 @@ bool pfsd_writable(int flags)
 static char work_dir[PFS_MAX_PATHLEN];
 static pthread_rwlock_t sdk_work_dir_rwlock;
 
-static int fdtbl_free_last = -1;
-static pfsd_file_t *fdtbl[PFSD_MAX_NFD];
-static int fdtbl_nopen;
-static pthread_mutex_t fdtbl_mtx;
+/*
+ * Lock free like the fd table of pfs core: a slot is open, with the
+ * readers and writers count in the low bits, or free, with the next fd of
+ * the free stack. The stack head carries a tag against ABA.
+ */
+#define FD_OPEN			(1UL << 63)
+#define FD_NIL			0xffffffffUL
+#define FD_HEAD(tag, fd)	(((uint64_t)(tag) << 32) | (fd))
+
+typedef struct fd_slot {
+	uint64_t	fs_val;
+	pfsd_file_t	*fs_file;
+} fd_slot_t;
 
-static inline pfsd_file_t*
-fd_to_file(int fd)
+static fd_slot_t fdtbl[PFSD_MAX_NFD];
+static int fdtbl_nused;
+static uint64_t fdtbl_free_head = FD_HEAD(0, FD_NIL);
+
+static inline pfsd_file_t *
+fd_ref(int fd)
 {
-	//When the fd is never allocated or it is recycled, it is free.
-	if ((fdtbl[fd] == NULL) || (((size_t)fdtbl[fd]) % 2 == 1))
+	fd_slot_t *fs;
+	uint64_t val;
+
+	if (fd < 0 || fd >= __atomic_load_n(&fdtbl_nused, __ATOMIC_ACQUIRE))
 		return NULL;
-	return fdtbl[fd];
+	fs = &fdtbl[fd];
+	val = __atomic_load_n(&fs->fs_val, __ATOMIC_RELAXED);
+	do {
+		if ((val & FD_OPEN) == 0)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&fs->fs_val, &val, val + 1,
+	    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return fs->fs_file;
+}
+
+static inline void
+fd_unref(int fd)
+{
+	__atomic_sub_fetch(&fdtbl[fd].fs_val, 1, __ATOMIC_RELEASE);
 }
 
 void pfsd_sdk_file_init()
 {
-	pthread_mutexattr_t attr;
-	int err = pthread_mutexattr_init(&attr);
-	pfsd_file_t *file = NULL;
-	err |= pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
-	err |= pthread_mutex_init(&fdtbl_mtx, &attr);
-	err |= pthread_mutexattr_destroy(&attr);
-	assert (err == 0);
-
-	if (fdtbl_nopen != 0) {
-		//This is atfork in subprocess or after umount in master process
-		for (int i = 0; i < PFSD_MAX_NFD; ++i) {
-			file = fd_to_file(i);
-			if (file)
-				pfsd_close_file(file);
-		}
+	//This is atfork in subprocess or after umount in master process.
+	//Threads holding refs are gone, drop the files and start over.
+	for (int i = 0; i < fdtbl_nused; ++i) {
+		if (fdtbl[i].fs_val & FD_OPEN)
+			pfsd_free_file(fdtbl[i].fs_file);
 	}
-	PFSD_ASSERT(fdtbl_nopen == 0);
+	memset(fdtbl, 0, fdtbl_nused * sizeof(fd_slot_t));
+	fdtbl_nused = 0;
+	fdtbl_free_head = FD_HEAD(0, FD_NIL);
 
 	pthread_rwlock_init(&sdk_work_dir_rwlock, NULL);
 }
@@ -97,72 +117,67 @@ pfsd_free_file(pfsd_file_t *f)
 }
 
 static inline int
-fd_get_free(pfsd_file_t *file)
+fd_get_free()
 {
-	int fd = -1;
-	if (fdtbl_free_last < 0) {
-		if (fdtbl_nopen < PFSD_MAX_NFD) {
-			/*
-			 * Pop from array
-			 */
-			fd = fdtbl_nopen;
-			++fdtbl_nopen;
-			fdtbl[fd] = file;
-		}
-	} else {
-		/*
-		 * Pop from the linked list with its head position at
-		 * fdtbl_free_last.
-		 * Attention (int)(((uint64_t)-1) / 2) == -1.
-		 * So after the last element is popped, then
-		 * fdtbl_free_last == -1.
-		 */
-		fd = fdtbl_free_last;
-		fdtbl_free_last = (int)(((uint64_t)fdtbl[fdtbl_free_last]) / 2);
-		++fdtbl_nopen;
-		fdtbl[fd] = file;
+	uint64_t head, next;
+	int fd;
+
+	/* Pop from the free stack */
+	head = __atomic_load_n(&fdtbl_free_head, __ATOMIC_ACQUIRE);
+	while ((head & FD_NIL) != FD_NIL) {
+		fd = (int)(head & FD_NIL);
+		next = __atomic_load_n(&fdtbl[fd].fs_val, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&fdtbl_free_head, &head,
+		    FD_HEAD((head >> 32) + 1, next & FD_NIL), false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return fd;
 	}
+
+	/* Or from the never used part of the array */
+	fd = __atomic_load_n(&fdtbl_nused, __ATOMIC_RELAXED);
+	do {
+		if (fd >= PFSD_MAX_NFD)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&fdtbl_nused, &fd, fd + 1,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 	return fd;
 }
 
 static inline void
 fd_put_free(int fd)
 {
-	/*
-	 * Push into the linked list with its head position changed to
-	 * the input fd.
-	 */
-	fdtbl[fd] = (pfsd_file_t*)(size_t)(fdtbl_free_last * 2 + 1);
-	fdtbl_free_last = fd;
-	--fdtbl_nopen;
+	uint64_t head;
+
+	/* Push into the free stack */
+	head = __atomic_load_n(&fdtbl_free_head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&fdtbl[fd].fs_val, head & FD_NIL,
+		    __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&fdtbl_free_head, &head,
+	    FD_HEAD((head >> 32) + 1, fd), false, __ATOMIC_RELEASE,
+	    __ATOMIC_RELAXED));
 }
 
 int
 pfsd_alloc_fd(pfsd_file_t *file)
 {
-	file->f_fd = -1;
-
-	pthread_mutex_lock(&fdtbl_mtx);
-	file->f_fd = fd_get_free(file);
-	pthread_mutex_unlock(&fdtbl_mtx);
+	int fd = fd_get_free();
 
-	if (file->f_fd == -1)
+	file->f_fd = fd;
+	if (fd == -1) {
 		PFSD_CLIENT_ELOG("alloc fd failed");
+		return -1;
+	}
 
-	return file->f_fd;
+	fdtbl[fd].fs_file = file;
+	__atomic_store_n(&fdtbl[fd].fs_val, FD_OPEN, __ATOMIC_RELEASE);
+	return fd;
 }
 
 pfsd_file_t*
 pfsd_get_file(int fd, bool writelock)
 {
-	pfsd_file_t *file = NULL;
-
-	pthread_mutex_lock(&fdtbl_mtx);
-	if (0 <= fd && fd < PFSD_MAX_NFD)
-		file = fd_to_file(fd);
-	if (file)
-		file->f_refcnt++;
-	pthread_mutex_unlock(&fdtbl_mtx);
+	pfsd_file_t *file = fd_ref(fd);
 
 	if (file) {
 		if (writelock)
@@ -181,10 +196,7 @@ pfsd_put_file(pfsd_file_t *f)
 {
 	if (f) {
 		pthread_rwlock_unlock(&f->f_rwlock);
-
-		pthread_mutex_lock(&fdtbl_mtx);
-		--f->f_refcnt;
-		pthread_mutex_unlock(&fdtbl_mtx);
+		fd_unref(f->f_fd);
 	}
 }
 
@@ -197,18 +209,20 @@ pfsd_close_file(pfsd_file_t *f)
 	if (f->f_fd < 0 || f->f_fd >= PFSD_MAX_NFD)
 		return -EBADF;
 
-	int err = -EAGAIN;
+	fd_slot_t *fs = &fdtbl[f->f_fd];
+	uint64_t val = __atomic_load_n(&fs->fs_val, __ATOMIC_RELAXED);
 
-	pthread_mutex_lock(&fdtbl_mtx);
-	if (f->f_refcnt <= 1) {
-		err = 0;
-		fd_put_free(f->f_fd);
-	}
-	pthread_mutex_unlock(&fdtbl_mtx);
-	if (err == 0)
-		pfsd_free_file(f);
+	//Only the closer may hold a ref.
+	do {
+		PFSD_ASSERT(val & FD_OPEN);
+		if ((val & ~FD_OPEN) > 1)
+			return -EAGAIN;
+	} while (!__atomic_compare_exchange_n(&fs->fs_val, &val, 0, false,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	fd_put_free(f->f_fd);
+	pfsd_free_file(f);
 
-	return err;
+	return 0;
 }
 
 static pthread_mutex_t pfsd_chdir_mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -373,20 +387,22 @@ pfsd_normalize_path(char *pbdpath)
 void
 pfsd_file_cleanup()
 {
-	//The function can not be protected within fdtbl_mtx because
-	//it will be locked in pfsd_close_file.
 	int ret = 0;
 	pfsd_file_t *file;
-	for (int i = 0; i < PFSD_MAX_NFD; ++i) {
-		file = fd_to_file(i);
+	int nused = __atomic_load_n(&fdtbl_nused, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nused; ++i) {
+		//The ref taken here is the closer's own.
+		file = fd_ref(i);
 		if (file) {
 			ret = pfsd_close_file(file);
 			//We do not check whether ret is zero but warn.
-			if (ret < 0)
+			if (ret < 0) {
+				fd_unref(i);
 				PFSD_CLIENT_ELOG("close fd %d err in cleanup, "
 				     "error: %d", i, ret);
-			else
+			} else {
 				PFSD_CLIENT_ELOG("close fd %d in cleanup", i);
+			}
 		}
 	}
 }
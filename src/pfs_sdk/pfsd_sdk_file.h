@@ -38,7 +38,6 @@ typedef struct pfsd_file {
     off_t   f_offset;
 
     int64_t f_inode;
-    int32_t f_refcnt; /* incr when be reading/writing */
     pfsd_chnl_payload_common_t f_common_pl;
 } pfsd_file_t;
 
@@ -215,12 +215,28 @@ journal_locate(pfs_mount_t *mnt, uint64_t *tailoff, uint64_t *headoff,
 	return 0;
 }
 
+static bool
+dumple_match_mo(pfs_logentry_phy_t *le, int motype, uint64_t mono)
+{
+	const pfs_logrec_phy_t *lr;
+	int pos = 0;
+
+	if (!pfs_logentry_ispack(le))
+		return le->le_obj_val.mo_type == motype &&
+		    le->le_obj_val.mo_number == mono;
+
+	while ((lr = pfs_logpack_next((pfs_logpack_phy_t *)le, &pos)) != NULL) {
+		if (lr->lr_obj_type == motype && lr->lr_obj_number == mono)
+			return true;
+	}
+	return false;
+}
+
 static bool
 dumple_filter(pfs_logentry_phy_t *le, void *args)
 {
 	dumple_filt_t *filtargs = (dumple_filt_t *)args;
 	opts_dumple_t *co_dumple = filtargs->opts;
-	pfs_metaobj_phy_t *mo = &le->le_obj_val;
 
 	filtargs->ntotal++;
 	if (memcmp(&emptyle, le, sizeof(*le)) == 0)
@@ -231,8 +247,7 @@ dumple_filter(pfs_logentry_phy_t *le, void *args)
 	    !(co_dumple->txid == le->le_txid))
 		return false;
 	if (co_dumple->motype != MT_NONE &&
-	    !(co_dumple->motype == mo->mo_type &&
-	    co_dumple->mono == mo->mo_number))
+	    !dumple_match_mo(le, co_dumple->motype, co_dumple->mono))
 		return false;
 	filtargs->nmatch++;
 	return true;
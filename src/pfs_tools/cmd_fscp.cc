@@ -46,7 +46,9 @@
  * 	(2) Copy used blocks to dst PBD by I/O workers
  * 	    multiple I/O workers are started and each one transfers used blocks
  * 	    of one chunk at one time. The number of workers shouldn't be bigger
- * 	    than valid chunks in PBD.
+ * 	    than valid chunks in PBD. A worker pipelines the chunk through two
+ * 	    fragment batches: one is written to dst while the next one is
+ * 	    read from src. Block holes are never copied.
  * 	(3) Modify leader record of .pfs-paxos in dst PBD
  * 	    checksum should be set to dst pbdname, otherwise disk
  * 	    paxos would fail when verify_leader()
@@ -55,7 +57,7 @@
 typedef struct opts_fscp {
 	opts_common_t   	common;
 	int			nworker;
-	int			nfrag;	/* pending frag number when copying a block */
+	int			nfrag;	/* pending frag number of a batch */
 	const char		*src_cluster;
 	const char		*dst_cluster;
 	bool crc_check;
@@ -77,10 +79,23 @@ typedef struct iotask {
 TAILQ_HEAD(task_qhead, iotask);
 
 #define NFRAG_MIN	8	/* min pending fragment number */
+#define NFRAG_DEFAULT	64	/* default pending fragment number */
 #define NFRAG_MAX	(PFS_BLOCK_SIZE / PFS_FRAG_SIZE) /* max pending
 							    fragment number */
 #define NWORKER_MIN	2	/* min worker number*/
 #define NWORKER_MAX	36	/* max worker number */
+#define PROGRESS_INTERVAL_US	(1000 * 1000)
+
+/*
+ * Fragments to be copied together, they may come from several blocks.
+ */
+typedef struct fragbatch {
+	char			*b_buf;
+	pfs_bda_t		*b_bdav;
+	int			b_nfrag;
+	int64_t			b_nblk;		/* blocks finished by batch */
+} fragbatch_t;
+
 typedef struct fscp_info {
 	uint64_t		i_disksize;
 	uint64_t		i_chunksize;
@@ -100,6 +115,11 @@ typedef struct fscp_info {
 	int			i_nfrag;		/* pending fragment number */
 	int64_t			i_nblkcopy;
 	int64_t			i_nckcopy;
+	int64_t			i_nbytecopy;
+	int64_t			i_nblktotal;
+	int			i_ncktotal;
+	uint64_t		i_start_us;
+	uint64_t		i_progress_us;		/* last progress print */
 
 	int			i_nworker;
 	pthread_t		i_workers[NWORKER_MAX];
@@ -123,7 +143,7 @@ usage_fscp()
 	" src_pbdname dst_pbdname\n"
 	"  -h, --help:             show this help message\n"
 	"  -w, --nworker:          I/O worker number @ [%d, %d]\n"
-	"  -n, --nfrag:            pending fragments number when copying a block @ [%d, %d]\n"
+	"  -n, --nfrag:            pending fragments number of each read/write batch @ [%d, %d]\n"
 	"  -S, --src_cluster:      source cluster name\n"
 	"  -D, --dst_cluster:      destination cluster name\n"
 	"  -c, --crc_check:        it will compare src pbd block and dest pbd "
@@ -141,7 +161,7 @@ getopt_fscp(int argc, char *argv[], cmd_opts_t *co)
 	opts_fscp_t *co_fscp = (opts_fscp_t*)co;
 
 	co_fscp->nworker = NWORKER_MIN;
-	co_fscp->nfrag = NFRAG_MIN;
+	co_fscp->nfrag = NFRAG_DEFAULT;
 	co_fscp->src_cluster = CL_DEFAULT;
 	co_fscp->dst_cluster = CL_DEFAULT;
 	co_fscp->crc_check = false;
@@ -230,114 +250,132 @@ frag_read(int iochd, pfs_bda_t fragbda, void *buf, int nfrag, int holeoff)
 	return 0;
 }
 
-static int
-frag_write(int iochd, pfs_bda_t fragbda, void *buf, int nfrag, int32_t holeoff)
+/*
+ * Print a summary at most once per PROGRESS_INTERVAL_US, whichever
+ * worker gets there first.
+ */
+static void
+fscp_progress(fscp_info_t *cpinfo, bool force)
 {
-	int err, waiterr;
-	char *data;
-	pfs_bda_t iobda;
-
-	err = waiterr = 0;
-	data = (char *)buf;
-	iobda = fragbda;
-	bool waitio = false;
-	for (; nfrag > 0; nfrag--) {
-		if (skip_block_hole(iobda, holeoff)) {
-			break;
-		}
+	uint64_t now, last, elapse;
 
-		err = pfsdev_pwrite_flags(iochd, data, PFS_FRAG_SIZE, iobda,
-		    IO_NOWAIT);
-		waitio = true;
-		if (err < 0) {
-			pfs_etrace("write to %d @ %ld, %d failed, err=%d\n",
-			    iochd, iobda, PFS_FRAG_SIZE, err);
-			break;
-		}
-		data += PFS_FRAG_SIZE;
-		iobda += PFS_FRAG_SIZE;
-	}
+	now = gettimeofday_us();
+	last = cpinfo->i_progress_us;
+	if (!force && now - last < PROGRESS_INTERVAL_US)
+		return;
+	if (!__sync_bool_compare_and_swap(&cpinfo->i_progress_us, last, now))
+		return;
 
-	if (waitio) {
-		waiterr = pfsdev_wait_io(iochd);
-		if (err < 0 || waiterr < 0)
-			return -EIO;
-	}
-	return 0;
+	elapse = MAX(now - cpinfo->i_start_us, 1);
+	printf("%ld/%ld blocks, %ld/%d chunks have been copied, %lu MB/s\r",
+	    cpinfo->i_nblkcopy, cpinfo->i_nblktotal, cpinfo->i_nckcopy,
+	    cpinfo->i_ncktotal,
+	    ((uint64_t)cpinfo->i_nbytecopy >> 20) * 1000000 / elapse);
+	fflush(stdout);
 }
 
-static int
-frag_copy(fscp_info_t *cpinfo, pfs_bda_t fragbda, void *buf, int nfrag, int32_t holeoff)
+/*
+ * Collect the next fragments of the chunk into @fb, from block index
+ * @posp and fragment offset @offp in it. Fragments beyond holeoff of
+ * a block are skipped.
+ */
+static void
+fragbatch_fill(fscp_info_t *cpinfo, int ckid, oidvect_t *pov, int *posp,
+    int32_t *offp, fragbatch_t *fb)
 {
-	int err;
-
-	err = frag_read(cpinfo->i_src_iochd, fragbda, buf, nfrag, holeoff);
-	if (err < 0)
-		return err;
+	int32_t holeoff;
+	pfs_blkno_t blkno;
 
-	err = frag_write(cpinfo->i_dst_iochd, fragbda, buf, nfrag, holeoff);
-	if (err < 0)
-		return err;
+	fb->b_nfrag = 0;
+	fb->b_nblk = 0;
+	while (*posp < oidvect_end(pov) && fb->b_nfrag < cpinfo->i_nfrag) {
+		holeoff = oidvect_get_holeoff(pov, *posp);
+		if (*offp >= PFS_BLOCK_SIZE ||
+		    skip_block_hole(*offp, holeoff)) {
+			(*posp)++;
+			*offp = 0;
+			fb->b_nblk++;
+			continue;
+		}
 
-	return 0;
+		blkno = (int64_t)ckid * PFS_NBT_PERCHUNK +
+		    oidvect_get(pov, *posp);
+		fb->b_bdav[fb->b_nfrag++] = blkno * PFS_BLOCK_SIZE + *offp;
+		*offp += PFS_FRAG_SIZE;
+	}
 }
 
+/*
+ * Submit IOs of the batch without waiting for them.
+ */
 static int
-block_copy(fscp_info_t *cpinfo, pfs_blkno_t blkno, void *iobuf, size_t buflen, int32_t holeoff)
+fragbatch_submit(int iochd, fragbatch_t *fb, bool write)
 {
-	int i, err, nfrag, fragperblk;
-	pfs_bda_t fragbda;
-
-	fragbda = blkno * PFS_BLOCK_SIZE;
-	fragperblk = PFS_BLOCK_SIZE / PFS_FRAG_SIZE;
-	for (i = 0; i < fragperblk; i += nfrag) {
-		nfrag = MIN(fragperblk - i, cpinfo->i_nfrag);
-		PFS_ASSERT((size_t)nfrag * PFS_FRAG_SIZE <= buflen);
+	int i, err;
+	char *data;
 
-		err = frag_copy(cpinfo, fragbda, iobuf, nfrag, holeoff);
-		if (err < 0)
+	for (i = 0; i < fb->b_nfrag; i++) {
+		data = fb->b_buf + (size_t)i * PFS_FRAG_SIZE;
+		if (write)
+			err = pfsdev_pwrite_flags(iochd, data, PFS_FRAG_SIZE,
+			    fb->b_bdav[i], IO_NOWAIT);
+		else
+			err = pfsdev_pread_flags(iochd, data, PFS_FRAG_SIZE,
+			    fb->b_bdav[i], IO_NOWAIT);
+		if (err < 0) {
+			pfs_etrace("%s %d @ %ld, %d failed, err=%d\n",
+			    write ? "write to" : "read from", iochd,
+			    fb->b_bdav[i], PFS_FRAG_SIZE, err);
 			return err;
-		fragbda += (int64_t)nfrag * PFS_FRAG_SIZE;
+		}
 	}
-
-	__sync_add_and_fetch(&cpinfo->i_nblkcopy, 1);
-	printf("%lu blocks have been copied, %ld chunks are done\r",
-	    cpinfo->i_nblkcopy, cpinfo->i_nckcopy);
-	fflush(stdout);
 	return 0;
 }
 
 static int
-chunk_copy(fscp_info_t *cpinfo, int ckid, oidvect_t *pov)
+chunk_copy(fscp_info_t *cpinfo, int ckid, oidvect_t *pov, fragbatch_t fb[2])
 {
-	int i, err;
-	int64_t oid;
-	pfs_blkno_t blkno;
-	void *iobuf;
-	int32_t holeoff;
-
-	iobuf = malloc(PFS_FRAG_SIZE * cpinfo->i_nfrag);
-	PFS_ASSERT(iobuf != NULL);
+	int cur, err, err1, pos;
+	int32_t off;
+	fragbatch_t *rfb, *wfb;
+
+	pos = oidvect_begin(pov);
+	off = 0;
+	cur = 0;
+	fragbatch_fill(cpinfo, ckid, pov, &pos, &off, &fb[cur]);
+	err = fragbatch_submit(cpinfo->i_src_iochd, &fb[cur], false);
+	err1 = pfsdev_wait_io(cpinfo->i_src_iochd);
+	ERR_UPDATE(err, err1);
+
+	while (err == 0 && (fb[cur].b_nfrag > 0 || fb[cur].b_nblk > 0)) {
+		wfb = &fb[cur];
+		rfb = &fb[cur ^ 1];
+
+		/* write out this batch while reading in the next one */
+		err = fragbatch_submit(cpinfo->i_dst_iochd, wfb, true);
+		fragbatch_fill(cpinfo, ckid, pov, &pos, &off, rfb);
+		if (err == 0)
+			err = fragbatch_submit(cpinfo->i_src_iochd, rfb, false);
+		err1 = pfsdev_wait_io(cpinfo->i_src_iochd);
+		ERR_UPDATE(err, err1);
+		err1 = pfsdev_wait_io(cpinfo->i_dst_iochd);
+		ERR_UPDATE(err, err1);
+		if (err < 0)
+			break;
 
-	for (i = oidvect_begin(pov); i < oidvect_end(pov); i++) {
-		oid = oidvect_get(pov, i);
-		holeoff = oidvect_get_holeoff(pov, i);
-		blkno = (int64_t)ckid * PFS_NBT_PERCHUNK + oid;
-		err = block_copy(cpinfo, blkno, iobuf,
-		    cpinfo->i_nfrag * PFS_FRAG_SIZE, holeoff);
-		if (err < 0) {
-			pfs_etrace("copy %lld blk in chunk %d failed, err=%d\n",
-			    blkno, ckid, err);
-			free(iobuf);
-			return err;
-		}
+		__sync_add_and_fetch(&cpinfo->i_nblkcopy, wfb->b_nblk);
+		__sync_add_and_fetch(&cpinfo->i_nbytecopy,
+		    (int64_t)wfb->b_nfrag * PFS_FRAG_SIZE);
+		fscp_progress(cpinfo, false);
+		cur ^= 1;
+	}
+	if (err < 0) {
+		pfs_etrace("copy chunk %d failed, err=%d\n", ckid, err);
+		return err;
 	}
-	free(iobuf);
 
 	__sync_add_and_fetch(&cpinfo->i_nckcopy, 1);
-	printf("%lu blocks have been copied, %ld chunks are done\r",
-	    cpinfo->i_nblkcopy, cpinfo->i_nckcopy);
-	fflush(stdout);
+	fscp_progress(cpinfo, false);
 
 	/*
 	 * If copying a large PBD, we can track progress by log file.
@@ -440,10 +478,20 @@ iotask_dequeue(fscp_info_t *cpinfo)
 static void *
 ioworker_main(void *arg)
 {
-	int err;
+	int i, err;
 	iotask_t *task;
+	fragbatch_t fb[2];
 	fscp_info_t *cpinfo = (fscp_info_t *)arg;
 
+	for (i = 0; i < 2; i++) {
+		fb[i].b_buf = (char *)memalign(PFS_FRAG_SIZE,
+		    (size_t)cpinfo->i_nfrag * PFS_FRAG_SIZE);
+		fb[i].b_bdav = (pfs_bda_t *)malloc(cpinfo->i_nfrag *
+		    sizeof(pfs_bda_t));
+		if (fb[i].b_buf == NULL || fb[i].b_bdav == NULL)
+			exit(ENOMEM);
+	}
+
 	for (;;) {
 		task = iotask_dequeue(cpinfo);
 		if (task->t_type == TASK_POSION) {
@@ -454,7 +502,7 @@ ioworker_main(void *arg)
 		PFS_ASSERT(task->t_type == TASK_NORMAL);
 		PFS_ASSERT(task->t_ckid >= 0);
 		PFS_ASSERT(task->t_ov != NULL);
-		err = chunk_copy(cpinfo, task->t_ckid, task->t_ov);
+		err = chunk_copy(cpinfo, task->t_ckid, task->t_ov, fb);
 		if (err < 0) {
 			pfs_etrace("copy chunk %d failed, err=%d\n",
 			    task->t_ckid, err);
@@ -475,6 +523,10 @@ ioworker_main(void *arg)
 		free(task);
 	}
 
+	for (i = 0; i < 2; i++) {
+		free(fb[i].b_buf);
+		free(fb[i].b_bdav);
+	}
 	return NULL;
 }
 
@@ -524,6 +576,7 @@ stop_all_workers(fscp_info_t *cpinfo)
 		cpinfo->i_workers[i] = 0;
 	}
 
+	fscp_progress(cpinfo, true);
 	printf("\nstop %d I/O workers\n", cpinfo->i_nworker);
 	cpinfo->i_nworker = 0;
 }
@@ -547,6 +600,7 @@ fscpinfo_init(fscp_info_t *cpinfo, const char *src, const char *dst,
 	cpinfo->i_dst_local_fd = -1;
 	cpinfo->i_nblkcopy = 0;
 	cpinfo->i_nckcopy = 0;
+	cpinfo->i_nbytecopy = 0;
 	cpinfo->i_nfrag = co_fscp->nfrag;
 	cpinfo->i_crc_check = co_fscp->crc_check;
 
@@ -750,9 +804,13 @@ fscp(fscp_info_t *cpinfo)
 	 * bigger than chunk number.
 	 */
 	cpinfo->i_nworker = MIN(cpinfo->i_nworker, nov);
+	for (i = 0; i < nov; i++)
+		nblk += oidvect_end(&ov_array[i]) - oidvect_begin(&ov_array[i]);
+	cpinfo->i_nblktotal = nblk;
+	cpinfo->i_ncktotal = nov;
+	cpinfo->i_start_us = gettimeofday_us();
 	start_all_workers(cpinfo);
 	for (i = 0; i < nov; i++) {
-		nblk += oidvect_end(&ov_array[i]) - oidvect_begin(&ov_array[i]);
 		task = (iotask_t *)malloc(sizeof(*task));
 		if (task == NULL)
 			exit(ENOMEM);
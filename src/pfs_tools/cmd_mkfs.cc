@@ -84,6 +84,7 @@
 #define	MIN_LOG_SIZE		(32UL << 20)
 #define	MAX_LOG_SIZE		(1UL << 30)
 #define	DEFAULT_JOURNAL_SIZE	MAX_LOG_SIZE
+#define	CHUNK_INIT_NTHREAD	16	/* max threads to init chunks */
 
 static int	ioch_desc = -1;	     /* io channel index */
 
@@ -102,6 +103,7 @@ typedef struct opts_mkfs {
 	size_t		logsize;
 	size_t		sectsize;
 	int		numhosts;
+	int		njobs;	/* threads to init chunks */
 	bool		force;	/* forcedly mkfs */
 } opts_mkfs_t;
 
@@ -109,6 +111,7 @@ static struct option mkfs_long_opts[] = {
 	{ "log-size",	optional_argument,	NULL,	'l' },
 	{ "sector-size", optional_argument,	NULL,	's' },
 	{ "num-users",	optional_argument,	NULL,	'u' },
+	{ "jobs",	optional_argument,	NULL,	'j' },
 	{ "force", optional_argument,		NULL,	'f' },
 	{ 0 },
 };
@@ -221,6 +224,8 @@ metaobj_init(pfs_metaobj_phy_t *mo, int mtype, uint32_t oid, uint64_t ckno)
  *
  * 	Init the metaset in a physical chunk. @sectbda is the first
  * 	page bda for the metaset. After init, a new page bda is returned.
+ * 	All pages of the metaset are built in memory and written by IOs
+ * 	of at most PFS_FRAG_SIZE.
  */
 int
 metaset_init(pfs_chunk_phy_t *phyck, int mtype, uint64_t *sectbda_ptr)
@@ -229,8 +234,9 @@ metaset_init(pfs_chunk_phy_t *phyck, int mtype, uint64_t *sectbda_ptr)
 	uint32_t fi, oi;
 	uint32_t oid, nobj_perpage, opcs;
 	pfs_metaset_phy_t *ms;
-	pfs_metaobj_phy_t *mobuf;
+	pfs_metaobj_phy_t *mobuf, *mo;
 	uint64_t sectbda = *sectbda_ptr;
+	size_t buflen, off, len;
 
 	ms = &phyck->ck_physet[mtype];
 	ms->ms_sectbda = sectbda;
@@ -241,44 +247,66 @@ metaset_init(pfs_chunk_phy_t *phyck, int mtype, uint64_t *sectbda_ptr)
 	//opcs = (uint32_t)ceil(log2(nobj_perchunk[mtype]));
 
 	oid = 0;
-	mobuf = (pfs_metaobj_phy_t *)malloc(PBD_SECTOR_SIZE);
-	if (mobuf == NULL) {
+	buflen = (size_t)ms->ms_nsect * PBD_SECTOR_SIZE;
+	err = posix_memalign((void **)&mobuf, PBD_SECTOR_SIZE, buflen);
+	if (err != 0) {
 		pfs_etrace("Error in malloc memory when mkfs\n");
 		exit(ENOMEM);
 	}
 
-	err = 0;
+	memset(mobuf, 0, buflen);
+	mo = mobuf;
 	for (fi = 0; fi < ms->ms_nsect; fi++) {
-		memset(mobuf, 0, PBD_SECTOR_SIZE);
 		for (oi = 0; oi < nobj_perpage; oi++) {
-			mobuf[oi].mo_number =
-			    MONO_MAKE(phyck->ck_number << opcs, oid);
-			metaobj_init(&mobuf[oi], mtype, oid, phyck->ck_number);
+			mo->mo_number = MONO_MAKE(phyck->ck_number << opcs, oid);
+			metaobj_init(mo, mtype, oid, phyck->ck_number);
+			mo++;
 			oid++;
 		}
-		err = pfsdev_pwrite(ioch_desc, mobuf, PBD_SECTOR_SIZE, sectbda);
+	}
+
+	for (off = 0; off < buflen; off += len) {
+		len = MIN(buflen - off, (size_t)PFS_FRAG_SIZE);
+		err = pfsdev_pwrite(ioch_desc, (char *)mobuf + off, len,
+		    sectbda + off);
 		if (err < 0) {
 			pfs_etrace("Error in pwrite when mkfs\n");
 			goto out;
 		}
-		sectbda += PBD_SECTOR_SIZE;
 	}
+	sectbda += buflen;
 
 out:
 	free(mobuf);
 	if (err < 0)
 		return err;
 
-	printf("\t\tmetaset %8lx/%d: sectbda %#16lx, npage %8u, objsize %4u, nobj %4u, "
-	    "oid range [%8lx, %8lx)\n", phyck->ck_number, mtype, ms->ms_sectbda,
-	    ms->ms_nsect, ms->ms_objsize, nobj_perchunk[mtype],
-	    MONO_MAKE(phyck->ck_number << opcs, 0),
-	    MONO_MAKE(phyck->ck_number << opcs, nobj_perchunk[mtype]-1) + 1);
-
 	*sectbda_ptr = sectbda;
 	return 0;
 }
 
+static void
+chunk_print(const pfs_chunk_phy_t *phyck)
+{
+	int mtype;
+	uint32_t opcs;
+	const pfs_metaset_phy_t *ms;
+
+	printf("Init chunk %lu\n", phyck->ck_number);
+	for (mtype = MT_BLKTAG; mtype <= MT_INODE; mtype++) {
+		ms = &phyck->ck_physet[mtype];
+		opcs = ffs(roundup_power2(nobj_perchunk[mtype])) - 1;
+		printf("\t\tmetaset %8lx/%d: sectbda %#16lx, npage %8u, "
+		    "objsize %4u, nobj %4u, oid range [%8lx, %8lx)\n",
+		    phyck->ck_number, mtype, ms->ms_sectbda, ms->ms_nsect,
+		    ms->ms_objsize, nobj_perchunk[mtype],
+		    MONO_MAKE(phyck->ck_number << opcs, 0),
+		    MONO_MAKE(phyck->ck_number << opcs,
+		    nobj_perchunk[mtype]-1) + 1);
+	}
+	printf("\n");
+}
+
 static int
 chunk_init(pfs_chunk_phy_t *phyck, uint32_t ckno)
 {
@@ -292,7 +320,6 @@ chunk_init(pfs_chunk_phy_t *phyck, uint32_t ckno)
 	phyck->ck_sectsize	= PBD_SECTOR_SIZE;
 	phyck->ck_nchunk	= pbd_disksize / pbd_chunksize;
 
-	printf("Init chunk %u\n", ckno);
 	sectbda = pbd_chunksize * ckno + PBD_SECTOR_SIZE;
 				/* first page for chunk info */
 
@@ -317,11 +344,117 @@ chunk_init(pfs_chunk_phy_t *phyck, uint32_t ckno)
 	/* generate checksum */
 	phyck->ck_checksum = crc32c_compute(phyck, sizeof(*phyck),
 	    offsetof(struct pfs_chunk_phy, ck_checksum));
-
-	printf("\n");
 	return 0;
 }
 
+typedef struct chunk_init_ctx {
+	int64_t		c_begin;
+	int64_t		c_next;		/* next chunk to init */
+	int64_t		c_end;
+	int		c_err;
+	pthread_mutex_t	c_mtx;
+	pthread_cond_t	c_cond;		/* a chunk is done or failed */
+	bool		*c_done;
+	pfs_chunk_phy_t	*c_phyck;	/* headers of done chunks to print */
+} chunk_init_ctx_t;
+
+static void *
+chunk_init_worker(void *arg)
+{
+	int err;
+	int64_t ckno;
+	char buf[PBD_SECTOR_SIZE];
+	chunk_init_ctx_t *ctx = (chunk_init_ctx_t *)arg;
+
+	while (__atomic_load_n(&ctx->c_err, __ATOMIC_ACQUIRE) == 0) {
+		ckno = __atomic_fetch_add(&ctx->c_next, 1, __ATOMIC_ACQ_REL);
+		if (ckno >= ctx->c_end)
+			break;
+
+		memset(buf, 0, PBD_SECTOR_SIZE);
+		err = chunk_init((pfs_chunk_phy_t *)buf, ckno);
+		if (err < 0) {
+			pfs_etrace("Error in init chunk %ld\n", ckno);
+			goto fail;
+		}
+		err = pfsdev_pwrite(ioch_desc, buf, PBD_SECTOR_SIZE,
+		    ckno * pbd_chunksize);
+		if (err < 0) {
+			pfs_etrace("Error in pwrite chunk %ld header\n", ckno);
+			goto fail;
+		}
+
+		pthread_mutex_lock(&ctx->c_mtx);
+		ctx->c_phyck[ckno - ctx->c_begin] = *(pfs_chunk_phy_t *)buf;
+		ctx->c_done[ckno - ctx->c_begin] = true;
+		pthread_cond_broadcast(&ctx->c_cond);
+		pthread_mutex_unlock(&ctx->c_mtx);
+	}
+	return NULL;
+
+fail:
+	pthread_mutex_lock(&ctx->c_mtx);
+	if (ctx->c_err == 0)
+		__atomic_store_n(&ctx->c_err, err, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&ctx->c_cond);
+	pthread_mutex_unlock(&ctx->c_mtx);
+	return NULL;
+}
+
+/*
+ * Init chunks in [begin, end) by a pool of at most nthread threads.
+ * Chunks are independent of each other, and a chunk header is still
+ * written after its metasets, so the result on disk doesn't depend on
+ * the order. The caller prints the chunks in order as they are done.
+ */
+static int
+chunk_init_parallel(int64_t begin, int64_t end, int nthread)
+{
+	int i, err;
+	int64_t ckno;
+	pthread_t tids[CHUNK_INIT_NTHREAD];
+	chunk_init_ctx_t ctx;
+
+	ctx.c_begin = begin;
+	ctx.c_next = begin;
+	ctx.c_end = end;
+	ctx.c_err = 0;
+	pthread_mutex_init(&ctx.c_mtx, NULL);
+	pthread_cond_init(&ctx.c_cond, NULL);
+	ctx.c_done = (bool *)calloc(end - begin, sizeof(bool));
+	ctx.c_phyck = (pfs_chunk_phy_t *)calloc(end - begin,
+	    sizeof(pfs_chunk_phy_t));
+	if (ctx.c_done == NULL || ctx.c_phyck == NULL) {
+		pfs_etrace("Error in malloc memory when mkfs\n");
+		exit(ENOMEM);
+	}
+
+	nthread = (int)MIN((int64_t)nthread, end - begin);
+	for (i = 0; i < nthread; i++) {
+		err = pthread_create(&tids[i], NULL, chunk_init_worker, &ctx);
+		PFS_ASSERT(err == 0);
+	}
+
+	pthread_mutex_lock(&ctx.c_mtx);
+	for (ckno = begin; ckno < end && ctx.c_err == 0; ckno++) {
+		while (!ctx.c_done[ckno - begin] && ctx.c_err == 0)
+			pthread_cond_wait(&ctx.c_cond, &ctx.c_mtx);
+		if (ctx.c_err == 0)
+			chunk_print(&ctx.c_phyck[ckno - begin]);
+	}
+	pthread_mutex_unlock(&ctx.c_mtx);
+
+	for (i = 0; i < nthread; i++) {
+		err = pthread_join(tids[i], NULL);
+		PFS_ASSERT(err == 0);
+	}
+	pthread_cond_destroy(&ctx.c_cond);
+	pthread_mutex_destroy(&ctx.c_mtx);
+	free(ctx.c_phyck);
+	free(ctx.c_done);
+	return ctx.c_err;
+}
+
 int
 paxos_file_make(pfs_mount_t *mnt, int nuser, size_t logsize)
 {
@@ -589,8 +722,10 @@ usage_mkfs()
 	    "  -l, --log-size=size:     set log size in byte\n"
 	    "  -u, --num-users=num:     set user number [1, %d]\n"
 	    "  -s, --sector-size=size:  set sector size (default is 4096)\n"
+	    "  -j, --jobs=num:          init chunks by num threads [1, %d]\n"
 	    "  -f, --force:             mkfs forcedly (default is disabled)\n"
-	    "mkfs should be executed by root\n", DEFAULT_MAX_HOSTS);
+	    "mkfs should be executed by root\n", DEFAULT_MAX_HOSTS,
+	    CHUNK_INIT_NTHREAD);
 }
 
 int
@@ -602,10 +737,11 @@ getopt_mkfs(int argc, char *argv[], cmd_opts_t *co)
 	co_mkfs->logsize = DEFAULT_JOURNAL_SIZE;
 	co_mkfs->sectsize = DEFAULT_SECTOR_SIZE;
 	co_mkfs->numhosts = DEFAULT_NUSER;
+	co_mkfs->njobs = CHUNK_INIT_NTHREAD;
 	co_mkfs->force = false;
 
 	optind = 1;
-	while ((opt = getopt_long(argc, argv, "hl:s:u:f", mkfs_long_opts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hl:s:u:j:f", mkfs_long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'l':
 			co_mkfs->logsize = strtoul(optarg, NULL, 10);
@@ -619,6 +755,10 @@ getopt_mkfs(int argc, char *argv[], cmd_opts_t *co)
 			co_mkfs->numhosts = strtoul(optarg, NULL, 10);
 			break;
 
+		case 'j':
+			co_mkfs->njobs = strtoul(optarg, NULL, 10);
+			break;
+
 		case 'f':
 			co_mkfs->force = true;
 			break;
@@ -631,31 +771,22 @@ getopt_mkfs(int argc, char *argv[], cmd_opts_t *co)
 
 	if (co_mkfs->numhosts <= 0 || co_mkfs->numhosts > DEFAULT_MAX_HOSTS)
 		return -1;
+	if (co_mkfs->njobs <= 0 || co_mkfs->njobs > CHUNK_INIT_NTHREAD)
+		return -1;
 
 	return optind;
 }
 
 int
-pfs_make()
+pfs_make(int njobs)
 {
 	int err;
-	char buf[PBD_SECTOR_SIZE];
-	uint32_t i, nchunk;
+	uint32_t nchunk;
 
 	nchunk = pbd_disksize / pbd_chunksize;
-	for (i = 0; i < nchunk; i++) {
-		memset(buf, 0, PBD_SECTOR_SIZE);
-		err = chunk_init((pfs_chunk_phy_t *)buf, i);
-		if (err < 0) {
-			pfs_etrace("Error in init chunk %u\n", i);
-			return err;
-		}
-		err = pfsdev_pwrite(ioch_desc, buf, PBD_SECTOR_SIZE, i * pbd_chunksize);
-		if (err < 0) {
-			pfs_etrace("Error in pwrite chunk %u header\n", i);
-			return err;
-		}
-	}
+	err = chunk_init_parallel(0, nchunk, njobs);
+	if (err < 0)
+		return err;
 
 	printf("Inited filesystem(%lu bytes), %u chunks, %u blktags,"
 	    " %u direntries, %u inodes per chunk\n",
@@ -702,7 +833,7 @@ cmd_mkfs(int argc, char *argv[], cmd_opts_t *co)
 	if (err < 0)
 		goto out;
 
-	err = pfs_make();
+	err = pfs_make(co_mkfs->njobs);
 	if (err < 0)
 		goto out;
 	pfsdev_close(ioch_desc);
@@ -834,19 +965,9 @@ pfs_grow(int64_t oldcknum, int64_t newcknum)
 	pfs_chunk_phy_t *phyck = (pfs_chunk_phy_t *)buf;
 
 	/* Format new chunks in [oldcknum, newcknum) */
-	for (i = oldcknum; i < newcknum; i++) {
-		memset(buf, 0, PBD_SECTOR_SIZE);
-		err = chunk_init((pfs_chunk_phy_t *)buf, i);
-		if (err < 0) {
-			pfs_etrace("Error in init chunk %ld\n", i);
-			return err;
-		}
-		err = pfsdev_pwrite(ioch_desc, buf, PBD_SECTOR_SIZE, i * pbd_chunksize);
-		if (err < 0) {
-			pfs_etrace("Error in pwrite chunk %ld header\n", i);
-			return err;
-		}
-	}
+	err = chunk_init_parallel(oldcknum, newcknum, CHUNK_INIT_NTHREAD);
+	if (err < 0)
+		return err;
 
 	/*
 	 * old chunks are in [0, oldcknum-1].
@@ -546,6 +546,28 @@ pfsd_fstat_svr(pfs_mount_t *mnt, pfs_inode_t *in, struct stat *buf,
 	return 0;
 }
 
+/*
+ * Writes through pfsd always commit their size change, so fsync only
+ * needs to flush the device cache.
+ */
+int
+pfsd_fsync_svr(pfs_mount_t *mnt, pfs_inode_t *in)
+{
+	assert (mnt && in);
+	int err = 0;
+
+	API_ENTER(DEBUG, "%ld", in->in_ino);
+
+	if (pfs_writable(mnt))
+		err = pfsdev_flush(mnt->mnt_ioch_desc);
+
+	API_EXIT(err);
+	if (err < 0)
+		return -1;
+
+	return 0;
+}
+
 static int
 _pfsd_stat_svr(const char *pbdpath, struct stat *buf)
 {
@@ -803,9 +825,14 @@ pfsd_dirent_ino(pfs_mount_t *mnt, int64_t dino, int64_t ino)
 	return NULL;
 }
 
+/*
+ * Read the entry at @ino, @offset of directory @dino. If @st is not
+ * NULL, it also gets the size, mtime and mode of the entry's inode,
+ * within the same read tx.
+ */
 int
 pfsd_readdir_svr(pfs_mount_t *mnt, int64_t dino, int64_t ino, uint64_t offset, 
-    struct dirent *entry, int64_t *next_ino)
+    struct dirent *entry, struct stat *st, int64_t *next_ino)
 {
 	int err = 0;
 	pfs_direntry_phy_t *de = NULL;
@@ -848,6 +875,14 @@ pfsd_readdir_svr(pfs_mount_t *mnt, int64_t dino, int64_t ino, uint64_t offset,
 		entry->d_ino = de->de_ino;
 		entry->d_type = in->in_type;
 		pfs_direntry_getname(mnt, de, entry->d_name, sizeof(entry->d_name));
+		if (st) {
+			st->st_ino = de->de_ino;
+			st->st_size = in->in_size;
+			st->st_mtime = in->in_mtime;
+			st->st_mode = (in->in_type == PFS_INODET_DIR) ?
+			    S_IFDIR : S_IFREG;
+			st->st_mode |= (S_IRWXU | S_IRWXG | S_IRWXO);
+		}
 
 		*next_ino = MONO_NEXT(de);
 	}
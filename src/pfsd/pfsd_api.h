@@ -39,6 +39,7 @@ int	pfsd_unlink_svr(const char *pbdpath);
 
 int	pfsd_stat_svr(const char *pbdpath, struct stat *buf);
 int	pfsd_fstat_svr(pfs_mount_t *mnt, pfs_inode_t *in, struct stat *buf, uint64_t btime);
+int	pfsd_fsync_svr(pfs_mount_t *mnt, pfs_inode_t *in);
 
 int	pfsd_fallocate_svr(pfs_mount_t *mnt, pfs_inode_t *in, off_t offset,
 	    off_t len, int mode, uint64_t btime);
@@ -46,7 +47,8 @@ int	pfsd_chdir_svr(const char *pbdpath);
 
 int	pfsd_opendir_svr(const char *pbdpath, int64_t *deno, int64_t *first_ino);
 int	pfsd_readdir_svr(pfs_mount_t *mnt, int64_t dino, int64_t ino,
-	    uint64_t offset, struct dirent *entry, int64_t *next_ino);
+	    uint64_t offset, struct dirent *entry, struct stat *st,
+	    int64_t *next_ino);
 
 off_t	pfsd_lseek_end_svr(pfs_mount_t *mnt, pfs_inode_t *in, off_t off, uint64_t btime);
 
@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <algorithm>
 
 #include "pfsd_chnl_shm.h"
 #include "pfsd_chnl_impl.h"
@@ -789,8 +790,13 @@ chnl_recover_new_mount(void *ctx, void *op, const char *fname)
 	return recover_stat;
 }
 
+/*
+ * Requests of a dead connection are not aborted here but collected in
+ * dead_conns, to be swept for all files in one pass.
+ */
 static int
-chnl_recover_shm_file(void *ctx, void *op, const char *fname)
+chnl_recover_shm_file(void *ctx, void *op, const char *fname,
+    pfsd_connset_t *dead_conns)
 {
 	bool need_mount = true;
 	bool need_abort = true;
@@ -913,9 +919,8 @@ chnl_recover_shm_file(void *ctx, void *op, const char *fname)
 		int32_t conn_id = data.ack_data.v1.shm_connect_id;
 		pfsd_info("connection %d wait abort requests", conn_id);
 		PFSD_ASSERT(pfsd_is_valid_connid(conn_id));
-		for (int i = 0; i < PFSD_SHM_MAX; ++i) {
-			pfsd_shm_svr_abort_request(g_shm[i], conn_id, true);
-		}
+		__atomic_or_fetch(dead_conns, pfsd_connset_of(conn_id),
+		    __ATOMIC_RELAXED);
 		recover_stat = RECOVER_HANDLED;
 	}
 	if (need_unlink) {
@@ -955,6 +960,60 @@ chnl_recover_filter(const char *file_name)
 }
 #endif
 
+#ifdef PFSD_SERVER
+typedef struct chnl_recover_job {
+	void		*rj_ctx;
+	void		*rj_op;
+	char		(*rj_fnames)[PFS_MAX_PATHLEN];
+	int		rj_nfile;
+	int		rj_next;
+	pfsd_connset_t	rj_dead_conns;
+	/* first mount requests, handled after all files */
+	char		rj_later[CHNL_MAX_CONN][PFS_MAX_PATHLEN];
+	int		rj_nlater;
+} chnl_recover_job_t;
+
+static void *
+chnl_recover_worker(void *arg)
+{
+	chnl_recover_job_t *rj = (chnl_recover_job_t *)arg;
+	int i, recover_stat;
+
+	while ((i = __atomic_fetch_add(&rj->rj_next, 1, __ATOMIC_RELAXED)) <
+	    rj->rj_nfile) {
+		const char *fname = rj->rj_fnames[i];
+
+		pfsd_info("recovery %s begin", fname);
+		recover_stat = chnl_recover_shm_file(rj->rj_ctx, rj->rj_op,
+		    fname, &rj->rj_dead_conns);
+		if (recover_stat == RECOVER_MOUNT_LATER) {
+			pfsd_info("This is a first mount request, handle it "
+			    "later to avoid connect id allocation collision:%s",
+			    fname);
+			int later = __atomic_fetch_add(&rj->rj_nlater, 1,
+			    __ATOMIC_RELAXED);
+			if (later < CHNL_MAX_CONN)
+				memcpy(rj->rj_later[later], fname,
+				    PFS_MAX_PATHLEN);
+			else
+				pfsd_error("Too many connections, ignore %s, "
+				    "client should wait its timeout", fname);
+		}
+		else
+			pfsd_info("recovery %s end, result:%d", fname,
+			    recover_stat);
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Pid files are recovered by up to nworkers threads. Mounts still take
+ * turns on the connect mutex, but the file io and the request sweep
+ * are done in parallel: dead connections are collected from all files
+ * and their requests freed in one pass over the shm channels, before
+ * new mounts may reuse their connect ids.
+ */
 static int
 chnl_recover_shm(void *ctx, void *op, const char *svr_addr, int nworkers,
     void *arg)
@@ -964,8 +1023,15 @@ chnl_recover_shm(void *ctx, void *op, const char *svr_addr, int nworkers,
 	int err = -1;
 	int recover_stat = RECOVER_HANDLED;
 	struct dirent *dp;
-	char fname_buf[CHNL_MAX_CONN][PFS_MAX_PATHLEN];
-	int fname_buf_index = 0;
+	chnl_recover_job_t *rj;
+	pthread_t *tids = NULL;
+	int nthread = 0, nalloc = 0, naborts, i;
+	uint64_t begin_us = gettimeofday_us();
+
+	rj = (chnl_recover_job_t *)calloc(1, sizeof(*rj));
+	PFSD_ASSERT(rj != NULL);
+	rj->rj_ctx = ctx;
+	rj->rj_op = op;
 
 	DIR *dir = opendir(svr_addr);
 	if (dir == NULL) {
@@ -990,37 +1056,47 @@ chnl_recover_shm(void *ctx, void *op, const char *svr_addr, int nworkers,
 		if (chnl_recover_filter(dp->d_name) < 0)
 			continue;
 
-		char fname[PFS_MAX_PATHLEN];
-		snprintf(fname, PFS_MAX_PATHLEN, "%s/%s", svr_addr, dp->d_name);
-		pfsd_info("recovery %s begin", fname);
-		recover_stat = chnl_recover_shm_file(ctx, op, fname);
-		if (recover_stat == RECOVER_MOUNT_LATER) {
-			pfsd_info("This is a first mount request, handle it "
-			    "later to avoid connect id allocation collision:%s",
-			    fname);
-			if (fname_buf_index < CHNL_MAX_CONN) {
-				memcpy(fname_buf[fname_buf_index], fname,
-				    sizeof(fname));
-				++fname_buf_index;
-			} else
-				pfsd_error("Too many connections, ignore %s, "
-				    "client should wait its timeout", fname);
+		if (rj->rj_nfile == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : CHNL_MAX_CONN;
+			rj->rj_fnames = (char (*)[PFS_MAX_PATHLEN])realloc(
+			    rj->rj_fnames, nalloc * PFS_MAX_PATHLEN);
+			PFSD_ASSERT(rj->rj_fnames != NULL);
 		}
-		else
-			pfsd_info("recovery %s end, result:%d", fname,
-			    recover_stat);
+		snprintf(rj->rj_fnames[rj->rj_nfile++], PFS_MAX_PATHLEN,
+		    "%s/%s", svr_addr, dp->d_name);
 	}
 
+	nthread = std::max(1, std::min(nworkers, rj->rj_nfile));
+	tids = (pthread_t *)calloc(nthread, sizeof(pthread_t));
+	for (i = 1; i < nthread; ++i) {
+		if (pthread_create(&tids[i], NULL, chnl_recover_worker, rj))
+			break;
+	}
+	chnl_recover_worker(rj);
+	while (--i > 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
 fini:
 	if (dir)
 		closedir(dir);
 
-	for (int i = 0; i < fname_buf_index; ++i) {
-		pfsd_info("mount %s begin", fname_buf[i]);
-		recover_stat = chnl_recover_new_mount(ctx, op, fname_buf[i]);
-		pfsd_info("mount %s end, %d", fname_buf[i], recover_stat);
+	naborts = pfsd_shm_abort_conns(g_shm, PFSD_SHM_MAX,
+	    rj->rj_dead_conns, std::max(1, nworkers));
+	pfsd_info("aborted %d requests of dead connections %#lx", naborts,
+	    rj->rj_dead_conns);
+
+	for (i = 0; i < std::min(rj->rj_nlater, CHNL_MAX_CONN); ++i) {
+		pfsd_info("mount %s begin", rj->rj_later[i]);
+		recover_stat = chnl_recover_new_mount(ctx, op, rj->rj_later[i]);
+		pfsd_info("mount %s end, %d", rj->rj_later[i], recover_stat);
 	}
 
+	pfsd_info("recovered %d pid files with %d threads in %lu us",
+	    rj->rj_nfile, nthread, gettimeofday_us() - begin_us);
+	free(rj->rj_fnames);
+	free(rj);
+
 	sem_post(&ch_ctx->svr.shm_listen_thread_latch);
 	pfsd_info("prepare done %d, notify listen thread", err);
 	return err;
@@ -1237,6 +1313,12 @@ chnl_getshm(chnl_ctx_shm_t *ctx)
 			    magic, PFSD_SHM_MAGIC);
 			return -1;
 		}
+
+		/* map THP backed buffers with huge pages on our side too */
+		if (((pfsd_shm_t *)ctx->clt.shm_ptr[i])->sh_flags &
+		    PFSD_SHM_F_HUGEPAGE)
+			(void)madvise(ctx->clt.shm_ptr[i], ctx->clt.shm_len[i],
+			    MADV_HUGEPAGE);
 	}
 #endif
 	return 0;
@@ -107,6 +107,11 @@ int pfsd_sdk_pbdname(const char* pbdpath, char* pbdname);
 /* only one instance running for each pbd */
 int pfsd_write_pid(const char* pbdname);
 
+/* NUMA nodes online, at least 1 */
+int pfsd_numa_nodes();
+/* node of the calling thread's cpu, -1 if unknown */
+int pfsd_numa_node();
+
 #define FILE_MAX_FNAME 512
 
 #define PFSD_MALLOC(T)  (T*)malloc(sizeof(T))
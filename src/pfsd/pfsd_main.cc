@@ -23,6 +23,7 @@
 #include "pfsd_option.h"
 
 #include "pfs_trace.h"
+#include "pfs_metrics.h"
 #include "pfsd_zlog.h"
 
 #include "pfsd_chnl.h"
@@ -100,6 +101,11 @@ int main(int ac, char *av[])
 	fprintf(stderr, "starting pfsd[%d] %s\n", getpid(), pbdname);
 	pfsd_info("starting pfsd[%d] %s", getpid(), pbdname);
 
+	pfs_metrics_set_provider(pfsd_worker_metrics);
+
+	g_shm_hugepage = g_option.o_shm_hugepage;
+	g_shm_numa = g_option.o_shm_numa;
+
 	/* init communicate shm and inotify stuff */
 	if (pfsd_chnl_listen(PFSD_USER_PID_DIR, pbdname, g_option.o_workers, 
 	    g_shm_fname, g_option.o_shm_dir) != 0) {
@@ -40,6 +40,10 @@ static bool
 sanity_check()
 {
 	PFSD_TRIM_VALUE(g_option.o_workers, 1, PFSD_WORKER_MAX);
+	/* no -m: fixed pool of o_workers */
+	if (g_option.o_min_workers <= 0)
+		g_option.o_min_workers = g_option.o_workers;
+	PFSD_TRIM_VALUE(g_option.o_min_workers, 1, g_option.o_workers);
 	PFSD_TRIM_VALUE(g_option.o_usleep, 0, 1000);
 	worker_usleep_us = g_option.o_usleep;
 
@@ -49,6 +53,7 @@ sanity_check()
 	}
 
 	fprintf(stderr, "option workers %d\n",g_option.o_workers);
+	fprintf(stderr, "option min workers %d\n",g_option.o_min_workers);
 	fprintf(stderr, "option pbdname %s\n",g_option.o_pbdname);
 	fprintf(stderr, "option server id %u\n", server_id);
 	fprintf(stderr, "option logconf %s\n",g_option.o_log_cfg);
@@ -67,13 +72,15 @@ init_default_value()
 	g_option.o_daemon = 1;
 	server_id = 0;
     g_option.o_auto_increase_epoch = 0;
+	g_option.o_shm_hugepage = 0;
+	g_option.o_shm_numa = 0;
 }
 
 int
 pfsd_parse_option(int ac, char *av[])
 {
 	int ch = 0;
-	while ((ch = getopt(ac, av, "w:s:i:c:p:a:l:e:fd:r:q")) != -1) {
+	while ((ch = getopt(ac, av, "w:m:s:i:c:p:a:l:e:fd:r:qHNb")) != -1) {
 		switch (ch) {
 			case 'f':
 				g_option.o_daemon = 0;
@@ -90,6 +97,14 @@ pfsd_parse_option(int ac, char *av[])
 						g_option.o_workers = int(w);
 				}
 				break;
+			case 'm':
+				{
+					errno = 0;
+					long w = strtol(optarg, NULL, 10);
+					if (errno == 0)
+						g_option.o_min_workers = int(w);
+				}
+				break;
 			case 's':
 				{
 					errno = 0;
@@ -128,6 +143,15 @@ pfsd_parse_option(int ac, char *av[])
             case 'q':
                 g_option.o_auto_increase_epoch = 1;
                 break;
+			case 'H':
+				g_option.o_shm_hugepage = 1;
+				break;
+			case 'N':
+				g_option.o_shm_numa = 1;
+				break;
+			case 'b':
+				g_option.o_affinity = 1;
+				break;
 			default:
 				return -1;
 		}
@@ -148,10 +172,14 @@ pfsd_usage(const char *prog)
 	fprintf(stderr, "Usage: %s \n"
 					" -f (not daemon mode)\n"
 					" -w #nworkers\n"
+					" -m #min nworkers (grow up to -w on load)\n"
 					" -c log_config_file\n"
+					" -b (bind io workers to cpus)\n"
 					" -p pbdname\n"
 					" -e db ins id\n"
 					" -a shm directory\n"
+					" -H (shm channels on huge pages)\n"
+					" -N (shm channels per NUMA node)\n"
 					" -i #inode_list_size\n", prog);
 }
 
@@ -22,6 +22,8 @@ typedef struct {
     int o_pollers;
 	/* Worker threads, same as num of channels */
 	int o_workers;
+	/* Min worker threads, the pool grows up to o_workers on load */
+	int o_min_workers;
 	/* Worker thread usleep interval in us */
 	int o_usleep;
 	/* pbdname like 1-1 */
@@ -36,6 +38,10 @@ typedef struct {
 	int o_affinity;
     /* auto increase epoch when mount which write mode */
     int o_auto_increase_epoch;
+	/* back shm channels with huge pages */
+	int o_shm_hugepage;
+	/* split shm channels per NUMA node */
+	int o_shm_numa;
 } pfsd_option_t;
 
 extern pfsd_option_t g_option;
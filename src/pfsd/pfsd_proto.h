@@ -45,6 +45,9 @@ enum {
 	PFSD_REQUEST_LSEEK,
 	PFSD_REQUEST_GROWFS,
     PFSD_REQUEST_INCREASEEPOCH,
+	PFSD_REQUEST_FSYNC,
+	PFSD_REQUEST_READDIRPLUS,
+	PFSD_REQUEST_NTYPE,	/* keep it last of requests */
 
 	PFSD_RESPONSE_MOUNT = 1000, /* Deprecated */
 	PFSD_RESPONSE_OPEN,
@@ -66,6 +69,8 @@ enum {
 	PFSD_RESPONSE_LSEEK,
 	PFSD_RESPONSE_GROWFS,
     PFSD_RESPONSE_INCREASEEPOCH,
+	PFSD_RESPONSE_FSYNC,
+	PFSD_RESPONSE_READDIRPLUS,
 };
 
 inline
@@ -94,11 +99,36 @@ const char* pfsd_req_type_string(int type)
 		ENUM_TYPE_STR(PFSD_REQUEST_ACCESS)
 		ENUM_TYPE_STR(PFSD_REQUEST_RENAME)
 		ENUM_TYPE_STR(PFSD_REQUEST_LSEEK)
+		ENUM_TYPE_STR(PFSD_REQUEST_GROWFS)
+		ENUM_TYPE_STR(PFSD_REQUEST_INCREASEEPOCH)
+		ENUM_TYPE_STR(PFSD_REQUEST_FSYNC)
+		ENUM_TYPE_STR(PFSD_REQUEST_READDIRPLUS)
 	}
 
 	return "Unknow request";
 }
 
+/* Whether the request may change attributes of any inode */
+inline
+bool pfsd_req_changes_meta(int type)
+{
+	switch (type) {
+		case PFSD_REQUEST_OPEN:
+		case PFSD_REQUEST_WRITE:
+		case PFSD_REQUEST_FTRUNCATE:
+		case PFSD_REQUEST_TRUNCATE:
+		case PFSD_REQUEST_UNLINK:
+		case PFSD_REQUEST_FALLOCATE:
+		case PFSD_REQUEST_MKDIR:
+		case PFSD_REQUEST_RMDIR:
+		case PFSD_REQUEST_RENAME:
+		case PFSD_REQUEST_GROWFS:
+			return true;
+	}
+
+	return false;
+}
+
 typedef enum pfsd_req_shm_state {
 	/**
 	 * Init state
@@ -127,9 +157,22 @@ typedef enum pfsd_req_shm_state {
 
 	/**
 	 * The requester will not need the reply. Replier can set it to CHNL_FREE
+	 * when the request is done, see pfsd_shm_done_request.
 	 */
 	REQ_ZOMBIE,
 
+	/**
+	 * The slot lends its buffer to the request at index repoch, whose
+	 * buffer runs on over it. Freed along with that request.
+	 */
+	REQ_BORROWED,
+
+	/**
+	 * Being freed by the process in owner, which frees the slots it
+	 * borrowed first. Finished by the recycler if that process died.
+	 */
+	REQ_FREEING,
+
 	/**
 	 * The replier can not generate reply due to restart. requester can set it
 	 * to CHNL_FREE.
@@ -155,6 +198,15 @@ const char* pfsd_req_state_string(int8_t state)
 		case REQ_WAIT_RELEASE:
 			return "REQ_WAIT_RELEASE";
 
+		case REQ_ZOMBIE:
+			return "REQ_ZOMBIE";
+
+		case REQ_BORROWED:
+			return "REQ_BORROWED";
+
+		case REQ_FREEING:
+			return "REQ_FREEING";
+
 		default:
 			break;
 	}
@@ -176,7 +228,7 @@ union { \
 	struct { \
 		int16_t connid; \
 		int8_t state; \
-		uint8_t _header_padding; \
+		uint8_t repoch; \
 		int32_t owner; \
 	}; \
 }
@@ -365,6 +417,18 @@ typedef struct {
 	int f_res;
 } fstat_response_t;
 
+typedef struct {
+	COMMON_REQUEST_HEADER;
+
+	int64_t f_ino;
+} fsync_request_t;
+
+typedef struct {
+	COMMON_RESPONSE_HEADER;
+
+	int f_res;
+} fsync_response_t;
+
 typedef struct {
 	COMMON_REQUEST_HEADER;
 } chdir_request_t;
@@ -449,9 +513,30 @@ typedef struct __dirstream {
 	/* For dirent buffer */
 	uint64_t d_data_offset;
 	uint64_t d_data_size;
+	bool d_data_plus;	/* pfsd_direntplus_t records, not dirents */
 	char d_data[PFSD_DIRENT_BUFFER_SIZE];
 } DIR;
 
+/*
+ * Compact dirent returned by readdirplus. Records of variable length are
+ * packed in the dirent buffer one after another, each carries the
+ * attributes of its inode so that no stat round trip is needed.
+ * dp_name is NUL terminated and dp_reclen keeps records 8 bytes aligned.
+ */
+typedef struct pfsd_direntplus {
+	int64_t dp_ino;
+	int64_t dp_size;
+	int64_t dp_mtime;
+	uint32_t dp_mode;
+	uint16_t dp_reclen;
+	uint16_t dp_namelen;
+	uint8_t dp_type;
+	char dp_name[0];
+} pfsd_direntplus_t;
+
+#define PFSD_DIRENTPLUS_RECLEN(namelen) \
+	(((offsetof(pfsd_direntplus_t, dp_name) + (namelen) + 1) + 7) & ~7UL)
+
 typedef struct {
 	COMMON_REQUEST_HEADER;
 
@@ -484,6 +569,8 @@ typedef struct {
 
 typedef struct pfsd_request {
 	uint32_t shm_epoch;
+	/* buffer units, the shm_nunit - 1 slots after it are REQ_BORROWED */
+	uint16_t shm_nunit;
 	union {
 		/* for convenience, same as COMMON_REQUEST_HEADER */
 		struct {
@@ -509,6 +596,7 @@ typedef struct pfsd_request {
 		rename_request_t re_req;
 		lseek_request_t l_req;
 		access_request_t a_req;
+		fsync_request_t fs_req;
 
 		pfsd_request_holder_t holder;
 	};
@@ -533,6 +621,31 @@ inline int8_t pfsd_request_get_state(int64_t val) {
 	return ((pfsd_request_info_t*)(&val))->state;
 }
 
+inline int32_t pfsd_request_get_pid(int64_t val) {
+	return ((pfsd_request_info_t*)(&val))->owner;
+}
+
+inline int16_t pfsd_request_get_connid(int64_t val) {
+	return ((pfsd_request_info_t*)(&val))->connid;
+}
+
+/*
+ * A request left over by a previous pfsd is taken over by one poller only:
+ * the CAS that takes it stores a tag of the current epoch in repoch.
+ */
+inline uint8_t pfsd_request_epoch_tag(uint32_t epoch) {
+	return (uint8_t)(epoch % 255 + 1);
+}
+
+inline int64_t pfsd_request_set_repoch(int64_t val, uint8_t tag) {
+	((pfsd_request_info_t*)(&val))->repoch = tag;
+	return val;
+}
+
+inline uint8_t pfsd_request_get_repoch(int64_t val) {
+	return ((pfsd_request_info_t*)(&val))->repoch;
+}
+
 /* compile sanity check */
 typedef char _check_request_[(sizeof(pfsd_request_t) <= 
     offsetof(pfsd_request_t, holder) + sizeof(pfsd_request_holder_t)) ? 1 : -1];
@@ -568,6 +681,7 @@ typedef struct {
 		rename_response_t re_rsp;
 		lseek_response_t l_rsp;
 		access_response_t a_rsp;
+		fsync_response_t fs_rsp;
 
 		pfsd_response_holder_t holder;
 	};
@@ -627,6 +741,10 @@ inline void pfsd_request_print(const pfsd_request_t* r, unsigned char* buf)
 			fprintf(stdout, "\t\t[f_ino %ld]\n", r->f_req.f_ino);
 			break;
 
+		case PFSD_REQUEST_FSYNC:
+			fprintf(stdout, "\t\t[f_ino %ld]\n", r->fs_req.f_ino);
+			break;
+
 		case PFSD_REQUEST_STAT:
 			fprintf(stdout, "\t\t[file %s]\n", buf);
 			break;
@@ -648,6 +766,7 @@ inline void pfsd_request_print(const pfsd_request_t* r, unsigned char* buf)
 			break;
 
 		case PFSD_REQUEST_READDIR:
+		case PFSD_REQUEST_READDIRPLUS:
 			fprintf(stdout, "\t\t[r_dino %ld, r_ino %ld, r_off %lu]\n",
 							r->rd_req.r_dino,
 							r->rd_req.r_ino,
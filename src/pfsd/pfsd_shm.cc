@@ -18,6 +18,9 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <algorithm>
 
 #include "pfsd_proto.h"
 #include "pfsd_common.h"
@@ -34,16 +37,69 @@ size_t g_shm_unit_size[PFSD_SHM_MAX] = {
     PFSD_MAX_IOSIZE
 };
 pfsd_shm_t *g_shm[PFSD_SHM_MAX];
+int g_shm_hugepage;
+int g_shm_numa;
 char g_shm_fname[PFSD_SHM_MAX][FILE_MAX_FNAME];
-
-/* mutex used only by pfsd */
-static pthread_mutex_t *g_chnl_mutex[PFSD_SHM_MAX];
+/* length g_shm[i] was mapped with, rounded to the page size of the dir */
+static size_t g_shm_maplen[PFSD_SHM_MAX];
 
 static void pfsd_channel_init(pfsd_iochannel_t *);
 static int pfsd_shm_init(pfsd_shm_t *shm, int shm_index, int nch, int nreq,
-    size_t req_size);
+    size_t req_size, uint32_t flags, int nnode);
 
 #ifdef PFSD_SERVER
+#define HUGETLBFS_MAGIC_NUM	(0x958458f6)
+#define MPOL_PREFERRED_NUM	(1)
+
+/*
+ * Page size the shm files are rounded to. With huge pages on, a shm dir
+ * on hugetlbfs gets its huge page size, anything else is taken as tmpfs
+ * and gets THP.
+ */
+static size_t
+shm_page_size(const char *dir, bool *hugetlbfs)
+{
+	struct statfs sfs;
+
+	*hugetlbfs = false;
+	if (!g_shm_hugepage)
+		return getpagesize();
+	if (statfs(dir, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC_NUM) {
+		*hugetlbfs = true;
+		return sfs.f_bsize;
+	}
+	return PFSD_SHM_THP_SIZE;
+}
+
+/*
+ * Prefer each node's memory for its channel set. It must be done before
+ * the pages are touched; pages of a shm left by the last run stay put.
+ */
+static void
+shm_bind_nodes(pfsd_shm_t *shm, int nch, int nreq, size_t unit_size,
+    size_t pgsz, int nnode)
+{
+	char *channels = (char *)(shm + 1);
+	size_t chsize = pfsd_channel_size(nreq, unit_size);
+	int first, last;
+
+	for (int node = 0; node < nnode; ++node) {
+		pfsd_shm_node_channels(nch, nnode, node, &first, &last);
+		if (first >= last)
+			continue;
+
+		uintptr_t start = (uintptr_t)(channels + first * chsize);
+		uintptr_t end = (uintptr_t)(channels + last * chsize);
+		start &= ~(pgsz - 1);
+		end = (end + pgsz - 1) & ~(pgsz - 1);
+		unsigned long mask = 1UL << node;
+		if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED_NUM,
+		    &mask, sizeof(mask) * 8, 0) != 0)
+			pfsd_warn("mbind channels [%d, %d) to node %d failed "
+			    "with error %d", first, last, node, errno);
+	}
+}
+
 int
 pfsd_shm_init(const char *dir, const char *pbdname, size_t nch)
 {
@@ -54,6 +110,19 @@ pfsd_shm_init(const char *dir, const char *pbdname, size_t nch)
 
 	int shmfd = -1;
 	void *shmaddr[PFSD_SHM_MAX] = {NULL};
+	bool hugetlbfs;
+	size_t pgsz = shm_page_size(dir, &hugetlbfs);
+	uint32_t flags = PFSD_SHM_F_EXTENT | PFSD_SHM_F_METAGEN |
+	    PFSD_SHM_F_DIRPLUS | (g_shm_hugepage ? PFSD_SHM_F_HUGEPAGE : 0);
+	int nnode = 1;
+
+	if (g_shm_numa) {
+		nnode = pfsd_numa_nodes();
+		if (nnode > 64)
+			nnode = 64;
+	}
+	pfsd_info("shm page size %lu%s, numa nodes %d", pgsz,
+	    hugetlbfs ? " (hugetlbfs)" : "", nnode);
 
 	size_t total = 0;
 	/* init communicate shm */
@@ -74,6 +143,7 @@ pfsd_shm_init(const char *dir, const char *pbdname, size_t nch)
 		/* create or attach shm */
 		struct stat st;
 		size_t shmsize = pfsd_shm_size(nc, nreq, unit_size);
+		shmsize = (shmsize + pgsz - 1) & ~(pgsz - 1);
 		total += shmsize;
 		char *path = g_shm_fname[si];
 		(void)pfsd_make_shm_path(si, dir, pbdname, path,
@@ -93,7 +163,7 @@ retry:
 			goto finish;
 		}
 
-		if (st.st_size == 0) {
+		if ((size_t)st.st_size < shmsize) {
 			if (ftruncate(shmfd, shmsize) == -1) {
 				pfsd_error("ftruncate shm failed with error %d",
 				    errno);
@@ -107,9 +177,18 @@ retry:
 			pfsd_error("mmap failed with error %d", errno);
 			goto finish;
 		}
+		g_shm_maplen[si] = shmsize;
 		close(shmfd);
 		shmfd = -1;
 
+		if (g_shm_hugepage && !hugetlbfs &&
+		    madvise(shmaddr[si], shmsize, MADV_HUGEPAGE) != 0)
+			pfsd_warn("madvise hugepage failed with error %d, "
+			    "check transparent_hugepage/shmem_enabled", errno);
+		if (nnode > 1)
+			shm_bind_nodes((pfsd_shm_t *)shmaddr[si], (int)nc, nreq,
+			    unit_size, pgsz, nnode);
+
 		pfsd_info("unit %lu, ch %lu, nreq %d, sizeof pfsd_shm %gM",
 			unit_size, nc, nreq, shmsize/1024.0/1024.0);
 
@@ -119,13 +198,15 @@ retry:
 			/* not compatiable, unlink and retry */
 			pfsd_warn("shm not compatiable, "
 			    "will remove %s and recreate", path);
-			munmap(g_shm[si], g_shm[si]->sh_size);
+			munmap(g_shm[si], g_shm_maplen[si]);
+			g_shm[si] = NULL;
 			unlink(path);
 
 			goto retry;
 		}
 
-		if (pfsd_shm_init(g_shm[si], si, (int)nc, nreq, unit_size) != 0) {
+		if (pfsd_shm_init(g_shm[si], si, (int)nc, nreq, unit_size,
+		    flags, nnode) != 0) {
 			pfsd_error("pfsd_shm_init failed!");
 			goto finish;
 		}
@@ -137,31 +218,20 @@ finish:
 	if (shmfd >= 0)
 		close(shmfd);
 
-	for (int si = 0; si < PFSD_SHM_MAX; ++si) {
-		if (g_shm[si] != NULL) {
-			munmap(g_shm[si], g_shm[si]->sh_size);
-			g_shm[si] = NULL;
-		}
-	}
-
+	pfsd_shm_fini();
 	pfsd_error("failed init shm: %s", strerror(errno));
 	return -1;
 }
 
 static int
-pfsd_shm_init(pfsd_shm_t *shm, int index, int nch, int nreq, size_t unit_size)
+pfsd_shm_init(pfsd_shm_t *shm, int index, int nch, int nreq, size_t unit_size,
+    uint32_t flags, int nnode)
 {
 	if (shm == NULL || nch <= 0)
 		return -1;
 
 	assert (IS_2_POWER(nreq));
 
-	g_chnl_mutex[index] = (pthread_mutex_t *)malloc(nch * sizeof(pthread_mutex_t));
-	for (int ci = 0; ci < nch; ++ci) {
-		int r = pthread_mutex_init(&g_chnl_mutex[index][ci], NULL);
-		PFSD_ASSERT(r == 0);
-	}
-
 	shm->sh_index = index;
 	if (shm->sh_magic == PFSD_SHM_MAGIC) {
 		if (shm->sh_version != PFSD_SHM_VERSION) {
@@ -195,6 +265,10 @@ pfsd_shm_init(pfsd_shm_t *shm, int index, int nch, int nreq, size_t unit_size)
 		 * is bigger than req->shm_epoch, so we plus 2 here.
 		 */
 		shm->sh_epoch += 2;
+		/* metadata may change while pfsd is down */
+		shm->sh_meta_gen++;
+		shm->sh_flags = flags;
+		shm->sh_nnode = nnode;
 		char *channels = (char *)(shm + 1);
 		for (int ci = 0; ci < nch; ++ci)  {
 			pfsd_iochannel_t *ch =
@@ -215,6 +289,8 @@ pfsd_shm_init(pfsd_shm_t *shm, int index, int nch, int nreq, size_t unit_size)
 
 	shm->sh_size = pfsd_shm_size(nch, nreq, unit_size);
 	shm->sh_nch = nch;
+	shm->sh_flags = flags;
+	shm->sh_nnode = nnode;
 	char *channels = (char *)(shm + 1);
 	for (int ci = 0; ci < nch; ++ci) {
 		pfsd_iochannel_t *ch =
@@ -277,6 +353,7 @@ pfsd_shm_attach(const char *dir, const char *pbdname, int wr_attach)
 			    errno);
 			goto finish;
 		}
+		g_shm_maplen[si] = st.st_size;
 
 		close(shmfd);
 		shmfd = -1;
@@ -289,15 +366,25 @@ finish:
 	if (shmfd >= 0)
 		close(shmfd);
 
+	pfsd_shm_fini();
+	fprintf(stderr, "[pfsd] %s failed\n", __FUNCTION__);
+	return -1;
+}
+
+/*
+ * sh_size is not what was mapped: the files are rounded up to the page
+ * size of the shm dir, and munmap of hugetlbfs takes whole huge pages.
+ */
+void
+pfsd_shm_fini()
+{
 	for (int si = 0; si < PFSD_SHM_MAX; ++si) {
 		if (g_shm[si] != NULL) {
-			munmap(g_shm[si], g_shm[si]->sh_size);
+			munmap(g_shm[si], g_shm_maplen[si]);
 			g_shm[si] = NULL;
+			g_shm_maplen[si] = 0;
 		}
 	}
-
-	fprintf(stderr, "[pfsd] %s failed\n", __FUNCTION__);
-	return -1;
 }
 
 void
@@ -461,6 +548,140 @@ pfsd_shm_destroy(pfsd_shm_t *shm)
 }
 #endif // PFSD_SERVER
 
+/*
+ * Slot ownership is moved only by CAS on the packed val word, there is
+ * no lock between the pollers, the recycler and abort. A slot a worker
+ * is still on is never freed by anyone else: abort turns it into
+ * REQ_ZOMBIE and the worker frees it in pfsd_shm_done_request.
+ *
+ * A request may run its buffer on over the slots after it, which are
+ * REQ_BORROWED and name it in repoch. The head slot is taken first and
+ * freed last, a borrowed slot whose head does not cover it any more is
+ * an orphan and freed by whoever finds it. Freeing the head first would
+ * let its slots be lent to a new head at the same index before they are
+ * freed, by a late free of the old one.
+ */
+
+/* Request is in this pfsd's hands, a worker may be on it */
+static inline bool
+pfsd_request_inflight(pfsd_iochannel_t *ch, pfsd_request_t *r, int64_t val)
+{
+	int state = pfsd_request_get_state(val);
+
+	if (state != REQ_IN_PROGRESS && state != REQ_ZOMBIE)
+		return false;
+	return r->shm_epoch == ch->ch_epoch ||
+	    pfsd_request_get_repoch(val) == pfsd_request_epoch_tag(ch->ch_epoch);
+}
+
+static inline int64_t
+pfsd_request_free_val()
+{
+	int64_t val = 0;
+
+	val = pfsd_request_set_pid(val, PFSD_INVALID_PID);
+	val = pfsd_request_set_connid(val, -1);
+	val = pfsd_request_set_state(val, REQ_FREE);
+	return val;
+}
+
+/*
+ * Slots the request takes, shm_nunit is only kept by clients of a shm
+ * that lends slots.
+ */
+static inline int
+pfsd_request_nunit(pfsd_iochannel_t *ch, pfsd_request_t *r)
+{
+	if ((pfsd_channel_shm(ch)->sh_flags & PFSD_SHM_F_EXTENT) == 0)
+		return 1;
+	return __atomic_load_n(&r->shm_nunit, __ATOMIC_RELAXED);
+}
+
+/* Borrowed slot at index, with val, is not covered by its head */
+static bool
+pfsd_request_orphan(pfsd_iochannel_t *ch, int index, int64_t val)
+{
+	int head = pfsd_request_get_repoch(val);
+	pfsd_request_t *h;
+	int64_t hval;
+
+	if (head >= index)
+		return true;
+	h = &ch->ch_requests[head];
+	hval = __atomic_load_n(&h->val, __ATOMIC_ACQUIRE);
+	return pfsd_request_get_state(hval) == REQ_FREE ||
+	    pfsd_request_get_state(hval) == REQ_BORROWED ||
+	    pfsd_request_get_pid(hval) != pfsd_request_get_pid(val) ||
+	    pfsd_request_get_connid(hval) != pfsd_request_get_connid(val) ||
+	    index >= head + pfsd_request_nunit(ch, h);
+}
+
+/*
+ * Buffer the request at index may use, checked against the slots it
+ * claims to borrow: 0 if any of them is not REQ_BORROWED naming it.
+ * shm_nunit is written by the client, pfsd may not trust it.
+ */
+size_t
+pfsd_shm_request_bufsize(pfsd_iochannel_t *ch, int index)
+{
+	int nunit = pfsd_request_nunit(ch, &ch->ch_requests[index]);
+
+	if (nunit <= 1)
+		return ch->ch_unitsize;
+	if (nunit > PFSD_SHM_MAX_EXTENT || index + nunit > ch->ch_max_req)
+		return 0;
+	for (int i = index + 1; i < index + nunit; ++i) {
+		int64_t val = __atomic_load_n(&ch->ch_requests[i].val,
+		    __ATOMIC_ACQUIRE);
+		if (pfsd_request_get_state(val) != REQ_BORROWED ||
+		    pfsd_request_get_repoch(val) != index)
+			return 0;
+	}
+	return (size_t)ch->ch_unitsize * nunit;
+}
+
+/* Free the slots borrowed by the request at head, up to nunit */
+static void
+pfsd_shm_free_tails(pfsd_iochannel_t *ch, int head, int nunit)
+{
+	for (int i = head + 1; i < head + nunit && i < ch->ch_max_req; ++i) {
+		pfsd_request_t *t = &ch->ch_requests[i];
+		int64_t old_val;
+	retry:
+		old_val = __atomic_load_n(&t->val, __ATOMIC_ACQUIRE);
+		if (pfsd_request_get_state(old_val) != REQ_BORROWED ||
+		    pfsd_request_get_repoch(old_val) != head)
+			continue;
+		if (!__sync_bool_compare_and_swap(&t->val, old_val,
+		    pfsd_request_free_val()))
+			goto retry;
+		(void)__sync_or_and_fetch(&ch->ch_free_bitmap, (0x1UL << i));
+	}
+}
+
+/*
+ * Free the slot if val is still old_val, along with the slots it
+ * borrowed. The slot is held in REQ_FREEING until they are free, so its
+ * index can not head new ones meanwhile. The bitmap follows the release.
+ */
+static bool
+pfsd_shm_free_slot(pfsd_iochannel_t *ch, int index, int64_t old_val)
+{
+	pfsd_request_t *r = &ch->ch_requests[index];
+	int64_t new_val = pfsd_request_set_pid(old_val, getpid());
+
+	new_val = pfsd_request_set_state(new_val, REQ_FREEING);
+
+	if (!__sync_bool_compare_and_swap(&r->val, old_val, new_val))
+		return false;
+	if (pfsd_request_get_state(old_val) != REQ_BORROWED)
+		pfsd_shm_free_tails(ch, index, pfsd_request_nunit(ch, r));
+	r->shm_nunit = 1;
+	__atomic_store_n(&r->val, pfsd_request_free_val(), __ATOMIC_RELEASE);
+	(void)__sync_or_and_fetch(&ch->ch_free_bitmap, (0x1UL << index));
+	return true;
+}
+
 #ifdef PFSD_CLIENT
 pfsd_request_t *
 pfsd_shm_get_request(pfsd_iochannel_t *ch, int connid)
@@ -508,6 +729,7 @@ retry:
 		(void)__sync_and_and_fetch(&ch->ch_free_bitmap, ~(0x1UL << index));
 
 		req->shm_epoch = ch->ch_epoch;
+		req->shm_nunit = 1;
 		int r = sem_init(&ch->ch_responses[index].r_sem,
 		    PTHREAD_PROCESS_SHARED, 0);
 		PFSD_ASSERT (r == 0);
@@ -516,6 +738,79 @@ retry:
 	return req;
 }
 
+pfsd_request_t *
+pfsd_shm_get_extent(pfsd_iochannel_t *ch, int connid, int nunit)
+{
+	if (nunit <= 1)
+		return pfsd_shm_get_request(ch, connid);
+
+	PFSD_ASSERT (ch->ch_magic == PFSD_SHM_MAGIC);
+	if (nunit > ch->ch_max_req)
+		return NULL;
+
+	pid_t pid = getpid();
+	int index, k;
+	int64_t old_val, new_val, tail_val;
+	pfsd_request_t *req;
+	uint64_t mask = uint64_t(-1);
+	uint64_t bmp, run;
+
+retry:
+	/* run has bit i set if slots [i, i + nunit) look free */
+	bmp = ch->ch_free_bitmap;
+	run = bmp & mask;
+	for (k = 1; k < nunit; ++k)
+		run &= bmp >> k;
+	run &= (0x1UL << (ch->ch_max_req - nunit + 1)) - 1;
+	index = ffsl((long)run) - 1;
+	if (index < 0)
+		return NULL;
+
+	mask &= ~(0x1UL << index);
+	req = &ch->ch_requests[index];
+
+	/* head first, so a borrowed slot is never seen without its head */
+	old_val = req->val;
+	if (pfsd_request_get_state(old_val) != REQ_FREE)
+		goto retry;
+	new_val = 0;
+	new_val = pfsd_request_set_pid(new_val, pid);
+	new_val = pfsd_request_set_connid(new_val, (int8_t)connid);
+	tail_val = pfsd_request_set_state(new_val, REQ_BORROWED);
+	tail_val = pfsd_request_set_repoch(tail_val, index);
+	new_val = pfsd_request_set_state(new_val, REQ_ALLOC);
+	if (!__sync_bool_compare_and_swap(&req->val, old_val, new_val))
+		goto retry;
+	req->shm_nunit = nunit;
+
+	for (k = 1; k < nunit; ++k) {
+		pfsd_request_t *t = &ch->ch_requests[index + k];
+		old_val = t->val;
+		if (pfsd_request_get_state(old_val) != REQ_FREE ||
+		    !__sync_bool_compare_and_swap(&t->val, old_val, tail_val))
+			break;
+	}
+	if (k < nunit) {
+		/* lost a slot to someone else, give back what we got */
+		pfsd_shm_free_tails(ch, index, k);
+		req->shm_nunit = 1;
+		if (!__sync_bool_compare_and_swap(&req->val, new_val,
+		    pfsd_request_free_val()))
+			PFSD_ASSERT(!"give back request failed");
+		goto retry;
+	}
+
+	(void)__sync_and_and_fetch(&ch->ch_free_bitmap,
+	    ~(((0x1UL << nunit) - 1) << index));
+
+	req->shm_epoch = ch->ch_epoch;
+	int r = sem_init(&ch->ch_responses[index].r_sem,
+	    PTHREAD_PROCESS_SHARED, 0);
+	PFSD_ASSERT (r == 0);
+
+	return req;
+}
+
 int
 pfsd_shm_put_request(pfsd_iochannel_t *ch, pfsd_request_t *req)
 {
@@ -538,6 +833,10 @@ pfsd_shm_put_request(pfsd_iochannel_t *ch, pfsd_request_t *req)
 
 	PFSD_ASSERT(req->owner == pid);
 
+	/* If pg crash at here, the borrowed slots are freed with req */
+	pfsd_shm_free_tails(ch, index, pfsd_request_nunit(ch, req));
+	req->shm_nunit = 1;
+
 	/*
 	 * If pg crash at here, req hasn't be put to free bitmap,
 	 * It can't be reused. But main process will recycle it eventually.
@@ -578,21 +877,27 @@ pfsd_shm_send_request(pfsd_iochannel_t *ch, pfsd_request_t *req)
 #ifdef PFSD_SERVER
 pfsd_request_t *
 pfsd_shm_fetch_request(pfsd_iochannel_t *ch)
+{
+	pfsd_request_t *req = NULL;
+
+	if (pfsd_shm_fetch_requests(ch, &req, 1) == 0)
+		return NULL;
+	return req;
+}
+
+int
+pfsd_shm_fetch_requests(pfsd_iochannel_t *ch, pfsd_request_t **reqs, int max)
 {
 	PFSD_ASSERT(ch->ch_magic == PFSD_SHM_MAGIC);
 
-	pfsd_request_t *req = NULL;
+	int nreq = 0;
+	uint8_t tag = pfsd_request_epoch_tag(ch->ch_epoch);
 
-	/* Check if has requests without lock */
 	uint64_t used_bitmap = ~(ch->ch_free_bitmap);
-	if (used_bitmap == 0)
-		return NULL;
+	if (used_bitmap == 0 || max <= 0)
+		return 0;
 
-	pfsd_shm_t *shm = pfsd_channel_shm(ch);
-	int sh_index = shm->sh_index;
-	PFSD_MUTEX_LOCK_EX(g_chnl_mutex[sh_index][ch->ch_index], NULL);
-	used_bitmap = ~(ch->ch_free_bitmap);
-	while (used_bitmap != 0) {
+	while (used_bitmap != 0 && nreq < max) {
 		int index = ffsl(long(used_bitmap));
 		assert(index > 0);
 		index--; /* ffsl return 1-based */
@@ -602,42 +907,33 @@ pfsd_shm_fetch_request(pfsd_iochannel_t *ch)
 
 		pfsd_request_t *r = &ch->ch_requests[index];
 		/*
-		 * If client dead, and pfsd handling request, set IN_PROGRESS
-		 * state, then restart. pfsd needs to continue process the
-		 * IN_PROGRESS request, return ESTALE, set to WAIT_RELEASE.
-		 * it will be recycled by main thread.
+		 * A request a previous pfsd was working on is still
+		 * IN_PROGRESS after restart, it is taken again and done as a
+		 * new one. Its client may be gone, the reply is then recycled.
 		 */
-		int64_t old_val;
+		int64_t old_val, new_val;
 	retry:
 		old_val = __atomic_load_n(&r->val, __ATOMIC_ACQUIRE);
-		if (r->state == REQ_IN_PROGRESS || r->state == REQ_WAIT_REPLY) {
-			/* if pfsd restart */
-			if (r->shm_epoch < ch->ch_epoch) {
-				/* avoid some other worker fetch me */
-				r->shm_epoch = ch->ch_epoch + 1;
-
-				bool cas;
-				int64_t new_val = pfsd_request_set_state(old_val,
+		int state = pfsd_request_get_state(old_val);
+		if (state == REQ_IN_PROGRESS || state == REQ_WAIT_REPLY) {
+			/* if pfsd restart, the tag keeps other pollers off */
+			if (r->shm_epoch < ch->ch_epoch &&
+			    pfsd_request_get_repoch(old_val) != tag) {
+				new_val = pfsd_request_set_state(old_val,
 				    REQ_IN_PROGRESS);
-				cas = __sync_bool_compare_and_swap(&r->val,
-				    old_val, new_val);
-				if (!cas)
+				new_val = pfsd_request_set_repoch(new_val, tag);
+				if (!__sync_bool_compare_and_swap(&r->val,
+				    old_val, new_val))
 					goto retry;
-				req = r;
-				break;
-			}
-
-			if (r->state == REQ_WAIT_REPLY &&
+				reqs[nreq++] = r;
+			} else if (state == REQ_WAIT_REPLY &&
 			    r->shm_epoch == ch->ch_epoch) {
-				bool cas;
-				int64_t new_val = pfsd_request_set_state(old_val,
+				new_val = pfsd_request_set_state(old_val,
 				    REQ_IN_PROGRESS);
-				cas = __sync_bool_compare_and_swap(&r->val,
-				    old_val, new_val);
-				if (!cas)
+				if (!__sync_bool_compare_and_swap(&r->val,
+				    old_val, new_val))
 					goto retry;
-				req = r;
-				break;
+				reqs[nreq++] = r;
 			}
 		}
 
@@ -645,13 +941,11 @@ pfsd_shm_fetch_request(pfsd_iochannel_t *ch)
 		uint64_t mask = 0x1UL << index;
 		used_bitmap &= ~mask;
 	}
-	PFSD_MUTEX_UNLOCK(g_chnl_mutex[sh_index][ch->ch_index]);
 	/*
-	 * if pfsd crashed here, when restart, increase epoch, sdk will recycle
-	 * old request. But what if pfsd and sdk both dead? pfsd should reset
-	 * each channel's bitmap and incr epoch under mutex protect?
+	 * If pfsd crashed here, the fetched requests are IN_PROGRESS of the
+	 * old epoch, and they are taken again after restart.
 	 */
-	return req;
+	return nreq;
 }
 
 /* worker thread done request, response is ready. */
@@ -667,13 +961,27 @@ pfsd_shm_done_request(pfsd_iochannel_t *ch, int req_index)
 	 * abort request.
 	 */
 	pfsd_request_t *req = &ch->ch_requests[req_index];
-	int64_t old_val = req->val;
-	int64_t new_val = old_val;
-	old_val = pfsd_request_set_state(old_val, REQ_IN_PROGRESS);
-	new_val = pfsd_request_set_state(new_val, REQ_WAIT_RELEASE);
-	if (!__sync_bool_compare_and_swap(&req->val, old_val, new_val)) {
+	int64_t old_val, new_val;
+retry:
+	old_val = __atomic_load_n(&req->val, __ATOMIC_ACQUIRE);
+	switch (pfsd_request_get_state(old_val)) {
+	case REQ_IN_PROGRESS:
+		new_val = pfsd_request_set_state(old_val, REQ_WAIT_RELEASE);
+		if (!__sync_bool_compare_and_swap(&req->val, old_val, new_val))
+			goto retry;
+		break;
+
+	case REQ_ZOMBIE:
+		/* aborted while in flight, nobody waits for the reply */
+		if (!pfsd_shm_free_slot(ch, req_index, old_val))
+			goto retry;
+		pfsd_info("free aborted request at (%d,%d)", ch->ch_index,
+		    req_index);
+		return;
+
+	default:
 		pfsd_fatal("req_i %d, %p, wrong state %s", req_index, req,
-		    pfsd_req_state_string(req->state));
+		    pfsd_req_state_string(pfsd_request_get_state(old_val)));
 		PFSD_ASSERT(0);
 	}
 	/* 
@@ -695,10 +1003,6 @@ pfsd_shm_recycle_request(pfsd_iochannel_t *ch)
 	const int limit = 16;
 	int recycled = 0;
 
-	pfsd_shm_t *shm = pfsd_channel_shm(ch);
-	int sh_index = shm->sh_index;
-	PFSD_MUTEX_LOCK(g_chnl_mutex[sh_index][ch->ch_index]);
-
 	uint64_t used_bitmap = uint64_t(-1);
 	while (used_bitmap != 0) {
 		if (recycled >= limit)
@@ -713,27 +1017,23 @@ pfsd_shm_recycle_request(pfsd_iochannel_t *ch)
 	retry:
 		pfsd_request_t *req = &ch->ch_requests[index];
 		int64_t old_val = __atomic_load_n(&req->val, __ATOMIC_ACQUIRE);
-		int state = req->state;
+		int state = pfsd_request_get_state(old_val);
 		int connid = req->connid;
-		if ((state == REQ_WAIT_RELEASE || state == REQ_ALLOC)
+		pid_t owner = req->owner;
+		if (((state == REQ_WAIT_RELEASE || state == REQ_ALLOC)
 		    && (!pfsd_request_alive(req)
-		    || pfsd_is_conn_closed(connid))) {
-			/* check if inflight */
-			bool cas;
-			pid_t owner = req->owner;
-			int64_t new_val = 0;
-			(void)__sync_or_and_fetch(&ch->ch_free_bitmap,
-			    (0x1UL << index));
-			new_val = pfsd_request_set_pid(new_val, PFSD_INVALID_PID);
-			new_val = pfsd_request_set_connid(new_val, -1);
-			new_val = pfsd_request_set_state(new_val, REQ_FREE);
-			cas = __sync_bool_compare_and_swap(&req->val, old_val, new_val);
-			if (cas) {
-				++recycled;
-				pfsd_info("request conn %d owner %d dead",
-				    connid, owner);
-			} else
+		    || pfsd_is_conn_closed(connid))) ||
+		    /* zombie left by a previous pfsd */
+		    (state == REQ_ZOMBIE &&
+		    !pfsd_request_inflight(ch, req, old_val)) ||
+		    (state == REQ_BORROWED &&
+		    pfsd_request_orphan(ch, index, old_val)) ||
+		    /* freer died halfway */
+		    (state == REQ_FREEING && !pfsd_request_alive(req))) {
+			if (!pfsd_shm_free_slot(ch, index, old_val))
 				goto retry;
+			++recycled;
+			pfsd_info("request conn %d owner %d dead", connid, owner);
 			//Here we do not investigate other states. Do not print
 			//logs to avoid large number of repeated logs.
 		}
@@ -742,8 +1042,6 @@ pfsd_shm_recycle_request(pfsd_iochannel_t *ch)
 		uint64_t mask = 0x1UL << index;
 		used_bitmap &= ~mask;
 	}
-
-	PFSD_MUTEX_UNLOCK(g_chnl_mutex[sh_index][ch->ch_index]);
 }
 #endif // PFSD_SERVER
 
@@ -759,87 +1057,114 @@ pfsd_shm_svr_abort_request(pfsd_shm_t *shm, int conn_id, bool forced)
 	return pfsd_shm_abort_request(shm, conn_id, PFSD_INVALID_PID, forced, true);
 }
 
-int
-pfsd_shm_abort_request(pfsd_shm_t *shm, int conn_id, pid_t pid, bool forced, bool is_svr)
-{
-	PFSD_ASSERT (shm->sh_magic == PFSD_SHM_MAGIC);
+#define ABORT_WAIT_MIN_US	100
+#define ABORT_WAIT_MAX_US	10000
+#define ABORT_CHUNK		16	/* channels a sweep thread takes at once */
 
-	int total_aborts = 0;
+static inline pfsd_iochannel_t *
+pfsd_shm_channel(pfsd_shm_t *shm, int ci)
+{
 	char *channels = (char *)(shm + 1);
 	int nreq = ((pfsd_iochannel_t *)channels)->ch_max_req;
-	for (int i = 0; i < shm->sh_nch; ++i) {
-		pfsd_iochannel_t *ch = (pfsd_iochannel_t *)(channels + i*pfsd_channel_size(nreq, shm->sh_unitsize));
-		PFSD_ASSERT (ch->ch_magic == PFSD_SHM_MAGIC);
 
-		for (;;) {
-			int waiting_req = 0;
+	return (pfsd_iochannel_t *)(channels +
+	    ci * pfsd_channel_size(nreq, shm->sh_unitsize));
+}
 
-			if (is_svr) {
-				PFSD_MUTEX_LOCK_EX(
-				    g_chnl_mutex[shm->sh_index][ch->ch_index],
-				    total_aborts);
-			}
+/*
+ * Abort the requests of connections in conns (of one pid, if given) on a
+ * channel. Requests pfsd is working on become REQ_ZOMBIE with forced and
+ * are counted in *waiting without. Without forced, requests not yet done
+ * are counted too, including those left IN_PROGRESS by a previous pfsd,
+ * which the running pfsd takes again. With forced, those are freed, as
+ * nobody is on them.
+ */
+static int
+pfsd_shm_abort_channel(pfsd_iochannel_t *ch, pfsd_connset_t conns, pid_t pid,
+    bool forced, int *waiting)
+{
+	PFSD_ASSERT (ch->ch_magic == PFSD_SHM_MAGIC);
+
+	int naborts = 0;
+	uint64_t used_bitmap = uint64_t(-1);
+	while (used_bitmap != 0) {
+		int index = ffsl(long(used_bitmap));
+		assert(index > 0);
+		index--; /* ffsl return 1-based */
+
+		if (index >= ch->ch_max_req)
+			break;
+	retry:
+		pfsd_request_t *r = &ch->ch_requests[index];
+		int64_t old_val = __atomic_load_n(&r->val, __ATOMIC_ACQUIRE);
+		bool pid_matched = (pid == PFSD_INVALID_PID || pid == r->owner);
+		int state = pfsd_request_get_state(old_val);
+		bool inflight = pfsd_request_inflight(ch, r, old_val);
+		if (pid_matched && pfsd_connset_has(conns, r->connid)) {
+			if (state == REQ_FREE || state == REQ_ZOMBIE ||
+			    state == REQ_FREEING || (state == REQ_BORROWED &&
+			    !pfsd_request_orphan(ch, index, old_val))) {
+				/* nothing to do, or freed with its head */
+			} else if (inflight && forced) {
+				int64_t new_val = pfsd_request_set_state(
+				    old_val, REQ_ZOMBIE);
+				if (!__sync_bool_compare_and_swap(&r->val,
+				    old_val, new_val))
+					goto retry;
+			} else if (inflight || (!forced &&
+			    state != REQ_ALLOC && state != REQ_WAIT_RELEASE &&
+			    state != REQ_BORROWED)) {
+				(*waiting)++;
+			} else {
+				int conn_id = r->connid;
+				pid_t owner = r->owner;
 
-			uint64_t used_bitmap = uint64_t(-1);
-			while (used_bitmap != 0) {
-				int index = ffsl(long(used_bitmap));
-				assert(index > 0);
-				index--; /* ffsl return 1-based */
-
-				if (index >= ch->ch_max_req)
-					break;
-			retry:
-				pfsd_request_t *r = &ch->ch_requests[index];
-				int64_t old_val = __atomic_load_n(&r->val,
-				    __ATOMIC_ACQUIRE);
-				bool pid_matched = (pid == PFSD_INVALID_PID || pid == r->owner);
-				int state = r->state;
-				if (pid_matched && r->connid == conn_id) {
-					if (forced || state == REQ_ALLOC ||
-					    state == REQ_WAIT_RELEASE) {
-						pid_t owner = r->owner;
-
-						(void)__sync_or_and_fetch(
-						    &ch->ch_free_bitmap,
-						    (0x1UL << index));
-						bool cas;
-						int64_t new_val = 0;
-						new_val = pfsd_request_set_pid(
-						    new_val, PFSD_INVALID_PID);
-						new_val = pfsd_request_set_connid(
-						    new_val, -1);
-						new_val = pfsd_request_set_state(
-						    new_val, REQ_FREE);
-						cas = __sync_bool_compare_and_swap(
-						    &r->val, old_val, new_val);
-						if (cas) {
+				if (!pfsd_shm_free_slot(ch, index, old_val))
+					goto retry;
 #ifdef PFSD_SERVER
-							pfsd_info(
-							    "connid %d recycle %d's request at (%d,%d)",
-							    conn_id, owner,
-							    ch->ch_index, index);
+				pfsd_info(
+				    "connid %d recycle %d's request at (%d,%d)",
+				    conn_id, owner, ch->ch_index, index);
 #else
-							PFSD_CLIENT_LOG(
-							    "connid %d recycle %d's request at (%d,%d)",
-							    conn_id, owner,
-							    ch->ch_index, index);
+				PFSD_CLIENT_LOG(
+				    "connid %d recycle %d's request at (%d,%d)",
+				    conn_id, owner, ch->ch_index, index);
 #endif
-							total_aborts++;
-						} else
-							goto retry;
-					} else if (state != REQ_FREE) {
-						waiting_req++;
-					}
-				}
-
-				/* iterate next index */
-				uint64_t mask = 0x1UL << index;
-				used_bitmap &= ~mask;
+				naborts++;
 			}
+		}
+
+		/* iterate next index */
+		uint64_t mask = 0x1UL << index;
+		used_bitmap &= ~mask;
+	}
+	return naborts;
+}
+
+/*
+ * Free the requests of a connection (of one pid, if given). Without
+ * forced, wait until every request sent to pfsd is done, so that no io
+ * of the aborted requests lands after return. That includes requests a
+ * previous pfsd left IN_PROGRESS, which are done again by the running
+ * one. With forced, requests a worker is on become REQ_ZOMBIE and are
+ * freed by the worker when done, the others are freed at once.
+ */
+int
+pfsd_shm_abort_request(pfsd_shm_t *shm, int conn_id, pid_t pid, bool forced, bool is_svr)
+{
+	PFSD_ASSERT (shm->sh_magic == PFSD_SHM_MAGIC);
 
-			if (is_svr)
-				PFSD_MUTEX_UNLOCK(g_chnl_mutex[shm->sh_index][ch->ch_index]);
+	int total_aborts = 0;
+	for (int i = 0; i < shm->sh_nch; ++i) {
+		pfsd_iochannel_t *ch = pfsd_shm_channel(shm, i);
+		int wait_us = ABORT_WAIT_MIN_US;
 
+		for (;;) {
+			int waiting_req = 0;
+
+			total_aborts += pfsd_shm_abort_channel(ch,
+			    pfsd_connset_of(conn_id), pid, forced,
+			    &waiting_req);
 			if (waiting_req == 0) {
 				break;
 			}
@@ -849,13 +1174,92 @@ pfsd_shm_abort_request(pfsd_shm_t *shm, int conn_id, pid_t pid, bool forced, boo
 #else
 			PFSD_CLIENT_LOG("inflight io %d", waiting_req);
 #endif
-			usleep(100);
+			usleep(wait_us);
+			if (wait_us < ABORT_WAIT_MAX_US)
+				wait_us *= 2;
 		}
 	}
 
 	return total_aborts;
 }
 
+typedef struct abort_sweep {
+	pfsd_shm_t	**as_shms;
+	int		as_nshm;
+	pfsd_connset_t	as_conns;
+	int		as_next;	/* next chunk, counted over all shms */
+	int		as_total;
+} abort_sweep_t;
+
+static void *
+pfsd_shm_abort_sweep(void *arg)
+{
+	abort_sweep_t *as = (abort_sweep_t *)arg;
+	int waiting = 0;
+
+	for (;;) {
+		int chunk = __atomic_fetch_add(&as->as_next, 1,
+		    __ATOMIC_RELAXED);
+		int si, nchunk = 0;
+
+		for (si = 0; si < as->as_nshm; ++si) {
+			if (as->as_shms[si] == NULL)
+				continue;
+			nchunk = (as->as_shms[si]->sh_nch + ABORT_CHUNK - 1) /
+			    ABORT_CHUNK;
+			if (chunk < nchunk)
+				break;
+			chunk -= nchunk;
+		}
+		if (si == as->as_nshm)
+			break;
+
+		pfsd_shm_t *shm = as->as_shms[si];
+		int first = chunk * ABORT_CHUNK;
+		int last = std::min(first + ABORT_CHUNK, shm->sh_nch);
+		int naborts = 0;
+		for (int ci = first; ci < last; ++ci)
+			naborts += pfsd_shm_abort_channel(
+			    pfsd_shm_channel(shm, ci), as->as_conns,
+			    PFSD_INVALID_PID, true, &waiting);
+		__atomic_add_fetch(&as->as_total, naborts, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int
+pfsd_shm_abort_conns(pfsd_shm_t *shms[], int nshm, pfsd_connset_t conns,
+    int nthread)
+{
+	abort_sweep_t as = { shms, nshm, conns, 0, 0 };
+	pthread_t *tids;
+	int nchunk = 0, i;
+
+	if (conns == 0)
+		return 0;
+	for (i = 0; i < nshm; ++i) {
+		if (shms[i] != NULL)
+			nchunk += (shms[i]->sh_nch + ABORT_CHUNK - 1) /
+			    ABORT_CHUNK;
+	}
+	nthread = std::min(nthread, nchunk);
+	if (nthread < 1)
+		nthread = 1;
+
+	/* the caller is one of the threads */
+	tids = (pthread_t *)calloc(nthread, sizeof(pthread_t));
+	for (i = 1; i < nthread; ++i) {
+		if (pthread_create(&tids[i], NULL, pfsd_shm_abort_sweep, &as))
+			break;
+	}
+	pfsd_shm_abort_sweep(&as);
+	while (--i > 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	return as.as_total;
+}
+
 #ifdef PFSD_CLIENT
 
 #define SEC2NANOSEC  (1000 * 1000 * 1000)
@@ -919,6 +1323,42 @@ pfsd_wait_io(pfsd_request_t *req, sem_t *sem)
 	}
 }
 
+/* Get a request of nunit slots from a channel of shm */
+static pfsd_request_t *
+pfsd_shm_alloc_in(pfsd_shm_t *shm, int32_t connid, int nunit,
+    pfsd_iochannel_t **och)
+{
+	char* const channels = (char*)(shm + 1);
+	size_t const unit_size = shm->sh_unitsize;
+	assert (unit_size > 0);
+	int nreq = ((pfsd_iochannel_t*)channels)->ch_max_req;
+	pfsd_iochannel_t *ch;
+	pfsd_request_t *req;
+
+	/* rand select a channel, of the local node set if any */
+	int chidx = rand() % shm->sh_nch;
+	int node = shm->sh_nnode > 1 ? pfsd_numa_node() : -1;
+	if (node >= 0 && node < shm->sh_nnode) {
+		int first, last;
+		pfsd_shm_node_channels(shm->sh_nch, shm->sh_nnode, node,
+		    &first, &last);
+		if (first < last)
+			chidx = first + rand() % (last - first);
+	}
+	for (int tried = 0; tried < shm->sh_nch; ++tried) {
+		ch = (pfsd_iochannel_t *)(channels + chidx * pfsd_channel_size(nreq, unit_size));
+		req = pfsd_shm_get_extent(ch, connid, nunit);
+		if (req != NULL) {
+			*och = ch;
+			return req;
+		}
+
+		/* try next channel */
+		chidx = (chidx + 1) % shm->sh_nch;
+	}
+	return NULL;
+}
+
 int
 pfsd_sdk_alloc_request(int32_t connid, size_t iosize, pfsd_shm_t *shm[],
     int nshm, pfsd_iochannel_t **och, pfsd_request_t **oreq)
@@ -942,22 +1382,20 @@ get_req:
 	for (si = 0; req == NULL && si < nshm; ++si) {
 		if (shm[si]->sh_unitsize < iosize)
 			continue;
+		req = pfsd_shm_alloc_in(shm[si], connid, 1, &ch);
+	}
+	/* size classes used up, borrow adjacent slots of a smaller one */
+	for (si = nshm - 1; req == NULL && si >= 0; --si) {
+		size_t unit_size = shm[si]->sh_unitsize;
+		if (unit_size >= iosize ||
+		    (shm[si]->sh_flags & PFSD_SHM_F_EXTENT) == 0)
+			continue;
 
-		char* const channels = (char*)(shm[si] + 1);
-		size_t const unit_size = g_shm_unit_size[si];
-		assert (unit_size > 0);
-		int nreq = ((pfsd_iochannel_t*)channels)->ch_max_req;
-		/* rand select a channel */
-		int chidx = rand() % shm[si]->sh_nch;
-		for (int tried = 0; tried < shm[si]->sh_nch; ++tried) {
-			ch = (pfsd_iochannel_t *)(channels + chidx * pfsd_channel_size(nreq, unit_size));
-			req = pfsd_shm_get_request(ch, connid);
-			if (req != NULL)
-				break;
-
-			/* try next channel */
-			chidx = (chidx + 1) % shm[si]->sh_nch;
-		}
+		int nreq = ((pfsd_iochannel_t*)(shm[si] + 1))->ch_max_req;
+		int nunit = (iosize + unit_size - 1) / unit_size;
+		if (nunit > PFSD_SHM_MAX_EXTENT || nunit > nreq / 2)
+			continue;
+		req = pfsd_shm_alloc_in(shm[si], connid, nunit, &ch);
 	}
 
 	if (req == NULL) {
@@ -18,6 +18,7 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include "pfsd_chnl.h"
 #include "pfsd_common.h"
 #include "pfsd_proto.h"
 
@@ -52,6 +53,24 @@ typedef struct pfsd_iochannel {
     unsigned char ch_buf[] __attribute__((aligned(4096))); /* ch_max_req * ch_unitsize */
 } pfsd_iochannel_t;
 
+/* Channel buffers are on huge pages, clients should madvise too */
+#define PFSD_SHM_F_HUGEPAGE (0x1)
+
+/* Requests may borrow the buffers of the slots after them */
+#define PFSD_SHM_F_EXTENT (0x2)
+
+/* pfsd bumps sh_meta_gen on metadata changes, sdk may cache attributes */
+#define PFSD_SHM_F_METAGEN (0x4)
+
+/* pfsd serves PFSD_REQUEST_READDIRPLUS */
+#define PFSD_SHM_F_DIRPLUS (0x8)
+
+/* Most slots a request may take, a channel still serves others */
+#define PFSD_SHM_MAX_EXTENT (16)
+
+/* Huge page size assumed for THP on tmpfs */
+#define PFSD_SHM_THP_SIZE (2UL * 1024 * 1024)
+
 /* A shm is visited by multiple processes */
 typedef struct pfsd_shm {
     uint32_t sh_magic;
@@ -61,12 +80,20 @@ typedef struct pfsd_shm {
     size_t sh_unitsize;
     int sh_nch;
     int sh_index;
+    uint32_t sh_flags;
+    /* channels are split into sh_nnode sets, one per NUMA node */
+    int sh_nnode;
 
+    /* bumped by pfsd on any metadata change, checked by sdk attr cache */
+    volatile uint64_t sh_meta_gen __attribute__((aligned(64)));
 } __attribute__((aligned(4096))) pfsd_shm_t;
 
 typedef char _check_shm_header_[sizeof(pfsd_shm_t) == 4096 ? 1 : -1];
 
 extern size_t g_shm_unit_size[PFSD_SHM_MAX];
+/* set by pfsd options before pfsd_shm_init */
+extern int g_shm_hugepage;
+extern int g_shm_numa;
 extern pfsd_shm_t* g_shm[PFSD_SHM_MAX];
 extern char g_shm_fname[PFSD_SHM_MAX][512];
 
@@ -86,11 +113,38 @@ pfsd_shm_t *pfsd_channel_shm(pfsd_iochannel_t *ch) {
         ch->ch_index * pfsd_channel_size(ch->ch_max_req, ch->ch_unitsize));
 }
 
+/* Buffer of the request is unitsize times its slots, from its own slot */
+static inline
+size_t pfsd_request_bufsize(pfsd_iochannel_t *ch, pfsd_request_t *req) {
+    return ch->ch_unitsize * (req->shm_nunit > 1 ? req->shm_nunit : 1);
+}
+
+/* Channels [first, last) are on NUMA node, the set may be empty */
+static inline
+void pfsd_shm_node_channels(int nch, int nnode, int node, int *first,
+    int *last) {
+    *first = node * nch / nnode;
+    *last = (node + 1) * nch / nnode;
+}
+
 int pfsd_shm_init(const char *shm_dir, const char *pbdname, size_t nch);
+
+#ifdef PFSD_SERVER
+/* pfsd changed metadata of the mount, attributes cached by sdk are stale */
+static inline
+void pfsd_shm_bump_meta_gen() {
+    for (int si = 0; si < PFSD_SHM_MAX; ++si) {
+        if (g_shm[si] != NULL)
+            __atomic_add_fetch(&g_shm[si]->sh_meta_gen, 1, __ATOMIC_RELEASE);
+    }
+}
+#endif
 int pfsd_shm_destroy(pfsd_shm_t *shm);
 
 /* shm attach, for pfsd shm tools */
 int pfsd_shm_attach(const char *shm_dir, const char *pbd, int wr_attach);
+/* unmap what init or attach mapped */
+void pfsd_shm_fini();
 void pfsd_print_shm(pfsd_shm_t *shm);
 void pfsd_print_channel(pfsd_shm_t *shm, int ch_index);
 void pfsd_print_all_channels(pfsd_shm_t *shm);
@@ -98,6 +152,10 @@ void pfsd_print_all_channels(pfsd_shm_t *shm);
 /* DB process got a request to fill in */
 pfsd_request_t *pfsd_shm_get_request(pfsd_iochannel_t *ch, int connid);
 
+/* Same, with a buffer of nunit adjacent slots */
+pfsd_request_t *pfsd_shm_get_extent(pfsd_iochannel_t *ch, int connid,
+    int nunit);
+
 /* DB process give request back to shm.
  * The arg req must be returned by pfsd_shm_get_request.
  */
@@ -108,9 +166,16 @@ int pfsd_shm_put_request(pfsd_iochannel_t *ch, pfsd_request_t *req);
  */
 void pfsd_shm_send_request(pfsd_iochannel_t* ch, pfsd_request_t *req);
 
+/* Buffer size of the request, 0 if its borrowed slots don't back it */
+size_t pfsd_shm_request_bufsize(pfsd_iochannel_t *ch, int index);
+
 /* pfsd fetch request to process */
 pfsd_request_t *pfsd_shm_fetch_request(pfsd_iochannel_t *ch);
 
+/* pfsd fetch up to max requests of a channel in one scan, return # got */
+int pfsd_shm_fetch_requests(pfsd_iochannel_t *ch, pfsd_request_t **reqs,
+    int max);
+
 /* When pfsd worker done request, dequeue it and notify DB process */
 void pfsd_shm_done_request(pfsd_iochannel_t *shm, int req_index);
 
@@ -124,6 +189,28 @@ int pfsd_shm_svr_abort_request(pfsd_shm_t *shm, int conn_id, bool force);
 
 int pfsd_shm_abort_request(pfsd_shm_t *shm, int conn_id, pid_t pid, bool force, bool is_svr);
 
+/* A set of connection ids, for sweeping the requests of many at once */
+typedef uint64_t pfsd_connset_t;
+static_assert(CHNL_MAX_CONN <= 64,
+    "pfsd_connset_t has a bit for each connection id");
+
+static inline
+pfsd_connset_t pfsd_connset_of(int conn_id) {
+    return (conn_id >= 0 && conn_id < 64) ? (1UL << conn_id) : 0;
+}
+
+static inline
+bool pfsd_connset_has(pfsd_connset_t conns, int conn_id) {
+    return (conns & pfsd_connset_of(conn_id)) != 0;
+}
+
+/*
+ * Force abort the requests of conns in all shms in one pass, channels
+ * shared out to nthread threads. Return # requests freed.
+ */
+int pfsd_shm_abort_conns(pfsd_shm_t *shms[], int nshm, pfsd_connset_t conns,
+    int nthread);
+
 
 void pfsd_wait_io(pfsd_request_t *req, sem_t *sem);
 
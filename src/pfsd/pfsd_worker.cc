@@ -13,6 +13,7 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/prctl.h>
@@ -20,6 +21,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <utility>
+#include <algorithm>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -28,6 +31,7 @@
 #include "pfs_inode.h"
 #include "pfsd_api.h"
 #include "pfs_mount.h"
+#include "pfs_metrics.h"
 
 #include "pfsd_shm.h"
 #include "pfsd_option.h"
@@ -42,8 +46,51 @@
 #include "blockingconcurrentqueue.h"
 
 typedef std::pair<pfsd_iochannel_t *, int> WorkItem;
+typedef moodycamel::BlockingConcurrentQueue<WorkItem> WorkQueue;
 
-static moodycamel::BlockingConcurrentQueue<WorkItem> &g_work_queue = *(new moodycamel::BlockingConcurrentQueue<WorkItem>);
+/*
+ * Work queue shards, each with its own few workers. Requests of a channel
+ * go to the channel's shard so they stay on the same workers, and on the
+ * same cpu with -b, as long as one of its workers is idle. Otherwise they
+ * go to a shard with an idle worker, and idle workers of other shards are
+ * woken to steal what the shard's own workers cannot take at once. The
+ * timed wait of an idle worker is only a fallback.
+ */
+#define WORKERS_PER_SHARD	8
+#define STEAL_WAIT_MIN_US	1000
+#define STEAL_WAIT_MAX_US	8000
+#define IDLE_STRIDE		16	/* ints, a cache line per shard */
+#define BUSY_STRIDE		16	/* ints, a cache line per worker slot */
+
+static WorkQueue *g_work_queues;
+static int g_nshard;
+static int *g_shard_idle;	/* workers waiting on a shard */
+
+/*
+ * The worker pool grows and shrinks between the -m and -w bounds, see
+ * pfsd_resize_target(). Worker slot i serves shard i % g_nshard and slots
+ * [0, g_nlive) are in use, so the workers stay spread over the shards.
+ *
+ * A worker only flags its slot busy while it handles a request. The
+ * resize thread samples the flags every millisecond or so, the busy
+ * share of an interval is the share of busy flags it saw.
+ */
+#define RESIZE_INTERVAL_US	100000
+
+enum {
+	SLOT_IDLE = 0,
+	SLOT_RUNNING,
+	SLOT_QUITTING,
+	SLOT_EXITED,
+};
+
+static int *g_slot_state;
+static int *g_slot_busy;
+static int g_nlive;
+static pfsd_resize_t g_resize;
+static uint64_t g_worker_busy_us;	/* estimated from the samples */
+static uint64_t g_worker_grows;
+static uint64_t g_worker_shrinks;
 
 static void *io_worker(void *arg);
 static void *io_poller(void *arg);
@@ -57,6 +104,9 @@ volatile bool g_stop = false;
 /* current processing request's pid */
 __thread pid_t g_currentPid;
 
+/* requests handled, by type */
+static uint64_t s_nrequest[PFSD_REQUEST_NTYPE];
+
 pid_t
 pfsd_worker_current_processing_pid()
 {
@@ -94,17 +144,127 @@ pfsd_destroy_workers(worker_t **workers)
 	}
 }
 
-static int init_io_workers(worker_t *wk)
+/* Start workers in slots [g_nlive, target), return the new live count */
+static int start_io_workers(worker_t *wk, int target)
 {
 	int i;
 
-	pfsd_info("create %d io workers", wk->w_nworkers);
-
-	for (i = 0; i < wk->w_nworkers; ++i) {
-		if (pthread_create(&wk->w_io_workers[i], NULL, io_worker, wk)) {
+	for (i = g_nlive; i < target; ++i) {
+		/* a quitting worker must be gone before its slot is reused */
+		if (__atomic_load_n(&g_slot_state[i], __ATOMIC_ACQUIRE) !=
+		    SLOT_IDLE)
+			break;
+		g_slot_state[i] = SLOT_RUNNING;
+		if (pthread_create(&wk->w_io_workers[i], NULL, io_worker,
+		    (void *)(intptr_t)i)) {
 			pfsd_error("can not create io worker thread, idx = %d", i);
+			g_slot_state[i] = SLOT_IDLE;
+			break;
 		}
 	}
+	return i;
+}
+
+/* Ask workers in slots [target, g_nlive) to quit */
+static int stop_io_workers_from(int target)
+{
+	for (int i = target; i < g_nlive; ++i)
+		__atomic_store_n(&g_slot_state[i], SLOT_QUITTING,
+		    __ATOMIC_RELEASE);
+	/* wake them up if they are waiting */
+	for (int i = target; i < g_nlive; ++i)
+		g_work_queues[i % g_nshard].enqueue({nullptr, -1});
+	return target;
+}
+
+static void reap_io_workers(worker_t *wk)
+{
+	for (int i = 0; i < wk->w_nworkers; ++i) {
+		if (__atomic_load_n(&g_slot_state[i], __ATOMIC_ACQUIRE) !=
+		    SLOT_EXITED)
+			continue;
+		pthread_join(wk->w_io_workers[i], NULL);
+		__atomic_store_n(&g_slot_state[i], SLOT_IDLE, __ATOMIC_RELEASE);
+	}
+}
+
+static void resize_io_workers(worker_t *wk)
+{
+	static uint64_t last_us, last_sample_us;
+	static uint64_t nsample, nbusy;		/* of this interval */
+	uint64_t now_us, busy_pct;
+	size_t depth = 0;
+	int target, busy = 0;
+
+	now_us = gettimeofday_us();
+	for (int i = 0; i < g_nlive; ++i)
+		busy += __atomic_load_n(&g_slot_busy[i * BUSY_STRIDE],
+		    __ATOMIC_RELAXED);
+	if (last_sample_us != 0)
+		__atomic_add_fetch(&g_worker_busy_us,
+		    busy * (now_us - last_sample_us), __ATOMIC_RELAXED);
+	last_sample_us = now_us;
+	nsample += g_nlive;
+	nbusy += busy;
+
+	if (now_us - last_us < RESIZE_INTERVAL_US)
+		return;
+	if (last_us == 0 || nsample == 0) {
+		last_us = now_us;
+		nsample = nbusy = 0;
+		return;
+	}
+	busy_pct = nbusy * 100 / nsample;
+	last_us = now_us;
+	nsample = nbusy = 0;
+	for (int q = 0; q < g_nshard; ++q)
+		depth += g_work_queues[q].size_approx();
+
+	reap_io_workers(wk);
+	target = pfsd_resize_target(&g_resize, g_nlive, depth, busy_pct);
+	if (target > g_nlive) {
+		target = start_io_workers(wk, target);
+		if (target > g_nlive) {
+			pfsd_info("grow io workers %d -> %d, busy %lu%%, "
+			    "queued %lu", g_nlive, target, busy_pct, depth);
+			__atomic_store_n(&g_nlive, target, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&g_worker_grows, 1, __ATOMIC_RELAXED);
+		}
+	} else if (target < g_nlive) {
+		pfsd_info("shrink io workers %d -> %d, busy %lu%%", g_nlive,
+		    target, busy_pct);
+		__atomic_store_n(&g_nlive, stop_io_workers_from(target),
+		    __ATOMIC_RELEASE);
+		__atomic_add_fetch(&g_worker_shrinks, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int init_io_workers(worker_t *wk)
+{
+	int i;
+	int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	g_nshard = wk->w_nworkers / WORKERS_PER_SHARD;
+	if (g_nshard > ncpu)
+		g_nshard = ncpu;
+	if (g_nshard < 1)
+		g_nshard = 1;
+	g_work_queues = new WorkQueue[g_nshard];
+	g_shard_idle = (int *)calloc(g_nshard * IDLE_STRIDE, sizeof(int));
+	g_slot_state = (int *)calloc(wk->w_nworkers, sizeof(int));
+	g_slot_busy = (int *)calloc(wk->w_nworkers * BUSY_STRIDE, sizeof(int));
+
+	g_resize.rs_nmin = g_option.o_min_workers;
+	if (g_resize.rs_nmin <= 0 || g_resize.rs_nmin > wk->w_nworkers)
+		g_resize.rs_nmin = wk->w_nworkers;
+	g_resize.rs_nmax = wk->w_nworkers;
+	g_resize.rs_nshard = g_nshard;
+	g_resize.rs_idle_ticks = 0;
+
+	pfsd_info("create %d-%d io workers in %d shards%s", g_resize.rs_nmin,
+	    wk->w_nworkers, g_nshard, g_option.o_affinity ? ", cpu bound" : "");
+
+	g_nlive = start_io_workers(wk, g_resize.rs_nmin);
 	return 0;
 }
 
@@ -126,12 +286,12 @@ static void stop_io_workers(worker_t *wk)
 {
 	int i;
 
+	g_nlive = stop_io_workers_from(0);
 	for (i = 0; i < wk->w_nworkers; ++i) {
-		g_work_queue.enqueue({nullptr, -1});
-	}
-
-	for (i = 0; i < wk->w_nworkers; ++i) {
-		pthread_join(wk->w_io_workers[i], NULL);
+		if (__atomic_load_n(&g_slot_state[i], __ATOMIC_ACQUIRE) !=
+		    SLOT_IDLE)
+			pthread_join(wk->w_io_workers[i], NULL);
+		g_slot_state[i] = SLOT_IDLE;
 	}
 }
 
@@ -148,8 +308,10 @@ static void drain_work_queue(void)
 {
 	WorkItem w;
 
-	while(g_work_queue.try_enqueue(w))
-		;
+	for (int q = 0; q < g_nshard; ++q) {
+		while (g_work_queues[q].try_dequeue(w))
+			;
+	}
 }
 
 void*
@@ -192,8 +354,10 @@ pfsd_worker_routine(void *arg)
 
 	init_io_pollers(wk);
 
-	while (!g_stop)
+	while (!g_stop) {
 		usleep(1000);
+		resize_io_workers(wk);
+	}
 
 	stop_io_workers(wk);
 	stop_io_pollers(wk);
@@ -201,21 +365,113 @@ pfsd_worker_routine(void *arg)
 	return NULL;
 }
 
+static inline int
+shard_nidle(int shard)
+{
+	return __atomic_load_n(&g_shard_idle[shard * IDLE_STRIDE],
+	    __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The channel's own shard if one of its workers is idle, else a shard
+ * with an idle worker. With every worker busy, the channel's shard unless
+ * another one is less backed up. Only the first nactive shards have
+ * workers while the pool is small.
+ */
+static int
+work_queue_pick(int chidx, int nitem)
+{
+	static __thread unsigned next;
+	int nactive = std::min(g_nshard,
+	    __atomic_load_n(&g_nlive, __ATOMIC_ACQUIRE));
+	size_t depth, other_depth;
+	int shard, other;
+
+	if (nactive <= 1)
+		return 0;
+	shard = chidx % nactive;
+	if (shard_nidle(shard) > 0)
+		return shard;
+	next++;
+	for (int k = 0; k < nactive - 1; ++k) {
+		other = (shard + 1 + (next + k) % (nactive - 1)) % nactive;
+		if (shard_nidle(other) > 0)
+			return other;
+	}
+
+	depth = g_work_queues[shard].size_approx() + nitem;
+	other = (shard + 1 + next % (nactive - 1)) % nactive;
+	other_depth = g_work_queues[other].size_approx() + nitem;
+	return other_depth < depth ? other : shard;
+}
+
+/*
+ * After nitem requests were queued on shard, wake idle workers of other
+ * shards for those its idle workers cannot take. A woken worker finds
+ * its own shard empty and steals. A worker counts itself idle before it
+ * looks for work the last time, so either it sees the requests or they
+ * see it.
+ */
+static void
+work_queue_wake(int shard, int nitem)
+{
+	int surplus, n, other;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	surplus = nitem - shard_nidle(shard);
+	for (int k = 1; k < g_nshard && surplus > 0; ++k) {
+		other = (shard + k) % g_nshard;
+		n = std::min(shard_nidle(other), surplus);
+		for (int i = 0; i < n; ++i)
+			g_work_queues[other].enqueue({nullptr, -1});
+		surplus -= n;
+	}
+}
+
+static bool
+work_queue_steal(int shard, WorkItem *w)
+{
+	for (int k = 1; k < g_nshard; ++k) {
+		if (g_work_queues[(shard + k) % g_nshard].try_dequeue(*w))
+			return true;
+	}
+	return false;
+}
+
+static void
+work_bind_cpu(int shard)
+{
+	cpu_set_t set;
+	int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(&set);
+	CPU_SET(shard % ncpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		pfsd_warn("bind worker of shard %d to cpu %d failed", shard,
+		    shard % ncpu);
+}
+
 static void* io_poller(void *arg)
 {
 	worker_t *wk = (worker_t*)(arg);
 
-	moodycamel::ProducerToken ptok(g_work_queue);
+	std::vector<moodycamel::ProducerToken> ptoks;
+	for (int q = 0; q < g_nshard; ++q)
+		ptoks.emplace_back(g_work_queues[q]);
+
+	pfsd_request_t *reqs[PFSD_SHM_MAX_REQUESTS];
+	WorkItem items[PFSD_SHM_MAX_REQUESTS];
 
 	while (!g_stop) {
 		for (int i = 0; i < wk->w_nch; ++i) {
-			int index = -1;
 			pfsd_iochannel_t *ch = wk->w_channels[i];
-			pfsd_request_t *req = pfsd_shm_fetch_request(ch);
+			int nreq = pfsd_shm_fetch_requests(ch, reqs,
+			    PFSD_SHM_MAX_REQUESTS);
 
-			if (req != NULL) {
+			for (int ri = 0; ri < nreq; ++ri) {
+				pfsd_request_t *req = reqs[ri];
 				g_currentPid = req->owner;
-				index = req - ch->ch_requests;
+				int index = req - ch->ch_requests;
 				PFSD_ASSERT(index < ch->ch_max_req);
 				pfsd_response_t *rsp = &ch->ch_responses[index];
 
@@ -231,9 +487,15 @@ static void* io_poller(void *arg)
 					rsp->error = 0;
 				}
 
-				g_work_queue.enqueue(ptok, {ch, index});
+				items[ri] = WorkItem(ch, index);
 				g_currentPid = PFSD_INVALID_PID;
 			}
+			if (nreq > 0) {
+				int q = work_queue_pick(i, nreq);
+				g_work_queues[q].enqueue_bulk(ptoks[q], items, nreq);
+				if (g_nshard > 1)
+					work_queue_wake(q, nreq);
+			}
 		}
 		wk->w_wait_io(wk);
 	}
@@ -242,30 +504,137 @@ static void* io_poller(void *arg)
 
 static void *io_worker(void *arg)
 {
-	worker_t *wk = (worker_t*)(arg);
-	moodycamel::ConsumerToken ctok(g_work_queue);
+	int slot = (int)(intptr_t)arg;
+	int shard = slot % g_nshard;
+	WorkQueue &queue = g_work_queues[shard];
+	moodycamel::ConsumerToken ctok(queue);
+	int64_t wait_us = STEAL_WAIT_MIN_US;
+	int *nidle = &g_shard_idle[shard * IDLE_STRIDE];
+	int *busy = &g_slot_busy[slot * BUSY_STRIDE];
+	bool got;
+	int type;
 
 	char name[32];
 	snprintf(name, sizeof(name), "pfsd-worker");
 	prctl(PR_SET_NAME,(unsigned long)name);
+	if (g_option.o_affinity)
+		work_bind_cpu(shard);
 
 	for (;;) {
 		WorkItem w;
-		g_work_queue.wait_dequeue(ctok, w);
+		if (!queue.try_dequeue(ctok, w) && !work_queue_steal(shard, &w)) {
+			if (__atomic_load_n(&g_slot_state[slot],
+			    __ATOMIC_ACQUIRE) == SLOT_QUITTING)
+				break;
+			/*
+			 * idle: pollers wake us when other shards are backed
+			 * up, the timeout grows in case one was missed
+			 */
+			__atomic_add_fetch(nidle, 1, __ATOMIC_SEQ_CST);
+			got = work_queue_steal(shard, &w) ||
+			    queue.wait_dequeue_timed(ctok, w, wait_us);
+			__atomic_sub_fetch(nidle, 1, __ATOMIC_SEQ_CST);
+			if (!got) {
+				if (wait_us < STEAL_WAIT_MAX_US)
+					wait_us *= 2;
+				continue;
+			}
+		}
+		wait_us = STEAL_WAIT_MIN_US;
 		pfsd_iochannel_t *ch = w.first;
 		if (ch == nullptr)
-			break;
+			continue;	/* wakeup to quit */
 		int index = w.second;
 		pfsd_request_t *req = ch->ch_requests + index;
 		g_currentPid = req->owner;
 		index = req - ch->ch_requests;
+		type = pfsd_request_type(req);
+		__atomic_store_n(busy, 1, __ATOMIC_RELAXED);
 		pfsd_worker_handle_request(w.first, w.second);
+		__atomic_store_n(busy, 0, __ATOMIC_RELAXED);
+		if (0 <= type && type < PFSD_REQUEST_NTYPE)
+			__atomic_add_fetch(&s_nrequest[type], 1, __ATOMIC_RELAXED);
+		/* Before the reply, so the caller never sees the old gen */
+		if (pfsd_req_changes_meta(type))
+			pfsd_shm_bump_meta_gen();
 		pfsd_shm_done_request(w.first, w.second);
 		g_currentPid = PFSD_INVALID_PID;
 	}
+	__atomic_store_n(&g_slot_state[slot], SLOT_EXITED, __ATOMIC_RELEASE);
 	return NULL;
 }
 
+void
+pfsd_worker_metrics(pfs_metrics_t *m)
+{
+	static const char prefix[] = "PFSD_REQUEST_";
+	char op[64], label[16];
+	const char *name;
+	uint64_t used;
+	int i, type;
+
+	pfs_metrics_family(m, "pfsd_requests_total", "counter",
+	    "Requests handled by pfsd.");
+	for (type = PFSD_REQUEST_OPEN; type < PFSD_REQUEST_NTYPE; type++) {
+		name = pfsd_req_type_string(type);
+		if (strncmp(name, prefix, sizeof(prefix) - 1) == 0)
+			name += sizeof(prefix) - 1;
+		for (i = 0; name[i] != '\0' && i < (int)sizeof(op) - 1; i++)
+			op[i] = tolower(name[i]);
+		op[i] = '\0';
+		pfs_metrics_u64(m, "pfsd_requests_total", "op", op,
+		    __atomic_load_n(&s_nrequest[type], __ATOMIC_RELAXED));
+	}
+
+	if (g_work_queues != NULL) {
+		pfs_metrics_family(m, "pfsd_workers", "gauge",
+		    "Io workers running.");
+		pfs_metrics_u64(m, "pfsd_workers", NULL, NULL,
+		    __atomic_load_n(&g_nlive, __ATOMIC_RELAXED));
+		pfs_metrics_family(m, "pfsd_worker_resizes_total", "counter",
+		    "Times the io worker pool was resized.");
+		pfs_metrics_u64(m, "pfsd_worker_resizes_total", "direction",
+		    "grow", __atomic_load_n(&g_worker_grows, __ATOMIC_RELAXED));
+		pfs_metrics_u64(m, "pfsd_worker_resizes_total", "direction",
+		    "shrink", __atomic_load_n(&g_worker_shrinks,
+		    __ATOMIC_RELAXED));
+		pfs_metrics_family(m, "pfsd_worker_busy_seconds_total",
+		    "counter", "Time io workers spent handling requests, "
+		    "sampled every millisecond or so.");
+		pfs_metrics_double(m, "pfsd_worker_busy_seconds_total", NULL,
+		    NULL, __atomic_load_n(&g_worker_busy_us,
+		    __ATOMIC_RELAXED) / 1000000.0);
+		pfs_metrics_family(m, "pfsd_work_queue_depth", "gauge",
+		    "Requests queued for workers, by work queue shard.");
+		for (i = 0; i < g_nshard; i++) {
+			snprintf(label, sizeof(label), "%d", i);
+			pfs_metrics_u64(m, "pfsd_work_queue_depth", "shard",
+			    label, g_work_queues[i].size_approx());
+		}
+	}
+
+	if (g_worker == NULL)
+		return;
+	pfs_metrics_family(m, "pfsd_channel_inflight_requests", "gauge",
+	    "Requests taken from a shm channel and not yet freed.");
+	for (i = 0; i < g_worker->w_nch; i++) {
+		pfsd_iochannel_t *ch = g_worker->w_channels[i];
+		used = ~ch->ch_free_bitmap;
+		if (ch->ch_max_req < 64)
+			used &= (1UL << ch->ch_max_req) - 1;
+		snprintf(label, sizeof(label), "%d", i);
+		pfs_metrics_u64(m, "pfsd_channel_inflight_requests", "channel",
+		    label, __builtin_popcountl(used));
+	}
+	pfs_metrics_family(m, "pfsd_channel_max_requests", "gauge",
+	    "Request slots of a shm channel.");
+	for (i = 0; i < g_worker->w_nch; i++) {
+		snprintf(label, sizeof(label), "%d", i);
+		pfs_metrics_u64(m, "pfsd_channel_max_requests", "channel",
+		    label, g_worker->w_channels[i]->ch_max_req);
+	}
+}
+
 int
 pfsd_worker_handle_request(pfsd_iochannel_t *ch, int req_index)
 {
@@ -347,6 +716,14 @@ pfsd_worker_handle_request(pfsd_iochannel_t *ch, int req_index)
 			return 0;
 		}
 
+		case PFSD_REQUEST_FSYNC: {
+			MNT_STAT_API_BEGIN(MNT_STAT_API_FSYNC);
+			pfs_mntstat_set_file_type(req->common_pl_req.pl_file_type);
+			pfsd_worker_handle_fsync(ch, req_index, &req->fs_req, &rsp->fs_rsp);
+			MNT_STAT_API_END(MNT_STAT_API_FSYNC);
+			return 0;
+		}
+
 		case PFSD_REQUEST_FALLOCATE: {
 			MNT_STAT_API_BEGIN(MNT_STAT_API_FALLOCATE);
 			pfs_mntstat_set_file_type(req->common_pl_req.pl_file_type);
@@ -375,6 +752,10 @@ pfsd_worker_handle_request(pfsd_iochannel_t *ch, int req_index)
 			pfsd_worker_handle_readdir(ch, req_index, &req->rd_req, &rsp->rd_rsp);
 			return 0;
 
+		case PFSD_REQUEST_READDIRPLUS:
+			pfsd_worker_handle_readdirplus(ch, req_index, &req->rd_req, &rsp->rd_rsp);
+			return 0;
+
 		case PFSD_REQUEST_ACCESS:
 			pfsd_worker_handle_access(ch, req_index, &req->a_req, &rsp->a_rsp);
 			return 0;
@@ -546,6 +927,12 @@ pfsd_worker_handle_read(pfsd_iochannel_t *ch, int req_index,
 		errno = EINVAL;
 		return;
 	}
+	if (read_len > pfsd_shm_request_bufsize(ch, req_index)) {
+		pfsd_error("pid %d read len %lu over the request buffer",
+		    g_currentPid, read_len);
+		rsp->error = EINVAL;
+		return;
+	}
 	pfs_mount_t *mnt = NULL;
 	pfs_inode_t *inode = NULL;
 	PFSD_GET_MOUNT_AND_INODE(req->mntid, req->r_ino, rsp);
@@ -580,6 +967,12 @@ pfsd_worker_handle_write(pfsd_iochannel_t *ch, int req_index,
 		rsp->error = EINVAL;
 		return;
 	}
+	if (req->w_len > pfsd_shm_request_bufsize(ch, req_index)) {
+		pfsd_error("pid %d write len %lu over the request buffer",
+		    g_currentPid, req->w_len);
+		rsp->error = EINVAL;
+		return;
+	}
 
 	pfs_mount_t* mnt = NULL;
 	pfs_inode_t* inode = NULL;
@@ -706,6 +1099,30 @@ pfsd_worker_handle_fstat(pfsd_iochannel *ch, int index,
 		    g_currentPid, req->f_ino, rsp->f_st.st_size);
 }
 
+void
+pfsd_worker_handle_fsync(pfsd_iochannel *ch, int index,
+    const fsync_request_t *req, fsync_response_t *rsp)
+{
+	rsp->type = PFSD_RESPONSE_FSYNC;
+	rsp->f_res = -1;
+
+	CHECK_RSP_ERROR(rsp);
+
+	pfs_mount_t *mnt = NULL;
+	pfs_inode_t *inode = NULL;
+	PFSD_GET_MOUNT_AND_INODE(req->mntid, req->f_ino, rsp);
+
+	rsp->f_res = pfsd_fsync_svr(mnt, inode);
+
+	PFSD_PUT_MOUNT_AND_INODE(mnt, inode);
+
+	if (rsp->f_res < 0) {
+		rsp->error = errno;
+		pfsd_error("pid %d fsync ino %ld error %d", g_currentPid, req->f_ino, errno);
+	} else
+		pfsd_debug("pid %d fsync ino %ld success", g_currentPid, req->f_ino);
+}
+
 void
 pfsd_worker_handle_fallocate(pfsd_iochannel_t *ch, int req_index,
     const fallocate_request_t *req, fallocate_response_t *rsp)
@@ -811,16 +1228,17 @@ pfsd_worker_handle_opendir(pfsd_iochannel_t *ch, int req_index,
 	/* pfsd_opendir_svr will print detail logs */
 }
 
-void
-pfsd_worker_handle_readdir(pfsd_iochannel_t *ch, int req_index,
-    const readdir_request_t *req, readdir_response_t *rsp)
+/*
+ * Fill the dirent buffer with entries from req->r_ino at req->r_offset,
+ * either as struct dirent or as compact pfsd_direntplus_t records.
+ */
+static void
+pfsd_worker_readdir_fill(pfsd_iochannel_t *ch, int req_index,
+    const readdir_request_t *req, readdir_response_t *rsp, bool plus)
 {
-	rsp->type = PFSD_RESPONSE_READDIR;
-	rsp->r_res = -1;
-
 	CHECK_RSP_ERROR(rsp);
 
-	if (ch->ch_unitsize < PFSD_DIRENT_BUFFER_SIZE) {
+	if (pfsd_shm_request_bufsize(ch, req_index) < PFSD_DIRENT_BUFFER_SIZE) {
 		rsp->error = EFAULT;
 		rsp->r_res = -1;
 		return;
@@ -838,9 +1256,13 @@ pfsd_worker_handle_readdir(pfsd_iochannel_t *ch, int req_index,
 	uint64_t cur_offset = req->r_offset;
 	int64_t next_ino = 0;
 	uint64_t data_size = 0;
-	while (cur_ino != 0 && data_size + sizeof(struct dirent) <= PFSD_DIRENT_BUFFER_SIZE) {
+	uint64_t reclen = plus ? PFSD_DIRENTPLUS_RECLEN(0) : sizeof(struct dirent);
+	struct dirent plusde;
+	struct stat plusst;
+	while (cur_ino != 0 && data_size + reclen <= PFSD_DIRENT_BUFFER_SIZE) {
+		struct dirent *de = plus ? &plusde : (struct dirent*)&rbuf[data_size];
 		int err = pfsd_readdir_svr(mnt, req->r_dino, cur_ino, cur_offset,
-		    (struct dirent*)&rbuf[data_size], &next_ino);
+		    de, plus ? &plusst : NULL, &next_ino);
 		if (err != 0) {
 			if (data_size == 0) {
 				rsp->r_res = err;
@@ -853,23 +1275,63 @@ pfsd_worker_handle_readdir(pfsd_iochannel_t *ch, int req_index,
 				rsp->r_ino = 0; /* Dir EOF */
 
 			break;
-		} else {
+		}
+
+		if (plus) {
+			/* Entry not fit is read again by the next request */
+			size_t namelen = strlen(de->d_name);
+			if (data_size + PFSD_DIRENTPLUS_RECLEN(namelen) >
+			    PFSD_DIRENT_BUFFER_SIZE)
+				break;
+
+			pfsd_direntplus_t *dp = (pfsd_direntplus_t*)&rbuf[data_size];
+			dp->dp_ino = de->d_ino;
+			dp->dp_size = plusst.st_size;
+			dp->dp_mtime = plusst.st_mtime;
+			dp->dp_mode = plusst.st_mode;
+			dp->dp_reclen = PFSD_DIRENTPLUS_RECLEN(namelen);
+			dp->dp_namelen = namelen;
+			dp->dp_type = de->d_type;
+			memcpy(dp->dp_name, de->d_name, namelen + 1);
+			data_size += dp->dp_reclen;
+		} else
 			data_size += sizeof(struct dirent);
-			pfsd_debug("got ino %ld at offset %ld", cur_ino, cur_offset);
-			cur_ino = next_ino;
-			++cur_offset;
 
-			rsp->r_data_size = data_size;
-			rsp->r_ino = next_ino;
-			rsp->r_offset = cur_offset;
-		}
+		pfsd_debug("got ino %ld at offset %ld", cur_ino, cur_offset);
+		cur_ino = next_ino;
+		++cur_offset;
+
+		rsp->r_data_size = data_size;
+		rsp->r_ino = next_ino;
+		rsp->r_offset = cur_offset;
 	}
-	pfsd_debug("pid %d, readdir err %d, req offset %ld rsp offset %ld",
-	    g_currentPid, rsp->error, req->r_offset, rsp->r_offset);
+	pfsd_debug("pid %d, readdir%s err %d, req offset %ld rsp offset %ld",
+	    g_currentPid, plus ? "plus" : "", rsp->error, req->r_offset,
+	    rsp->r_offset);
 
 	PFSD_PUT_MOUNT(mnt);
 }
 
+void
+pfsd_worker_handle_readdir(pfsd_iochannel_t *ch, int req_index,
+    const readdir_request_t *req, readdir_response_t *rsp)
+{
+	rsp->type = PFSD_RESPONSE_READDIR;
+	rsp->r_res = -1;
+
+	pfsd_worker_readdir_fill(ch, req_index, req, rsp, false);
+}
+
+void
+pfsd_worker_handle_readdirplus(pfsd_iochannel_t *ch, int req_index,
+    const readdir_request_t *req, readdir_response_t *rsp)
+{
+	rsp->type = PFSD_RESPONSE_READDIRPLUS;
+	rsp->r_res = -1;
+
+	pfsd_worker_readdir_fill(ch, req_index, req, rsp, true);
+}
+
 void
 pfsd_worker_handle_access(pfsd_iochannel *ch, int req_index,
     const access_request_t *req, access_response_t *rsp)
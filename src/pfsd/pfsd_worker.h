@@ -17,6 +17,7 @@
 #define _PFSD_WORKER_H_
 
 #include <pthread.h>
+#include <algorithm>
 #include "pfsd_proto.h"
 #include "pfsd_common.h"
 
@@ -47,6 +48,44 @@ void pfsd_destroy_workers(worker_t **workers);
 
 void *pfsd_worker_routine(void *arg);
 
+/*
+ * Io worker pool sizing. Every resize interval the pool grows when
+ * requests are queued while workers are mostly busy, and shrinks after
+ * staying mostly idle for RESIZE_SHRINK_TICKS intervals in a row.
+ */
+#define RESIZE_GROW_BUSY	75	/* percent */
+#define RESIZE_SHRINK_BUSY	25	/* percent */
+#define RESIZE_SHRINK_TICKS	50
+
+typedef struct pfsd_resize {
+	int	rs_nmin;
+	int	rs_nmax;
+	int	rs_nshard;
+	int	rs_idle_ticks;
+} pfsd_resize_t;
+
+/* Workers to run, given those running and the load of the last interval */
+static inline int
+pfsd_resize_target(pfsd_resize_t *rs, int nlive, size_t depth,
+    uint64_t busy_pct)
+{
+	if (depth > 0 && busy_pct >= RESIZE_GROW_BUSY &&
+	    nlive < rs->rs_nmax) {
+		rs->rs_idle_ticks = 0;
+		return std::min(nlive + std::max(rs->rs_nshard, nlive / 4),
+		    rs->rs_nmax);
+	}
+	if (depth == 0 && busy_pct < RESIZE_SHRINK_BUSY &&
+	    nlive > rs->rs_nmin) {
+		if (++rs->rs_idle_ticks < RESIZE_SHRINK_TICKS)
+			return nlive;
+		rs->rs_idle_ticks = 0;
+		return std::max(nlive - rs->rs_nshard, rs->rs_nmin);
+	}
+	rs->rs_idle_ticks = 0;
+	return nlive;
+}
+
 extern pfsd_cpu_record_t *g_cpufile;
 extern int g_ncpu;
 /*Exec in main thread when start, find available core for worker threads */
@@ -67,17 +106,23 @@ void pfsd_worker_handle_ftruncate(pfsd_iochannel *ch, int index, const ftruncate
 void pfsd_worker_handle_unlink(pfsd_iochannel *ch, int index, const unlink_request_t *req, unlink_response_t *rsp);
 void pfsd_worker_handle_stat(pfsd_iochannel *ch, int index, const stat_request_t *req, stat_response_t *rsp);
 void pfsd_worker_handle_fstat(pfsd_iochannel *ch, int index, const fstat_request_t *req, fstat_response_t *rsp);
+void pfsd_worker_handle_fsync(pfsd_iochannel *ch, int index, const fsync_request_t *req, fsync_response_t *rsp);
 void pfsd_worker_handle_fallocate(pfsd_iochannel *ch, int index, const fallocate_request_t *req, fallocate_response_t *rsp);
 void pfsd_worker_handle_chdir(pfsd_iochannel *ch, int index, const chdir_request_t *req, chdir_response_t *rsp);
 void pfsd_worker_handle_mkdir(pfsd_iochannel *ch, int index, const mkdir_request_t *req, mkdir_response_t *rsp);
 void pfsd_worker_handle_rmdir(pfsd_iochannel *ch, int index, const rmdir_request_t *req, rmdir_response_t *rsp);
 void pfsd_worker_handle_opendir(pfsd_iochannel *ch, int index, const opendir_request_t *req, opendir_response_t *rsp);
 void pfsd_worker_handle_readdir(pfsd_iochannel *ch, int index, const readdir_request_t *req, readdir_response_t *rsp);
+void pfsd_worker_handle_readdirplus(pfsd_iochannel *ch, int index, const readdir_request_t *req, readdir_response_t *rsp);
 void pfsd_worker_handle_access(pfsd_iochannel *ch, int index, const access_request_t *req, access_response_t *rsp);
 void pfsd_worker_handle_lseek(pfsd_iochannel *ch, int index, const lseek_request_t *req, lseek_response_t *rsp);
 
 /*for debug : return current processing request's pid  */
 pid_t pfsd_worker_current_processing_pid();
 
+typedef struct pfs_metrics pfs_metrics_t;
+/* pfsd counters for the metrics admin command */
+void pfsd_worker_metrics(pfs_metrics_t *m);
+
 #endif
 
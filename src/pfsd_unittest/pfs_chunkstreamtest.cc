@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "pfs_api.h"
+
+/*
+ * Backs up and restores a spare disk, which is given by
+ * PFS_TEST_SPARE_PBD (a name under /dev such as loop1). It is formatted
+ * by the pfs tool, which is taken from PFS_TOOL or PATH. Digests and
+ * restore marks of the disk under /var/run/pfs are removed.
+ */
+#define BUFSZ   (4 << 20)
+#define BIGBUFSZ (64 << 20)     /* spans several blocks */
+#define FILESZ  (16 << 20)
+#define HDRSZ   4096            /* stream header, block metas follow */
+
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f " + pbd +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static void
+clear_bases(const char *pbd)
+{
+    std::string cmd;
+
+    cmd = std::string("rm -f /var/run/pfs/pbd") + pbd + ".*";
+    ASSERT_EQ(system(cmd.c_str()), 0);
+}
+
+static std::string
+file_path(const char *pbd)
+{
+    return std::string("/") + pbd + "/f";
+}
+
+// Write @len bytes of @c at @off of the file
+static void
+fill_file(const char *pbd, char c, off_t off, size_t len)
+{
+    char *buf = (char *)malloc(len);
+    int fd;
+
+    memset(buf, c, len);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    fd = pfs_open(file_path(pbd).c_str(), O_CREAT | O_RDWR, 0);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(pfs_pwrite(fd, buf, len, off), (ssize_t)len);
+    EXPECT_EQ(pfs_close(fd), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+    free(buf);
+}
+
+typedef std::vector<std::string> images_t;
+
+static size_t
+images_size(const images_t &imgv)
+{
+    size_t sz = 0;
+
+    for (size_t i = 0; i < imgv.size(); i++)
+        sz += imgv[i].size();
+    return sz;
+}
+
+// Read out every chunk, committing the streams as the base if asked
+static images_t
+backup(const char *pbd, bool commit, size_t bufsz = BUFSZ)
+{
+    pfs_chunkstream_desc_t *desc;
+    pfs_chunkstream_t *cs;
+    images_t imgv;
+    char *buf;
+    int64_t n;
+    int nchunk;
+
+    desc = pfs_chunkstream_init("disk", pbd, CHUNK_BACKUP | CHUNK_INCR);
+    EXPECT_TRUE(desc != NULL);
+    if (desc == NULL)
+        return imgv;
+    pfs_chunkstream_get_nchunk(desc, &nchunk);
+    buf = (char *)malloc(bufsz);
+    imgv.resize(nchunk);
+    for (int ckid = 0; ckid < nchunk; ckid++) {
+        cs = pfs_chunkstream_open(desc, ckid);
+        EXPECT_TRUE(cs != NULL);
+        if (cs == NULL)
+            break;
+        // not read out, not a base
+        EXPECT_EQ(pfs_chunkstream_commit(cs), -EINVAL);
+        while ((n = pfs_chunkstream_read(cs, buf, bufsz)) > 0)
+            imgv[ckid].append(buf, n);
+        EXPECT_EQ(n, 0);
+        EXPECT_EQ(pfs_chunkstream_isfinish(cs), 0);
+        if (commit) {
+            EXPECT_EQ(pfs_chunkstream_commit(cs), 0);
+        }
+        pfs_chunkstream_close(cs);
+    }
+    free(buf);
+    pfs_chunkstream_fini(desc);
+    return imgv;
+}
+
+static int
+restore(const char *pbd, const images_t &imgv)
+{
+    pfs_chunkstream_desc_t *desc;
+    pfs_chunkstream_t *cs;
+    size_t off, len;
+    int64_t n;
+
+    desc = pfs_chunkstream_init("disk", pbd, CHUNK_RESTORE);
+    EXPECT_TRUE(desc != NULL);
+    if (desc == NULL)
+        return -EIO;
+    n = 0;
+    for (size_t ckid = 0; ckid < imgv.size() && n >= 0; ckid++) {
+        const std::string &img = imgv[ckid];
+
+        cs = pfs_chunkstream_open(desc, ckid);
+        for (off = 0; off < img.size(); off += n) {
+            len = std::min(img.size() - off, (size_t)BUFSZ);
+            n = pfs_chunkstream_write(cs, img.data() + off, len);
+            if (n <= 0)
+                break;
+        }
+        if (n >= 0 && pfs_chunkstream_isfinish(cs) != 0)
+            n = -EIO;
+        pfs_chunkstream_close(cs);
+    }
+    pfs_chunkstream_fini(desc);
+    return n < 0 ? (int)n : 0;
+}
+
+static char
+file_byte(const char *pbd, off_t off)
+{
+    char c = 0;
+    int fd;
+
+    EXPECT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    fd = pfs_open(file_path(pbd).c_str(), O_RDONLY, 0);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(pfs_pread(fd, &c, 1, off), 1);
+    EXPECT_EQ(pfs_close(fd), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+    return c;
+}
+
+TEST(ChunkstreamTest, incremental_backup_and_restore)
+{
+    const char *pbd = spare_pbd();
+    images_t again, idle, delta;
+    size_t fullsz;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    clear_bases(pbd);
+    fill_file(pbd, 'a', 0, FILESZ);
+
+    // nothing is committed, so each backup is full
+    fullsz = images_size(backup(pbd, false));
+    again = backup(pbd, true);
+    ASSERT_GT(fullsz, (size_t)FILESZ);
+    EXPECT_EQ(fullsz, images_size(again));
+
+    // only the header and meta if nothing changed
+    idle = backup(pbd, false);
+    EXPECT_LT(images_size(idle), (size_t)BUFSZ);
+
+    // an overwrite in place, which changes no metadata of the file
+    fill_file(pbd, 'b', FILESZ / 2, 4096);
+    delta = backup(pbd, true);
+    EXPECT_GT(images_size(delta), images_size(idle));
+    EXPECT_LT(images_size(delta) + FILESZ / 2, fullsz);
+
+    // the delta is only applied over the stream it is taken against
+    fill_file(pbd, 'c', FILESZ / 2, 4096);
+    clear_bases(pbd);
+    EXPECT_EQ(restore(pbd, delta), -EINVAL);
+    ASSERT_EQ(restore(pbd, again), 0);
+    EXPECT_EQ(file_byte(pbd, FILESZ / 2), 'a');
+    ASSERT_EQ(restore(pbd, delta), 0);
+    EXPECT_EQ(file_byte(pbd, FILESZ / 2), 'b');
+    EXPECT_EQ(file_byte(pbd, 0), 'a');
+
+    // nor twice
+    EXPECT_EQ(restore(pbd, delta), -EINVAL);
+    clear_bases(pbd);
+}
+
+typedef struct {
+    int64_t blko;
+    int64_t datalen;
+} blkmeta_t;
+
+// Make the second block streamed out of @img claim to be another one
+static void
+corrupt_second_block(std::string &img)
+{
+    blkmeta_t *meta = (blkmeta_t *)&img[HDRSZ];
+    int64_t nblk, nfound = 0;
+
+    for (nblk = 0; meta[nblk].blko == nblk; nblk++)
+        ;
+    for (int64_t i = nblk - 1; i >= 0; i--) {
+        if (meta[i].datalen != 0 && ++nfound == 2) {
+            meta[i].blko = -2;
+            return;
+        }
+    }
+    ADD_FAILURE() << "less than 2 blocks in the stream";
+}
+
+TEST(ChunkstreamTest, stream_spans_blocks)
+{
+    const char *pbd = spare_pbd();
+    pfs_chunkstream_desc_t *desc;
+    pfs_chunkstream_t *cs;
+    images_t small, big;
+    size_t ckid = 0;
+    int64_t n;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    clear_bases(pbd);
+    fill_file(pbd, 'a', 0, FILESZ);
+
+    // the same stream, whatever the buffer size; headers differ in ctime
+    small = backup(pbd, false);
+    big = backup(pbd, false, BIGBUFSZ);
+    ASSERT_EQ(small.size(), big.size());
+    for (size_t i = 0; i < small.size(); i++) {
+        ASSERT_EQ(small[i].size(), big[i].size()) << i;
+        EXPECT_TRUE(small[i].compare(HDRSZ, std::string::npos, big[i],
+            HDRSZ, std::string::npos) == 0) << i;
+        if (small[i].size() > small[ckid].size())
+            ckid = i;
+    }
+
+    /*
+     * A write of several blocks failing halfway takes what was written
+     * before the bad block, the error comes with the next write.
+     */
+    corrupt_second_block(big[ckid]);
+    desc = pfs_chunkstream_init("disk", pbd, CHUNK_RESTORE);
+    ASSERT_TRUE(desc != NULL);
+    cs = pfs_chunkstream_open(desc, ckid);
+    ASSERT_TRUE(cs != NULL);
+    n = pfs_chunkstream_write(cs, big[ckid].data(), big[ckid].size());
+    EXPECT_GT(n, HDRSZ);
+    EXPECT_LT(n, (int64_t)big[ckid].size());
+    if (n > 0) {
+        EXPECT_EQ(pfs_chunkstream_write(cs, big[ckid].data() + n,
+            big[ckid].size() - n), -EINVAL);
+        // and again, the stream did not move past the bad block
+        EXPECT_EQ(pfs_chunkstream_write(cs, big[ckid].data() + n,
+            big[ckid].size() - n), -EINVAL);
+    }
+    pfs_chunkstream_close(cs);
+    pfs_chunkstream_fini(desc);
+
+    ASSERT_EQ(restore(pbd, small), 0);
+    EXPECT_EQ(file_byte(pbd, FILESZ - 1), 'a');
+    clear_bases(pbd);
+}
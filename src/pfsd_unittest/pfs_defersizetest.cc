@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "pfs_api.h"
+#include "pfs_option.h"
+
+/*
+ * Mounts a spare disk in this process, which is given by PFS_TEST_SPARE_PBD
+ * (a name under /dev such as loop1). It is formatted by the pfs tool, which
+ * is taken from PFS_TOOL or PATH.
+ */
+#define NFILE   150     /* more than a flush batch */
+#define WLEN    4096
+
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f " + pbd +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+// Sizes are deferred for long, so that only umount commits them
+static void
+defer_sizes()
+{
+    char path[] = "/tmp/pfs_defersize.XXXXXX";
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    fp = fdopen(fd, "w");
+    fprintf(fp, "[common]\n"
+        "file_defer_size_enable=1\n"
+        "file_defer_size_bytes=1073741824\n"
+        "file_defer_size_us=600000000\n");
+    fclose(fp);
+    EXPECT_EQ(pfs_option_init(path), 0);
+    unlink(path);
+}
+
+// Files under pg_wal are redo logs, whose size changes are deferred
+static std::string
+redo_path(const char *pbd, int i)
+{
+    return std::string("/") + pbd + "/data/pg_wal/" + std::to_string(i);
+}
+
+TEST(DefersizeTest, umount_commits_every_file)
+{
+    const char *pbd = spare_pbd();
+    char buf[WLEN];
+    struct stat st;
+    int fdv[NFILE];
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    defer_sizes();
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    ASSERT_EQ(pfs_mkdir((std::string("/") + pbd + "/data").c_str(), 0), 0);
+    ASSERT_EQ(pfs_mkdir((std::string("/") + pbd + "/data/pg_wal").c_str(),
+        0), 0);
+
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < NFILE; i++) {
+        fdv[i] = pfs_open(redo_path(pbd, i).c_str(), O_CREAT | O_RDWR, 0);
+        ASSERT_GE(fdv[i], 0) << i;
+        // two writes, the second extends a parked change
+        ASSERT_EQ(pfs_pwrite(fdv[i], buf, WLEN, 0), WLEN) << i;
+        ASSERT_EQ(pfs_pwrite(fdv[i], buf, i + 1, WLEN), i + 1) << i;
+    }
+
+    // the files are still open, close would commit their sizes itself
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    for (int i = 0; i < NFILE; i++) {
+        ASSERT_EQ(pfs_stat(redo_path(pbd, i).c_str(), &st), 0) << i;
+        EXPECT_EQ(st.st_size, WLEN + i + 1) << i;
+    }
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
+
+// Opening a file does not wait for the size change parked on it
+TEST(DefersizeTest, open_does_not_wait_for_parked_size)
+{
+    const char *pbd = spare_pbd();
+    std::string path;
+    char buf[WLEN];
+    struct stat st;
+    time_t start;
+    int fd, fd2;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    defer_sizes();
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    ASSERT_EQ(pfs_mkdir((std::string("/") + pbd + "/data").c_str(), 0), 0);
+    ASSERT_EQ(pfs_mkdir((std::string("/") + pbd + "/data/pg_wal").c_str(),
+        0), 0);
+
+    path = redo_path(pbd, 0);
+    memset(buf, 'x', sizeof(buf));
+    fd = pfs_open(path.c_str(), O_CREAT | O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    // the first write allocates a block and commits, the second parks
+    ASSERT_EQ(pfs_pwrite(fd, buf, WLEN, 0), WLEN);
+    ASSERT_EQ(pfs_pwrite(fd, buf, 1, WLEN), 1);
+
+    // the change is parked for minutes
+    start = time(NULL);
+    fd2 = pfs_open(path.c_str(), O_RDONLY, 0);
+    EXPECT_GE(fd2, 0);
+    EXPECT_LT(time(NULL) - start, 10);
+    // stat commits it
+    ASSERT_EQ(pfs_stat(path.c_str(), &st), 0);
+    EXPECT_EQ(st.st_size, WLEN + 1);
+    EXPECT_EQ(pfs_close(fd2), 0);
+    EXPECT_EQ(pfs_close(fd), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "pfs_devio.h"
+
+#define NGEN    8
+
+static pfs_dev_t dev;
+
+/*
+ * The device flush is faked, flush of generation gen waits until the test
+ * releases it and then returns g_err[gen].
+ */
+static std::mutex g_mtx;
+static std::condition_variable g_cv;
+static uint64_t g_released;
+static int g_err[NGEN];
+static int g_nflush;
+
+static int
+fake_flush(pfs_dev_t *d)
+{
+    // only the flushing thread moves it
+    uint64_t gen = d->d_flush_started;
+    std::unique_lock<std::mutex> lk(g_mtx);
+
+    g_nflush++;
+    g_cv.wait(lk, [gen]() { return g_released >= gen; });
+    return g_err[gen];
+}
+
+static void
+release(uint64_t gen)
+{
+    std::lock_guard<std::mutex> lk(g_mtx);
+
+    g_released = gen;
+    g_cv.notify_all();
+}
+
+static void
+flush_async(std::thread *th, int *res)
+{
+    *th = std::thread([res]() {
+        *res = pfsdev_flush_shared(&dev, fake_flush);
+    });
+    // let it get to the device, or wait for the running flush
+    usleep(20 * 1000);
+}
+
+TEST(DevflushTest, error_stays_with_its_generation)
+{
+    std::thread a, b, c, d;
+    int ra = 1, rb = 1, rc = 1, rd = 1;
+
+    memset(&dev, 0, sizeof(dev));
+    pthread_mutex_init(&dev.d_flush_mtx, NULL);
+    pthread_cond_init(&dev.d_flush_cond, NULL);
+    memset(g_err, 0, sizeof(g_err));
+    g_err[2] = -EIO;
+    g_released = 0;
+    g_nflush = 0;
+
+    // b and d arrive while gen 1 runs, so they share gen 2
+    flush_async(&a, &ra);
+    flush_async(&b, &rb);
+    flush_async(&d, &rd);
+    release(1);
+    a.join();
+    EXPECT_EQ(ra, 0);
+    usleep(20 * 1000);
+
+    // c arrives while gen 2 runs, gen 3 succeeds right after gen 2 fails
+    flush_async(&c, &rc);
+    release(3);
+    b.join();
+    c.join();
+    d.join();
+    EXPECT_EQ(rb, -EIO);
+    EXPECT_EQ(rd, -EIO);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(g_nflush, 3);
+    EXPECT_EQ(dev.d_flush_errgen, 2u);
+
+    // a new caller doesn't inherit the old error
+    release(4);
+    EXPECT_EQ(pfsdev_flush_shared(&dev, fake_flush), 0);
+    EXPECT_EQ(g_nflush, 4);
+
+    pthread_cond_destroy(&dev.d_flush_cond);
+    pthread_mutex_destroy(&dev.d_flush_mtx);
+}
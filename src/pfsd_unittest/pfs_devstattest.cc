@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+#include "pfs_devio.h"
+#include "pfs_devstat.h"
+
+static pfs_dev_t dev;
+
+static void
+run_ios(int nthread, uint64_t nio)
+{
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < nthread; t++) {
+        threads.push_back(std::thread([nio]() {
+            pfs_devio_t io;
+
+            memset(&io, 0, sizeof(io));
+            io.io_dev = &dev;
+            io.io_flags = IO_STAT;
+            for (uint64_t i = 0; i < nio; i++) {
+                io.io_op = (i & 1) ? PFSDEV_REQ_WR : PFSDEV_REQ_RD;
+                io.io_len = 4096;
+                io.io_error = (i % 100 == 99) ? -EIO : 0;
+                gettimeofday(&io.io_start_ts, NULL);
+                pfs_devstat_io_start(&dev.d_ds, &io);
+                pfs_devstat_io_end(&dev.d_ds, &io);
+            }
+        }));
+    }
+    for (auto &th : threads)
+        th.join();
+}
+
+TEST(DevstatTest, collect)
+{
+    const int nthread = 2 * PFS_DEVSTAT_NSHARD;
+    const uint64_t nio = 10000;
+    pfs_iostat_t st;
+    uint64_t inflight, begin, elapsed;
+
+    pfs_devstat_init(&dev.d_ds);
+    begin = gettimeofday_us();
+    run_ios(nthread, nio);
+    elapsed = gettimeofday_us() - begin;
+
+    pfs_devstat_collect(&dev.d_ds, &st, &inflight);
+    EXPECT_EQ(inflight, 0u);
+    EXPECT_EQ(st.is_start_count, nthread * nio);
+    EXPECT_EQ(st.is_end_count, nthread * nio);
+    // every 100th io fails and is left out of ops and bytes
+    EXPECT_EQ(st.is_ops[PFSDEV_REQ_RD] + st.is_ops[PFSDEV_REQ_WR],
+        nthread * (nio - nio / 100));
+    EXPECT_EQ(st.is_bytes[PFSDEV_REQ_RD], st.is_ops[PFSDEV_REQ_RD] * 4096);
+    EXPECT_EQ(st.is_bytes[PFSDEV_REQ_WR], st.is_ops[PFSDEV_REQ_WR] * 4096);
+    EXPECT_LE((uint64_t)(st.is_busy_time.tv_sec * 1000000 +
+        st.is_busy_time.tv_usec), elapsed);
+    pfs_devstat_uninit(&dev.d_ds);
+}
+
+static uint64_t
+busy_us(uint64_t *inflight)
+{
+    pfs_iostat_t st;
+
+    pfs_devstat_collect(&dev.d_ds, &st, inflight);
+    return st.is_busy_time.tv_sec * 1000000 + st.is_busy_time.tv_usec;
+}
+
+TEST(DevstatTest, busy_time)
+{
+    const uint64_t busy = 20000, tick = PFS_DEVSTAT_TICK_US;
+    pfs_devio_t io;
+    uint64_t inflight, begin, first;
+
+    pfs_devstat_init(&dev.d_ds);
+    memset(&io, 0, sizeof(io));
+    io.io_dev = &dev;
+    io.io_flags = IO_STAT;
+    io.io_op = PFSDEV_REQ_RD;
+    io.io_len = 4096;
+
+    begin = gettimeofday_us();
+    gettimeofday(&io.io_start_ts, NULL);
+    pfs_devstat_io_start(&dev.d_ds, &io);
+    usleep(busy);
+    EXPECT_GE(busy_us(&inflight), busy);
+    EXPECT_EQ(inflight, 1u);
+
+    // ended by another thread, so on another shard
+    std::thread([&io]() {
+        pfs_devstat_io_end(&dev.d_ds, &io);
+    }).join();
+    first = busy_us(&inflight);
+    EXPECT_EQ(inflight, 0u);
+    EXPECT_GE(first, busy);
+    EXPECT_LE(first, gettimeofday_us() - begin);
+
+    // idle time is not counted
+    usleep(busy);
+    gettimeofday(&io.io_start_ts, NULL);
+    pfs_devstat_io_start(&dev.d_ds, &io);
+    pfs_devstat_io_end(&dev.d_ds, &io);
+    EXPECT_LE(busy_us(&inflight), first + 2 * tick);
+    EXPECT_EQ(inflight, 0u);
+    pfs_devstat_uninit(&dev.d_ds);
+}
+
+/*
+ * Not a pass/fail check: shows how io completion scales with threads.
+ * Run with --gtest_also_run_disabled_tests.
+ */
+TEST(DevstatTest, DISABLED_scaling)
+{
+    const uint64_t nio = 20000;
+    uint64_t begin, elapsed;
+
+    for (int nthread = 1; nthread <= 64; nthread *= 2) {
+        pfs_devstat_init(&dev.d_ds);
+        begin = gettimeofday_us();
+        run_ios(nthread, nio);
+        elapsed = gettimeofday_us() - begin;
+        printf("%2d threads: %8.2f ios/us\n", nthread,
+            nthread * nio / (double)(elapsed ? elapsed : 1));
+        pfs_devstat_uninit(&dev.d_ds);
+    }
+}
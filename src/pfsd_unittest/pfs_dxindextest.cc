@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <map>
+#include <vector>
+
+#include "pfs_avl.h"
+#include "pfs_dxindex.h"
+
+static uint64_t
+now_us()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static void
+free_ent(pfs_dxent_t *ent)
+{
+    delete ent;
+}
+
+static pfs_dxent_t *
+new_ent(uint32_t nmhash, int64_t ino)
+{
+    pfs_dxent_t *ent = new pfs_dxent_t;
+
+    ent->e_nmhash = nmhash;
+    ent->e_ino = ino;
+    ent->e_in = NULL;
+    ent->e_next = NULL;
+    return ent;
+}
+
+static size_t
+chain_len(const pfs_dxindex_t *dx, uint32_t nmhash)
+{
+    size_t n = 0;
+
+    for (pfs_dxent_t *e = pfs_dxindex_find(dx, nmhash); e; e = e->e_next) {
+        EXPECT_EQ(e->e_nmhash, nmhash);
+        n++;
+    }
+    return n;
+}
+
+TEST(DxindexTest, add_del_across_grows)
+{
+    pfs_dxindex_t dx;
+    std::multimap<uint32_t, pfs_dxent_t *> ref;
+    int64_t ino = 0;
+
+    srand(1);
+    pfs_dxindex_init(&dx);
+    // few hashes so that names collide, many ops so that tables grow
+    for (int op = 0; op < 400000; op++) {
+        uint32_t nmhash = rand() % 60000;
+
+        if (ref.empty() || rand() % 3 != 0) {
+            pfs_dxent_t *ent = new_ent(nmhash, ino++);
+            pfs_dxindex_add(&dx, ent);
+            ref.insert(std::make_pair(nmhash, ent));
+        } else {
+            auto it = ref.lower_bound(nmhash);
+            if (it == ref.end())
+                it = ref.begin();
+            pfs_dxindex_del(&dx, it->second);
+            delete it->second;
+            ref.erase(it);
+        }
+        if (op % 997 == 0) {
+            for (uint32_t h = 0; h < 60000; h += 7)
+                ASSERT_EQ(chain_len(&dx, h), ref.count(h)) << op << " " << h;
+        }
+    }
+    for (uint32_t h = 0; h < 60000; h++)
+        ASSERT_EQ(chain_len(&dx, h), ref.count(h)) << h;
+    while (!ref.empty()) {
+        pfs_dxindex_del(&dx, ref.begin()->second);
+        delete ref.begin()->second;
+        ref.erase(ref.begin());
+    }
+    EXPECT_EQ(dx.dx_nused, 0u);
+    pfs_dxindex_clear(&dx, free_ent);
+}
+
+typedef struct avl_ent {
+    pfs_avl_node_t  node;
+    uint32_t        nmhash;
+} avl_ent_t;
+
+static int
+avl_compare(const void *a, const void *b)
+{
+    uint32_t ha = ((const avl_ent_t *)a)->nmhash;
+    uint32_t hb = ((const avl_ent_t *)b)->nmhash;
+
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/*
+ * Not a pass/fail check: lookup cost against directory size, with the
+ * avl tree the index used to be for reference. Run with
+ * --gtest_also_run_disabled_tests.
+ */
+TEST(DxindexTest, DISABLED_large_directory)
+{
+    for (int n = 1000; n <= 1000000; n *= 10) {
+        std::vector<uint32_t> hashes(n);
+        std::vector<avl_ent_t> avlents(n);
+        pfs_dxindex_t dx;
+        pfs_avl_tree_t avl;
+        uint64_t begin, tadd, tfind, tavl;
+        avl_ent_t key;
+        size_t found = 0;
+        const int nlookup = 1000000;
+
+        for (int i = 0; i < n; i++)
+            hashes[i] = (uint32_t)rand() * 2654435761U + i;
+
+        pfs_dxindex_init(&dx);
+        begin = now_us();
+        for (int i = 0; i < n; i++)
+            pfs_dxindex_add(&dx, new_ent(hashes[i], i));
+        tadd = now_us() - begin;
+
+        begin = now_us();
+        for (int i = 0; i < nlookup; i++) {
+            uint32_t nmhash = hashes[(uint64_t)i * 7919 % n];
+            found += pfs_dxindex_find(&dx, nmhash) != NULL;
+        }
+        tfind = now_us() - begin;
+        EXPECT_EQ(found, (size_t)nlookup);
+
+        pfs_avl_create(&avl, avl_compare, offsetof(avl_ent_t, node));
+        for (int i = 0; i < n; i++) {
+            avlents[i].nmhash = hashes[i];
+            if (pfs_avl_find(&avl, &avlents[i], NULL) == NULL)
+                pfs_avl_add(&avl, &avlents[i]);
+        }
+        begin = now_us();
+        for (int i = 0; i < nlookup; i++) {
+            key.nmhash = hashes[(uint64_t)i * 7919 % n];
+            found += pfs_avl_find(&avl, &key, NULL) != NULL;
+        }
+        tavl = now_us() - begin;
+        while (!pfs_avl_is_empty(&avl))
+            pfs_avl_remove(&avl, pfs_avl_first(&avl));
+        pfs_avl_destroy(&avl);
+
+        printf("%7d subfiles: add %6.1f ns, lookup %6.1f ns, avl lookup "
+            "%6.1f ns\n", n, tadd * 1000.0 / n, tfind * 1000.0 / nlookup,
+            tavl * 1000.0 / nlookup);
+        pfs_dxindex_clear(&dx, free_ent);
+    }
+}
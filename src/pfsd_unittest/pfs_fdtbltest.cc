@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pfs_api.h"
+
+/*
+ * Mounts a spare disk in this process, which is given by PFS_TEST_SPARE_PBD
+ * (a name under /dev such as loop1). It is formatted by the pfs tool, which
+ * is taken from PFS_TOOL or PATH.
+ */
+#define NTHREAD 8
+#define NLOOP   500
+#define NFILE   4       /* per thread */
+#define NPROBE  1024    /* fds the prober looks at */
+
+#define PFS_FD_MAKE(fd)                                     \
+    (int)((unsigned int)(fd) | (1U << PFS_FD_VALIDBIT))
+
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f " + pbd +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static std::string
+file_path(const char *pbd, int i)
+{
+    return std::string("/") + pbd + "/f" + std::to_string(i);
+}
+
+TEST(FdtblTest, closed_fd_is_reused_first)
+{
+    const char *pbd = spare_pbd();
+    struct stat st;
+    int fd0, fd1, fd2;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    fd0 = pfs_open(file_path(pbd, 0).c_str(), O_CREAT | O_RDWR, 0);
+    fd1 = pfs_open(file_path(pbd, 1).c_str(), O_CREAT | O_RDWR, 0);
+    ASSERT_GE(fd0, 0);
+    ASSERT_GE(fd1, 0);
+    EXPECT_NE(fd0, fd1);
+
+    EXPECT_EQ(pfs_close(fd0), 0);
+    EXPECT_EQ(pfs_fstat(fd0, &st), -1);
+    EXPECT_EQ(errno, EBADF);
+    EXPECT_EQ(pfs_close(fd0), -1);
+    EXPECT_EQ(errno, EBADF);
+
+    fd2 = pfs_open(file_path(pbd, 2).c_str(), O_CREAT | O_RDWR, 0);
+    EXPECT_EQ(fd2, fd0);
+    EXPECT_EQ(pfs_fstat(fd1, &st), 0);
+    EXPECT_EQ(pfs_close(fd1), 0);
+    EXPECT_EQ(pfs_close(fd2), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
+
+/*
+ * Threads open, stat and close their own files, while another one stats
+ * the fds they were handed. An fd is never handed out twice, and a stat
+ * racing with close finds either the file or no file. The journal and
+ * paxos files of the mount have fds too, which are not probed.
+ */
+TEST(FdtblTest, concurrent_open_close)
+{
+    const char *pbd = spare_pbd();
+    std::atomic<int> nerr(0), maxfd(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::atomic<bool>> handed(NPROBE);
+    std::vector<std::thread> threads;
+    struct stat st;
+    int fd;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    for (int i = 0; i < NTHREAD * NFILE; i++) {
+        fd = pfs_open(file_path(pbd, i).c_str(), O_CREAT | O_RDWR, 0);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(pfs_ftruncate(fd, i), 0);
+        EXPECT_EQ(pfs_close(fd), 0);
+    }
+
+    for (int t = 0; t < NTHREAD; t++) {
+        threads.push_back(std::thread([&, t]() {
+            int fdv[NFILE];
+            struct stat fst;
+
+            for (int n = 0; n < NLOOP; n++) {
+                for (int j = 0; j < NFILE; j++) {
+                    fdv[j] = pfs_open(file_path(pbd, t * NFILE + j).c_str(),
+                        O_RDONLY, 0);
+                    if (fdv[j] < 0) {
+                        nerr++;
+                        continue;
+                    }
+                    if (PFS_FD_RAW(fdv[j]) < NPROBE)
+                        handed[PFS_FD_RAW(fdv[j])] = true;
+                    if (PFS_FD_RAW(fdv[j]) > maxfd)
+                        maxfd = PFS_FD_RAW(fdv[j]);
+                }
+                for (int j = 0; j < NFILE; j++) {
+                    // the size tells the file
+                    if (pfs_fstat(fdv[j], &fst) != 0 ||
+                        fst.st_size != t * NFILE + j)
+                        nerr++;
+                }
+                for (int j = 0; j < NFILE; j++) {
+                    if (pfs_close(fdv[j]) != 0)
+                        nerr++;
+                }
+            }
+        }));
+    }
+    std::thread prober([&]() {
+        struct stat pst;
+
+        while (!stop) {
+            for (int i = 0; i <= maxfd && i < NPROBE; i++) {
+                if (handed[i] && pfs_fstat(PFS_FD_MAKE(i), &pst) != 0 &&
+                    errno != EBADF)
+                    nerr++;
+            }
+            usleep(100);
+        }
+    });
+    for (auto &th : threads)
+        th.join();
+    stop = true;
+    prober.join();
+
+    EXPECT_EQ(nerr.load(), 0);
+    // closed fds were reused, not taken from the rest of the table
+    EXPECT_LT(maxfd.load(), 2 * NTHREAD * NFILE);
+    fd = pfs_open(file_path(pbd, 0).c_str(), O_RDONLY, 0);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(pfs_fstat(fd, &st), 0);
+    EXPECT_EQ(pfs_close(fd), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "pfs_api.h"
+
+/*
+ * fscp copies one spare disk to another, PFS_TEST_SPARE_PBD to
+ * PFS_TEST_SPARE_PBD2 (names under /dev such as loop1 and loop2). The
+ * second must be at least as large as the first. Both are formatted by
+ * the pfs tool, which is taken from PFS_TOOL or PATH.
+ */
+#define NFILE   8
+#define FILESZ  (10 << 20)      /* some blocks and a partial one */
+#define HOLEOFF (5 << 20)       /* files with odd i are not written here */
+#define HOLESZ  (4 << 20)
+
+static const char *
+src_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static const char *
+dst_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD2");
+}
+
+static std::string
+tool()
+{
+    const char *t = getenv("PFS_TOOL");
+
+    return t ? t : "pfs";
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    std::string cmd;
+
+    cmd = tool() + " -C disk mkfs -f " + pbd + " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static int
+run_fscp(const char *src, const char *dst, const std::string &opts)
+{
+    std::string cmd;
+
+    cmd = tool() + " -C disk fscp " + opts + " " + src + " " + dst +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static std::string
+file_path(const char *pbd, int i)
+{
+    return std::string("/") + pbd + "/d/f" + std::to_string(i);
+}
+
+// What file @i holds at @off, zero in its hole
+static char
+file_byte(int i, off_t off)
+{
+    if ((i & 1) && off >= HOLEOFF && off < HOLEOFF + HOLESZ)
+        return 0;
+    return (char)(i * 131 + off / 512 + 1);
+}
+
+static void
+fill_files(const char *pbd)
+{
+    char *buf = (char *)malloc(FILESZ);
+    int fd;
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    EXPECT_EQ(pfs_mkdir((std::string("/") + pbd + "/d").c_str(), 0), 0);
+    for (int i = 0; i < NFILE; i++) {
+        fd = pfs_open(file_path(pbd, i).c_str(), O_CREAT | O_RDWR, 0);
+        EXPECT_GE(fd, 0) << i;
+        for (off_t off = 0; off < FILESZ; off++)
+            buf[off] = file_byte(i, off);
+        if (i & 1) {
+            EXPECT_EQ(pfs_pwrite(fd, buf, HOLEOFF, 0), HOLEOFF) << i;
+            EXPECT_EQ(pfs_pwrite(fd, buf + HOLEOFF + HOLESZ,
+                FILESZ - HOLEOFF - HOLESZ, HOLEOFF + HOLESZ),
+                FILESZ - HOLEOFF - HOLESZ) << i;
+        } else {
+            EXPECT_EQ(pfs_pwrite(fd, buf, FILESZ, 0), FILESZ) << i;
+        }
+        EXPECT_EQ(pfs_close(fd), 0);
+    }
+    EXPECT_EQ(pfs_umount(pbd), 0);
+    free(buf);
+}
+
+// Leave a file on dst, which the copy must not keep
+static void
+dirty_dst(const char *pbd)
+{
+    int fd;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    fd = pfs_open((std::string("/") + pbd + "/stale").c_str(),
+        O_CREAT | O_RDWR, 0);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(pfs_pwrite(fd, "stale", 5, 0), 5);
+    EXPECT_EQ(pfs_close(fd), 0);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
+
+static void
+compare_files(const char *pbd)
+{
+    char *buf = (char *)malloc(FILESZ);
+    struct stat st;
+    off_t off;
+    int fd;
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    EXPECT_EQ(pfs_stat((std::string("/") + pbd + "/stale").c_str(), &st),
+        -1);
+    EXPECT_EQ(errno, ENOENT);
+    for (int i = 0; i < NFILE; i++) {
+        fd = pfs_open(file_path(pbd, i).c_str(), O_RDONLY, 0);
+        EXPECT_GE(fd, 0) << i;
+        if (fd < 0)
+            continue;
+        EXPECT_EQ(pfs_fstat(fd, &st), 0) << i;
+        EXPECT_EQ(st.st_size, FILESZ) << i;
+        EXPECT_EQ(pfs_pread(fd, buf, FILESZ, 0), FILESZ) << i;
+        for (off = 0; off < FILESZ; off++) {
+            if (buf[off] != file_byte(i, off))
+                break;
+        }
+        EXPECT_EQ(off, FILESZ) << i;
+        EXPECT_EQ(pfs_close(fd), 0);
+    }
+    EXPECT_EQ(pfs_umount(pbd), 0);
+    free(buf);
+}
+
+TEST(FscpTest, copy_then_compare)
+{
+    const char *src = src_pbd(), *dst = dst_pbd();
+
+    if (src == NULL || dst == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(src), 0);
+    fill_files(src);
+    dirty_dst(dst);
+    ASSERT_EQ(run_fscp(src, dst, "-w 4"), 0);
+    compare_files(dst);
+}
+
+// The fewest fragments a batch, so a block takes several batches
+TEST(FscpTest, copy_small_batches_with_crc)
+{
+    const char *src = src_pbd(), *dst = dst_pbd();
+
+    if (src == NULL || dst == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(src), 0);
+    fill_files(src);
+    dirty_dst(dst);
+    ASSERT_EQ(run_fscp(src, dst, "-w 2 -n 8 -c"), 0);
+    compare_files(dst);
+}
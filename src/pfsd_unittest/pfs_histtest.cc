@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "pfs_hist.h"
+
+static pfs_hist_t hist;
+static pfs_hist_snap_t snap;
+
+static void
+check_bucket(uint64_t val)
+{
+    int idx = pfs_hist_index(val);
+
+    ASSERT_GE(idx, 0);
+    ASSERT_LT(idx, PFS_HIST_NBUCKET);
+    EXPECT_LE(pfs_hist_lowest(idx), val) << val;
+    EXPECT_GE(pfs_hist_highest(idx), val) << val;
+    if (idx < PFS_HIST_NBUCKET - 1) {
+        // bucket width is within 1/NSUB of its lowest value
+        uint64_t width = pfs_hist_highest(idx) - pfs_hist_lowest(idx) + 1;
+        EXPECT_LE(width * PFS_HIST_NSUB,
+            pfs_hist_lowest(idx) > PFS_HIST_NSUB ?
+            pfs_hist_lowest(idx) : PFS_HIST_NSUB) << val;
+    }
+}
+
+TEST(HistTest, bucket_bounds)
+{
+    uint64_t val;
+    int i;
+
+    // 1 Exact buckets for small values, contiguous buckets after
+    for (val = 0; val < 100000; val++)
+        check_bucket(val);
+    for (i = 1; i < PFS_HIST_NBUCKET; i++)
+        EXPECT_EQ(pfs_hist_lowest(i), pfs_hist_highest(i - 1) + 1) << i;
+
+    // 2 Around every power of two
+    for (i = 1; i < 40; i++) {
+        val = (uint64_t)1 << i;
+        check_bucket(val - 1);
+        check_bucket(val);
+        check_bucket(val + 1);
+    }
+
+    // 3 Huge values are clamped into the last bucket
+    EXPECT_EQ(pfs_hist_index((uint64_t)1 << PFS_HIST_MAXBITS),
+        PFS_HIST_NBUCKET - 1);
+    EXPECT_EQ(pfs_hist_index(UINT64_MAX), PFS_HIST_NBUCKET - 1);
+}
+
+TEST(HistTest, percentile)
+{
+    const uint64_t n = 100000;
+    const double pcts[] = { 1, 50, 90, 99, 99.9, 100 };
+    uint64_t val, expect, got;
+
+    pfs_hist_reset(&hist);
+    for (val = 1; val <= n; val++)
+        pfs_hist_record(&hist, val);
+    pfs_hist_merge(&hist, &snap);
+    EXPECT_EQ(snap.hn_total, n);
+    EXPECT_EQ(snap.hn_sum, n * (n + 1) / 2);
+    EXPECT_EQ(snap.hn_max, n);
+
+    // Never below the real percentile, never above it by a bucket width
+    for (double pct : pcts) {
+        expect = (uint64_t)(pct / 100 * n);
+        got = pfs_hist_percentile(&snap, pct);
+        EXPECT_GE(got, expect) << "p" << pct;
+        EXPECT_LE(got, expect + expect / PFS_HIST_NSUB) << "p" << pct;
+    }
+    EXPECT_EQ(pfs_hist_percentile(&snap, 100), n);
+
+    // A tail of slow values shows up in p99 only
+    pfs_hist_reset(&hist);
+    for (val = 0; val < 990; val++)
+        pfs_hist_record(&hist, 100);
+    for (val = 0; val < 10; val++)
+        pfs_hist_record(&hist, 50000);
+    pfs_hist_merge(&hist, &snap);
+    EXPECT_GE(pfs_hist_percentile(&snap, 50), 100u);
+    EXPECT_LE(pfs_hist_percentile(&snap, 99), 100u + 100 / PFS_HIST_NSUB);
+    EXPECT_GE(pfs_hist_percentile(&snap, 99.9), 50000u - 50000 / PFS_HIST_NSUB);
+    EXPECT_EQ(snap.hn_max, 50000u);
+}
+
+TEST(HistTest, merge_threads)
+{
+    const int nthread = 2 * PFS_HIST_NSHARD;
+    const uint64_t n = 10000;
+    std::vector<std::thread> threads;
+    uint64_t sum = 0;
+
+    pfs_hist_reset(&hist);
+    for (int t = 0; t < nthread; t++) {
+        threads.push_back(std::thread([t, n]() {
+            for (uint64_t val = 0; val < n; val++)
+                pfs_hist_record(&hist, val * (t + 1));
+        }));
+    }
+    for (auto &th : threads)
+        th.join();
+    for (int t = 0; t < nthread; t++)
+        sum += (n - 1) * n / 2 * (t + 1);
+
+    pfs_hist_merge(&hist, &snap);
+    EXPECT_EQ(snap.hn_total, n * nthread);
+    EXPECT_EQ(snap.hn_sum, sum);
+    EXPECT_EQ(snap.hn_max, (n - 1) * nthread);
+
+    // Reset clears every shard
+    pfs_hist_reset(&hist);
+    pfs_hist_merge(&hist, &snap);
+    EXPECT_EQ(snap.hn_total, 0u);
+    EXPECT_EQ(snap.hn_sum, 0u);
+    EXPECT_EQ(snap.hn_max, 0u);
+    EXPECT_EQ(pfs_hist_percentile(&snap, 99), 0u);
+}
+
+TEST(HistTest, reset_keeps_totals_since_start)
+{
+    uint64_t alltotal, allsum;
+
+    pfs_hist_reset(&hist);
+    pfs_hist_merge(&hist, &snap);
+    alltotal = snap.hn_alltotal;
+    allsum = snap.hn_allsum;
+
+    for (uint64_t val = 1; val <= 100; val++)
+        pfs_hist_record(&hist, val);
+    pfs_hist_reset(&hist);
+    pfs_hist_record(&hist, 1000);
+    pfs_hist_merge(&hist, &snap);
+
+    // the admin view starts over, exporters see monotonic counters
+    EXPECT_EQ(snap.hn_total, 1u);
+    EXPECT_EQ(snap.hn_sum, 1000u);
+    EXPECT_EQ(pfs_hist_percentile(&snap, 50), 1000u);
+    EXPECT_EQ(snap.hn_alltotal, alltotal + 101);
+    EXPECT_EQ(snap.hn_allsum, allsum + 5050 + 1000);
+}
+
+TEST(HistTest, parse_pcts)
+{
+    double pcts[PFS_HIST_MAXPCT];
+
+    EXPECT_EQ(pfs_hist_parse_pcts("", pcts, PFS_HIST_MAXPCT), 4);
+    EXPECT_EQ(pcts[3], 99.9);
+    EXPECT_EQ(pfs_hist_parse_pcts("50,99.99", pcts, PFS_HIST_MAXPCT), 2);
+    EXPECT_EQ(pcts[1], 99.99);
+    EXPECT_EQ(pfs_hist_parse_pcts("0", pcts, PFS_HIST_MAXPCT), -EINVAL);
+    EXPECT_EQ(pfs_hist_parse_pcts("101", pcts, PFS_HIST_MAXPCT), -EINVAL);
+    EXPECT_EQ(pfs_hist_parse_pcts("50;99", pcts, PFS_HIST_MAXPCT), -EINVAL);
+    EXPECT_EQ(pfs_hist_parse_pcts("1,2,3", pcts, 2), -E2BIG);
+}
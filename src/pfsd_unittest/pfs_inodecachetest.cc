@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "pfs_api.h"
+#include "pfs_option.h"
+#include "pfs_impl.h"
+#include "pfs_inode.h"
+#include "pfs_mount.h"
+
+/*
+ * Mounts a spare disk in this process, which is given by PFS_TEST_SPARE_PBD
+ * (a name under /dev such as loop1). It is formatted by the pfs tool, which
+ * is taken from PFS_TOOL or PATH.
+ */
+#define LRU_SIZE    64
+#define NFILE       400
+
+typedef struct {
+    size_t ncached[PFS_INODE_NSHARD];
+    size_t nused[PFS_INODE_NSHARD];     /* of them in use */
+    size_t lrumem[PFS_INODE_NSHARD];
+    size_t unusedmem;                   /* the sum of their memsize */
+} cache_t;
+
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f " + pbd +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static void
+set_options(int64_t lrusize, bool memenable, int64_t memmb)
+{
+    char path[] = "/tmp/pfs_inodecache.XXXXXX";
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    fp = fdopen(fd, "w");
+    fprintf(fp, "[common]\n"
+        "inodetree_lru_size=%ld\n"
+        "inodetree_lru_mem_enable=%d\n"
+        "inodetree_lru_mem_mb=%ld\n", lrusize, memenable ? 1 : 0, memmb);
+    fclose(fp);
+    EXPECT_EQ(pfs_option_init(path), 0);
+    unlink(path);
+}
+
+static void
+scan_cache(const char *pbd, cache_t *c)
+{
+    pfs_mount_t *mnt = pfs_get_mount(pbd);
+    pfs_inode_t *in;
+
+    memset(c, 0, sizeof(*c));
+    ASSERT_TRUE(mnt != NULL);
+    for (int i = 0; i < PFS_INODE_NSHARD; i++) {
+        pfs_inode_shard_t *sh = &mnt->mnt_inodeshard[i];
+
+        pthread_mutex_lock(&sh->is_mtx);
+        c->ncached[i] = pfs_avl_numnodes(&sh->is_tree);
+        c->lrumem[i] = sh->is_lrumem;
+        TAILQ_FOREACH(in, &sh->is_lru, in_next) {
+            if (in->in_refcnt != 0)
+                c->nused[i]++;
+            else
+                c->unusedmem += in->in_lrumem;
+        }
+        pthread_mutex_unlock(&sh->is_mtx);
+    }
+    pfs_put_mount(mnt);
+}
+
+static std::string
+file_path(const char *pbd, int i)
+{
+    return std::string("/") + pbd + "/f" + std::to_string(i);
+}
+
+static int
+open_file(const char *pbd, int i)
+{
+    return pfs_open(file_path(pbd, i).c_str(), O_CREAT | O_RDWR, 0);
+}
+
+TEST(InodecacheTest, shards_keep_their_part_of_lru_size)
+{
+    const char *pbd = spare_pbd();
+    size_t total = 0, lrumem = 0;
+    int nonempty = 0, fd;
+    cache_t c;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    set_options(LRU_SIZE, false, 1024);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    for (int i = 0; i < NFILE; i++) {
+        fd = open_file(pbd, i);
+        ASSERT_GE(fd, 0) << i;
+        EXPECT_EQ(pfs_close(fd), 0);
+    }
+
+    scan_cache(pbd, &c);
+    for (int i = 0; i < PFS_INODE_NSHARD; i++) {
+        // and those in use, such as the root
+        EXPECT_LE(c.ncached[i], LRU_SIZE / PFS_INODE_NSHARD + c.nused[i])
+            << i;
+        total += c.ncached[i];
+        lrumem += c.lrumem[i];
+        if (c.ncached[i] > 0)
+            nonempty++;
+    }
+    // consecutive inos are spread over the shards
+    EXPECT_GE(total, (size_t)LRU_SIZE / 2);
+    EXPECT_GE(nonempty, PFS_INODE_NSHARD * 3 / 4);
+    EXPECT_EQ(lrumem, c.unusedmem);
+    EXPECT_GT(lrumem, 0u);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+}
+
+TEST(InodecacheTest, memory_target_counts_unused_inodes)
+{
+    const char *pbd = spare_pbd();
+    const size_t shardmem = (1 << 20) / PFS_INODE_NSHARD;
+    size_t nfile, total, lrumem;
+    std::vector<int> fdv;
+    cache_t c;
+    int fd;
+
+    if (pbd == NULL)
+        return;
+
+    // inodes in use alone take twice the target
+    nfile = (2 << 20) / sizeof(pfs_inode_t);
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    set_options(1 << 20, true, 1);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    for (size_t i = 0; i < nfile; i++) {
+        fd = open_file(pbd, i);
+        ASSERT_GE(fd, 0) << i;
+        fdv.push_back(fd);
+    }
+
+    // still cached, though they take more than the target
+    scan_cache(pbd, &c);
+    total = 0;
+    for (int i = 0; i < PFS_INODE_NSHARD; i++)
+        total += c.ncached[i];
+    EXPECT_GT(total, nfile);
+
+    // other files come and go, and are cached as well
+    for (size_t i = nfile; i < nfile + NFILE; i++) {
+        fd = open_file(pbd, i);
+        ASSERT_GE(fd, 0) << i;
+        EXPECT_EQ(pfs_close(fd), 0);
+    }
+    scan_cache(pbd, &c);
+    total = 0;
+    for (int i = 0; i < PFS_INODE_NSHARD; i++)
+        total += c.ncached[i];
+    EXPECT_GT(total, nfile + NFILE);
+
+    // once unused, each shard swaps out down to its part of the target
+    for (size_t i = 0; i < fdv.size(); i++)
+        EXPECT_EQ(pfs_close(fdv[i]), 0);
+    scan_cache(pbd, &c);
+    total = lrumem = 0;
+    for (int i = 0; i < PFS_INODE_NSHARD; i++) {
+        EXPECT_LE(c.lrumem[i], shardmem) << i;
+        total += c.ncached[i];
+        lrumem += c.lrumem[i];
+    }
+    EXPECT_LT(total, nfile);
+    EXPECT_EQ(lrumem, c.unusedmem);
+    EXPECT_EQ(pfs_umount(pbd), 0);
+    set_options(65536, false, 1024);
+}
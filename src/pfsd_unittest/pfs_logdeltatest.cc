@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <search.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pfs_meta.h"
+#include "pfs_memory.h"
+#include "pfs_util.h"
+#include "pfs_tx.h"
+#include "pfs_log.h"
+
+#define NOBJ    8
+#define BDA     (64 << 10)
+
+static void
+set_crc(pfs_metaobj_phy_t *mo)
+{
+    mo->mo_checksum = crc32c_compute(mo, sizeof(*mo),
+        offsetof(struct pfs_metaobj_phy, mo_checksum));
+}
+
+// a sector of blktags whose unused bytes are not zero, as on disk
+static void
+init_sector(pfs_metaobj_phy_t *buf)
+{
+    memset(buf, 0, sizeof(*buf) * NOBJ);
+    for (int i = 0; i < NOBJ; i++) {
+        pfs_blktag_phy_t *bt = (pfs_blktag_phy_t *)buf[i].mo_data;
+
+        buf[i].mo_number = 100 + i;
+        buf[i].mo_type = MT_BLKTAG;
+        buf[i].mo_next = i + 1;
+        buf[i].mo_prev = i - 1;
+        bt->bt_ino = -1;
+        bt->bt_blkid = -1;
+        memset(&buf[i].mo_data[sizeof(*bt)], 0x5a,
+            sizeof(buf[i].mo_data) - sizeof(*bt));
+        set_crc(&buf[i]);
+    }
+}
+
+static void
+init_tx(pfs_tx_t *tx)
+{
+    memset(tx, 0, sizeof(*tx));
+    TAILQ_INIT(&tx->t_ops);
+}
+
+static void
+fini_tx(pfs_tx_t *tx)
+{
+    pfs_txop_t *top;
+
+    while ((top = TAILQ_FIRST(&tx->t_ops)) != NULL) {
+        TAILQ_REMOVE(&tx->t_ops, top, top_next);
+        pfs_mem_free(top, M_TXOP);
+    }
+    tdestroy(tx->t_opsroot, [](void *) {});
+}
+
+// allocate blktag oid of the sector to a file block, as pfs_meta_alloc does
+static pfs_txop_t *
+alloc_blktag(pfs_tx_t *tx, pfs_metaobj_phy_t *buf, int oid, int64_t ino)
+{
+    pfs_txop_t *top;
+    pfs_metaobj_phy_t *mo;
+    pfs_blktag_phy_t *bt;
+
+    EXPECT_EQ(pfs_tx_new_op(tx, top), 0);
+    mo = pfs_txop_init(top, buf, oid, BDA);
+    bt = (pfs_blktag_phy_t *)mo->mo_data;
+    mo->mo_used = 1;
+    mo->mo_next = 0;
+    bt->bt_ino = ino;
+    bt->bt_blkid = oid;
+    pfs_tx_done_op(tx, top);
+    return top;
+}
+
+static void
+redo_all(pfs_tx_t *rtx, pfs_metaobj_phy_t *buf)
+{
+    pfs_txop_t *top;
+
+    TAILQ_FOREACH(top, &rtx->t_ops, top_next) {
+        EXPECT_EQ(top->top_bda, (uint64_t)BDA);
+        pfs_txop_redo(top, &buf[top->top_idx], buf);
+    }
+}
+
+TEST(LogdeltaTest, round_trip)
+{
+    pfs_metaobj_phy_t buf[NOBJ], replica[NOBJ];
+    pfs_logpack_phy_t lp;
+    pfs_tx_t tx, rtx;
+    pfs_txop_t *top;
+    char rec[LOGREC_MAXSIZE];
+    int reclen, oid;
+
+    init_sector(buf);
+    memcpy(replica, buf, sizeof(buf));
+    init_tx(&tx);
+    alloc_blktag(&tx, buf, 1, 7);
+    alloc_blktag(&tx, buf, 2, 7);
+    alloc_blktag(&tx, buf, 5, 8);
+
+    // the writer logs against its cache, which still has the old image
+    pfs_logpack_init(&lp, 10, 3);
+    TAILQ_FOREACH(top, &tx.t_ops, top_next) {
+        reclen = pfs_txop_logrec(top, rec, sizeof(rec));
+        ASSERT_GT(reclen, 0);
+        EXPECT_LT(reclen, (int)sizeof(pfs_metaobj_phy_t));
+        ASSERT_TRUE(pfs_logpack_add(&lp, rec, reclen));
+    }
+    pfs_logpack_seal(&lp, false);
+
+    pfs_logentry_phy_t *le = (pfs_logentry_phy_t *)&lp;
+    EXPECT_TRUE(pfs_logentry_ispack(le));
+    EXPECT_EQ(le->le_lsn, 10);
+    EXPECT_EQ(le->le_txid, 3);
+    EXPECT_EQ(le->le_more, 0);
+    EXPECT_EQ(le->le_checksum, crc32c_compute(le, sizeof(*le),
+        offsetof(struct pfs_logentry_phy, le_checksum)));
+    EXPECT_EQ(lp.lp_nrec, 3u);
+
+    // a replayer rebuilds the ops and redoes them on its own copy
+    init_tx(&rtx);
+    ASSERT_EQ(pfs_tx_recreate_pack(&rtx, &lp), 0);
+    EXPECT_EQ(rtx.t_nops, 3);
+    redo_all(&rtx, replica);
+
+    oid = 0;
+    TAILQ_FOREACH(top, &tx.t_ops, top_next) {
+        buf[top->top_idx] = top->top_local;
+        oid++;
+    }
+    EXPECT_EQ(oid, 3);
+    EXPECT_EQ(memcmp(buf, replica, sizeof(buf)), 0);
+    fini_tx(&rtx);
+    fini_tx(&tx);
+}
+
+TEST(LogdeltaTest, redo_skips_newer_object)
+{
+    pfs_metaobj_phy_t buf[NOBJ], disk[NOBJ];
+    pfs_logpack_phy_t lp;
+    pfs_tx_t tx, rtx;
+    pfs_txop_t *top;
+    char rec[LOGREC_MAXSIZE];
+    int reclen;
+
+    init_sector(buf);
+    init_tx(&tx);
+    top = alloc_blktag(&tx, buf, 3, 9);
+    reclen = pfs_txop_logrec(top, rec, sizeof(rec));
+    ASSERT_GT(reclen, 0);
+    pfs_logpack_init(&lp, 1, 1);
+    ASSERT_TRUE(pfs_logpack_add(&lp, rec, reclen));
+    pfs_logpack_seal(&lp, false);
+
+    // a trim already wrote a later image of the object to disk
+    memcpy(disk, buf, sizeof(buf));
+    disk[3] = top->top_local;
+    ((pfs_blktag_phy_t *)disk[3].mo_data)->bt_blkid = 1000;
+    set_crc(&disk[3]);
+    pfs_metaobj_phy_t later = disk[3];
+
+    init_tx(&rtx);
+    ASSERT_EQ(pfs_tx_recreate_pack(&rtx, &lp), 0);
+    redo_all(&rtx, disk);
+    EXPECT_EQ(memcmp(&disk[3], &later, sizeof(later)), 0);
+    fini_tx(&rtx);
+    fini_tx(&tx);
+}
+
+TEST(LogdeltaTest, full_entry_fallback)
+{
+    pfs_metaobj_phy_t buf[NOBJ];
+    pfs_txop_t *top;
+    pfs_metaobj_phy_t *mo;
+    pfs_tx_t tx;
+    char rec[LOGREC_MAXSIZE];
+
+    // a change larger than a record
+    init_sector(buf);
+    init_tx(&tx);
+    EXPECT_EQ(pfs_tx_new_op(&tx, top), 0);
+    mo = pfs_txop_init(top, buf, 4, BDA);
+    for (size_t i = 0; i < sizeof(mo->mo_data); i += 2)
+        mo->mo_data[i] ^= 0xff;
+    pfs_tx_done_op(&tx, top);
+    EXPECT_EQ(pfs_txop_logrec(top, rec, sizeof(rec)), -1);
+    fini_tx(&tx);
+
+    // a base object without checksum can't be matched on replay
+    init_sector(buf);
+    buf[6].mo_checksum = 0;
+    init_tx(&tx);
+    top = alloc_blktag(&tx, buf, 6, 1);
+    EXPECT_EQ(pfs_txop_logrec(top, rec, sizeof(rec)), -1);
+    fini_tx(&tx);
+}
+
+TEST(LogdeltaTest, pack_fills_head_then_tail)
+{
+    pfs_metaobj_phy_t buf[NOBJ];
+    pfs_logpack_phy_t lp;
+    pfs_tx_t tx;
+    pfs_txop_t *top;
+    const pfs_logrec_phy_t *lr;
+    char rec[LOGREC_MAXSIZE];
+    int reclen, nadd, pos;
+    uint32_t n;
+
+    init_sector(buf);
+    init_tx(&tx);
+    top = alloc_blktag(&tx, buf, 0, 5);
+    reclen = pfs_txop_logrec(top, rec, sizeof(rec));
+    ASSERT_GT(reclen, 0);
+
+    pfs_logpack_init(&lp, 1, 1);
+    for (nadd = 0; pfs_logpack_add(&lp, rec, reclen); nadd++)
+        ;
+    EXPECT_EQ(nadd, (int)(sizeof(lp.lp_head) / reclen +
+        LOGPACK_TAILSIZE / reclen));
+    EXPECT_GT(lp.lp_taillen, 0);
+    pfs_logpack_seal(&lp, true);
+
+    pos = 0;
+    for (n = 0; (lr = pfs_logpack_next(&lp, &pos)) != NULL; n++) {
+        EXPECT_EQ(lr->lr_len, reclen);
+        EXPECT_EQ(lr->lr_obj_number, 100u);
+        EXPECT_EQ(lr->lr_basecrc, buf[0].mo_checksum);
+    }
+    EXPECT_EQ(n, lp.lp_nrec);
+    EXPECT_EQ((int)n, nadd);
+    fini_tx(&tx);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "pfs_api.h"
+#include "pfs_option.h"
+
+/*
+ * Mounts a spare disk in this process, which is given by PFS_TEST_SPARE_PBD
+ * (a name under /dev such as loop1). It is formatted by the pfs tool, which
+ * is taken from PFS_TOOL or PATH. The checkpoint of the disk under
+ * /var/run/pfs is removed.
+ */
+#define WLEN    4096
+
+typedef struct {
+    uint64_t magic;
+    uint64_t txid;
+    uint64_t btime;
+    uint32_t nchunk;
+    uint32_t crc;
+} ckpt_header_t;
+
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f " + pbd +
+        " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+static void
+enable_ckpt()
+{
+    char path[] = "/tmp/pfs_metackpt.XXXXXX";
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    fp = fdopen(fd, "w");
+    fprintf(fp, "[common]\n"
+        "meta_ckpt_enable=1\n");
+    fclose(fp);
+    EXPECT_EQ(pfs_option_init(path), 0);
+    unlink(path);
+}
+
+static std::string
+ckpt_path(const char *pbd)
+{
+    return std::string("/var/run/pfs/pbd") + pbd + ".ckpt";
+}
+
+static bool
+read_header(const char *pbd, ckpt_header_t *mh)
+{
+    FILE *fp = fopen(ckpt_path(pbd).c_str(), "r");
+    bool ok;
+
+    if (fp == NULL)
+        return false;
+    ok = fread(mh, sizeof(*mh), 1, fp) == 1;
+    fclose(fp);
+    return ok;
+}
+
+static std::string
+file_path(const char *pbd, int i)
+{
+    return std::string("/") + pbd + "/f" + std::to_string(i);
+}
+
+static void
+write_file(const char *pbd, int i)
+{
+    char buf[WLEN];
+    int fd;
+
+    memset(buf, 'a' + i, sizeof(buf));
+    fd = pfs_open(file_path(pbd, i).c_str(), O_CREAT | O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(pfs_pwrite(fd, buf, WLEN, 0), WLEN);
+    EXPECT_EQ(pfs_close(fd), 0);
+}
+
+static void
+check_file(const char *pbd, int i)
+{
+    char buf[WLEN];
+    int fd;
+
+    fd = pfs_open(file_path(pbd, i).c_str(), O_RDONLY, 0);
+    ASSERT_GE(fd, 0) << i;
+    EXPECT_EQ(pfs_pread(fd, buf, WLEN, 0), WLEN) << i;
+    EXPECT_EQ(buf[0], 'a' + i);
+    EXPECT_EQ(buf[WLEN - 1], 'a' + i);
+    EXPECT_EQ(pfs_close(fd), 0);
+}
+
+TEST(MetackptTest, save_and_load)
+{
+    const char *pbd = spare_pbd();
+    ckpt_header_t mh, mh2;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    unlink(ckpt_path(pbd).c_str());
+    enable_ckpt();
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    write_file(pbd, 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    ASSERT_TRUE(read_header(pbd, &mh));
+    EXPECT_GT(mh.nchunk, 0u);
+    EXPECT_GT(mh.txid, 0u);
+
+    // the image is loaded, the log brings it up to date
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    check_file(pbd, 0);
+    write_file(pbd, 1);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    ASSERT_TRUE(read_header(pbd, &mh2));
+    EXPECT_GT(mh2.txid, mh.txid);
+    EXPECT_EQ(mh2.nchunk, mh.nchunk);
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    check_file(pbd, 0);
+    check_file(pbd, 1);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    unlink(ckpt_path(pbd).c_str());
+}
+
+TEST(MetackptTest, read_only_mount_does_not_save)
+{
+    const char *pbd = spare_pbd();
+    struct stat st;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    unlink(ckpt_path(pbd).c_str());
+    enable_ckpt();
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    EXPECT_EQ(stat(ckpt_path(pbd).c_str(), &st), -1);
+    EXPECT_EQ(errno, ENOENT);
+}
+
+TEST(MetackptTest, stale_image_is_skipped)
+{
+    const char *pbd = spare_pbd();
+    std::string path;
+    struct stat st;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    path = ckpt_path(pbd);
+    unlink(path.c_str());
+    enable_ckpt();
+
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    write_file(pbd, 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+
+    // a corrupted image falls back to reading the PBD
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    ASSERT_EQ(truncate(path.c_str(), st.st_size / 2), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    check_file(pbd, 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+
+    // an image of the filesystem before mkfs is not taken
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RDWR), 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    ASSERT_EQ(run_mkfs(pbd), 0);
+    ASSERT_EQ(pfs_mount("disk", pbd, 1, PFS_RD), 0);
+    EXPECT_LT(pfs_stat(file_path(pbd, 0).c_str(), &st), 0);
+    ASSERT_EQ(pfs_umount(pbd), 0);
+    unlink(path.c_str());
+}
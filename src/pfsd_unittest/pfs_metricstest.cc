@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <map>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "pfs_metrics.h"
+#include "pfs_stat.h"
+
+static int
+string_printf(void *dest, const char *fmt, va_list ap)
+{
+    char buf[1024];
+    int n;
+
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    ((std::string *)dest)->append(buf);
+    return n;
+}
+
+static void
+test_provider(pfs_metrics_t *m)
+{
+    pfs_metrics_family(m, "test_escaped_total", "counter", "Escaping.");
+    pfs_metrics_u64(m, "test_escaped_total", "name", "a\"b\\c\nd", 7);
+}
+
+// Check the text against the exposition format and return the samples
+static void
+parse_exposition(const std::string &text,
+    std::map<std::string, std::string> *samples)
+{
+    static const std::regex help_re("# HELP ([a-zA-Z_:][a-zA-Z0-9_:]*) .*");
+    static const std::regex type_re("# TYPE ([a-zA-Z_:][a-zA-Z0-9_:]*) "
+        "(counter|gauge|summary|histogram|untyped)");
+    static const std::regex sample_re("([a-zA-Z_:][a-zA-Z0-9_:]*)"
+        "(\\{([a-zA-Z_][a-zA-Z0-9_]*=\"([^\"\\\\\\n]|\\\\[\\\\\"n])*\""
+        "(,[a-zA-Z_][a-zA-Z0-9_]*=\"([^\"\\\\\\n]|\\\\[\\\\\"n])*\")*)\\})?"
+        " (-?[0-9]+(\\.[0-9]+)?(e[-+]?[0-9]+)?)");
+    std::set<std::string> seen;
+    std::string family, type, line;
+    std::istringstream in(text);
+    std::smatch mt;
+
+    while (std::getline(in, line)) {
+        if (std::regex_match(line, mt, help_re)) {
+            family = mt[1];
+            // a family is contiguous and shows up once
+            ASSERT_TRUE(seen.insert(family).second) << line;
+            ASSERT_TRUE(std::getline(in, line));
+            ASSERT_TRUE(std::regex_match(line, mt, type_re)) << line;
+            ASSERT_EQ(mt[1], family) << line;
+            type = mt[2];
+            continue;
+        }
+        ASSERT_TRUE(std::regex_match(line, mt, sample_re)) << line;
+        std::string name = mt[1];
+        if (type == "summary" && name != family)
+            ASSERT_TRUE(name == family + "_sum" ||
+                name == family + "_count") << line;
+        else
+            ASSERT_EQ(name, family) << line;
+        std::string series = line.substr(0, line.rfind(' '));
+        ASSERT_EQ(samples->count(series), 0u) << line;
+        (*samples)[series] = line.substr(line.rfind(' ') + 1);
+    }
+}
+
+TEST(MetricsTest, exposition_format)
+{
+    std::map<std::string, std::string> samples;
+    std::string text;
+    pfs_printer_t pr = { &text, string_printf };
+    struct timeval begin, end;
+
+    gettimeofday(&begin, NULL);
+    end = begin;
+    end.tv_usec += 100;
+    pfs_mntstat_store(&begin, &end, MNT_STAT_JOURNAL_WRITE, false, 0);
+    pfs_metrics_set_provider(test_provider);
+
+    EXPECT_EQ(pfs_metrics_dump(&pr, NULL), 0);
+    pfs_metrics_set_provider(NULL);
+    parse_exposition(text, &samples);
+    ASSERT_FALSE(HasFatalFailure()) << text;
+
+    std::string count = "pfs_op_latency_seconds_count"
+        "{op=\"journal_write\"}";
+    std::string sum = "pfs_op_latency_seconds_sum{op=\"journal_write\"}";
+    ASSERT_EQ(samples.count(count), 1u) << text;
+    EXPECT_GE(std::stoul(samples[count]), 1u);
+    // 100us, in seconds
+    ASSERT_EQ(samples.count(sum), 1u) << text;
+    EXPECT_GE(std::stod(samples[sum]), 0.0001);
+    EXPECT_LT(std::stod(samples[sum]), 1.0);
+    EXPECT_EQ(samples.count("pfs_op_latency_seconds"
+        "{op=\"journal_write\",quantile=\"0.99\"}"), 1u);
+    EXPECT_EQ(samples["test_escaped_total{name=\"a\\\"b\\\\c\\nd\"}"], "7");
+    EXPECT_EQ(samples.count("pfs_namecache_entries"), 1u);
+}
+
+static int
+full_printf(void *dest, const char *fmt, va_list ap)
+{
+    int *nleft = (int *)dest;
+
+    if (--*nleft < 0)
+        return -ENOBUFS;
+    return vsnprintf(NULL, 0, fmt, ap);
+}
+
+TEST(MetricsTest, printer_error_is_returned)
+{
+    int nleft = 3;
+    pfs_printer_t pr = { &nleft, full_printf };
+
+    EXPECT_EQ(pfs_metrics_dump(&pr, NULL), -ENOBUFS);
+    // nothing is printed after the first error
+    EXPECT_EQ(nleft, -1);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#include "pfs_impl.h"
+#include "pfs_inode.h"
+#include "pfs_meta.h"
+
+/*
+ * mkfs formats a spare disk, which is given by PFS_TEST_SPARE_PBD (a name
+ * under /dev such as loop1). It is wiped. The pfs tool is taken from
+ * PFS_TOOL or PATH.
+ */
+static const char *
+spare_pbd()
+{
+    return getenv("PFS_TEST_SPARE_PBD");
+}
+
+static int
+run_mkfs(const char *pbd, int njobs)
+{
+    const char *tool = getenv("PFS_TOOL");
+    std::string cmd;
+
+    cmd = std::string(tool ? tool : "pfs") + " -C disk mkfs -f -j " +
+        std::to_string(njobs) + " " + pbd + " >/dev/null 2>&1";
+    return system(cmd.c_str());
+}
+
+// Inode times are taken when mkfs creates the root and inner files
+static void
+clear_times(char *meta)
+{
+    pfs_chunk_phy_t *phyck = (pfs_chunk_phy_t *)meta;
+    pfs_metaset_phy_t *ms = &phyck->ck_physet[MT_INODE];
+    uint64_t off = ms->ms_sectbda % phyck->ck_chunksize;
+    uint64_t end = off + (uint64_t)ms->ms_nsect * PBD_SECTOR_SIZE;
+    pfs_metaobj_phy_t *mo;
+    pfs_inode_phy_t *in;
+
+    ASSERT_LE(end, (uint64_t)PFS_BLOCK_SIZE);
+    for (; off < end; off += ms->ms_objsize) {
+        mo = (pfs_metaobj_phy_t *)&meta[off];
+        in = (pfs_inode_phy_t *)mo->mo_data;
+        in->in_atime = in->in_ctime = in->in_mtime = in->in_btime = 0;
+        mo->mo_checksum = 0;
+    }
+}
+
+// The meta area of every chunk, that is the first block of the chunk
+static std::string
+read_meta(const char *pbd)
+{
+    std::string path = std::string("/dev/") + pbd;
+    std::string img;
+    pfs_chunk_phy_t phyck;
+    char *buf;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    if (fd < 0)
+        return img;
+    EXPECT_EQ(pread(fd, &phyck, sizeof(phyck), 0), (ssize_t)sizeof(phyck));
+    buf = (char *)malloc(PFS_BLOCK_SIZE);
+    for (uint64_t ckno = 0; ckno < phyck.ck_nchunk; ckno++) {
+        EXPECT_EQ(pread(fd, buf, PFS_BLOCK_SIZE,
+            ckno * phyck.ck_chunksize), PFS_BLOCK_SIZE);
+        clear_times(buf);
+        img.append(buf, PFS_BLOCK_SIZE);
+    }
+    free(buf);
+    close(fd);
+    return img;
+}
+
+TEST(MkfsTest, parallel_image_same_as_serial)
+{
+    const char *pbd = spare_pbd();
+    std::string serial, parallel;
+
+    if (pbd == NULL)
+        return;
+
+    ASSERT_EQ(run_mkfs(pbd, 1), 0);
+    serial = read_meta(pbd);
+    ASSERT_EQ(run_mkfs(pbd, 16), 0);
+    parallel = read_meta(pbd);
+
+    ASSERT_GT(serial.size(), 0u);
+    ASSERT_EQ(serial.size(), parallel.size());
+    EXPECT_TRUE(serial == parallel);
+}
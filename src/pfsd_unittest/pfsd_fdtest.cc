@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "pfsd_common.h"
+#include "pfsd_sdk_file.h"
+
+static uint64_t
+now_us()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+// Each thread opens a few files, looks them up and closes them again
+static void
+run_open_close(int nthread, int nloop, std::atomic<int> *nerr)
+{
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < nthread; t++) {
+        threads.push_back(std::thread([nloop, nerr]() {
+            pfsd_file_t *files[4], *f;
+
+            for (int i = 0; i < nloop; i++) {
+                for (int j = 0; j < 4; j++) {
+                    files[j] = pfsd_alloc_file();
+                    if (pfsd_alloc_fd(files[j]) < 0)
+                        (*nerr)++;
+                    files[j]->f_inode = (int64_t)(intptr_t)files[j];
+                }
+                for (int j = 0; j < 4; j++) {
+                    f = pfsd_get_file(files[j]->f_fd, false);
+                    // an fd is never handed out twice
+                    if (f != files[j] || f->f_inode != (int64_t)(intptr_t)f)
+                        (*nerr)++;
+                    pfsd_put_file(f);
+                }
+                for (int j = 0; j < 4; j++) {
+                    if (pfsd_close_file(files[j]) != 0)
+                        (*nerr)++;
+                }
+            }
+        }));
+    }
+    for (auto &th : threads)
+        th.join();
+}
+
+TEST(FdTest, ref_blocks_close)
+{
+    pfsd_file_t *file = pfsd_alloc_file();
+    int fd = pfsd_alloc_fd(file);
+
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(pfsd_get_file(fd, false), file);
+    EXPECT_EQ(pfsd_get_file(fd, false), file);
+    // two readers besides the closer
+    EXPECT_EQ(pfsd_close_file(file), -EAGAIN);
+    pfsd_put_file(file);
+    EXPECT_EQ(pfsd_close_file(file), 0);
+    EXPECT_EQ(pfsd_get_file(fd, false), nullptr);
+
+    // the closed fd is the first to be reused
+    file = pfsd_alloc_file();
+    EXPECT_EQ(pfsd_alloc_fd(file), fd);
+    EXPECT_EQ(pfsd_close_file(file), 0);
+}
+
+TEST(FdTest, concurrent_open_close)
+{
+    std::atomic<int> nerr(0);
+
+    run_open_close(16, 5000, &nerr);
+    EXPECT_EQ(nerr.load(), 0);
+}
+
+/*
+ * Not a pass/fail check: shows how open and close scale with threads.
+ * Run with --gtest_also_run_disabled_tests.
+ */
+TEST(FdTest, DISABLED_scaling)
+{
+    const int nloop = 20000;
+    std::atomic<int> nerr(0);
+    uint64_t begin, elapsed;
+
+    for (int nthread = 1; nthread <= 64; nthread *= 2) {
+        begin = now_us();
+        run_open_close(nthread, nloop, &nerr);
+        elapsed = now_us() - begin;
+        printf("%2d threads: %8.2f open+close/us\n", nthread,
+            nthread * nloop * 4 / (double)(elapsed ? elapsed : 1));
+    }
+    EXPECT_EQ(nerr.load(), 0);
+}
@@ -19,6 +19,8 @@
 #include <iostream>
 #include <limits.h>
 #include <fcntl.h>
+#include <atomic>
+#include <thread>
 
 using std::cout;
 using std::endl;
@@ -1087,6 +1089,62 @@ TEST_F(FileTest, pfsd_stat)
     pfsd_rmdir(path.c_str());
 }
 
+TEST_F(FileTest, pfsd_readdirplus)
+{
+    const int nfile = 1000;  /* more than one dirent buffer */
+    struct stat st, fst;
+    struct dirent *ent;
+    string dirpath, path;
+    char buf[64];
+    int i, fd, ret, nent;
+    DIR *dir;
+
+    dirpath = "/" + g_testenv->pbdname_ + "/readdirplus_dir";
+    ret = pfsd_mkdir(dirpath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+    CHECK_RET(0, ret);
+    memset(buf, 'a', sizeof(buf));
+    for (i = 0; i < nfile; i++) {
+        path = dirpath + "/file_" + std::to_string(i);
+        fd = pfsd_creat(path.c_str(), 0);
+        ASSERT_GE(fd, 0) << strerror(errno);
+        ret = pfsd_write(fd, buf, i % sizeof(buf));
+        EXPECT_EQ(ret, (int)(i % sizeof(buf)));
+        pfsd_close(fd);
+    }
+
+    // 1 Attributes of every entry are the same as stat
+    dir = pfsd_opendir(dirpath.c_str());
+    ASSERT_NE(dir, (DIR *)NULL) << strerror(errno);
+    nent = 0;
+    while ((ent = pfsd_readdirplus(dir, &st)) != NULL) {
+        path = dirpath + "/" + ent->d_name;
+        ret = pfsd_stat(path.c_str(), &fst);
+        CHECK_RET(0, ret);
+        EXPECT_EQ(st.st_ino, fst.st_ino);
+        EXPECT_EQ(st.st_size, fst.st_size);
+        EXPECT_EQ(st.st_mtime, fst.st_mtime);
+        EXPECT_TRUE(S_ISREG(st.st_mode));
+        nent++;
+    }
+    EXPECT_EQ(nent, nfile);
+    pfsd_closedir(dir);
+
+    // 2 readdir gets the same entries
+    dir = pfsd_opendir(dirpath.c_str());
+    ASSERT_NE(dir, (DIR *)NULL) << strerror(errno);
+    nent = 0;
+    while ((ent = pfsd_readdir(dir)) != NULL)
+        nent++;
+    EXPECT_EQ(nent, nfile);
+    pfsd_closedir(dir);
+
+    for (i = 0; i < nfile; i++) {
+        path = dirpath + "/file_" + std::to_string(i);
+        pfsd_unlink(path.c_str());
+    }
+    pfsd_rmdir(dirpath.c_str());
+}
+
 TEST_F(FileTest, pfsd_fstat)
 {
     struct stat fstat;
@@ -1138,6 +1196,77 @@ TEST_F(FileTest, pfsd_fstat)
     CHECK_ERR_RET(-1, ret, EBADF);
 }
 
+TEST_F(FileTest, pfsd_attrcache)
+{
+    const int nloop = 200;
+    const off_t range = 64 << 10;
+    struct stat cst, ust;
+    char buf[4096];
+    int i, ret;
+    off_t off;
+
+    memset(buf, 'c', sizeof(buf));
+    pfsd_set_attr_lease(1000 * 1000);
+
+    // 1 Cached attributes are the same as uncached ones after every change
+    for (i = 0; i < nloop; i++) {
+        if (i % 3 == 2) {
+            ret = pfsd_ftruncate(fd_, (i * 997) % range);
+            CHECK_RET(0, ret);
+        } else {
+            ret = pfsd_pwrite(fd_, buf, 1 + i % sizeof(buf),
+                (i * 4093) % range);
+            EXPECT_EQ(ret, (int)(1 + i % sizeof(buf)));
+        }
+
+        ret = pfsd_fstat(fd_, &cst);
+        CHECK_RET(0, ret);
+        ret = pfsd_fstat(fd_, &cst);
+        CHECK_RET(0, ret);
+        off = pfsd_lseek(fd_, 0, SEEK_END);
+
+        pfsd_set_attr_lease(0);
+        ret = pfsd_fstat(fd_, &ust);
+        CHECK_RET(0, ret);
+        pfsd_set_attr_lease(1000 * 1000);
+
+        EXPECT_EQ(0, memcmp(&cst, &ust, sizeof(cst)));
+        EXPECT_EQ(off, ust.st_size);
+    }
+
+    // 2 Writer sees its own writes while another thread keeps stating
+    ret = pfsd_ftruncate(fd_, 0);
+    CHECK_RET(0, ret);
+    std::atomic<bool> done(false);
+    std::thread stater([&]() {
+        struct stat st;
+        off_t last = 0;
+        while (!done.load()) {
+            if (pfsd_fstat(fd_, &st) == 0) {
+                EXPECT_GE(st.st_size, last);
+                last = st.st_size;
+            }
+        }
+    });
+    for (i = 0; i < nloop; i++) {
+        ret = pfsd_pwrite(fd_, buf, 1, i);
+        EXPECT_EQ(ret, 1);
+        ret = pfsd_stat(pbdpath_.c_str(), &cst);
+        CHECK_RET(0, ret);
+        EXPECT_EQ(cst.st_size, i + 1);
+        ret = pfsd_fstat(fd_, &cst);
+        CHECK_RET(0, ret);
+        EXPECT_EQ(cst.st_size, i + 1);
+        off = pfsd_lseek(fd_, 0, SEEK_END);
+        EXPECT_EQ(off, i + 1);
+    }
+    done = true;
+    stater.join();
+
+    pfsd_set_attr_lease(100 * 1000);
+    pfsd_ftruncate(fd_, 0);
+}
+
 TEST_F(FileTest, pfsd_truncate)
 {
     off_t len;
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfsd_shmtest.h"
+
+/*
+ * Clients, pollers, the recycler and abort of dead connections run on
+ * one channel at once. This binary has both the client and the server
+ * side of pfsd_shm.cc, the connection table of pfsd is faked below.
+ */
+#define NWORKER     4
+#define NCLIENT     6       /* connections 1 to 6 */
+#define NCRASH      2       /* connections 9 and 10, die over and over */
+#define CRASH_CONN  9
+#define RUN_US      (2 * 1000 * 1000)
+#define WAIT_US     (5 * 1000 * 1000)
+
+static pfsd_connset_t g_closed;
+
+bool
+pfsd_is_conn_closed(int32_t connect_id)
+{
+    return pfsd_connset_has(__atomic_load_n(&g_closed, __ATOMIC_ACQUIRE),
+        connect_id);
+}
+
+typedef struct stress {
+    pfsd_shm_t          *shm;
+    pfsd_iochannel_t    *ch;
+    volatile bool       stop_clients;
+    volatile bool       stop_pfsd;
+    int                 busy[PFSD_SHM_MAX_REQUESTS];  /* workers on slot */
+    int                 ndone;
+    int                 ncrash;
+    int                 nbad_get;       /* got a slot a worker is on */
+    int                 nbad_fetch;     /* two workers on a slot */
+    int                 nstuck;         /* reply never came */
+} stress_t;
+
+static uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static pfsd_request_t *
+get_slots(stress_t *st, int connid, unsigned *seed)
+{
+    pfsd_iochannel_t *ch = st->ch;
+    pfsd_request_t *req;
+    int head;
+
+    req = pfsd_shm_get_extent(ch, connid, 1 + rand_r(seed) % 3);
+    if (req == NULL)
+        return NULL;
+    head = req - ch->ch_requests;
+    for (int i = head; i < head + req->shm_nunit; i++) {
+        if (__atomic_load_n(&st->busy[i], __ATOMIC_ACQUIRE) != 0)
+            __atomic_add_fetch(&st->nbad_get, 1, __ATOMIC_RELAXED);
+    }
+    return req;
+}
+
+static void *
+worker(void *arg)
+{
+    stress_t *st = (stress_t *)arg;
+    pfsd_request_t *reqs[4];
+    unsigned seed = pthread_self();
+
+    while (!st->stop_pfsd) {
+        int n = pfsd_shm_fetch_requests(st->ch, reqs, 4);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        for (int k = 0; k < n; k++) {
+            int idx = reqs[k] - st->ch->ch_requests;
+
+            if (__atomic_add_fetch(&st->busy[idx], 1, __ATOMIC_ACQ_REL) != 1)
+                __atomic_add_fetch(&st->nbad_fetch, 1, __ATOMIC_RELAXED);
+            usleep(rand_r(&seed) % 20);
+            __atomic_sub_fetch(&st->busy[idx], 1, __ATOMIC_ACQ_REL);
+            pfsd_shm_done_request(st->ch, idx);
+            __atomic_add_fetch(&st->ndone, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void *
+recycler(void *arg)
+{
+    stress_t *st = (stress_t *)arg;
+
+    while (!st->stop_pfsd) {
+        pfsd_shm_recycle_request(st->ch);
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void *
+client(void *arg)
+{
+    stress_t *st = (stress_t *)((void **)arg)[0];
+    int connid = (int)(intptr_t)((void **)arg)[1];
+    unsigned seed = connid;
+    pfsd_request_t *req;
+    uint64_t begin;
+
+    while (!st->stop_clients) {
+        if ((req = get_slots(st, connid, &seed)) == NULL) {
+            sched_yield();
+            continue;
+        }
+        pfsd_shm_send_request(st->ch, req);
+        begin = now_us();
+        while (pfsd_request_get_state(__atomic_load_n(&req->val,
+            __ATOMIC_ACQUIRE)) != REQ_WAIT_RELEASE) {
+            if (now_us() - begin > WAIT_US) {
+                __atomic_add_fetch(&st->nstuck, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            sched_yield();
+        }
+        pfsd_shm_put_request(st->ch, req);
+    }
+    return NULL;
+}
+
+// Sends some requests and dies, pfsd then aborts the connection
+static void *
+crasher(void *arg)
+{
+    stress_t *st = (stress_t *)((void **)arg)[0];
+    int connid = (int)(intptr_t)((void **)arg)[1];
+    unsigned seed = connid;
+    pfsd_request_t *req;
+
+    while (!st->stop_clients) {
+        if (pfsd_is_conn_closed(connid)) {
+            sched_yield();
+            continue;
+        }
+        for (int n = 1 + rand_r(&seed) % 4; n > 0; n--) {
+            if ((req = get_slots(st, connid, &seed)) == NULL)
+                break;
+            // some are left half built
+            if (rand_r(&seed) % 4)
+                pfsd_shm_send_request(st->ch, req);
+        }
+        usleep(rand_r(&seed) % 50);
+        __atomic_or_fetch(&g_closed, pfsd_connset_of(connid),
+            __ATOMIC_RELEASE);
+        __atomic_add_fetch(&st->ncrash, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void
+abort_closed(stress_t *st)
+{
+    pfsd_shm_t *shms[1] = { st->shm };
+    pfsd_connset_t closed = __atomic_load_n(&g_closed, __ATOMIC_ACQUIRE);
+
+    if (closed == 0)
+        return;
+    (void)pfsd_shm_abort_conns(shms, 1, closed, 2);
+    // the connection ids are taken again by new clients
+    __atomic_and_fetch(&g_closed, ~closed, __ATOMIC_RELEASE);
+}
+
+static void *
+aborter(void *arg)
+{
+    stress_t *st = (stress_t *)arg;
+
+    while (!st->stop_clients) {
+        abort_closed(st);
+        usleep(200);
+    }
+    return NULL;
+}
+
+TEST(ShmStressTest, get_fetch_done_abort_recycle)
+{
+    stress_t st;
+    pthread_t pfsd_tids[NWORKER + 1], cli_tids[NCLIENT + NCRASH + 1];
+    void *args[NCLIENT + NCRASH][2];
+    int ncli = 0, npfsd = 0;
+    uint64_t begin;
+
+    memset(&st, 0, sizeof(st));
+    st.shm = make_shm(0, false);
+    st.ch = channel(st.shm, 0);
+    g_closed = 0;
+
+    for (int i = 0; i < NWORKER; i++)
+        pthread_create(&pfsd_tids[npfsd++], NULL, worker, &st);
+    pthread_create(&pfsd_tids[npfsd++], NULL, recycler, &st);
+    for (int i = 0; i < NCLIENT + NCRASH; i++) {
+        args[i][0] = &st;
+        args[i][1] = (void *)(intptr_t)(i < NCLIENT ? i + 1 :
+            CRASH_CONN + i - NCLIENT);
+        pthread_create(&cli_tids[ncli++], NULL,
+            i < NCLIENT ? client : crasher, args[i]);
+    }
+    pthread_create(&cli_tids[ncli++], NULL, aborter, &st);
+
+    usleep(RUN_US);
+    st.stop_clients = true;
+    for (int i = 0; i < ncli; i++)
+        pthread_join(cli_tids[i], NULL);
+
+    // whatever the last crashes left is aborted, then done by workers
+    abort_closed(&st);
+    begin = now_us();
+    while (st.ch->ch_free_bitmap != ~0UL && now_us() - begin < WAIT_US)
+        usleep(1000);
+    st.stop_pfsd = true;
+    for (int i = 0; i < npfsd; i++)
+        pthread_join(pfsd_tids[i], NULL);
+
+    EXPECT_EQ(st.nbad_get, 0);
+    EXPECT_EQ(st.nbad_fetch, 0);
+    EXPECT_EQ(st.nstuck, 0);
+    EXPECT_GT(st.ndone, 0);
+    EXPECT_GT(st.ncrash, 0);
+    EXPECT_EQ(st.ch->ch_free_bitmap, ~0UL);
+    for (int i = 0; i < PFSD_SHM_MAX_REQUESTS; i++)
+        EXPECT_EQ(st.ch->ch_requests[i].state, REQ_FREE) << i;
+    free(st.shm);
+}
+
+static void *
+cli_abort(void *arg)
+{
+    pfsd_shm_t *shm = (pfsd_shm_t *)arg;
+
+    return (void *)(intptr_t)pfsd_shm_cli_abort_request(shm, 1,
+        PFSD_INVALID_PID);
+}
+
+TEST(ShmStressTest, abort_waits_for_previous_pfsd)
+{
+    pfsd_shm_t *shm = make_shm(0, false);
+    pfsd_iochannel_t *ch = channel(shm, 0);
+    pfsd_request_t *req = &ch->ch_requests[5], *got;
+    pthread_t tid;
+    void *naborts;
+
+    // a previous pfsd was on it when it died
+    req->val = pfsd_request_set_pid(0, getpid());
+    req->val = pfsd_request_set_connid(req->val, 1);
+    req->val = pfsd_request_set_state(req->val, REQ_IN_PROGRESS);
+    req->shm_epoch = EPOCH - 1;
+    req->shm_nunit = 1;
+    ch->ch_free_bitmap &= ~(1UL << 5);
+
+    // not forced, so it waits for the running pfsd to do it again
+    pthread_create(&tid, NULL, cli_abort, shm);
+    usleep(20 * 1000);
+    EXPECT_EQ(req->state, REQ_IN_PROGRESS);
+    ASSERT_EQ(pfsd_shm_fetch_requests(ch, &got, 1), 1);
+    EXPECT_EQ(got, req);
+    EXPECT_EQ(pfsd_shm_fetch_requests(ch, &got, 1), 0);
+    usleep(20 * 1000);
+    EXPECT_EQ(req->state, REQ_IN_PROGRESS);
+    pfsd_shm_done_request(ch, 5);
+    pthread_join(tid, &naborts);
+    EXPECT_EQ((intptr_t)naborts, 1);
+    EXPECT_EQ(req->state, REQ_FREE);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+    free(shm);
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "pfsd_shmtest.h"
+
+#define NSHM        3
+
+TEST(ShmTest, abort_dead_conns)
+{
+    pfsd_shm_t *shms[PFSD_SHM_MAX] = { NULL };
+    pfsd_connset_t dead = pfsd_connset_of(1) | pfsd_connset_of(3);
+    int nfreed = 0, nzombie = 0;
+
+    // regions with holes, like unit sizes that are not configured
+    for (int si = 0; si < NSHM; si++)
+        shms[si * 2] = make_shm(si * 2);
+
+    int naborts = pfsd_shm_abort_conns(shms, PFSD_SHM_MAX, dead, 4);
+
+    for (int si = 0; si < PFSD_SHM_MAX; si++) {
+        if (shms[si] == NULL)
+            continue;
+        for (int ci = 0; ci < NCH; ci++) {
+            pfsd_iochannel_t *ch = channel(shms[si], ci);
+            for (int i = 0; i < PFSD_SHM_MAX_REQUESTS; i++) {
+                pfsd_request_t *r = &ch->ch_requests[i];
+                int8_t before = slot_states[i % NSTATE];
+                int connid = i / NSTATE % 4 + 1;
+                bool bit = (ch->ch_free_bitmap & (1UL << i)) != 0;
+
+                if (before == REQ_FREE) {
+                    EXPECT_EQ(r->state, REQ_FREE);
+                    EXPECT_TRUE(bit);
+                } else if (!pfsd_connset_has(dead, connid)) {
+                    // alive connections are left alone
+                    EXPECT_EQ(r->state, before) << si << " " << ci << " " << i;
+                    EXPECT_EQ(r->connid, connid);
+                    EXPECT_FALSE(bit);
+                } else if (before == REQ_IN_PROGRESS &&
+                    r->shm_epoch == EPOCH) {
+                    // a worker is on it, freed when done
+                    EXPECT_EQ(r->state, REQ_ZOMBIE);
+                    EXPECT_FALSE(bit);
+                    nzombie++;
+                } else {
+                    EXPECT_EQ(r->state, REQ_FREE) << si << " " << ci << " " << i;
+                    EXPECT_EQ(r->connid, -1);
+                    EXPECT_TRUE(bit);
+                    nfreed++;
+                }
+            }
+        }
+    }
+    EXPECT_EQ(naborts, nfreed);
+    EXPECT_GT(nzombie, 0);
+
+    // Nothing left to abort
+    EXPECT_EQ(pfsd_shm_abort_conns(shms, PFSD_SHM_MAX, dead, 4), 0);
+    EXPECT_EQ(pfsd_shm_abort_conns(shms, PFSD_SHM_MAX, 0, 4), 0);
+
+    for (int si = 0; si < PFSD_SHM_MAX; si++)
+        free(shms[si]);
+}
+
+static void
+expect_extent(pfsd_iochannel_t *ch, pfsd_request_t *req, int nunit)
+{
+    int head = req - ch->ch_requests;
+
+    ASSERT_EQ(req->state, REQ_ALLOC);
+    EXPECT_EQ(req->shm_nunit, nunit);
+    EXPECT_EQ(pfsd_request_bufsize(ch, req), (size_t)nunit * UNITSIZE);
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, head), (size_t)nunit * UNITSIZE);
+    for (int i = head; i < head + nunit; i++) {
+        EXPECT_EQ(ch->ch_free_bitmap & (1UL << i), 0u) << i;
+        if (i > head) {
+            EXPECT_EQ(ch->ch_requests[i].state, REQ_BORROWED) << i;
+            EXPECT_EQ(ch->ch_requests[i].repoch, head) << i;
+        }
+    }
+}
+
+TEST(ShmTest, extent)
+{
+    pfsd_shm_t *shm = make_shm(0, false);
+    pfsd_iochannel_t *ch = channel(shm, 0);
+    pfsd_request_t *a, *b, *c;
+
+    // 1 Adjacent slots are taken and given back together
+    a = pfsd_shm_get_extent(ch, 1, 4);
+    ASSERT_NE(a, nullptr);
+    expect_extent(ch, a, 4);
+    b = pfsd_shm_get_extent(ch, 1, 3);
+    ASSERT_NE(b, nullptr);
+    expect_extent(ch, b, 3);
+    EXPECT_EQ(b - ch->ch_requests, 4);
+    EXPECT_EQ(pfsd_shm_put_request(ch, a), 0);
+    EXPECT_EQ(ch->ch_free_bitmap & 0xf, 0xfu);
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(ch->ch_requests[i].state, REQ_FREE) << i;
+    EXPECT_EQ(pfsd_shm_put_request(ch, b), 0);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+
+    // 2 pfsd only trusts a unit count its borrowed slots back
+    a = pfsd_shm_get_extent(ch, 1, 2);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    a->shm_nunit = 3;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 0u);
+    a->shm_nunit = PFSD_SHM_MAX_EXTENT + 1;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 0u);
+    a->shm_nunit = 2;
+    ch->ch_requests[1].repoch = 5;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 0u);
+    ch->ch_requests[1].repoch = 0;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 2u * UNITSIZE);
+    EXPECT_EQ(pfsd_shm_put_request(ch, a), 0);
+    a = pfsd_shm_get_extent(ch, 1, 1);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    a->shm_nunit = 2;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 0u);
+    a->shm_nunit = 1;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), (size_t)UNITSIZE);
+    EXPECT_EQ(pfsd_shm_put_request(ch, a), 0);
+
+    // 3 No run long enough in a fragmented channel
+    for (int i = 0; i < PFSD_SHM_MAX_REQUESTS; i += 2) {
+        ch->ch_requests[i].val = pfsd_request_set_state(0, REQ_ALLOC);
+        ch->ch_free_bitmap &= ~(1UL << i);
+    }
+    EXPECT_EQ(pfsd_shm_get_extent(ch, 1, 2), nullptr);
+    EXPECT_NE(c = pfsd_shm_get_extent(ch, 1, 1), nullptr);
+    EXPECT_EQ(c->shm_nunit, 1);
+    free(shm);
+
+    // 4 Borrowed slots whose head is gone are orphans, freed by a sweep
+    pfsd_shm_t *shms[PFSD_SHM_MAX] = { make_shm(0, false) };
+    ch = channel(shms[0], 1);
+    a = pfsd_shm_get_extent(ch, 2, 5);
+    ASSERT_NE(a, nullptr);
+    EXPECT_EQ(pfsd_shm_abort_conns(shms, PFSD_SHM_MAX,
+        pfsd_connset_of(2), 2), 1);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+    a = pfsd_shm_get_extent(ch, 2, 5);
+    ASSERT_NE(a, nullptr);
+    a->val = pfsd_request_set_state(a->val, REQ_FREE);  // died half way
+    ch->ch_free_bitmap |= 1UL << (a - ch->ch_requests);
+    EXPECT_EQ(pfsd_shm_abort_conns(shms, PFSD_SHM_MAX,
+        pfsd_connset_of(2), 2), 4);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+    free(shms[0]);
+}
+
+static pid_t
+dead_pid()
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+        _exit(0);
+    waitpid(pid, NULL, 0);
+    return pid;
+}
+
+TEST(ShmTest, extent_free)
+{
+    pfsd_shm_t *shms[PFSD_SHM_MAX] = { make_shm(0, false) };
+    pfsd_iochannel_t *ch = channel(shms[0], 0);
+    pfsd_request_t *a;
+
+    // 1 A freed head leaves no unit count for a client that never sets it
+    a = pfsd_shm_get_extent(ch, 2, 3);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    EXPECT_EQ(pfsd_shm_put_request(ch, a), 0);
+    EXPECT_EQ(a->shm_nunit, 1);
+    a = pfsd_shm_get_extent(ch, 2, 3);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    EXPECT_EQ(pfsd_shm_abort_conns(shms, PFSD_SHM_MAX,
+        pfsd_connset_of(2), 2), 1);
+    EXPECT_EQ(a->shm_nunit, 1);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+
+    // 2 Without extents the unit count is not looked at
+    a = pfsd_shm_get_request(ch, 2);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    a->shm_nunit = 3;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), 0u);
+    shms[0]->sh_flags = 0;
+    EXPECT_EQ(pfsd_shm_request_bufsize(ch, 0), (size_t)UNITSIZE);
+    shms[0]->sh_flags = PFSD_SHM_F_EXTENT;
+    a->shm_nunit = 1;
+    EXPECT_EQ(pfsd_shm_put_request(ch, a), 0);
+
+    // 3 A head being freed covers its borrowed slots, till its freer dies
+    a = pfsd_shm_get_extent(ch, 2, 3);
+    ASSERT_EQ(a, &ch->ch_requests[0]);
+    a->val = pfsd_request_set_state(a->val, REQ_FREEING);
+    pfsd_shm_recycle_request(ch);
+    EXPECT_EQ(a->state, REQ_FREEING);
+    for (int i = 1; i < 3; i++)
+        EXPECT_EQ(ch->ch_requests[i].state, REQ_BORROWED) << i;
+    a->val = pfsd_request_set_pid(a->val, dead_pid());
+    pfsd_shm_recycle_request(ch);
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(ch->ch_requests[i].state, REQ_FREE) << i;
+    EXPECT_EQ(a->shm_nunit, 1);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+    free(shms[0]);
+}
+
+TEST(ShmTest, alloc_borrows_when_class_used_up)
+{
+    pfsd_shm_t *shms[2] = { make_shm(0, false), make_shm(1, false) };
+    pfsd_iochannel_t *ch;
+    pfsd_request_t *req;
+
+    // Bigger than any unit: only adjacent slots can carry it
+    shms[1]->sh_flags = 0;
+    ASSERT_EQ(pfsd_sdk_alloc_request(1, 3 * UNITSIZE, shms, 2, &ch, &req), 0);
+    EXPECT_TRUE((char *)ch > (char *)shms[0] &&
+        (char *)ch < (char *)shms[0] + shms[0]->sh_size);
+    expect_extent(ch, req, 3);
+    EXPECT_EQ(pfsd_shm_put_request(ch, req), 0);
+    EXPECT_EQ(ch->ch_free_bitmap, ~0UL);
+
+    // Fits a unit: a single slot
+    ASSERT_EQ(pfsd_sdk_alloc_request(1, UNITSIZE, shms, 2, &ch, &req), 0);
+    EXPECT_EQ(req->shm_nunit, 1);
+    EXPECT_EQ(pfsd_shm_put_request(ch, req), 0);
+
+    free(shms[0]);
+    free(shms[1]);
+}
+
+static double
+bench_memcpy(const char *dir, int hugepage)
+{
+    const size_t iosizes[] = { 16 << 10, 64 << 10, 256 << 10, 1 << 20 };
+    const int nloop = 100000, ninflight = 16;
+    pfsd_iochannel_t *chs[ninflight];
+    pfsd_request_t *reqs[ninflight];
+    struct timespec begin, end;
+    char *src, *dst;
+    uint64_t nbyte = 0;
+
+    g_shm_hugepage = hugepage;
+    if (pfsd_shm_init(dir, "shmbench", 32) != 0)
+        return 0;
+    src = (char *)malloc(1 << 20);
+    dst = (char *)malloc(1 << 20);
+    memset(src, 'x', 1 << 20);
+    memset(reqs, 0, sizeof(reqs));
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int n = 0; n < nloop; n++) {
+        int k = n % ninflight;
+        size_t iosize = iosizes[n % 4];
+        unsigned char *buf;
+
+        // like the sdk, ios of many threads are in flight at once
+        if (reqs[k] != NULL)
+            pfsd_shm_put_request(chs[k], reqs[k]);
+        if (pfsd_sdk_alloc_request(1, iosize, g_shm, PFSD_SHM_MAX,
+            &chs[k], &reqs[k]) != 0)
+            break;
+        buf = chs[k]->ch_buf + (reqs[k] - chs[k]->ch_requests) *
+            chs[k]->ch_unitsize;
+        memcpy(buf, src, iosize);
+        memcpy(dst, buf, iosize);
+        nbyte += iosize * 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (int k = 0; k < ninflight; k++) {
+        if (reqs[k] != NULL)
+            pfsd_shm_put_request(chs[k], reqs[k]);
+    }
+
+    pfsd_shm_fini();
+    for (int si = 0; si < PFSD_SHM_MAX; si++)
+        unlink(g_shm_fname[si]);
+    free(src);
+    free(dst);
+    return (nbyte >> 20) / ((end.tv_sec - begin.tv_sec) +
+        (end.tv_nsec - begin.tv_nsec) / 1e9);
+}
+
+/*
+ * Not a pass/fail check: memcpy through request buffers of shm mapped
+ * as pfsd does, with and without huge pages. The shm dir is taken from
+ * PFSD_TEST_SHM_DIR or is /dev/shm; THP on tmpfs needs
+ * transparent_hugepage/shmem_enabled. Run with
+ * --gtest_also_run_disabled_tests.
+ */
+TEST(ShmTest, DISABLED_hugepage_memcpy)
+{
+    const char *dir = getenv("PFSD_TEST_SHM_DIR");
+
+    if (dir == NULL)
+        dir = "/dev/shm";
+    for (int hugepage = 0; hugepage <= 1; hugepage++) {
+        double mbps = bench_memcpy(dir, hugepage);
+
+        EXPECT_GT(mbps, 0);
+        printf("%s: %.0f MB/s\n", hugepage ? "huge pages" : "4K pages",
+            mbps);
+    }
+}
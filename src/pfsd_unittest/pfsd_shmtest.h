@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PFSD_SHMTEST_H__
+#define __PFSD_SHMTEST_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfsd_common.h"
+#include "pfsd_proto.h"
+#include "pfsd_shm.h"
+
+// Shm regions built in memory, shared by the shm tests
+#define NCH         40
+#define UNITSIZE    4096
+#define EPOCH       7
+
+// Slot states the regions are populated with, by slot index
+static const int8_t slot_states[] = {
+    REQ_FREE, REQ_ALLOC, REQ_WAIT_REPLY, REQ_IN_PROGRESS, REQ_WAIT_RELEASE,
+    REQ_IN_PROGRESS,    // left by a previous pfsd
+};
+#define NSTATE      (int)(sizeof(slot_states) / sizeof(slot_states[0]))
+
+static inline pfsd_shm_t *
+make_shm(int index, bool populate = true)
+{
+    size_t size = pfsd_shm_size(NCH, PFSD_SHM_MAX_REQUESTS, UNITSIZE);
+    pfsd_shm_t *shm = (pfsd_shm_t *)aligned_alloc(4096, size);
+
+    memset(shm, 0, size);
+    shm->sh_magic = PFSD_SHM_MAGIC;
+    shm->sh_epoch = EPOCH;
+    shm->sh_size = size;
+    shm->sh_unitsize = UNITSIZE;
+    shm->sh_nch = NCH;
+    shm->sh_index = index;
+    shm->sh_flags = PFSD_SHM_F_EXTENT;
+    for (int ci = 0; ci < NCH; ci++) {
+        pfsd_iochannel_t *ch = (pfsd_iochannel_t *)((char *)(shm + 1) +
+            ci * pfsd_channel_size(PFSD_SHM_MAX_REQUESTS, UNITSIZE));
+
+        ch->ch_magic = PFSD_SHM_MAGIC;
+        ch->ch_epoch = EPOCH;
+        ch->ch_index = ci;
+        ch->ch_unitsize = UNITSIZE;
+        ch->ch_max_req = PFSD_SHM_MAX_REQUESTS;
+        ch->ch_free_bitmap = 0;
+        for (int i = 0; i < PFSD_SHM_MAX_REQUESTS; i++) {
+            if (!populate) {
+                ch->ch_requests[i].val = pfsd_request_set_state(0, REQ_FREE);
+                ch->ch_free_bitmap |= 1UL << i;
+                continue;
+            }
+            pfsd_request_t *r = &ch->ch_requests[i];
+            int8_t state = slot_states[i % NSTATE];
+            int64_t val = 0;
+
+            // connections 1 to 4 own the slots in turn
+            val = pfsd_request_set_pid(val, 1000 + i);
+            val = pfsd_request_set_connid(val, i / NSTATE % 4 + 1);
+            val = pfsd_request_set_state(val, state);
+            r->val = val;
+            r->shm_epoch = (i % NSTATE == NSTATE - 1) ? EPOCH - 1 : EPOCH;
+            if (state == REQ_FREE)
+                ch->ch_free_bitmap |= 1UL << i;
+        }
+    }
+    return shm;
+}
+
+static inline pfsd_iochannel_t *
+channel(pfsd_shm_t *shm, int ci)
+{
+    return (pfsd_iochannel_t *)((char *)(shm + 1) +
+        ci * pfsd_channel_size(PFSD_SHM_MAX_REQUESTS, UNITSIZE));
+}
+
+#endif
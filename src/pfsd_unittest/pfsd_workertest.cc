@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2017-2021, Alibaba Group Holding Limited
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "pfsd_shm.h"
+#include "pfsd_worker.h"
+
+static pfsd_resize_t
+resize(int nmin, int nmax, int nshard)
+{
+    pfsd_resize_t rs;
+
+    rs.rs_nmin = nmin;
+    rs.rs_nmax = nmax;
+    rs.rs_nshard = nshard;
+    rs.rs_idle_ticks = 0;
+    return rs;
+}
+
+// Idle intervals until the pool shrinks, from @nlive
+static int
+idle_until_shrink(pfsd_resize_t *rs, int nlive, int *target)
+{
+    for (int n = 1; n <= 2 * RESIZE_SHRINK_TICKS; n++) {
+        *target = pfsd_resize_target(rs, nlive, 0, 0);
+        if (*target != nlive)
+            return n;
+    }
+    return -1;
+}
+
+TEST(WorkerTest, resize_grows_when_busy_and_queued)
+{
+    pfsd_resize_t rs = resize(4, 40, 4);
+
+    // by a shard's worth, or a quarter once larger
+    EXPECT_EQ(pfsd_resize_target(&rs, 4, 1, RESIZE_GROW_BUSY), 8);
+    EXPECT_EQ(pfsd_resize_target(&rs, 8, 100, 100), 12);
+    EXPECT_EQ(pfsd_resize_target(&rs, 24, 100, 100), 30);
+    EXPECT_EQ(pfsd_resize_target(&rs, 38, 100, 100), 40);
+    EXPECT_EQ(pfsd_resize_target(&rs, 40, 100, 100), 40);
+
+    // not with nothing queued, nor with workers left idle
+    EXPECT_EQ(pfsd_resize_target(&rs, 8, 0, 100), 8);
+    EXPECT_EQ(pfsd_resize_target(&rs, 8, 100, RESIZE_GROW_BUSY - 1), 8);
+}
+
+TEST(WorkerTest, resize_shrinks_after_staying_idle)
+{
+    pfsd_resize_t rs = resize(4, 40, 4);
+    int nlive = 14, target;
+
+    EXPECT_EQ(idle_until_shrink(&rs, nlive, &target), RESIZE_SHRINK_TICKS);
+    EXPECT_EQ(target, 10);
+    EXPECT_EQ(idle_until_shrink(&rs, 10, &target), RESIZE_SHRINK_TICKS);
+    EXPECT_EQ(target, 6);
+    EXPECT_EQ(idle_until_shrink(&rs, 6, &target), RESIZE_SHRINK_TICKS);
+    EXPECT_EQ(target, 4);
+    // never below -m
+    EXPECT_EQ(idle_until_shrink(&rs, 4, &target), -1);
+
+    // an interval with load starts the count again
+    for (int n = 1; n < RESIZE_SHRINK_TICKS; n++)
+        EXPECT_EQ(pfsd_resize_target(&rs, nlive, 0, 0), nlive);
+    EXPECT_EQ(pfsd_resize_target(&rs, nlive, 0, RESIZE_SHRINK_BUSY), nlive);
+    EXPECT_EQ(idle_until_shrink(&rs, nlive, &target), RESIZE_SHRINK_TICKS);
+
+    // so does a grow
+    for (int n = 1; n < RESIZE_SHRINK_TICKS; n++)
+        EXPECT_EQ(pfsd_resize_target(&rs, nlive, 0, 0), nlive);
+    EXPECT_EQ(pfsd_resize_target(&rs, nlive, 1, 100), nlive + 4);
+    EXPECT_EQ(idle_until_shrink(&rs, nlive, &target), RESIZE_SHRINK_TICKS);
+}
+
+TEST(WorkerTest, resize_fixed_pool)
+{
+    pfsd_resize_t rs = resize(16, 16, 4);
+    int target;
+
+    EXPECT_EQ(pfsd_resize_target(&rs, 16, 100, 100), 16);
+    EXPECT_EQ(idle_until_shrink(&rs, 16, &target), -1);
+}